@@ -0,0 +1,99 @@
+/*
+Measures how fast dynamic args are deserialized out of the session's asio::streambuf. A TRAIN payload of
+nVectors embeddings is written into the stream buffer exactly as it arrives over the wire, then parsed
+with TrainArgs. For reference the same payload is also parsed one float at a time, which is how
+dynamic args used to be read.
+
+Build and run with:
+    cmake --build build --target args_benchmarking && ./build/args_benchmarking
+*/
+
+#include "../src/args.h"
+
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <vector>
+#include <asio.hpp>
+
+
+// Fill the stream buffer with a TRAIN command's static and dynamic args
+void write_train_payload(asio::streambuf& buf, const std::vector<float>& floats) {
+    std::ostream os(&buf);
+    size_t max_samples = 0;
+    bool last = true;
+    size_t size = sizeof(float) * floats.size();
+    os.write(reinterpret_cast<const char *>(&max_samples), sizeof(max_samples));
+    os.write(reinterpret_cast<const char *>(&last), sizeof(last));
+    os.write(reinterpret_cast<const char *>(&size), sizeof(size));
+    os.put('\n');
+    os.write(reinterpret_cast<const char *>(floats.data()), size);
+    os.write("\r\n", 2);
+}
+
+int main() {
+    const size_t d = 768;
+    const size_t nVectors = 100000;
+    const int rounds = 5;
+
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<float> uniform(-1, 1);
+    std::vector<float> floats(nVectors * d);
+    for (auto& x : floats) {
+        x = uniform(rng);
+    }
+    double gigabytes = (sizeof(float) * floats.size()) / 1e9;
+    std::cout << "Payload: " << nVectors << " x " << d << " floats (" << gigabytes << " GB)" << std::endl;
+
+    double bulkSeconds = 0;
+    for (int r = 0; r < rounds; r++) {
+        asio::streambuf buf;
+        write_train_payload(buf, floats);
+
+        auto start = std::chrono::steady_clock::now();
+        std::istream is(&buf);
+        TrainArgs args;
+        args.deserialize_static(is);
+        args.deserialize_dynamic(is);
+        bulkSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        if (reinterpret_cast<std::uintptr_t>(args.training_data.get()) % 64 != 0) {
+            std::cerr << "Training data is not 64 byte aligned" << std::endl;
+            return 1;
+        }
+        if (args.training_data[floats.size() - 1] != floats.back()) {
+            std::cerr << "Training data was not deserialized correctly" << std::endl;
+            return 1;
+        }
+    }
+
+    double elementSeconds = 0;
+    for (int r = 0; r < rounds; r++) {
+        asio::streambuf buf;
+        write_train_payload(buf, floats);
+
+        auto start = std::chrono::steady_clock::now();
+        std::istream is(&buf);
+        size_t max_samples;
+        bool last;
+        size_t size;
+        is.read(reinterpret_cast<char *>(&max_samples), sizeof(max_samples));
+        is.read(reinterpret_cast<char *>(&last), sizeof(last));
+        is.read(reinterpret_cast<char *>(&size), sizeof(size));
+        is.get();
+        std::unique_ptr<float[]> data(new float[size / sizeof(float)]);
+        for (size_t i = 0; i < size / sizeof(float); i++) {
+            char buffer[sizeof(float)];
+            is.read(buffer, sizeof(float));
+            std::memcpy(&data[i], buffer, sizeof(float));
+        }
+        elementSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    std::cout << "bulk read:        " << (rounds * gigabytes) / bulkSeconds << " GB/s" << std::endl;
+    std::cout << "per-element read: " << (rounds * gigabytes) / elementSeconds << " GB/s" << std::endl;
+
+    return 0;
+}
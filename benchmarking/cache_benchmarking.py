@@ -68,9 +68,14 @@ async def main():
     print("Cache is in READY state")
 
 
+    # Each query is searched once per refine factor. A refine factor of 1 is the plain IVFPQ ranking, larger ones
+    # re-rank refine_factor * k candidates by exact distance.
+    refine_factors = [1, 2, 4, 8]
+    top_k = 10
+
     # Initialize metrics
-    recalls = []
-    latencies = []
+    recalls = {refine_factor: [] for refine_factor in refine_factors}
+    latencies = {refine_factor: [] for refine_factor in refine_factors}
 
     # Perform queries and calculate recall and latency
     for i, query in enumerate(queries):
@@ -78,59 +83,54 @@ async def main():
         #     continue
         print("performing query: " + str(i))
         groundtruth = groundtruths[i][:10]
-        top_k = 10
 
         await client.load(vector=query.tolist())
 
-        # Record the start time
-        start_time = time.time()
-        
-        # Query the cache
-        response = await client.search(k=top_k, query_vectors=[query.tolist()])
-        # (should always be a hit since we are loading beforehand)
-        assert len(response[0]) > 0
-        
-        # Record the end time
-        end_time = time.time()
+        for refine_factor in refine_factors:
+            # Record the start time
+            start_time = time.time()
 
-        await client.evict(vector=query.tolist())
+            # Query the cache
+            response = await client.search(k=top_k, xq=[query.tolist()], options={ 'refine_factor': refine_factor })
+            # (should always be a hit since we are loading beforehand)
+            assert len(response[0]) > 0
 
+            # Record the end time
+            end_time = time.time()
 
+            # Calculate latency
+            latency = end_time - start_time
+            latencies[refine_factor].append(latency)
 
-        # Calculate latency
-        latency = end_time - start_time
-        if i % 10 == 0:
-            print("latency: " + str(latency))
-        latencies.append(latency)
+            # Extract Cache IDs
+            cache_ids = [int(match.id) for match in response[0]]
 
-        # Extract Cache IDs
-        cache_ids = [int(match.id) for match in response[0]]
-        
-        # Calculate recall
-        correct = len(set(cache_ids).intersection(set(groundtruth)))
-        recall = correct / top_k
-        if i % 10 == 0:
-            print("Recall: " + str(recall))
-        recalls.append(recall)
+            # Calculate recall
+            correct = len(set(cache_ids).intersection(set(groundtruth)))
+            recall = correct / top_k
+            recalls[refine_factor].append(recall)
 
-        if i == 500:
-            break
+            if i % 10 == 0:
+                print("refine_factor: " + str(refine_factor) + ", latency: " + str(latency) + ", recall: " + str(recall))
 
-    # Calculate recall distribution and overall recall
-    recall_distribution = np.histogram(recalls, bins=10, range=(0, 1))
-    overall_recall = np.mean(recalls)
+        await client.evict(vector=query.tolist())
 
-    # Calculate latency distribution and average/median latency
-    latency_distribution = np.histogram(latencies, bins=10)
-    average_latency = np.mean(latencies)
-    median_latency = np.median(latencies)
+        if i == 500:
+            break
 
     # Print results
-    print("Recall Distribution (bins, counts):", recall_distribution)
-    print("Overall Recall:", overall_recall)
-    print("Latency Distribution (bins, counts):", latency_distribution)
-    print("Average Latency:", average_latency)
-    print("Median Latency:", median_latency)
+    for refine_factor in refine_factors:
+        print("refine_factor:", refine_factor)
+        print("  Recall Distribution (bins, counts):", np.histogram(recalls[refine_factor], bins=10, range=(0, 1)))
+        print("  Overall Recall:", np.mean(recalls[refine_factor]))
+        print("  Latency Distribution (bins, counts):", np.histogram(latencies[refine_factor], bins=10))
+        print("  Average Latency:", np.mean(latencies[refine_factor]))
+        print("  Median Latency:", np.median(latencies[refine_factor]))
+
+    print()
+    print("refine_factor | recall@" + str(top_k) + " | median latency (ms)")
+    for refine_factor in refine_factors:
+        print(f"{refine_factor:>13} | {np.mean(recalls[refine_factor]):>9.4f} | {np.median(latencies[refine_factor]) * 1000:.3f}")
 
 
 if __name__ == '__main__':
@@ -0,0 +1,129 @@
+"""
+Measures how SEARCH throughput scales with the number of I/O threads Periplus runs with.
+
+For each thread count a fresh Periplus process is started with `-t <threads>`, populated with the
+same collection the e2e test proxy serves, and then queried by several client processes at once for
+a fixed amount of time. The resulting queries per second are printed for every thread count.
+
+The e2e test proxy must be running before starting the benchmark:
+    python3 test/e2e/test_proxy.py
+"""
+
+import argparse
+import asyncio
+import multiprocessing
+import random
+import subprocess
+import time
+import uuid
+
+from periplus_client import Periplus
+
+
+def generate_ids(num_ids):
+    # Must match the ids generated by test/e2e/test_proxy.py
+    namespace = uuid.UUID('12345678-1234-5678-1234-567812345678')
+    return [str(uuid.uuid3(namespace, "document: " + str(i))) for i in range(num_ids)]
+
+
+def generate_embeddings(d, num_embeddings):
+    # Must match the embeddings generated by test/e2e/test_proxy.py
+    random.seed(42)
+    return [[random.uniform(-100, 100) for _ in range(d)] for _ in range(num_embeddings)]
+
+
+async def wait_for_server(host, port, timeout=30):
+    deadline = time.time() + timeout
+    while time.time() < deadline:
+        try:
+            _, writer = await asyncio.open_connection(host, port)
+            writer.close()
+            await writer.wait_closed()
+            return
+        except OSError:
+            await asyncio.sleep(0.2)
+    raise RuntimeError("Periplus did not start listening in time")
+
+
+async def populate(host, port, url, ids, embeddings, queries, n_probe):
+    client = Periplus(host, port)
+    await client.initialize(d=len(embeddings[0]), db_url=url, options={"n_records": len(ids), "use_flat": True})
+    await client.train(training_data=embeddings)
+    await client.add(ids=ids, embeddings=embeddings)
+
+    # Make sure every benchmark query is a cache hit
+    for query in queries:
+        await client.load(query, options={"n_load": n_probe})
+
+
+async def search_worker(host, port, queries, k, n_probe, deadline):
+    client = Periplus(host, port)
+    completed = 0
+    while time.time() < deadline:
+        query = queries[completed % len(queries)]
+        res = await client.search(k, [query], options={"n_probe": n_probe})
+        assert len(res[0]) > 0
+        completed += 1
+    return completed
+
+
+def run_client_process(host, port, queries, k, n_probe, concurrency, duration):
+    async def run():
+        deadline = time.time() + duration
+        workers = [search_worker(host, port, queries, k, n_probe, deadline) for _ in range(concurrency)]
+        return sum(await asyncio.gather(*workers))
+
+    return asyncio.run(run())
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Benchmark SEARCH throughput against the number of Periplus I/O threads")
+    parser.add_argument("--binary", type=str, help="Path to the periplus executable", default="./build/periplus")
+    parser.add_argument("--proxy-host", type=str, help="Host the e2e test proxy is running on", default="localhost")
+    parser.add_argument("--port", type=int, help="Port to start Periplus on", default=3000)
+    parser.add_argument("--threads", type=int, nargs="+", help="Thread counts to benchmark", default=[1, 2, 4, 8, 16])
+    parser.add_argument("--clients", type=int, help="Number of client processes", default=multiprocessing.cpu_count())
+    parser.add_argument("--concurrency", type=int, help="Concurrent connections per client process", default=8)
+    parser.add_argument("--duration", type=float, help="Seconds to run each measurement for", default=10)
+    args = parser.parse_args()
+
+    host = "localhost"
+    url = f"http://{args.proxy_host}:8000/api/v1/load_data"
+    num_docs = 50000
+    d = 128
+    k = 10
+    n_probe = 4
+
+    print("generating data")
+    ids = generate_ids(num_docs)
+    embeddings = generate_embeddings(d, num_docs)
+    queries = embeddings[:200]
+
+    results = {}
+    for n_threads in args.threads:
+        print(f"starting Periplus with {n_threads} threads")
+        server = subprocess.Popen([args.binary, "-p", str(args.port), "-t", str(n_threads)],
+                                  stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        try:
+            asyncio.run(wait_for_server(host, args.port))
+            asyncio.run(populate(host, args.port, url, ids, embeddings, queries, n_probe))
+
+            print(f"running {args.clients} client processes x {args.concurrency} connections for {args.duration}s")
+            with multiprocessing.Pool(args.clients) as pool:
+                counts = pool.starmap(run_client_process,
+                                      [(host, args.port, queries, k, n_probe, args.concurrency, args.duration)] * args.clients)
+            qps = sum(counts) / args.duration
+            results[n_threads] = qps
+            print(f"threads: {n_threads}, QPS: {qps:.1f}")
+        finally:
+            server.terminate()
+            server.wait()
+
+    baseline = results[args.threads[0]]
+    print("\nthreads\tQPS\tspeedup")
+    for n_threads, qps in results.items():
+        print(f"{n_threads}\t{qps:.1f}\t{qps / baseline:.2f}x")
+
+
+if __name__ == '__main__':
+    main()
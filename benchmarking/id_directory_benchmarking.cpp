@@ -0,0 +1,128 @@
+/*
+Reports how much memory the id bookkeeping takes per million ids. The same UUID-like ids are added to the
+structures the core used to keep (a vector of id strings per cell plus an unordered_map from id to internal id)
+and to the IdDirectory which replaced them. Allocations are counted by overriding the global operator new, and
+lookups of every id are timed for both.
+
+Build and run with:
+    cmake --build build --target id_directory_benchmarking && ./build/id_directory_benchmarking
+*/
+
+#include "../src/id_directory.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+
+static size_t allocated = 0;
+
+// Every allocation is prefixed with its size so the matching delete can subtract it
+void *operator new(size_t size) {
+    size_t *p = static_cast<size_t*>(std::malloc(size + sizeof(std::max_align_t)));
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    *p = size;
+    allocated += size;
+    return reinterpret_cast<char*>(p) + sizeof(std::max_align_t);
+}
+
+void operator delete(void *ptr) noexcept {
+    if (!ptr) {
+        return;
+    }
+    size_t *p = reinterpret_cast<size_t*>(static_cast<char*>(ptr) - sizeof(std::max_align_t));
+    allocated -= *p;
+    std::free(p);
+}
+
+void operator delete(void *ptr, size_t) noexcept {
+    operator delete(ptr);
+}
+
+std::vector<std::string> make_ids(size_t n) {
+    std::mt19937_64 rng(42);
+    std::vector<std::string> ids;
+    ids.reserve(n);
+    char buf[37];
+    for (size_t i = 0; i < n; i++) {
+        uint64_t a = rng(), b = rng();
+        std::snprintf(buf, sizeof(buf), "%08x-%04x-%04x-%04x-%012llx",
+            (unsigned)(a >> 32), (unsigned)(a >> 16) & 0xffff, (unsigned)a & 0xffff,
+            (unsigned)(b >> 48), (unsigned long long)(b & 0xffffffffffffULL));
+        ids.emplace_back(buf);
+    }
+    return ids;
+}
+
+int main() {
+    const size_t nIds = 1000000;
+    const size_t nCells = 4000;
+
+    std::vector<std::string> ids = make_ids(nIds);
+    std::cout << "Ids: " << nIds << " of length " << ids[0].size() << ", cells: " << nCells << std::endl;
+
+    size_t oldBytes = 0;
+    double oldSeconds = 0;
+    {
+        size_t before = allocated;
+        std::vector<std::vector<std::string>> ids_by_cell(nCells);
+        std::unordered_map<std::string, faiss::idx_t> id_map;
+        for (size_t i = 0; i < nIds; i++) {
+            ids_by_cell[i % nCells].push_back(ids[i]);
+            id_map.insert({ids[i], (faiss::idx_t)i});
+        }
+        oldBytes = allocated - before;
+
+        auto start = std::chrono::steady_clock::now();
+        size_t found = 0;
+        for (const std::string& id : ids) {
+            found += id_map.find(id) != id_map.end();
+        }
+        oldSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (found != nIds) {
+            std::cerr << "Lookup failed" << std::endl;
+            return 1;
+        }
+    }
+
+    size_t newBytes = 0;
+    double newSeconds = 0;
+    {
+        size_t before = allocated;
+        IdDirectory directory(nCells);
+        for (size_t i = 0; i < nIds; i++) {
+            directory.insert(ids[i], i % nCells);
+        }
+        newBytes = allocated - before;
+        if (directory.memoryUsage() > newBytes) {
+            std::cerr << "memoryUsage over reports: " << directory.memoryUsage() << " > " << newBytes << std::endl;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        size_t found = 0;
+        for (const std::string& id : ids) {
+            found += directory.find(id) != -1;
+        }
+        newSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (found != nIds) {
+            std::cerr << "Lookup failed" << std::endl;
+            return 1;
+        }
+    }
+
+    double perMillion = 1e6 / nIds / (1024.0 * 1024.0);
+    std::cout << "id_map + ids_by_cell: " << oldBytes * perMillion << " MB per million ids, "
+              << oldSeconds * 1e9 / nIds << " ns per lookup" << std::endl;
+    std::cout << "IdDirectory:          " << newBytes * perMillion << " MB per million ids, "
+              << newSeconds * 1e9 / nIds << " ns per lookup" << std::endl;
+    std::cout << "Reduction: " << (double)oldBytes / newBytes << "x" << std::endl;
+    return 0;
+}
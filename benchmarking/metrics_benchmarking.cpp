@@ -0,0 +1,100 @@
+/*
+Reports what the always-on metrics cost the hot paths. Times LatencyHistogram::record on its own, a ScopedLatency
+(which adds the two steady_clock reads), and record from several threads into the same histogram, where the relaxed
+increments contend on the shared cache lines. Also times rendering every metric, which STATS and each scrape of
+/metrics do once.
+
+Build and run with:
+    cmake --build build --target metrics_benchmarking && ./build/metrics_benchmarking
+*/
+
+#include "../src/metrics.h"
+
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+double nanoseconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main() {
+    const size_t nRecords = 10000000;
+
+    // Latencies spread from about a microsecond to a few hundred milliseconds, like the search and load paths
+    std::mt19937_64 rng(42);
+    std::lognormal_distribution<double> distribution(12.0, 2.0);
+    std::vector<uint64_t> latencies(1 << 16);
+    for (auto& latency : latencies) {
+        latency = static_cast<uint64_t>(distribution(rng));
+    }
+    size_t mask = latencies.size() - 1;
+
+    {
+        LatencyHistogram histogram;
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < nRecords; i++) {
+            histogram.record(latencies[i & mask]);
+        }
+        double ns = nanoseconds_since(start);
+        std::cout << "record, 1 thread: " << ns / nRecords << " ns/op" << std::endl;
+        std::cout << "    p50: " << histogram.quantile(0.5) << " ns, p99: " << histogram.quantile(0.99)
+                  << " ns, p99.9: " << histogram.quantile(0.999) << " ns" << std::endl;
+    }
+
+    {
+        LatencyHistogram histogram;
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < nRecords; i++) {
+            ScopedLatency timer(histogram);
+        }
+        double ns = nanoseconds_since(start);
+        std::cout << "ScopedLatency, 1 thread: " << ns / nRecords << " ns/op" << std::endl;
+    }
+
+    unsigned int nThreads = std::thread::hardware_concurrency();
+    if (nThreads > 1) {
+        LatencyHistogram histogram;
+        size_t perThread = nRecords / nThreads;
+        std::vector<std::thread> threads;
+        auto start = std::chrono::steady_clock::now();
+        for (unsigned int t = 0; t < nThreads; t++) {
+            threads.emplace_back([&histogram, &latencies, mask, perThread, t]() {
+                for (size_t i = 0; i < perThread; i++) {
+                    histogram.record(latencies[(i + t * 7919) & mask]);
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        double ns = nanoseconds_since(start);
+        std::cout << "record, " << nThreads << " threads: " << ns / (perThread * nThreads) << " ns/op across threads, "
+                  << ns / perThread << " ns/op per thread" << std::endl;
+    }
+
+    {
+        Metrics& m = metrics();
+        for (size_t i = 0; i < 100000; i++) {
+            m.search.record(latencies[i & mask]);
+            m.commands[SEARCH].record(latencies[i & mask]);
+        }
+        const size_t nRenders = 1000;
+        size_t bytes = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < nRenders; i++) {
+            std::string out;
+            m.render(out);
+            bytes = out.size();
+        }
+        double ns = nanoseconds_since(start);
+        std::cout << "render: " << ns / nRenders / 1000 << " us for " << bytes << " bytes" << std::endl;
+    }
+
+    return 0;
+}
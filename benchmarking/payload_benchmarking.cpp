@@ -0,0 +1,94 @@
+/*
+Compares the precisions the cell arenas can keep embeddings at, for a cell of records with 1536 dimensional
+embeddings and RAG sized documents. For each precision it reports the arena's size, how many such cells fit in a
+1 GB memory budget, the time to decode an embedding on the way out of a search, and the largest relative error of
+the decoded embeddings.
+
+Build and run with:
+    cmake --build build --target payload_benchmarking && ./build/payload_benchmarking
+*/
+
+#include "../src/cell_store.h"
+#include "../src/data.h"
+#include "../src/embedding_codec.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+
+int main() {
+    const size_t d = 1536;
+    const size_t n = 1000;
+    const size_t documentLength = 1000;
+    const size_t metadataLength = 100;
+    const size_t budget = 1024 * 1024 * 1024;
+    const int rounds = 20;
+
+    std::mt19937 rng(42);
+    std::normal_distribution<float> normal(0, 1);
+
+    std::vector<Data> records;
+    for (size_t i = 0; i < n; i++) {
+        std::string id = "record-" + std::to_string(i);
+        std::vector<float> embedding(d);
+        for (auto& x : embedding) {
+            x = normal(rng);
+        }
+        std::string document(documentLength, 'd');
+        std::string metadata(metadataLength, 'm');
+        records.push_back(Data(id.size() + 1, d, document.size(), metadata.size(), id.data(), embedding.data(), document.data(), metadata.data()));
+    }
+    std::vector<const Data*> pointers;
+    for (const Data& record : records) {
+        pointers.push_back(&record);
+    }
+
+    std::vector<std::pair<std::string, EmbeddingPrecision>> precisions = {
+        {"fp32", PRECISION_FP32},
+        {"fp16", PRECISION_FP16},
+        {"bf16", PRECISION_BF16},
+        {"int8", PRECISION_INT8},
+    };
+
+    std::cout << "d: " << d << ", records per cell: " << n << ", document: " << documentLength << " bytes, metadata: "
+        << metadataLength << " bytes, decoding kernel: " << embeddingCodecKernel() << std::endl;
+    std::cout << std::setw(6) << "" << std::setw(16) << "arena (MB)" << std::setw(16) << "cells per GB" << std::setw(16)
+        << "decode (us)" << std::setw(16) << "max rel error" << std::endl;
+
+    std::vector<float> decoded(d);
+    for (const auto& [name, precision] : precisions) {
+        CellArena arena(d, pointers, precision);
+
+        auto start = std::chrono::steady_clock::now();
+        for (int r = 0; r < rounds; r++) {
+            for (size_t slot = 0; slot < n; slot++) {
+                arena.embedding(slot, decoded.data());
+            }
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        float maxError = 0;
+        for (size_t slot = 0; slot < n; slot++) {
+            const float *embedding = arena.embedding(slot, decoded.data());
+            float largest = 0;
+            float error = 0;
+            for (size_t i = 0; i < d; i++) {
+                largest = std::max(largest, std::fabs(records[slot].embedding[i]));
+                error = std::max(error, std::fabs(embedding[i] - records[slot].embedding[i]));
+            }
+            maxError = std::max(maxError, error / largest);
+        }
+
+        std::cout << std::setw(6) << name << std::setw(16) << arena.bytes / (1024.0 * 1024.0) << std::setw(16) << budget / arena.bytes
+            << std::setw(16) << (seconds * 1e6) / (rounds * n) << std::setw(16) << maxError << std::endl;
+    }
+
+    return 0;
+}
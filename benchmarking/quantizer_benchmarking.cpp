@@ -0,0 +1,106 @@
+/*
+Compares the coarse quantizers a core can be initialized with as the number of cells grows. For each nCells the
+centroids are added to a flat quantizer and to an HNSW quantizer built the way the core builds it, then both are
+timed assigning a single query to its nprobe nearest cells (SEARCH, LOAD and EVICT) and a batch of vectors to their
+nearest cell (ADD and the per-record assignment in loadCell). The HNSW recall is the fraction of the flat
+quantizer's nprobe nearest cells it also finds.
+
+Build and run with:
+    cmake --build build --target quantizer_benchmarking && ./build/quantizer_benchmarking
+*/
+
+#include "../src/core.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <unordered_set>
+#include <vector>
+
+#include <faiss/Index.h>
+
+
+// Average seconds per call of search over the queries, one query at a time
+double timeSingle(const faiss::Index& quantizer, size_t d, const std::vector<float>& queries, size_t nQueries, size_t k) {
+    std::vector<float> distances(k);
+    std::vector<faiss::idx_t> labels(k);
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < nQueries; i++) {
+        quantizer.search(1, &queries[i * d], k, distances.data(), labels.data());
+    }
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / nQueries;
+}
+
+int main() {
+    const size_t d = 128;
+    const size_t nQueries = 1000;
+    const size_t nBatch = 100000;
+    const size_t nprobe = 16;
+    const std::vector<size_t> cellCounts = {1024, 4096, 16384, 32768};
+
+    std::mt19937 rng(42);
+    std::normal_distribution<float> normal(0, 1);
+
+    std::vector<float> queries(nQueries * d);
+    for (auto& x : queries) {
+        x = normal(rng);
+    }
+    std::vector<float> batch(nBatch * d);
+    for (auto& x : batch) {
+        x = normal(rng);
+    }
+
+    std::cout << "d: " << d << ", nprobe: " << nprobe << ", batch: " << nBatch << " vectors" << std::endl;
+    std::cout << std::setw(8) << "nCells" << std::setw(10) << "quantizer" << std::setw(14) << "build (s)"
+        << std::setw(16) << "query (us)" << std::setw(16) << "batch (ms)" << std::setw(10) << "recall" << std::endl;
+
+    for (size_t nCells : cellCounts) {
+        std::vector<float> centroids(nCells * d);
+        for (auto& x : centroids) {
+            x = normal(rng);
+        }
+
+        std::vector<faiss::idx_t> flatLabels(nQueries * nprobe);
+        for (QuantizerType type : {FLAT_QUANTIZER, HNSW_QUANTIZER}) {
+            std::shared_ptr<faiss::Index> quantizer = Core::createQuantizer(d, type);
+
+            auto start = std::chrono::steady_clock::now();
+            quantizer->add(nCells, centroids.data());
+            double build = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            double single = timeSingle(*quantizer, d, queries, nQueries, nprobe);
+
+            std::vector<float> batchDistances(nBatch);
+            std::vector<faiss::idx_t> batchLabels(nBatch);
+            start = std::chrono::steady_clock::now();
+            quantizer->search(nBatch, batch.data(), 1, batchDistances.data(), batchLabels.data());
+            double batched = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            std::vector<float> distances(nQueries * nprobe);
+            std::vector<faiss::idx_t> labels(nQueries * nprobe);
+            quantizer->search(nQueries, queries.data(), nprobe, distances.data(), labels.data());
+            double recall = 1;
+            if (type == FLAT_QUANTIZER) {
+                flatLabels = labels;
+            } else {
+                size_t found = 0;
+                for (size_t i = 0; i < nQueries; i++) {
+                    std::unordered_set<faiss::idx_t> exact(&flatLabels[i * nprobe], &flatLabels[(i + 1) * nprobe]);
+                    for (size_t j = 0; j < nprobe; j++) {
+                        found += exact.count(labels[(i * nprobe) + j]);
+                    }
+                }
+                recall = (double)found / (nQueries * nprobe);
+            }
+
+            std::cout << std::setw(8) << nCells << std::setw(10) << (type == FLAT_QUANTIZER ? "flat" : "hnsw")
+                << std::setw(14) << build << std::setw(16) << single * 1e6 << std::setw(16) << batched * 1e3
+                << std::setw(10) << recall << std::endl;
+        }
+    }
+
+    return 0;
+}
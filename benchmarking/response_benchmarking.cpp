@@ -0,0 +1,82 @@
+/*
+Reports how many bytes a SEARCH response puts on the wire for different field masks, for a batch of queries
+against 1536 dimensional embeddings with RAG sized documents. Serialization of each mask is timed as well.
+
+Build and run with:
+    cmake --build build --target response_benchmarking && ./build/response_benchmarking
+*/
+
+#include "../src/data.h"
+#include "../src/response.h"
+
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+#include <asio.hpp>
+
+
+int main() {
+    const size_t d = 1536;
+    const size_t nQueries = 64;
+    const size_t k = 10;
+    const size_t documentLength = 1000;
+    const size_t metadataLength = 100;
+    const int rounds = 100;
+
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<float> uniform(-1, 1);
+
+    // Every query gets the same k records, only the payload sizes matter here
+    std::vector<Data> records;
+    for (size_t j = 0; j < k; j++) {
+        std::string id = "record-" + std::to_string(j);
+        std::vector<float> embedding(d);
+        for (auto& x : embedding) {
+            x = uniform(rng);
+        }
+        std::string document(documentLength, 'd');
+        std::string metadata(metadataLength, 'm');
+        records.push_back(Data(id.size() + 1, d, document.size(), metadata.size(), id.data(), embedding.data(), document.data(), metadata.data()));
+    }
+
+    std::vector<std::pair<std::string, uint8_t>> masks = {
+        {"all fields", ALL_FIELDS},
+        {"id, document, metadata, distance", FIELD_ID | FIELD_DOCUMENT | FIELD_METADATA | FIELD_DISTANCE},
+        {"id, document", FIELD_ID | FIELD_DOCUMENT},
+        {"id, distance", FIELD_ID | FIELD_DISTANCE},
+    };
+
+    std::cout << "batch size: " << nQueries << ", k: " << k << ", d: " << d << ", document: " << documentLength
+        << " bytes, metadata: " << metadataLength << " bytes" << std::endl;
+    size_t allBytes = 0;
+    for (const auto& [name, fields] : masks) {
+        SearchResponse response(nQueries, k, fields);
+        for (size_t i = 0; i < nQueries; i++) {
+            response.cacheHits[i] = k;
+            for (size_t j = 0; j < k; j++) {
+                response.results[(i * k) + j] = records[j];
+                response.distances[(i * k) + j] = j;
+            }
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        for (int r = 0; r < rounds; r++) {
+            response.serialize();
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        size_t bytes = asio::buffer_size(response.buffers);
+        if (fields == ALL_FIELDS) {
+            allBytes = bytes;
+        }
+        std::cout << name << ": " << bytes << " bytes (" << bytes / (nQueries * k) << " per result, "
+            << (100.0 * bytes) / allBytes << "% of all fields), serialize " << (elapsed.count() * 1e6) / rounds << " us" << std::endl;
+    }
+
+    return 0;
+}
@@ -0,0 +1,102 @@
+/*
+Compares SEARCH throughput when a batch of queries is resolved one query at a time against resolving
+the whole batch with a single call into the index. Every cell is loaded up front so all queries are
+cache hits and only the search itself is measured.
+
+Build and run with:
+    cmake --build build --target search_benchmarking && ./build/search_benchmarking
+*/
+
+#include "../src/core.h"
+#include "../src/data.h"
+
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+
+int main() {
+    const size_t d = 128;
+    const size_t nTotal = 100000;
+    const size_t nCells = 256;
+    const size_t nQueries = 256;
+    const size_t k = 10;
+    const size_t nprobe = 8;
+    const int rounds = 20;
+
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<float> uniform(-100, 100);
+    std::normal_distribution<float> noise(0, 1);
+
+    std::cout << "Generating " << nTotal << " vectors (d = " << d << ")" << std::endl;
+    std::vector<float> embeddings(nTotal * d);
+    for (auto& x : embeddings) {
+        x = uniform(rng);
+    }
+
+    std::vector<Data> data;
+    std::vector<std::shared_ptr<char[]>> ids;
+    data.reserve(nTotal);
+    char document[] = "document";
+    char metadata[] = "{}";
+    for (size_t i = 0; i < nTotal; i++) {
+        std::string id = std::to_string(i);
+        ids.push_back(std::shared_ptr<char[]>(new char[id.size() + 1]));
+        std::memcpy(ids.back().get(), id.c_str(), id.size() + 1);
+        data.push_back(Data(id.size() + 1, d, sizeof(document), sizeof(metadata), ids.back().get(), &embeddings[i * d], document, metadata));
+    }
+
+    std::shared_ptr<DBClient_Mock> client = std::make_shared<DBClient_Mock>(d);
+    client->loadDB(nTotal, data.data());
+    Core core(d, client, nCells, nTotal, true);
+
+    std::cout << "Training " << nCells << " cells" << std::endl;
+    core.train(nTotal, embeddings.data());
+
+    std::shared_ptr<float[]> embeddingsCopy(new float[embeddings.size()]);
+    std::memcpy(embeddingsCopy.get(), embeddings.data(), sizeof(float) * embeddings.size());
+    core.add(nTotal, ids, embeddingsCopy);
+
+    std::cout << "Loading every cell" << std::endl;
+    for (size_t c = 0; c < nCells; c++) {
+        core.loadCell(c);
+    }
+
+    // Queries are perturbed copies of vectors in the collection
+    std::vector<float> xq(nQueries * d);
+    for (size_t i = 0; i < nQueries; i++) {
+        size_t source = rng() % nTotal;
+        for (size_t j = 0; j < d; j++) {
+            xq[(i * d) + j] = embeddings[(source * d) + j] + noise(rng);
+        }
+    }
+
+    std::vector<Data> results(nQueries * k);
+    std::vector<int> cacheHits(nQueries);
+
+    auto start = std::chrono::steady_clock::now();
+    for (int r = 0; r < rounds; r++) {
+        for (size_t i = 0; i < nQueries; i++) {
+            core.search(1, &xq[i * d], k, nprobe, true, &results[i * k], &cacheHits[i]);
+        }
+    }
+    std::chrono::duration<double> perQuery = std::chrono::steady_clock::now() - start;
+
+    start = std::chrono::steady_clock::now();
+    for (int r = 0; r < rounds; r++) {
+        core.search(nQueries, xq.data(), k, nprobe, true, results.data(), cacheHits.data());
+    }
+    std::chrono::duration<double> batched = std::chrono::steady_clock::now() - start;
+
+    double perQueryQps = (rounds * nQueries) / perQuery.count();
+    double batchedQps = (rounds * nQueries) / batched.count();
+    std::cout << "batch size: " << nQueries << ", k: " << k << ", nprobe: " << nprobe << std::endl;
+    std::cout << "per-query loop: " << perQueryQps << " QPS" << std::endl;
+    std::cout << "batched:        " << batchedQps << " QPS" << std::endl;
+    std::cout << "speedup:        " << batchedQps / perQueryQps << "x" << std::endl;
+
+    return 0;
+}
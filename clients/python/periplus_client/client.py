@@ -1,23 +1,126 @@
+import asyncio
 import struct
 from collections import namedtuple
 from .connection import Connection
 from .error import PeriplusConnectionError, PeriplusServerError
 
-Record = namedtuple('Record', ['id', 'embedding', 'document', 'metadata'])
+Record = namedtuple('Record', ['id', 'embedding', 'document', 'metadata', 'distance'], defaults=[None])
+
+class QueryResults(list):
+    """ The records returned for one query vector. coverage is the fraction of the vectors in the n_probe nearest cells
+    which were resident when it was searched. """
+    def __init__(self, records=(), coverage=0.0):
+        super().__init__(records)
+        self.coverage = coverage
+
+
+# Bits of the field mask sent with SEARCH, a result only carries the fields asked for
+_SEARCH_FIELDS = {'id': 1, 'embedding': 2, 'document': 4, 'metadata': 8, 'distance': 16}
+_ALL_SEARCH_FIELDS = sum(_SEARCH_FIELDS.values())
+
+
+class _Payload:
+    """ The payload of a pipelined response, read through the same interface as the connection. """
+
+    def __init__(self, data):
+        self.data = data
+        self.offset = 0
+
+    async def receive(self, buffer_size=1024):
+        chunk = self.data[self.offset:self.offset + buffer_size]
+        self.offset += len(chunk)
+        return chunk
 
 class Periplus:
-    def __init__(self, host, port):
+    # Wire values of the eviction policies and quantizers accepted by initialize
+    EVICTION_POLICIES = {"lru": 0, "lfu": 1, "2q": 2}
+    QUANTIZERS = {"flat": 0, "hnsw": 1}
+    PAYLOAD_PRECISIONS = {"fp32": 0, "fp16": 1, "bf16": 2, "int8": 3}
+
+    def __init__(self, host, port, pipelined=False):
+        """
+        Parameters:
+        host (str): Host Periplus is running on.
+
+        port (int): Port Periplus is listening on.
+
+        pipelined (bool, optional): When true, the client keeps a single connection open and tags every command
+        with a request id. Any number of commands can then be awaited concurrently (e.g. with asyncio.gather) over
+        that one connection, and Periplus runs SEARCH, LOAD and EVICT commands concurrently and answers them as
+        they finish. Call close() when done with the client. By default, each command opens its own connection
+        and only one command is outstanding at a time.
+        """
         self.conn = Connection(host, port)
+        self.pipelined = pipelined
+        self.next_request_id = 0
+        self.pending = {}
+        self.reader_task = None
+        self.connect_lock = asyncio.Lock()
 
     def _format_command(command, static_args, dynamic_args):
         return command + "\r\n" + static_args.decode('latin1') + "\n" + dynamic_args.decode('latin1') + "\r\n"
     
     async def _connect(self):
-         if not self.conn.connected:
-            try:
-                await self.conn.connect()
-            except ConnectionError as e:
-                raise PeriplusConnectionError(message="Could not connect to Periplus", address=self.conn.host, port=self.conn.port) from e
+        # Concurrent commands on a pipelined client share one connection, so only the first of them connects
+        async with self.connect_lock:
+            if not self.conn.connected:
+                try:
+                    await self.conn.connect()
+                except ConnectionError as e:
+                    raise PeriplusConnectionError(message="Could not connect to Periplus", address=self.conn.host, port=self.conn.port) from e
+                if self.pipelined:
+                    self.reader_task = asyncio.create_task(self._read_responses())
+
+
+    async def _read_responses(self):
+        """ Reads pipelined responses as they arrive and hands each one to the command waiting on its request id. """
+        try:
+            while True:
+                header = await self.conn.receive_exactly(16)
+                request_id, length = struct.unpack('<QQ', header)
+                payload = await self.conn.receive_exactly(length)
+                future = self.pending.pop(request_id, None)
+                if future is not None and not future.done():
+                    future.set_result(payload)
+        except (asyncio.IncompleteReadError, ConnectionError, OSError) as e:
+            error = PeriplusConnectionError(message="Lost connection to Periplus", address=self.conn.host, port=self.conn.port)
+            for future in self.pending.values():
+                if not future.done():
+                    future.set_exception(error)
+            self.pending.clear()
+            self.conn.connected = False
+
+
+    async def _execute(self, command, static_args, dynamic_args):
+        """
+        Sends a command and returns what its response can be read from: the connection itself, or the payload
+        of the response to the command's request id when pipelined.
+        """
+        if not self.pipelined:
+            await self.conn.send(Periplus._format_command(command, static_args, dynamic_args))
+            return self.conn
+
+        request_id = self.next_request_id
+        self.next_request_id += 1
+        future = asyncio.get_running_loop().create_future()
+        self.pending[request_id] = future
+        # The whole command is sent with a single write so commands from concurrent coroutines never interleave
+        await self.conn.send(Periplus._format_command(f"{command} {request_id}", static_args, dynamic_args))
+        return _Payload(await future)
+
+
+    async def _release(self):
+        # TODO: Recycle TCP connection while ensuring proper resource clean up
+        if not self.pipelined:
+            await self.conn.close()
+
+
+    async def close(self):
+        """ Closes the connection kept open by a pipelined client. """
+        if self.reader_task is not None:
+            self.reader_task.cancel()
+            self.reader_task = None
+        await self.conn.close()
 
 
     async def initialize(self, d, db_url, options={}):
@@ -46,6 +149,30 @@ class Periplus:
             quantization when the vectors are sufficiently large (>= 64 dimensions) and evenly divisible 
             into subvectors of 8. If those conditions are not met, or if use_flat is set to true, a flat
             IVF index will be used instead.
+            - max_mem (int): Memory budget for resident data in megabytes. When loading cells would exceed
+            it, Periplus automatically evicts resident cells chosen by the eviction policy first. Defaults
+            to 0, which means no limit.
+            - eviction_policy (str): How cells are chosen for automatic eviction, one of "lru" (least
+            recently searched), "lfu" (least frequently searched) or "2q" (cells never searched since they
+            were loaded first, then least recently searched). Defaults to "lru".
+            - quantizer (str): How vectors and queries are assigned to IVF cells, one of "flat" (compare against every
+            centroid) or "hnsw" (search an HNSW graph over the centroids). HNSW is much faster once there are tens of
+            thousands of cells, i.e. collections of tens of millions of vectors, at the cost of occasionally missing
+            one of the nearest cells. Defaults to "flat".
+            - payload_precision (str): Precision the embeddings of resident records are kept at alongside the index,
+            one of "fp32", "fp16", "bf16" (the range of fp32 with less precision) or "int8" (scaled per vector).
+            Reduced precision halves or quarters the memory the embeddings take, so more cells fit in max_mem, and
+            the embeddings returned by search are decoded from it. Defaults to "fp32".
+            - target_recall (float): When set, training tunes the index for the collection instead of using
+            the defaults. IVFFlat, IVF with 8 bit or fp16 scalar quantization and IVFPQ with a range of
+            subquantizers and bits per code are each tried on the training set, and the one with the smallest
+            codes reaching this recall@10 is used, along with the most IVF cells that still reach it when n_probe
+            of them are searched. The chosen index and its measured recall and QPS are reported by status.
+            Defaults to 0, which disables tuning.
+            - n_probe (int): The n_probe searches are expected to use, which tuning measures recall at.
+            Defaults to 1.
+            - index_mem (int): Most megabytes the index codes and ids of n_records vectors may take when
+            tuning. Defaults to 0, which means no limit.
 
         Returns:
         bool: Returns true if the Periplus instance was initialized successfully.
@@ -57,10 +184,22 @@ class Periplus:
 
         command = "INITIALIZE"
 
-        max_mem = 1024
+        max_mem = 0
         if 'max_mem' in options:
             max_mem = options['max_mem']
 
+        eviction_policy = "lru"
+        if 'eviction_policy' in options:
+            eviction_policy = options['eviction_policy']
+        if eviction_policy not in Periplus.EVICTION_POLICIES:
+            raise ValueError(f"eviction_policy must be one of {list(Periplus.EVICTION_POLICIES)}")
+
+        quantizer = "flat"
+        if 'quantizer' in options:
+            quantizer = options['quantizer']
+        if quantizer not in Periplus.QUANTIZERS:
+            raise ValueError(f"quantizer must be one of {list(Periplus.QUANTIZERS)}")
+
         n_records = 250000
         if 'n_records' in options:
             n_records = options['n_records']
@@ -69,17 +208,36 @@ class Periplus:
         if 'use_flat' in options:
             use_flat = options['use_flat']
 
-        fmt = '<QQQ?Q'
-        static_args = struct.pack(fmt, d, max_mem, n_records, use_flat, len(db_url))
-        dynamic_args = db_url.encode('latin1')
-        message = Periplus._format_command(command, static_args, dynamic_args)
+        target_recall = 0.0
+        if 'target_recall' in options:
+            target_recall = options['target_recall']
+        if not 0 <= target_recall <= 1:
+            raise ValueError("target_recall must be between 0 and 1")
+
+        index_mem = 0
+        if 'index_mem' in options:
+            index_mem = options['index_mem']
+
+        n_probe = 1
+        if 'n_probe' in options:
+            n_probe = options['n_probe']
+
+        payload_precision = "fp32"
+        if 'payload_precision' in options:
+            payload_precision = options['payload_precision']
+        if payload_precision not in Periplus.PAYLOAD_PRECISIONS:
+            raise ValueError(f"payload_precision must be one of {list(Periplus.PAYLOAD_PRECISIONS)}")
 
-        await self.conn.send(message)
+        fmt = '<QQQ?BBfQQBQ'
+        static_args = struct.pack(fmt, d, max_mem, n_records, use_flat, Periplus.EVICTION_POLICIES[eviction_policy],
+                                  Periplus.QUANTIZERS[quantizer], target_recall, index_mem, n_probe,
+                                  Periplus.PAYLOAD_PRECISIONS[payload_precision], len(db_url))
+        dynamic_args = db_url.encode('latin1')
+        response = await self._execute(command, static_args, dynamic_args)
 
         # Await confirmation the command was successful
-        res = await self.conn.receive()
-        # TODO: Recycle TCP connection while ensuring proper resource clean up
-        await self.conn.close()
+        res = await response.receive()
+        await self._release()
         if res.decode() != "Initialized cache":
             message = "[Error: Initialization Failed] " + res.decode()
             raise PeriplusServerError(message=message, operation=command)
@@ -87,13 +245,15 @@ class Periplus:
         return True
     
 
-    async def train(self, training_data):
+    async def train(self, training_data, options={}):
         """
         Train sets up Periplus's IVF index. A representative sample of the vector collection
         is provided to Periplus which is then used to detemine the optimal position of the 
         IVF centroids. Initialize must be called beforehand, and train must be called before 
         any other commands. Once train has been called, it cannot be called again after calling
-        ADD without re-initializing.
+        ADD without re-initializing. The training data is streamed to Periplus in chunks and
+        sampled down as it arrives, then the index is trained in the background. Use status to
+        follow its progress when not waiting for it.
 
         Parameters:
         training_data (List[List[float]]): This is a representative sample of the vector collection
@@ -101,39 +261,180 @@ class Periplus:
         percentage is fine for large datasets where that's not possible. Each inner list must be of 
         length d (as specificed in the prior initialize command).
 
+        options (dict, optional): A dictionary containing additional optional settings.
+        Heres a description of each of those options:
+            - max_samples (int): Periplus keeps a uniform random sample of at most this many of the
+            training vectors and trains on those. By default, max_samples is 0 which keeps every vector.
+            - chunk_size (int): How many vectors are sent per TRAIN command. By default, chunk_size is 10000.
+            - wait (bool): When true (the default), train returns once training has finished. When false,
+            it returns as soon as the training data has been sent.
+
         Returns:
         bool: Returns true if the Periplus instance was trained successfully.
 
         Raises:
         Error: If training fails for any reason, an error will be raised.
         """
+        command = "TRAIN"
+
+        max_samples = 0
+        if 'max_samples' in options:
+            max_samples = options['max_samples']
+
+        chunk_size = 10000
+        if 'chunk_size' in options:
+            chunk_size = options['chunk_size']
+
+        wait = True
+        if 'wait' in options:
+            wait = options['wait']
+
+        for start in range(0, len(training_data), chunk_size):
+            await self._connect()
+
+            chunk = training_data[start:start + chunk_size]
+            last = start + chunk_size >= len(training_data)
+            num_bytes = len(chunk) * len(chunk[0]) * 4
+            float_list = [item for sublist in chunk for item in sublist]
+
+            fmt = "<Q?Q"
+            static_args = struct.pack(fmt, max_samples, last, num_bytes)
+            dynamic_args = struct.pack(f'<{len(float_list)}f', *float_list)
+            assert num_bytes == len(dynamic_args)
+            response = await self._execute(command, static_args, dynamic_args)
+
+            res = (await response.receive()).decode()
+            await self._release()
+            expected = "Training started" if last else "Received training chunk"
+            if res != expected:
+                message = "[Error: Training Failed] " + res
+                raise PeriplusServerError(message=message, operation=command)
+
+        if not wait:
+            return True
+
+        while True:
+            status = await self.status()
+            if status['status'] == "READY":
+                return True
+            if status['status'] != "TRAINING":
+                message = "[Error: Training Failed] " + status.get('error', status['status'])
+                raise PeriplusServerError(message=message, operation=command)
+            await asyncio.sleep(0.1)
+
+
+    async def status(self):
+        """
+        Status reports the state of the Periplus instance and how far along training is. It can be
+        called at any time, including while the instance is training.
+
+        Returns:
+        dict: 'status' is one of "UNINITIALIZED", "INITIALIZED", "TRAINING" or "READY". 'samples' is the
+        number of training vectors kept out of the 'seen' vectors sent with train. 'step' and 'steps' give
+        the progress of training. 'index' describes the index in FAISS index_factory notation, e.g.
+        "IVF1024,PQ16x8". 'recall' and 'qps' are only present once training has tuned the index, and give
+        what the chosen index measured on the held out part of the training set. 'error' is only present
+        if the last training run failed.
+        """
+        await self._connect()
+
+        command = "STATUS"
+        static_args = struct.pack("<Q", 0)
+        response = await self._execute(command, static_args, b'')
+
+        res = (await response.receive()).decode()
+        await self._release()
+
+        # e.g. "status=READY samples=100000 seen=2500000 step=21 steps=21 index=IVF1264,PQ32x8 recall=0.912 qps=5120.5",
+        # with an error message at the end
+        fields, _, error = res.partition(" error=")
+        status = {}
+        for token in fields.split():
+            key, value = token.split('=', 1)
+            if key in ('status', 'index'):
+                status[key] = value
+            elif key in ('recall', 'qps'):
+                status[key] = float(value)
+            else:
+                status[key] = int(value)
+        if error:
+            status['error'] = error
+        return status
+
+
+    async def stats(self, options={}):
+        """
+        Stats reports Periplus' counters and latency percentiles, the same metrics served to Prometheus on the
+        port given with the `-m <port>` startup flag. It can be called at any time.
 
+        Parameters:
+        options (dict, optional): A dictionary containing additional optional settings.
+        Heres a description of each of those options:
+            - include_cells (bool): When true, the number of times each IVF cell was probed by a search, how many
+            vectors it holds and whether it's resident are included too. By default, include_cells is false.
+
+        Returns:
+        dict: Maps each sample, named as in the Prometheus text format with its labels, to its value e.g.
+        'periplus_queries_total', 'periplus_search_seconds{quantile="0.99"}' or 'periplus_cell_probes_total{cell="3"}'.
+        Latencies are in seconds.
+        """
         await self._connect()
 
-        command = "TRAIN"
-        num_bytes = len(training_data) * len(training_data[0]) * 4
-        float_list = [item for sublist in training_data for item in sublist]
-        
-        fmt = "<Q"
-        static_args = struct.pack(fmt, num_bytes)
-        dynamic_args = struct.pack(f'<{len(float_list)}f', *float_list)
-        assert num_bytes == len(dynamic_args)
-        message = Periplus._format_command(command, static_args, dynamic_args)
+        command = "STATS"
 
-        await self.conn.send(message)
+        include_cells = False
+        if 'include_cells' in options:
+            include_cells = options['include_cells']
 
-        res = await self.conn.receive()
+        static_args = struct.pack("<?Q", include_cells, 0)
+        response = await self._execute(command, static_args, b'')
 
-        # TODO: Recycle TCP connection while ensuring proper resource clean up
-        await self.conn.close()
-        if res.decode() != "Trained cache":
-            message = "[Error: Training Failed] " + res.decode()
-            raise PeriplusServerError(message=message, operation=command)
-        
-        return True
+        # The metrics can be longer than a single read, so they're prefixed with their length
+        length = struct.unpack('<Q', await self._read_bytes(response, 8))[0]
+        res = await self._read_string(response, length)
+        await self._release()
+
+        stats = {}
+        for line in res.splitlines():
+            if not line or line.startswith('#'):
+                continue
+            name, _, value = line.rpartition(' ')
+            stats[name] = float(value)
+        return stats
     
     
-    async def add(self, ids, embeddings):
+    @staticmethod
+    def _format_vectors(ids, embeddings, options):
+        # ADD and UPSERT send each id prefixed with its length, followed by the length prefixed document and metadata
+        # when they're given, then the id / embedding delimiter, then the embeddings
+        assert len(ids) == len(embeddings)
+        documents = options.get('documents')
+        metadata = options.get('metadata')
+        with_payloads = documents is not None or metadata is not None
+        if with_payloads:
+            documents = documents if documents is not None else [""] * len(ids)
+            metadata = metadata if metadata is not None else [""] * len(ids)
+            assert len(documents) == len(ids) and len(metadata) == len(ids)
+
+        chunks = []
+        for i, id in enumerate(ids):
+            id = str(id).encode('latin1')
+            chunks.append(struct.pack('<Q', len(id)))
+            chunks.append(id)
+            if with_payloads:
+                for payload in (documents[i], metadata[i]):
+                    payload = payload.encode('utf-8') if isinstance(payload, str) else bytes(payload)
+                    chunks.append(struct.pack('<Q', len(payload)))
+                    chunks.append(payload)
+        chunks.append(b'\n')
+        for embedding in embeddings:
+            chunks.append(struct.pack(f'<{len(embedding)}f', *embedding))
+        dynamic_args = b''.join(chunks)
+        static_args = struct.pack("<Q?Q", len(ids), with_payloads, len(dynamic_args))
+        return static_args, dynamic_args
+
+
+    async def add(self, ids, embeddings, options={}):
         """
         Add makes Periplus aware of vectors which have been added to the collection. This command must
         be called with any vectors which Periplus should be able to load. 
@@ -147,6 +448,14 @@ class Periplus:
         in the previous argument. Each inner list represents a vector and must be of length d as
         specified in the initialization step.
 
+        options (dict, optional): A dictionary containing additional optional settings.
+        Heres a description of each of those options:
+            - documents (List[str]): The document of each vector. When documents or metadata are given, vectors
+            which land in cells that are already resident are inserted into them right away and can be searched
+            without reloading the cell. Otherwise they're searched once their cells are next loaded.
+            - metadata (List[str]): The metadata of each vector, sent like documents. Whichever of the two isn't
+            given is left empty.
+
         Returns:
         bool: Returns true if the data was added to the Periplus instance successfully.
 
@@ -155,72 +464,89 @@ class Periplus:
         """
         await self._connect()
 
-        assert len(ids) == len(embeddings)
         command = "ADD"
+        static_args, dynamic_args = self._format_vectors(ids, embeddings, options)
+        response = await self._execute(command, static_args, dynamic_args)
 
-        print("computing dynamic length")
-        # Compute the dynamic length
-        num_bytes = 0
-        # account for ids
-        for id in ids:
-            num_bytes += len(str(id))
+        res = await response.receive()
+        await self._release()
+        if res.decode() != "Added vectors":
+            message = "[Error: Adding Vectors Failed] " + res.decode()
+            raise PeriplusServerError(message=message, operation=command)
 
-        # account for id lengths
-        num_bytes += len(ids) * 8
+        return True
 
-        # account for delimiter between ids and embeddings
-        num_bytes += 1
 
-        # account for embeddings
-        num_bytes += len(embeddings) * len(embeddings[0]) * 4
-        print("num_bytes: " + str(num_bytes))
+    async def delete(self, ids):
+        """
+        Delete makes Periplus forget vectors which have been removed from the collection. Deleted vectors are
+        dropped from the resident cells straight away, so searches stop returning them without a reload.
 
-        
-        # Send the static args
-        print("Sending static data")
-        fmt = "<QQ"
-        static_args = struct.pack(fmt, len(ids), num_bytes)
-        static_message = command + "\r\n" + static_args.decode('latin1') + "\n"
-        await self.conn.send(static_message)
+        Parameters:
+        ids (List[str]): The ids of the vectors to delete. Ids Periplus hasn't been given with add are skipped.
+
+        Returns:
+        int: The number of ids which were deleted.
+
+        Raises:
+        Error: If deleting the vectors fails for any reason, an error will be raised.
+        """
+        await self._connect()
 
-        print("Sending id data")
-        # Send the ids
+        command = "DELETE"
+        chunks = []
         for id in ids:
-            id = str(id)
-            # Pack the unsigned integer
-            length = len(id)
-            id_data = ""
-            id_data += struct.pack('<Q', length).decode('latin1')
-            id_data += id
-
-            await self.conn.send(id_data)
-
-
-        print("Sending id / embedding delimiter")
-        # Send the id / embedding delimiter
-        delimiter = b'\n'
-        await self.conn.send(delimiter.decode('latin1'))
-
-        # Send the embeddings
-        print("Sending embeddings")
-        for i, embedding in enumerate(embeddings):
-            if i % 100 == 0:
-                print("Sending " + str(i) + "th embedding") 
-            embedding_data = struct.pack(f'<{len(embedding)}f', *embedding)
-            await self.conn.send(embedding_data.decode('latin1'))
-        
-        await self.conn.send("\r\n")
+            id = str(id).encode('latin1')
+            chunks.append(struct.pack('<Q', len(id)))
+            chunks.append(id)
+        dynamic_args = b''.join(chunks)
+        static_args = struct.pack("<QQ", len(ids), len(dynamic_args))
+        response = await self._execute(command, static_args, dynamic_args)
+
+        res = (await response.receive()).decode()
+        await self._release()
+        if not (res.startswith("Deleted ") and res.endswith(" vectors")):
+            message = "[Error: Deleting Vectors Failed] " + res
+            raise PeriplusServerError(message=message, operation=command)
 
-        res = await self.conn.receive()
-        # TODO: Recycle TCP connection while ensuring proper resource clean up
-        await self.conn.close()
-        if res.decode() != "Added vectors":
-            message = "[Error: Adding Vectors Failed] " + res.decode()
+        return int(res[len("Deleted "):-len(" vectors")])
+
+
+    async def upsert(self, ids, embeddings, options={}):
+        """
+        Upsert replaces the embeddings of vectors which have changed in the collection, and adds any ids Periplus
+        doesn't know about yet. An upserted vector moves to the cell its new embedding is assigned to. Its old
+        embedding stops being returned by searches straight away, and as with add, the new one is searched once
+        its cell is next loaded, or straight away if its cell is resident and its document or metadata is given.
+
+        Parameters:
+        ids (List[str]): The ids of the vectors to upsert.
+
+        embeddings (List[List[float]]): The new embeddings of the ids, each of length d.
+
+        options (dict, optional): The documents and metadata of the vectors, as for add.
+
+        Returns:
+        bool: Returns true if the vectors were upserted successfully.
+
+        Raises:
+        Error: If upserting the vectors fails for any reason, an error will be raised.
+        """
+        await self._connect()
+
+        command = "UPSERT"
+        static_args, dynamic_args = self._format_vectors(ids, embeddings, options)
+        response = await self._execute(command, static_args, dynamic_args)
+
+        res = await response.receive()
+        await self._release()
+        if res.decode() != "Upserted vectors":
+            message = "[Error: Upserting Vectors Failed] " + res.decode()
             raise PeriplusServerError(message=message, operation=command)
 
         return True
-        
-    
+
+
 
     async def load(self, xq, options={}):
         """
@@ -237,12 +563,16 @@ class Periplus:
         Heres a description of each of those options:
             - n_load (int): This specifies how many IVF cells to load. The cells with the n_load
             nearest centroids will be loaded from the database. The default is 1 if not specified.
+            - wait (bool): When true (the default), load returns once the cells are in residence. When
+            false, Periplus acknowledges the command immediately and loads the cells in the background.
+            The cells become searchable as soon as they finish loading.
 
         Returns:
-        bool: Returns true if the data was added to the Periplus instance successfully.
+        dict: When waiting, how many of the cells were served from each tier: 'ram' (already resident), 'disk'
+        (mapped back from the disk tier) and 'db' (fetched from the database). Returns true when not waiting.
 
         Raises:
-        Error: If adding the data fails for any reason, an error will be raised.
+        Error: If loading the data fails for any reason, an error will be raised.
         """
         await self._connect()
 
@@ -252,89 +582,126 @@ class Periplus:
         n_load = 1
         if 'n_load' in options:
             n_load = options['n_load']
+
+        wait = True
+        if 'wait' in options:
+            wait = options['wait']
         
-        fmt = "<QQ"
-        static_args = struct.pack(fmt, n_load, num_bytes)
+        fmt = "<Q?Q"
+        static_args = struct.pack(fmt, n_load, wait, num_bytes)
         dynamic_args = struct.pack(f'<{len(xq)}f', *xq)
         assert num_bytes == len(dynamic_args)
-        message = Periplus._format_command(command, static_args, dynamic_args)
-
-        await self.conn.send(message)
-
-        res = await self.conn.receive()
-
-        # TODO: Recycle TCP connection while ensuring proper resource clean up
-        await self.conn.close()
-        if res.decode() != "Loaded cell":
-            message = "[Error: Loading Failed] " + res.decode()
+        response = await self._execute(command, static_args, dynamic_args)
+
+        res = (await response.receive()).decode()
+        await self._release()
+        if not wait and res == "Loading cell":
+            return True
+        if not wait or not res.startswith("Loaded cell"):
+            message = "[Error: Loading Failed] " + res
             raise PeriplusServerError(message=message, operation=command)
 
-        return True
+        # e.g. "Loaded cell ram=1 disk=2 db=0"
+        return {key: int(value) for key, value in (token.split('=') for token in res.split()[2:])}
 
 
-    async def _read_string(self, length):
+    async def _read_string(self, source, length):
         """ Helper function to read a given length of bytes and decode it to string. """
         chunks = []
         bytes_recd = 0
         while bytes_recd < length:
-            chunk = await self.conn.receive(min(length - bytes_recd, 2048))
+            chunk = await source.receive(min(length - bytes_recd, 2048))
             if chunk == b'':
                 raise RuntimeError("socket connection broken")
             chunks.append(chunk)
             bytes_recd += len(chunk)
         return b''.join(chunks).decode('utf-8')
 
-    async def _read_floats(self, num_floats):
-        """ Helper function to read a specific number of 4-byte floats. """
-        num_bytes = num_floats * 4  # Calculate total bytes to read for the floats
-        floats_data = []
+    async def _read_bytes(self, source, num_bytes):
+        """ Helper function to read a given number of bytes. """
+        chunks = []
         bytes_recd = 0
         while bytes_recd < num_bytes:
-            chunk = await self.conn.receive(min(num_bytes - bytes_recd, 2048))
+            chunk = await source.receive(min(num_bytes - bytes_recd, 2048))
             if chunk == b'':
                 raise RuntimeError("socket connection broken")
-            floats_data.append(chunk)
+            chunks.append(chunk)
             bytes_recd += len(chunk)
-        all_data = b''.join(floats_data)
-        return list(struct.unpack(f'{num_floats}f', all_data))
+        return b''.join(chunks)
 
+    async def _read_floats(self, source, num_floats):
+        """ Helper function to read a specific number of 4-byte floats. """
+        all_data = await self._read_bytes(source, num_floats * 4)
+        return list(struct.unpack(f'{num_floats}f', all_data))
 
-    async def _deserialize_record(self):
-        """ Deserialize structured query results from an already connected TCP socket and return as a namedtuple. """
+    async def _read_compact_embedding(self, source, d):
+        """ Reads an embedding sent as stored, its precision followed by its code, and decodes it to floats. """
+        precision = (await self._read_bytes(source, 1))[0]
+        if precision == Periplus.PAYLOAD_PRECISIONS['fp16']:
+            return list(struct.unpack(f'<{d}e', await self._read_bytes(source, 2 * d)))
+        if precision == Periplus.PAYLOAD_PRECISIONS['bf16']:
+            # A bf16 is the upper half of a float
+            halves = struct.unpack(f'<{d}H', await self._read_bytes(source, 2 * d))
+            return list(struct.unpack(f'<{d}f', struct.pack(f'<{d}I', *(half << 16 for half in halves))))
+        if precision == Periplus.PAYLOAD_PRECISIONS['int8']:
+            code = await self._read_bytes(source, 4 + d)
+            scale = struct.unpack('<f', code[:4])[0]
+            return [component * scale for component in struct.unpack(f'<{d}b', code[4:])]
+        return await self._read_floats(source, d)
+
+
+    async def _deserialize_record(self, source, fields=_ALL_SEARCH_FIELDS, compact=False):
+        """ Deserialize structured query results from the connection or a pipelined payload and return as a namedtuple. """
         # TODO: implement error handling
-        # Read first length (8-byte unsigned integer) for ID string
-        data = await self.conn.receive(8)
-        id_length = struct.unpack('Q', data)[0]
-        id_str = await self._read_string(id_length)
-
-        # Read the number of floats (8-byte unsigned integer)
-        data = await self.conn.receive(8)
-        num_floats = struct.unpack('Q', data)[0]
-        embedding = await self._read_floats(num_floats)
-
-        # Read the length of the second string
-        data = await self.conn.receive(8)
-        document_length = struct.unpack('Q', data)[0]
-        document = await self._read_string(document_length)
-
-        # Read the length of the final string
-        data = await self.conn.receive(8)
-        metadata_length = struct.unpack('Q', data)[0]
-        metadata = await self._read_string(metadata_length)
+        # Fields left out of the mask aren't sent at all and are None in the record
+        id_str = None
+        if fields & _SEARCH_FIELDS['id']:
+            # Read first length (8-byte unsigned integer) for ID string
+            data = await source.receive(8)
+            id_length = struct.unpack('Q', data)[0]
+            id_str = await self._read_string(source, id_length)
+
+        embedding = None
+        if fields & _SEARCH_FIELDS['embedding']:
+            # Read the number of floats (8-byte unsigned integer)
+            data = await source.receive(8)
+            num_floats = struct.unpack('Q', data)[0]
+            if compact:
+                embedding = await self._read_compact_embedding(source, num_floats)
+            else:
+                embedding = await self._read_floats(source, num_floats)
+
+        document = None
+        if fields & _SEARCH_FIELDS['document']:
+            # Read the length of the second string
+            data = await source.receive(8)
+            document_length = struct.unpack('Q', data)[0]
+            document = await self._read_string(source, document_length)
+
+        metadata = None
+        if fields & _SEARCH_FIELDS['metadata']:
+            # Read the length of the final string
+            data = await source.receive(8)
+            metadata_length = struct.unpack('Q', data)[0]
+            metadata = await self._read_string(source, metadata_length)
 
         # Return the received data as a namedtuple
         return Record(id=id_str, embedding=embedding, document=document, metadata=metadata)
 
 
-    async def _deserialize_query_results(self, num_queries):
+    async def _deserialize_query_results(self, source, num_queries, fields=_ALL_SEARCH_FIELDS, compact=False):
         results = []
         for i in range(num_queries):
-            data = await self.conn.receive(4)
-            num_results = struct.unpack('i', data)[0]
-            results.append([])
+            data = await source.receive(8)
+            num_results, coverage = struct.unpack('<if', data)
+            results.append(QueryResults(coverage=coverage))
             for _ in range(num_results):
-                record = await self._deserialize_record()
-                results[i].append(record)
+                distance = None
+                if fields & _SEARCH_FIELDS['distance']:
+                    data = await source.receive(4)
+                    distance = struct.unpack('<f', data)[0]
+                record = await self._deserialize_record(source, fields, compact)
+                results[i].append(record._replace(distance=distance))
 
         return results
     
@@ -359,13 +726,39 @@ class Periplus:
             in-residence then the query will be a cache hit and the subset of the IVF cells defined by the n_probe nearest
             centroids to the query vector will be searched. This means the total number of cells searched will be >= 1 and <= k. By
             default, require_all is true.
+            - read_through (bool): When true, cells which cause cache misses are loaded in the background so later queries
+            in the same region hit. Concurrent queries missing on the same cell only load it once. By default, read_through
+            is false.
+            - wait_ms (int): Only used with read_through. How long to wait for the missing cells to load before answering.
+            Queries whose cells load in time are answered as hits, the rest are still misses. By default, wait_ms is 0 which
+            answers right away.
+            - refine_factor (int): Takes refine_factor * k candidates from the index and re-ranks them by their exact
+            distance to the query vector, computed from the full precision embeddings of the resident records. This
+            recovers the recall lost to product quantization at the cost of some latency. By default, refine_factor is 1
+            which returns the index's ranking as is.
+            - max_distance (float): Results whose squared L2 distance to the query vector is greater than this are
+            dropped by Periplus before they are sent. By default, there is no limit.
+            - min_similarity (float): The same for inner product indexes, results whose inner product with the query
+            vector is less than this are dropped. By default, there is no limit.
+            - fields (List[str]): Which of 'id', 'embedding', 'document', 'metadata' and 'distance' to send with each
+            result. The others are left out of the response and are None in the returned records, e.g. ['id', 'document']
+            saves sending every embedding. By default, every field is sent.
+            - min_coverage (float): Searches only the resident cells among the n_probe nearest, and counts the query as
+            a hit if they hold at least this fraction of the vectors in the n_probe nearest cells. This trades recall
+            for hit rate, e.g. 0.75 still answers a query when a quarter of its neighborhood is cold. require_all is
+            ignored when it's given. By default, it isn't used.
+            - compact_embeddings (bool): When Periplus keeps embeddings at a reduced payload_precision, sends them as
+            stored and decodes them here, which cuts the bytes sent per embedding to match. By default, Periplus
+            decodes them and sends floats.
 
         Returns:
-        List[List[Record]]: The outer list corresponds to the list of query vectors and each inner list contains the k nearest
+        List[QueryResults]: The outer list corresponds to the list of query vectors and each inner list contains the k nearest
         neighbors in the form of Record tuples. Some inner lists may be of size 0 if the corresponding query vector resulted in 
         a cache miss. If the length is > 0 but < k, then k was greater than the number of records contained in the search
-        space. Each Record tuple contains 4 properties: id, embedding, document, and metadata. These will correspond to what was
-        given to Periplus when loading data from the vector database / database proxy.
+        space, or that the rest were past max_distance or min_similarity. Each Record tuple contains 5 properties: id, embedding,
+        document, metadata and distance. The first 4 will correspond to what was given to Periplus when loading data from the
+        vector database / database proxy, and distance is the result's distance to the query vector as computed by the index.
+        Each inner list also has a coverage attribute, the fraction of the vectors in its n_probe nearest cells which were resident.
         """
         await self._connect()
 
@@ -381,20 +774,54 @@ class Periplus:
         if 'require_all' in options:
             require_all = options['require_all']
 
+        read_through = False
+        if 'read_through' in options:
+            read_through = options['read_through']
+
+        wait_ms = 0
+        if 'wait_ms' in options:
+            wait_ms = options['wait_ms']
+
+        refine_factor = 1
+        if 'refine_factor' in options:
+            refine_factor = options['refine_factor']
+
+        max_distance = float('inf')
+        if 'max_distance' in options:
+            max_distance = options['max_distance']
+
+        min_similarity = float('-inf')
+        if 'min_similarity' in options:
+            min_similarity = options['min_similarity']
+
+        # Negative disables partial coverage
+        min_coverage = -1.0
+        if 'min_coverage' in options:
+            min_coverage = options['min_coverage']
+
+        fields = _ALL_SEARCH_FIELDS
+        if 'fields' in options:
+            fields = 0
+            for field in options['fields']:
+                if field not in _SEARCH_FIELDS:
+                    raise ValueError(f"Unknown search field '{field}', expected one of {list(_SEARCH_FIELDS)}")
+                fields |= _SEARCH_FIELDS[field]
+
+        compact_embeddings = False
+        if 'compact_embeddings' in options:
+            compact_embeddings = options['compact_embeddings']
+
         float_list = [item for sublist in xq for item in sublist]
         num_bytes = len(float_list) * 4
 
-        fmt = "<QQQ?Q"
-        static_args = struct.pack(fmt, n, k, n_probe, require_all, num_bytes)
+        fmt = "<QQQ??QQfffB?Q"
+        static_args = struct.pack(fmt, n, k, n_probe, require_all, read_through, wait_ms, refine_factor, max_distance, min_similarity,
+                                  min_coverage, fields, compact_embeddings, num_bytes)
         dynamic_args = struct.pack(f'<{len(float_list)}f', *float_list)
-        message = Periplus._format_command(command, static_args, dynamic_args)
+        response = await self._execute(command, static_args, dynamic_args)
 
-        await self.conn.send(message)
-
-        res = await self._deserialize_query_results(len(xq))
-
-        # TODO: Recycle TCP connection while ensuring proper resource clean up
-        await self.conn.close()
+        res = await self._deserialize_query_results(response, len(xq), fields, compact_embeddings)
+        await self._release()
         return res
     
 
@@ -430,16 +857,56 @@ class Periplus:
         fmt = "<QQ"
         static_args = struct.pack(fmt, n_evict, num_bytes)
         dynamic_args = struct.pack(f'<{len(vector)}f', *vector)
-        message = Periplus._format_command(command, static_args, dynamic_args)
-
-        await self.conn.send(message)
+        response = await self._execute(command, static_args, dynamic_args)
 
-        res = await self.conn.receive()
-
-        # TODO: Recycle TCP connection while ensuring proper resource clean up
-        await self.conn.close()
+        res = await response.receive()
+        await self._release()
         if res.decode() != "Evicted cell":
             message = "[Error: Evicting Failed] " + res.decode()
             raise PeriplusServerError(message=message, operation=command)
         
-        return True
\ No newline at end of file
+        return True
+
+
+    async def snapshot(self, path, options={}):
+        """
+        Snapshot saves the trained index and the ids Periplus has been given with add to a directory on the
+        Periplus server, so the instance can be restarted from it with the `-r <path>` startup flag instead of
+        re-running initialize, train and add. An existing snapshot at the path is only replaced once the new one
+        has been written completely.
+
+        Parameters:
+        path (str): Directory on the Periplus server the snapshot is written to.
+
+        options (dict, optional): A dictionary containing additional optional settings.
+        Heres a description of each of those options:
+            - include_cells (bool): When true, the data of the resident cells is saved too and they're resident
+            again as soon as the snapshot is restored, without being loaded from the database. By default,
+            include_cells is false.
+
+        Returns:
+        bool: Returns true if the snapshot was saved successfully.
+
+        Raises:
+        Error: If saving the snapshot fails for any reason, an error will be raised.
+        """
+        await self._connect()
+
+        command = "SNAPSHOT"
+
+        include_cells = False
+        if 'include_cells' in options:
+            include_cells = options['include_cells']
+
+        encoded_path = path.encode('latin1')
+        fmt = "<?Q"
+        static_args = struct.pack(fmt, include_cells, len(encoded_path))
+        response = await self._execute(command, static_args, encoded_path)
+
+        res = await response.receive()
+        await self._release()
+        if res.decode() != "Saved snapshot":
+            message = "[Error: Snapshot Failed] " + res.decode()
+            raise PeriplusServerError(message=message, operation=command)
+
+        return True
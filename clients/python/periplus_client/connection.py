@@ -61,6 +61,11 @@ class Connection:
         data = await self.reader.read(buffer_size)
         return data
 
+    async def receive_exactly(self, num_bytes):
+        if self.reader is None:
+            raise ConnectionError("Client is not connected.")
+        return await self.reader.readexactly(num_bytes)
+
     async def close(self):
         self.connected = False
         if self.writer is not None:
@@ -0,0 +1,75 @@
+"""
+Tests of the pipelined client against a stand-in server which answers STATUS commands out of order.
+
+Run from clients/python with: python -m pytest tests
+"""
+import asyncio
+import struct
+
+import pytest
+
+from periplus_client.client import Periplus
+from periplus_client.error import PeriplusConnectionError
+
+
+# STATUS sends a u64 size of 0 and no dynamic args
+STATUS_ARGS_SIZE = len(struct.pack("<Q", 0) + b"\n" + b"\r\n")
+
+
+async def start_server(n_commands, answer=True):
+    """ Reads n_commands pipelined STATUS commands, then answers them in reverse order or drops the connection. """
+    received = []
+
+    async def handle(reader, writer):
+        request_ids = []
+        for _ in range(n_commands):
+            line = await reader.readuntil(b"\r\n")
+            command, request_id = line.decode().split()
+            assert command == "STATUS"
+            await reader.readexactly(STATUS_ARGS_SIZE)
+            request_ids.append(int(request_id))
+        received.extend(request_ids)
+
+        if answer:
+            for request_id in reversed(request_ids):
+                payload = f"status=READY samples={request_id} seen=0 step=0 steps=0 index=Flat".encode()
+                writer.write(struct.pack("<QQ", request_id, len(payload)) + payload)
+            await writer.drain()
+        writer.close()
+
+    server = await asyncio.start_server(handle, "127.0.0.1", 0)
+    return server, server.sockets[0].getsockname()[1], received
+
+
+def test_responses_are_matched_to_requests_out_of_order():
+    async def run():
+        n = 8
+        server, port, received = await start_server(n)
+        client = Periplus("127.0.0.1", port, pipelined=True)
+        try:
+            statuses = await asyncio.gather(*(client.status() for _ in range(n)))
+        finally:
+            await client.close()
+            server.close()
+            await server.wait_closed()
+
+        # Every command went over the one connection with its own request id, and got the response tagged with it
+        assert sorted(received) == list(range(n))
+        assert [status['samples'] for status in statuses] == list(range(n))
+
+    asyncio.run(run())
+
+
+def test_lost_connection_fails_pending_commands():
+    async def run():
+        server, port, _ = await start_server(2, answer=False)
+        client = Periplus("127.0.0.1", port, pipelined=True)
+        try:
+            with pytest.raises(PeriplusConnectionError):
+                await asyncio.gather(client.status(), client.status())
+        finally:
+            await client.close()
+            server.close()
+            await server.wait_closed()
+
+    asyncio.run(run())
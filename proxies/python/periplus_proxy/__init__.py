@@ -1,5 +1,6 @@
 # __init__.py
 from .controller import ProxyController
+from .encoding import encode_query_result
 from .models import Query, QueryResult, Record
 
-__all__ = ['ProxyController', 'Query', 'QueryResult', 'Record']
+__all__ = ['ProxyController', 'Query', 'QueryResult', 'Record', 'encode_query_result']
@@ -1,7 +1,8 @@
-from fastapi import FastAPI, Request, HTTPException
+from fastapi import FastAPI, Request, HTTPException, Response
 from pydantic import ValidationError
 from typing import List
 
+from .encoding import BINARY_CONTENT_TYPE, encode_query_result
 from .models import QueryResult, Query
 
 class ProxyController:
@@ -22,6 +23,13 @@ class ProxyController:
 
         response = await self.handler_function(event)
         if isinstance(response, QueryResult):
+            # Periplus asks for the binary format, which it can decode far faster than JSON
+            if BINARY_CONTENT_TYPE in request.headers.get("accept", ""):
+                try:
+                    content = encode_query_result(response)
+                except ValueError as e:
+                    raise HTTPException(status_code=500, detail=str(e))
+                return Response(content=content, media_type=BINARY_CONTENT_TYPE)
             return response
         else:
             raise HTTPException(status_code=500, detail="Invalid response from handler function")
@@ -0,0 +1,47 @@
+import struct
+import sys
+from array import array
+
+from .models import QueryResult
+
+# Content type of the binary response format. Periplus asks for it in the Accept header and falls back to
+# JSON when a proxy doesn't produce it.
+BINARY_CONTENT_TYPE = "application/octet-stream"
+
+
+def _pack_strings(strings):
+    chunks = []
+    for string in strings:
+        encoded = string.encode("utf-8")
+        chunks.append(struct.pack("<Q", len(encoded)))
+        chunks.append(encoded)
+    return b"".join(chunks)
+
+
+def encode_query_result(result: QueryResult) -> bytes:
+    """
+    Encodes a QueryResult in the binary format Periplus decodes without any parsing. All values are little-endian:
+        u64 n, u64 d
+        n x (u64 id_len, id bytes)
+        n x d float32 embeddings
+        n x (u64 document_len, document bytes)
+        n x (u64 metadata_len, metadata bytes)
+    """
+    records = result.results
+    d = len(records[0].embedding) if records else 0
+
+    embeddings = array("f")
+    for record in records:
+        if len(record.embedding) != d:
+            raise ValueError("Every record must have an embedding of the same dimensionality")
+        embeddings.extend(record.embedding)
+    if sys.byteorder != "little":
+        embeddings.byteswap()
+
+    return b"".join([
+        struct.pack("<QQ", len(records), d),
+        _pack_strings(record.id for record in records),
+        embeddings.tobytes(),
+        _pack_strings(record.document for record in records),
+        _pack_strings(record.metadata for record in records),
+    ])
@@ -0,0 +1,77 @@
+"""
+Tests of the binary response format. ENCODED_QUERY_RESULT is also decoded by Periplus' own unit tests
+(test/unit/test_core.cpp), so a change to the format on either side breaks one of them.
+
+Run from proxies/python with: python -m pytest tests
+"""
+import struct
+
+import pytest
+
+from periplus_proxy import QueryResult, Record, encode_query_result
+
+
+RECORDS = [
+    Record(id='id-0', embedding=[1.0, -2.5, 0.125], document='first', metadata='{"i": 0}'),
+    Record(id='id-1', embedding=[3.0, 4.0, -0.5], document='café', metadata=''),
+]
+
+ENCODED_QUERY_RESULT = bytes.fromhex(
+    "0200000000000000" "0300000000000000"
+    "0400000000000000" "69642d30" "0400000000000000" "69642d31"
+    "0000803f000020c00000003e" "0000404000008040000000bf"
+    "0500000000000000" "6669727374" "0500000000000000" "636166c3a9"
+    "0800000000000000" "7b2269223a20307d" "0000000000000000"
+)
+
+
+def decode_query_result(data):
+    """ Decodes the binary format the way Periplus does, checking every length against the bytes left. """
+    offset = 0
+
+    def take(n):
+        nonlocal offset
+        if n > len(data) - offset:
+            raise ValueError("truncated")
+        chunk = data[offset:offset + n]
+        offset += n
+        return chunk
+
+    def read_strings(n):
+        return [take(struct.unpack('<Q', take(8))[0]).decode('utf-8') for _ in range(n)]
+
+    n, d = struct.unpack('<QQ', take(16))
+    ids = read_strings(n)
+    embeddings = struct.unpack(f'<{n * d}f', take(n * d * 4))
+    documents = read_strings(n)
+    metadata = read_strings(n)
+    if offset != len(data):
+        raise ValueError("trailing bytes")
+    return [Record(id=ids[i], embedding=list(embeddings[i * d:(i + 1) * d]), document=documents[i], metadata=metadata[i])
+            for i in range(n)]
+
+
+def test_encoding_matches_periplus_fixture():
+    assert encode_query_result(QueryResult(results=RECORDS)) == ENCODED_QUERY_RESULT
+
+
+def test_round_trip():
+    assert decode_query_result(encode_query_result(QueryResult(results=RECORDS))) == RECORDS
+
+
+def test_empty_result():
+    encoded = encode_query_result(QueryResult(results=[]))
+    assert encoded == struct.pack('<QQ', 0, 0)
+    assert decode_query_result(encoded) == []
+
+
+def test_truncated_result_is_rejected():
+    for size in range(len(ENCODED_QUERY_RESULT)):
+        with pytest.raises(ValueError):
+            decode_query_result(ENCODED_QUERY_RESULT[:size])
+
+
+def test_mismatched_dimensions_are_rejected():
+    records = RECORDS + [Record(id='id-2', embedding=[1.0], document='', metadata='')]
+    with pytest.raises(ValueError):
+        encode_query_result(QueryResult(results=records))
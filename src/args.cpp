@@ -4,11 +4,17 @@
 #include <memory>
 
 void InitializeArgs::deserialize_static(std::istream& is) {
-    this->read_arg<size_t>(&this->d, is);
-    this->read_arg<size_t>(&this->max_mem, is);
-    this->read_arg<size_t>(&this->nTotal, is);
-    this->read_arg<bool>(&this->use_flat, is);
-    this->read_arg<size_t>(&this->size, is);
+    this->read_arg<size_t>(&this->d, is, "d");
+    this->read_arg<size_t>(&this->max_mem, is, "max_mem");
+    this->read_arg<size_t>(&this->nTotal, is, "nTotal");
+    this->read_arg<bool>(&this->use_flat, is, "use_flat");
+    this->read_arg<uint8_t>(&this->eviction_policy, is, "eviction_policy");
+    this->read_arg<uint8_t>(&this->quantizer, is, "quantizer");
+    this->read_arg<float>(&this->target_recall, is, "target_recall");
+    this->read_arg<size_t>(&this->index_mem, is, "index_mem");
+    this->read_arg<size_t>(&this->nprobe, is, "nprobe");
+    this->read_arg<uint8_t>(&this->payload_precision, is, "payload_precision");
+    this->read_arg<size_t>(&this->size, is, "size");
 
     this->read_static_delimiter(is);
 }
@@ -20,7 +26,9 @@ void InitializeArgs::deserialize_dynamic(std::istream& is) {
 
 
 void TrainArgs::deserialize_static(std::istream& is) {
-    this->read_arg<size_t>(&this->size, is);
+    this->read_arg<size_t>(&this->max_samples, is, "max_samples");
+    this->read_arg<bool>(&this->last, is, "last");
+    this->read_arg<size_t>(&this->size, is, "size");
     this->read_static_delimiter(is);
 }
 
@@ -31,8 +39,9 @@ void TrainArgs::deserialize_dynamic(std::istream& is) {
 }
 
 void LoadArgs::deserialize_static(std::istream& is) {
-    this->read_arg<size_t>(&this->nload, is);
-    this->read_arg<size_t>(&this->size, is);
+    this->read_arg<size_t>(&this->nload, is, "nload");
+    this->read_arg<bool>(&this->wait, is, "wait");
+    this->read_arg<size_t>(&this->size, is, "size");
     this->read_static_delimiter(is);
 }
 
@@ -45,11 +54,19 @@ void LoadArgs::deserialize_dynamic(std::istream& is) {
 
 
 void SearchArgs::deserialize_static(std::istream& is) {
-    this->read_arg<size_t>(&this->n, is);
-    this->read_arg<size_t>(&this->k, is);
-    this->read_arg<size_t>(&this->nprobe, is);
-    this->read_arg<bool>(&this->require_all, is);
-    this->read_arg<size_t>(&this->size, is);
+    this->read_arg<size_t>(&this->n, is, "n");
+    this->read_arg<size_t>(&this->k, is, "k");
+    this->read_arg<size_t>(&this->nprobe, is, "nprobe");
+    this->read_arg<bool>(&this->require_all, is, "require_all");
+    this->read_arg<bool>(&this->read_through, is, "read_through");
+    this->read_arg<size_t>(&this->wait_ms, is, "wait_ms");
+    this->read_arg<size_t>(&this->refine_factor, is, "refine_factor");
+    this->read_arg<float>(&this->max_distance, is, "max_distance");
+    this->read_arg<float>(&this->min_similarity, is, "min_similarity");
+    this->read_arg<float>(&this->min_coverage, is, "min_coverage");
+    this->read_arg<uint8_t>(&this->fields, is, "fields");
+    this->read_arg<bool>(&this->compact_embeddings, is, "compact_embeddings");
+    this->read_arg<size_t>(&this->size, is, "size");
     this->read_static_delimiter(is);
 }
 
@@ -60,8 +77,8 @@ void SearchArgs::deserialize_dynamic(std::istream& is) {
 }
 
 void EvictArgs::deserialize_static(std::istream& is) {
-    this->read_arg<size_t>(&this->nevict, is);
-    this->read_arg<size_t>(&this->size, is);
+    this->read_arg<size_t>(&this->nevict, is, "nevict");
+    this->read_arg<size_t>(&this->size, is, "size");
     this->read_static_delimiter(is);
 }
 
@@ -72,8 +89,9 @@ void EvictArgs::deserialize_dynamic(std::istream& is) {
 }
 
 void AddArgs::deserialize_static(std::istream& is) {
-    this->read_arg<size_t>(&this->num_docs, is);
-    this->read_arg<size_t>(&this->size, is);
+    this->read_arg<size_t>(&this->num_docs, is, "num_docs");
+    this->read_arg<bool>(&this->with_payloads, is, "with_payloads");
+    this->read_arg<size_t>(&this->size, is, "size");
     this->read_static_delimiter(is);
 }
 
@@ -81,11 +99,21 @@ void AddArgs::deserialize_dynamic(std::istream& is) {
     size_t totalSize = 0;
     for (size_t i = 0; i < this->num_docs; i++) {
         size_t id_len;
-        this->read_arg<size_t>(&id_len, is);
+        this->read_arg<size_t>(&id_len, is, "id_len");
         totalSize += id_len;
         totalSize += sizeof(id_len);
         std::shared_ptr<char[]> id = this->read_dynamic_data<char>(is, id_len);
         this->ids.push_back(id);
+
+        if (this->with_payloads) {
+            Payload payload;
+            this->read_arg<size_t>(&payload.document_len, is, "document_len");
+            payload.document = this->read_dynamic_data<char>(is, payload.document_len);
+            this->read_arg<size_t>(&payload.metadata_len, is, "metadata_len");
+            payload.metadata = this->read_dynamic_data<char>(is, payload.metadata_len);
+            totalSize += (2 * sizeof(size_t)) + payload.document_len + payload.metadata_len;
+            this->payloads.push_back(payload);
+        }
     }
 
     // Use delimiter between the ids and the embeddings
@@ -95,4 +123,53 @@ void AddArgs::deserialize_dynamic(std::istream& is) {
     size_t num_floats = (this->size - totalSize) / sizeof(float);
     this->embeddings = this->read_dynamic_data<float>(is, num_floats);
     this->read_end_delimiter(is);
-}
\ No newline at end of file
+}
+
+void DeleteArgs::deserialize_static(std::istream& is) {
+    this->read_arg<size_t>(&this->num_ids, is, "num_ids");
+    this->read_arg<size_t>(&this->size, is, "size");
+    this->read_static_delimiter(is);
+}
+
+void DeleteArgs::deserialize_dynamic(std::istream& is) {
+    for (size_t i = 0; i < this->num_ids; i++) {
+        size_t id_len;
+        this->read_arg<size_t>(&id_len, is, "id_len");
+        this->ids.push_back(this->read_dynamic_data<char>(is, id_len));
+    }
+    this->read_end_delimiter(is);
+}
+
+void SnapshotArgs::deserialize_static(std::istream& is) {
+    this->read_arg<bool>(&this->include_cells, is, "include_cells");
+    this->read_arg<size_t>(&this->size, is, "size");
+    this->read_static_delimiter(is);
+}
+
+void SnapshotArgs::deserialize_dynamic(std::istream& is) {
+    this->path = this->read_dynamic_data<char>(is, this->size);
+    this->read_end_delimiter(is);
+}
+
+void StatusArgs::deserialize_static(std::istream& is) {
+    this->read_arg<size_t>(&this->size, is, "size");
+    this->read_static_delimiter(is);
+}
+
+void StatusArgs::deserialize_dynamic(std::istream& is) {
+    // STATUS has no dynamic args, anything sent is skipped
+    is.ignore(this->size);
+    this->read_end_delimiter(is);
+}
+
+void StatsArgs::deserialize_static(std::istream& is) {
+    this->read_arg<bool>(&this->include_cells, is, "include_cells");
+    this->read_arg<size_t>(&this->size, is, "size");
+    this->read_static_delimiter(is);
+}
+
+void StatsArgs::deserialize_dynamic(std::istream& is) {
+    // STATS has no dynamic args, anything sent is skipped
+    is.ignore(this->size);
+    this->read_end_delimiter(is);
+}
@@ -8,10 +8,18 @@ structs passed into it to read commands.
 #ifndef ARGS_H
 #define ARGS_H
 
+#include "data.h"
+
+#include <chrono>
 #include <memory>
 #include <vector>
 #include <cstring>
+#include <cstdlib>
+#include <algorithm>
+#include <cstdint>
 #include <iostream>
+#include <stdexcept>
+#include <string>
 
 enum Command {
     INITIALIZE,
@@ -19,14 +27,34 @@ enum Command {
     LOAD,
     SEARCH,
     EVICT,
-    ADD
+    ADD,
+    SNAPSHOT,
+    STATUS,
+    DELETE,
+    UPSERT,
+    STATS
+};
+
+// Names of the commands on the wire, indexed by Command
+static constexpr const char *command_names[] = {
+    "INITIALIZE", "TRAIN", "LOAD", "SEARCH", "EVICT", "ADD", "SNAPSHOT", "STATUS", "DELETE", "UPSERT", "STATS"
 };
+static constexpr const size_t n_commands = sizeof(command_names) / sizeof(command_names[0]);
 
 struct Args {
     size_t size;
     size_t static_size;
+    // Set when the command line carried a request id (e.g. "SEARCH 42"). Pipelined responses are framed with
+    // the id so they can be sent out of order.
+    bool pipelined = false;
+    uint64_t request_id = 0;
+    // When the command line was read, which command latencies are measured from
+    std::chrono::steady_clock::time_point received_at;
 
     virtual size_t get_static_size() { return static_size; };
+    // Whether a pipelined command can run alongside the commands sent after it. Commands which change what the
+    // following commands operate on (INITIALIZE, TRAIN, ADD, DELETE, UPSERT) run before the next command is read.
+    virtual bool is_concurrent() { return false; }
     virtual Command get_command() = 0;
     virtual void deserialize_static(std::istream& is) = 0;
     virtual void deserialize_dynamic(std::istream& is) = 0;
@@ -40,38 +68,58 @@ protected:
         return false;
     }
 
+    // Numeric payloads are aligned to a cache line so FAISS and SIMD kernels can consume them directly
+    static constexpr size_t payload_alignment = 64;
+
+    template<typename T>
+    std::shared_ptr<T[]> allocate_aligned(size_t size) {
+        // aligned_alloc requires the size to be a non-zero multiple of the alignment
+        size_t bytes = std::max(sizeof(T) * size, payload_alignment);
+        bytes = ((bytes + payload_alignment - 1) / payload_alignment) * payload_alignment;
+        T *data = static_cast<T*>(std::aligned_alloc(payload_alignment, bytes));
+        if (data == nullptr) {
+            throw std::bad_alloc();
+        }
+        return std::shared_ptr<T[]>(data, [](T *ptr) { std::free(ptr); });
+    }
+
     template<typename T>
     std::shared_ptr<T[]> read_dynamic_data(std::istream& is, size_t size) {
+        // The whole payload is copied out of the stream buffer with a single read, which the streambuf
+        // turns into one memcpy, instead of going through the stream once per element.
         if (isChar<T>()) {
             std::shared_ptr<T[]> data(new T[size + 1]);
-            for (size_t i = 0; i < size; i++) {
-                this->read_arg<T>(&data[i], is);
-            }
+            this->read_bytes(reinterpret_cast<char *>(data.get()), sizeof(T) * size, is);
             data[size] = '\0'; // Add null terminator if the data is a char
             return data;
         }
-        std::shared_ptr<T[]> data(new T[size]);
-        for (size_t i = 0; i < size; i++) {
-            this->read_arg<T>(&data[i], is);
-        }
+        std::shared_ptr<T[]> data = this->allocate_aligned<T>(size);
+        this->read_bytes(reinterpret_cast<char *>(data.get()), sizeof(T) * size, is);
         return data;
     }
 
+    void read_bytes(char *dest, size_t length, std::istream& is) {
+        is.read(dest, length);
+        if (!is) {
+            std::cerr << "Failed to read the required number of bytes." << std::endl;
+            throw std::runtime_error("Failed to read " + std::to_string(length) + " bytes of dynamic data");
+        }
+    }
+
     template<typename T>
-    void read_arg(T *arg, std::istream& is) {
+    void read_arg(T *arg, std::istream& is, const char *name) {
         char buffer[sizeof(T)];
         is.read(buffer, sizeof(T));
         if (!is) {
             std::cerr << "Failed to read the required number of bytes." << std::endl;
-            throw;
-            // return;
+            throw std::runtime_error("Failed to read the " + std::to_string(sizeof(T)) + " bytes of argument " + name);
         }
         memcpy(arg, buffer, sizeof(T));
     }
 
     void read_static_delimiter(std::istream& is) {
         char temp;
-        this->read_arg<char>(&temp, is);
+        this->read_arg<char>(&temp, is, "static delimiter");
         if (temp != '\n') {
             std::cerr << "Expected static delimiter (\\n) but didn't find it" << std::endl;
             // TODO: somehow abandon command (Probably throw an error that gets caught in the cache layer)
@@ -80,11 +128,11 @@ protected:
 
     void read_end_delimiter(std::istream& is) {
         char temp;
-        this->read_arg<char>(&temp, is);
+        this->read_arg<char>(&temp, is, "end delimiter");
         if (temp != '\r') {
             std::cerr << "Expected end delimiter but didn't find it" << std::endl;
         }
-        this->read_arg<char>(&temp, is);
+        this->read_arg<char>(&temp, is, "end delimiter");
         if (temp != '\n') {
             std::cerr << "Expected end delimiter but didn't find it" << std::endl;
         }
@@ -96,7 +144,18 @@ struct InitializeArgs : Args {
     size_t max_mem;
     size_t nTotal;
     bool use_flat;
-    const static size_t static_size = 4 * sizeof(size_t) + sizeof(bool) + sizeof(char);
+    // One of the EvictionPolicyType values
+    uint8_t eviction_policy;
+    // One of the QuantizerType values
+    uint8_t quantizer;
+    // When above 0, TRAIN tunes the index for the smallest codes reaching this recall at nprobe, keeping the codes
+    // and ids of nTotal vectors within index_mem megabytes (0 for no limit)
+    float target_recall;
+    size_t index_mem;
+    size_t nprobe;
+    // One of the EmbeddingPrecision values, which resident embeddings are kept at
+    uint8_t payload_precision;
+    const static size_t static_size = 6 * sizeof(size_t) + sizeof(bool) + 3 * sizeof(uint8_t) + sizeof(float) + sizeof(char);
     std::shared_ptr<char[]> db_url;
 
     virtual size_t get_static_size() override { return static_size; };
@@ -106,8 +165,13 @@ struct InitializeArgs : Args {
 };
 
 
+// The training set is streamed in over any number of TRAIN commands, each carrying a chunk of it. Training starts
+// in the background once the last chunk arrives.
 struct TrainArgs : Args {
-    const static size_t static_size = 9;
+    const static size_t static_size = 2 * sizeof(size_t) + sizeof(bool) + sizeof(char);
+    // Most vectors kept from the training set, which is sampled down to this many. 0 keeps every vector.
+    size_t max_samples;
+    bool last;
     std::shared_ptr<float[]> training_data;
 
     virtual size_t get_static_size() override { return static_size; };
@@ -118,25 +182,46 @@ struct TrainArgs : Args {
 
 
 struct LoadArgs : Args {
-    const static size_t static_size = 2 * sizeof(size_t) + sizeof(char);
+    const static size_t static_size = 2 * sizeof(size_t) + sizeof(bool) + sizeof(char);
     size_t nload;
+    // When false the response is sent right away and the cells are loaded in the background
+    bool wait;
     std::shared_ptr<float[]> xq;
     
     virtual size_t get_static_size() override { return static_size; }
+    virtual bool is_concurrent() override { return true; }
     virtual Command get_command() override { return LOAD; };
     virtual void deserialize_static(std::istream& is) override;
     virtual void deserialize_dynamic(std::istream& is) override;
 };
 
 struct SearchArgs : Args {
-    const static size_t static_size = 4 * sizeof(size_t) + sizeof(char) + sizeof(bool);
+    const static size_t static_size = 6 * sizeof(size_t) + 3 * sizeof(float) + sizeof(uint8_t) + sizeof(char) + 3 * sizeof(bool);
     size_t n;
     size_t k;
     size_t nprobe;
     bool require_all;
+    // Load the cells that cause cache misses in the background
+    bool read_through;
+    // How long a read-through search waits for the missing cells before answering, 0 answers right away
+    size_t wait_ms;
+    // Candidates taken per result and re-ranked by exact distance, 1 returns the index's ranking as is
+    size_t refine_factor;
+    // Results past these are dropped before they're sent: max_distance applies to L2 indexes and min_similarity to
+    // inner product ones. Clients send infinities when they don't want a threshold.
+    float max_distance;
+    float min_similarity;
+    // When not negative, probe only the resident cells among the nprobe nearest and count the query as a hit if they
+    // hold at least this fraction of the vectors in those cells. Negative uses require_all instead.
+    float min_coverage;
+    // Mask of the SearchFields (see response.h) each result is sent with
+    uint8_t fields;
+    // Send embeddings kept at reduced precision as stored instead of decoding them to floats
+    bool compact_embeddings;
     std::shared_ptr<float[]> xq;
 
     virtual size_t get_static_size() override { return static_size; }
+    virtual bool is_concurrent() override { return true; }
     virtual Command get_command() override { return SEARCH; }
     virtual void deserialize_static(std::istream& is) override;
     virtual void deserialize_dynamic(std::istream& is) override;
@@ -148,6 +233,7 @@ struct EvictArgs : Args {
     std::shared_ptr<float[]> xq;
 
     virtual size_t get_static_size() override { return static_size; }
+    virtual bool is_concurrent() override { return true; }
     virtual Command get_command() override { return EVICT; }
     virtual void deserialize_static(std::istream& is) override;
     virtual void deserialize_dynamic(std::istream& is) override;
@@ -155,11 +241,15 @@ struct EvictArgs : Args {
 
 // Add?, Track?, Register?, Notify?
 struct AddArgs : Args {
-    const static size_t static_size = sizeof(size_t) + sizeof(char);
+    const static size_t static_size = 2 * sizeof(size_t) + sizeof(bool) + sizeof(char);
     size_t num_docs;
+    // Whether each id is followed by the vector's document and metadata, so vectors landing in resident cells are
+    // searchable straight away
+    bool with_payloads;
 
     std::shared_ptr<float[]> embeddings;
     std::vector<std::shared_ptr<char[]>> ids;
+    std::vector<Payload> payloads;
 
     virtual size_t get_static_size() override { return static_size; }
     virtual Command get_command() override { return ADD; }
@@ -167,4 +257,56 @@ struct AddArgs : Args {
     virtual void deserialize_dynamic(std::istream& is ) override;
 };
 
+// Same layout as ADD, with the embeddings the ids are moved to
+struct UpsertArgs : AddArgs {
+    virtual Command get_command() override { return UPSERT; }
+};
+
+struct DeleteArgs : Args {
+    const static size_t static_size = 2 * sizeof(size_t) + sizeof(char);
+    size_t num_ids;
+    std::vector<std::shared_ptr<char[]>> ids;
+
+    virtual size_t get_static_size() override { return static_size; }
+    virtual Command get_command() override { return DELETE; }
+    virtual void deserialize_static(std::istream& is) override;
+    virtual void deserialize_dynamic(std::istream& is) override;
+};
+
+struct SnapshotArgs : Args {
+    const static size_t static_size = sizeof(bool) + sizeof(size_t) + sizeof(char);
+    // Also persist the data of the resident cells so they're resident again as soon as the snapshot is restored
+    bool include_cells;
+    // Directory the snapshot is written to on the server
+    std::shared_ptr<char[]> path;
+
+    virtual size_t get_static_size() override { return static_size; }
+    virtual bool is_concurrent() override { return true; }
+    virtual Command get_command() override { return SNAPSHOT; }
+    virtual void deserialize_static(std::istream& is) override;
+    virtual void deserialize_dynamic(std::istream& is) override;
+};
+
+struct StatusArgs : Args {
+    const static size_t static_size = sizeof(size_t) + sizeof(char);
+
+    virtual size_t get_static_size() override { return static_size; }
+    virtual bool is_concurrent() override { return true; }
+    virtual Command get_command() override { return STATUS; }
+    virtual void deserialize_static(std::istream& is) override;
+    virtual void deserialize_dynamic(std::istream& is) override;
+};
+
+struct StatsArgs : Args {
+    const static size_t static_size = sizeof(bool) + sizeof(size_t) + sizeof(char);
+    // Also report how often each cell has been probed and how many vectors it holds
+    bool include_cells;
+
+    virtual size_t get_static_size() override { return static_size; }
+    virtual bool is_concurrent() override { return true; }
+    virtual Command get_command() override { return STATS; }
+    virtual void deserialize_static(std::istream& is) override;
+    virtual void deserialize_dynamic(std::istream& is) override;
+};
+
 #endif
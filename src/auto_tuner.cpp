@@ -0,0 +1,238 @@
+#include "auto_tuner.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include <faiss/IndexFlat.h>
+#include <faiss/IndexHNSW.h>
+#include <faiss/IndexIVFFlat.h>
+#include <faiss/IndexIVFPQ.h>
+#include <faiss/IndexScalarQuantizer.h>
+
+
+IndexConfig IndexConfig::defaults(size_t d, size_t nCells, bool use_flat) {
+    IndexConfig config;
+    config.nCells = nCells;
+    // Low dimensional embeddings don't need to be product quantization
+    // Embeddings with dimensions no divisible by m can't be quantized
+    if (use_flat || d < 64 || d % 8 != 0) {
+        return config;
+    }
+    config.family = IVF_PQ;
+    config.m = d % 16 == 0 ? 16 : 8;
+    config.nbits = 8;
+    return config;
+}
+
+std::unique_ptr<faiss::IndexIVF> IndexConfig::createIndex(faiss::Index *quantizer, size_t d) const {
+    switch (this->family) {
+    case IVF_PQ:
+        return std::unique_ptr<faiss::IndexIVFPQ>(new faiss::IndexIVFPQ(quantizer, d, this->nCells, this->m, this->nbits));
+    case IVF_SQ8:
+        return std::unique_ptr<faiss::IndexIVFScalarQuantizer>(
+            new faiss::IndexIVFScalarQuantizer(quantizer, d, this->nCells, faiss::ScalarQuantizer::QT_8bit));
+    case IVF_SQ_FP16:
+        return std::unique_ptr<faiss::IndexIVFScalarQuantizer>(
+            new faiss::IndexIVFScalarQuantizer(quantizer, d, this->nCells, faiss::ScalarQuantizer::QT_fp16));
+    default:
+        return std::unique_ptr<faiss::IndexIVFFlat>(new faiss::IndexIVFFlat(quantizer, d, this->nCells));
+    }
+}
+
+size_t IndexConfig::codeSize(size_t d) const {
+    switch (this->family) {
+    case IVF_PQ:
+        return (this->m * this->nbits + 7) / 8;
+    case IVF_SQ8:
+        return d;
+    case IVF_SQ_FP16:
+        return 2 * d;
+    default:
+        return sizeof(float) * d;
+    }
+}
+
+
+std::string describeIndex(const faiss::IndexIVF& index) {
+    std::string description = "IVF" + std::to_string(index.nlist);
+    if (dynamic_cast<const faiss::IndexHNSW*>(index.quantizer) != nullptr) {
+        description += "_HNSW";
+    }
+    if (const faiss::IndexIVFPQ *pq = dynamic_cast<const faiss::IndexIVFPQ*>(&index)) {
+        description += ",PQ" + std::to_string(pq->pq.M) + "x" + std::to_string(pq->pq.nbits);
+    } else if (const faiss::IndexIVFScalarQuantizer *sq = dynamic_cast<const faiss::IndexIVFScalarQuantizer*>(&index)) {
+        description += sq->sq.qtype == faiss::ScalarQuantizer::QT_fp16 ? ",SQfp16" : ",SQ8";
+    } else {
+        description += ",Flat";
+    }
+    return description;
+}
+
+
+AutoTuner::AutoTuner(size_t d, float target_recall, size_t memory_budget)
+    : d(d), target_recall(target_recall), memory_budget(memory_budget) {}
+
+std::vector<IndexConfig> AutoTuner::candidates(size_t nCells) const {
+    std::vector<IndexConfig> configs;
+    auto add = [&](IndexFamily family, size_t m, size_t nbits) {
+        IndexConfig config;
+        config.family = family;
+        config.nCells = nCells;
+        config.m = m;
+        config.nbits = nbits;
+        configs.push_back(config);
+    };
+    add(IVF_FLAT, 0, 0);
+    add(IVF_SQ_FP16, 0, 0);
+    add(IVF_SQ8, 0, 0);
+    // Subvectors need at least 2 dimensions, and codes must fill whole bytes
+    for (size_t m : {4, 8, 16, 32, 48, 64, 96, 128, 192, 256}) {
+        if (2 * m > this->d || this->d % m != 0) {
+            continue;
+        }
+        for (size_t nbits : {4, 8}) {
+            if ((m * nbits) % 8 == 0) {
+                add(IVF_PQ, m, nbits);
+            }
+        }
+    }
+    std::stable_sort(configs.begin(), configs.end(), [this](const IndexConfig& a, const IndexConfig& b) {
+        return a.codeSize(this->d) < b.codeSize(this->d);
+    });
+    return configs;
+}
+
+TuningResult AutoTuner::tune(size_t n, const float *x, size_t nTotal, size_t nCells, size_t nprobe) const {
+    // k-means needs enough of the sample for every centroid
+    nCells = std::max<size_t>(1, std::min(nCells, n / min_points_per_cell));
+    nprobe = std::max<size_t>(1, nprobe);
+
+    std::vector<IndexConfig> configs = this->candidates(nCells);
+    std::vector<IndexConfig> affordable;
+    for (const IndexConfig& config : configs) {
+        if (this->memory_budget == 0 || (config.codeSize(this->d) + sizeof(faiss::idx_t)) * nTotal <= this->memory_budget) {
+            affordable.push_back(config);
+        }
+    }
+    if (affordable.empty()) {
+        std::cerr << "No index fits " << nTotal << " vectors in " << this->memory_budget << " bytes, using the smallest codes" << std::endl;
+        affordable.push_back(configs.front());
+    }
+
+    // The start of the sample is indexed and the rest of it is searched
+    size_t nUsed = std::min(n, max_vectors);
+    size_t nq = std::min(max_queries, nUsed / 10);
+    size_t nb = nUsed - nq;
+    TuningResult best;
+    best.config = affordable.back();
+    if (nq == 0) {
+        std::cerr << "Training sample of " << n << " vectors is too small to tune with, using " << best.config.codeSize(this->d)
+                  << " byte codes" << std::endl;
+        return best;
+    }
+    const float *base = x;
+    const float *queries = &x[nb * this->d];
+
+    faiss::IndexFlatL2 exact(this->d);
+    exact.add(nb, base);
+    std::vector<float> distances(nq * k);
+    std::vector<faiss::idx_t> truth(nq * k);
+    exact.search(nq, queries, k, distances.data(), truth.data());
+
+    // nCells is swept by halving it until every cell is probed. With nprobe fixed, more cells means fewer vectors
+    // scanned per query, so the largest nCells reaching the target is the fastest. The sample index can have fewer
+    // cells than the collection will, in which case it probes the same fraction of its cells as nprobe is of nCells.
+    struct SampleShape {
+        size_t nCells;
+        size_t sampleCells;
+        size_t sampleProbes;
+    };
+    std::vector<SampleShape> shapes;
+    for (size_t cells = nCells; ; cells /= 2) {
+        SampleShape shape;
+        shape.nCells = cells;
+        shape.sampleCells = std::max<size_t>(1, std::min(cells, nb / min_points_per_cell));
+        shape.sampleProbes = std::max<size_t>(1, std::min(shape.sampleCells, (size_t)std::lround((double)nprobe * shape.sampleCells / cells)));
+        shapes.push_back(shape);
+        if (cells <= nprobe || cells == 1) {
+            break;
+        }
+    }
+
+    // Every candidate with the same number of sample cells shares one quantizer, trained by the first of them
+    std::map<size_t, std::unique_ptr<faiss::IndexFlatL2>> quantizers;
+    for (const SampleShape& shape : shapes) {
+        if (quantizers.count(shape.sampleCells) == 0) {
+            quantizers[shape.sampleCells] = std::unique_ptr<faiss::IndexFlatL2>(new faiss::IndexFlatL2(this->d));
+        }
+    }
+
+    bool measured = false;
+    std::vector<faiss::idx_t> labels(nq * k);
+    for (const IndexConfig& codec : affordable) {
+        if (codec.family == IVF_PQ && ((size_t)1 << codec.nbits) > nb) {
+            // Too few vectors to train the codebooks
+            continue;
+        }
+        // Shapes which differ only in the collection's nCells are the same sample index, searched the same way
+        std::unique_ptr<faiss::IndexIVF> index;
+        float recall = 0;
+        float qps = 0;
+        for (size_t s = 0; s < shapes.size(); s++) {
+            const SampleShape& shape = shapes[s];
+            if (s == 0 || shape.sampleCells != shapes[s - 1].sampleCells || shape.sampleProbes != shapes[s - 1].sampleProbes) {
+                if (!index || index->nlist != shape.sampleCells) {
+                    IndexConfig sampleConfig = codec;
+                    sampleConfig.nCells = shape.sampleCells;
+                    index = sampleConfig.createIndex(quantizers[shape.sampleCells].get(), this->d);
+                    index->train(nb, base);
+                    index->add(nb, base);
+                }
+                faiss::IVFSearchParameters params;
+                params.nprobe = shape.sampleProbes;
+
+                auto start = std::chrono::steady_clock::now();
+                index->search(nq, queries, k, distances.data(), labels.data(), &params);
+                double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+                size_t found = 0;
+                for (size_t i = 0; i < nq; i++) {
+                    std::unordered_set<faiss::idx_t> neighbors(&truth[i * k], &truth[(i + 1) * k]);
+                    for (size_t j = 0; j < k; j++) {
+                        found += neighbors.count(labels[(i * k) + j]);
+                    }
+                }
+                recall = (float)found / (nq * k);
+                qps = seconds > 0 ? nq / seconds : 0;
+                std::cout << "Auto-tuner: " << describeIndex(*index) << " nprobe=" << shape.sampleProbes << " recall=" << recall
+                          << " qps=" << qps << std::endl;
+            }
+
+            IndexConfig config = codec;
+            config.nCells = shape.nCells;
+            if (!measured || recall > best.recall) {
+                best.config = config;
+                best.recall = recall;
+                best.qps = qps;
+                measured = true;
+            }
+            // Codecs come smallest codes first and nCells largest first, so the first to reach the target is the
+            // cheapest and then the fastest that does
+            if (recall >= this->target_recall) {
+                best.config = config;
+                best.recall = recall;
+                best.qps = qps;
+                return best;
+            }
+        }
+    }
+    std::cerr << "No index reached a recall of " << this->target_recall << ", using the most accurate" << std::endl;
+    return best;
+}
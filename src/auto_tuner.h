@@ -0,0 +1,80 @@
+/*
+The auto-tuner picks the IVF index a core is built with from its training sample, instead of always using PQ with
+16 subquantizers. Each candidate codec (IVFFlat, scalar quantization to fp16 or 8 bits, and PQ with a range of m
+and nbits) which fits the memory budget is built on part of the sample and searched with the rest as queries, and
+the one with the smallest codes which reaches the target recall is chosen. Each codec is measured at a range of
+nCells, halving it down to the nprobe searches are expected to use, and the largest nCells reaching the target is
+kept, since it scans the fewest vectors per query.
+*/
+
+#ifndef AUTO_TUNER_H
+#define AUTO_TUNER_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <faiss/Index.h>
+#include <faiss/IndexIVF.h>
+
+enum IndexFamily : uint8_t {
+    IVF_FLAT,
+    IVF_PQ,
+    IVF_SQ8,
+    IVF_SQ_FP16
+};
+
+struct IndexConfig {
+    IndexFamily family = IVF_FLAT;
+    size_t nCells = 1;
+    // Product quantization only: the number of subquantizers and the bits in each of their codes
+    size_t m = 0;
+    size_t nbits = 0;
+
+    // What a core is built with when it isn't tuned: PQ with 16 subquantizers (8 if d doesn't divide by 16) for
+    // embeddings of at least 64 dimensions, IVFFlat otherwise
+    static IndexConfig defaults(size_t d, size_t nCells, bool use_flat);
+
+    std::unique_ptr<faiss::IndexIVF> createIndex(faiss::Index *quantizer, size_t d) const;
+    // Bytes of index code per vector
+    size_t codeSize(size_t d) const;
+};
+
+// Describes an index in faiss::index_factory notation, e.g. "IVF1024,PQ16x8"
+std::string describeIndex(const faiss::IndexIVF& index);
+
+struct TuningResult {
+    IndexConfig config;
+    // Recall at AutoTuner::k and queries per second of the chosen configuration on the held out part of the sample
+    float recall = 0;
+    float qps = 0;
+};
+
+class AutoTuner {
+public:
+    static constexpr const size_t k = 10;
+    // The sweep runs on at most this many vectors of the sample, of which up to max_queries are held out as queries
+    static constexpr const size_t max_vectors = 20000;
+    static constexpr const size_t max_queries = 200;
+    // FAISS warns when k-means has fewer training points than this per centroid
+    static constexpr const size_t min_points_per_cell = 39;
+
+    // A target_recall between 0 and 1. memory_budget is the most bytes the codes and ids of nTotal vectors may
+    // take, 0 for no limit.
+    AutoTuner(size_t d, float target_recall, size_t memory_budget);
+
+    // Tunes for a collection of nTotal vectors split into at most nCells cells and searched with nprobe, given n
+    // training vectors x
+    TuningResult tune(size_t n, const float *x, size_t nTotal, size_t nCells, size_t nprobe) const;
+
+    // Every codec the sweep considers for d, smallest codes first
+    std::vector<IndexConfig> candidates(size_t nCells) const;
+
+private:
+    size_t d;
+    float target_recall;
+    size_t memory_budget;
+};
+
+#endif
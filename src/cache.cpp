@@ -1,21 +1,43 @@
 #include "cache.h"
 #include "args.h"
 #include "session.h"
+#include "response.h"
 #include "exceptions.h"
+#include "snapshot.h"
+#include "metrics.h"
 
 #include <random>
 #include <iostream>
 #include <math.h>
 #include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <algorithm>
+#include <cstring>
 
 
-Cache::Cache() : status(UNINITIALIZED), core(nullptr) {}
+Cache::Cache(const CacheConfig& config) : config(config), status(UNINITIALIZED), core(nullptr), fetch_pool(std::max<size_t>(config.fetch_threads, 1)) {
+    if (!config.restore_path.empty()) {
+        this->restore(config.restore_path);
+    }
+}
 
 // Should the command be passed in or should session.read_command be called?
 void Cache::processCommand(std::shared_ptr<Session> session, std::string command) {
     // Determine the whether we can process the command
     std::string output("Unable to process command: " + command);
     std::cout << "Received command: " << command << '\n';
+    // STATUS can be sent whatever state the cache is in
+    if (command == std::string("STATUS")) {
+        std::shared_ptr<StatusArgs> args = std::make_shared<StatusArgs>();
+        session->read_args(args);
+        return;
+    }
+    if (command == std::string("STATS")) {
+        std::shared_ptr<StatsArgs> args = std::make_shared<StatsArgs>();
+        session->read_args(args);
+        return;
+    }
     switch (this->status) {
         case READY:
             if (command == std::string("SEARCH")) {
@@ -28,6 +50,16 @@ void Cache::processCommand(std::shared_ptr<Session> session, std::string command
                 std::shared_ptr<AddArgs> args = std::make_shared<AddArgs>();
                 session->read_args(args);
                 break;
+            } else if (command == std::string("DELETE")) {
+                output = "Parsing delete command";
+                std::shared_ptr<DeleteArgs> args = std::make_shared<DeleteArgs>();
+                session->read_args(args);
+                break;
+            } else if (command == std::string("UPSERT")) {
+                output = "Parsing upsert command";
+                std::shared_ptr<UpsertArgs> args = std::make_shared<UpsertArgs>();
+                session->read_args(args);
+                break;
             } else if (command == std::string("LOAD")) {
                 output = "Parsing load command!";
                 std::shared_ptr<LoadArgs> args = std::make_shared<LoadArgs>();
@@ -38,6 +70,11 @@ void Cache::processCommand(std::shared_ptr<Session> session, std::string command
                 std::shared_ptr<EvictArgs> args = std::make_shared<EvictArgs>();
                 session->read_args(args);
                 break;
+            } else if (command == std::string("SNAPSHOT")) {
+                output = "Parsing snapshot command!";
+                std::shared_ptr<SnapshotArgs> args = std::make_shared<SnapshotArgs>();
+                session->read_args(args);
+                break;
             } else {
                 std::cout << "DIDn't match READY command" << std::endl;
             }
@@ -48,6 +85,7 @@ void Cache::processCommand(std::shared_ptr<Session> session, std::string command
                 session->read_args(args);
                 break;
             }
+        case TRAINING:
         case UNINITIALIZED:
             if (command == std::string("INITIALIZE")) {
                 output = "Processing initialize command!";
@@ -62,43 +100,54 @@ void Cache::processCommand(std::shared_ptr<Session> session, std::string command
 }
 
 
-void Cache::process_args(std::shared_ptr<Session> session) {
+void Cache::process_args(std::shared_ptr<Session> session, std::shared_ptr<Args> args) {
     // Complete any logic which is command agnostic
     // We now have a completed args object
     // Determine the command
-    if (session->args->get_command() == SEARCH) {
-        this->search(session);
+    if (args->get_command() == SEARCH) {
+        this->search(session, args);
         std::cout << "Completed SEARCH execution\n";
-    } else if (session->args->get_command() == ADD) {
-        this->add(session);
+    } else if (args->get_command() == ADD) {
+        this->add(session, args);
         std::cout << "Completed ADD execution\n";
-    } else if (session->args->get_command() == INITIALIZE) {
-        this->initialize(session);
+    } else if (args->get_command() == DELETE) {
+        this->remove(session, args);
+        std::cout << "Completed DELETE execution\n";
+    } else if (args->get_command() == UPSERT) {
+        this->upsert(session, args);
+        std::cout << "Completed UPSERT execution\n";
+    } else if (args->get_command() == INITIALIZE) {
+        this->initialize(session, args);
         std::cout << "Completed INITIALIZE execution\n";
-    } else if (session->args->get_command() == TRAIN) {
-        this->train(session);
+    } else if (args->get_command() == TRAIN) {
+        this->train(session, args);
         std::cout << "Completed TRAIN execution\n";
-    } else if (session->args->get_command() == LOAD) {
-        this->load(session);
+    } else if (args->get_command() == LOAD) {
+        this->load(session, args);
         std::cout << "Completed LOAD execution\n";
-    } else if (session->args->get_command() == EVICT) {
-        this->evict(session);
+    } else if (args->get_command() == EVICT) {
+        this->evict(session, args);
         std::cout << "Completed EVICT execution\n";
+    } else if (args->get_command() == SNAPSHOT) {
+        this->snapshot(session, args);
+        std::cout << "Completed SNAPSHOT execution\n";
+    } else if (args->get_command() == STATUS) {
+        this->reportStatus(session, args);
+    } else if (args->get_command() == STATS) {
+        this->reportStats(session, args);
     }
-
-    // Allow for multiple commands in a single session
-    session->read_command();
 }
 
 size_t Cache::determineNCells(size_t nTotal) {
-    // TODO: modify this to account for low total
-    return 4 * sqrt(nTotal);
+    // Small collections get fewer cells so each still has enough vectors to train its centroid
+    return std::max<size_t>(1, std::min<size_t>(4 * sqrt(nTotal), nTotal / AutoTuner::min_points_per_cell));
 }
 
 
-void Cache::initialize(std::shared_ptr<Session> session) {
+void Cache::initialize(std::shared_ptr<Session> session, std::shared_ptr<Args> command_args) {
     // TODO: create DB client
-    std::shared_ptr<InitializeArgs> args = std::dynamic_pointer_cast<InitializeArgs>(session->args);
+    std::shared_ptr<InitializeArgs> args = std::dynamic_pointer_cast<InitializeArgs>(command_args);
+    std::unique_lock<std::shared_mutex> lock(this->core_mutex);
 
     std::shared_ptr<DBClient> db_client = std::make_shared<DBClient>(args->d, args->db_url);
 
@@ -106,89 +155,492 @@ void Cache::initialize(std::shared_ptr<Session> session) {
     size_t nCells = determineNCells(args->nTotal);
     std::cout << "nCells: " << nCells << std::endl;
 
-    this->core = std::make_unique<Core>(args->d, db_client, nCells, args->nTotal, args->use_flat);
+    if (args->eviction_policy > TWO_Q) {
+        session->respond(args, std::make_shared<MessageResponse>("Unknown eviction policy: " + std::to_string(args->eviction_policy)));
+        return;
+    }
 
-    std::string output("Initialized cache");
-    output.copy(session->output_buf, 1024);
+    if (args->quantizer > HNSW_QUANTIZER) {
+        session->respond(args, std::make_shared<MessageResponse>("Unknown quantizer: " + std::to_string(args->quantizer)));
+        return;
+    }
 
-    session->async_write(output.size());
+    if (args->payload_precision > PRECISION_INT8) {
+        session->respond(args, std::make_shared<MessageResponse>("Unknown payload precision: " + std::to_string(args->payload_precision)));
+        return;
+    }
+
+    // max_mem is given in megabytes
+    size_t maxMem = args->max_mem * 1024 * 1024;
+    this->core = std::make_shared<Core>(args->d, db_client, nCells, args->nTotal, args->use_flat, maxMem, (EvictionPolicyType)args->eviction_policy,
+        (QuantizerType)args->quantizer);
+    this->core->target_recall = args->target_recall;
+    // index_mem is given in megabytes as well
+    this->core->index_mem = args->index_mem * 1024 * 1024;
+    this->core->tuning_nprobe = std::max<size_t>(1, args->nprobe);
+    this->core->payload_precision = (EmbeddingPrecision)args->payload_precision;
+    this->core->disk_tier = this->createDiskTier();
+    // Let read-through searches know when the cells they're waiting on have been loaded
+    this->core->on_cells_settled = [this](const std::vector<faiss::idx_t>& cells) {
+        this->settleCells(cells);
+    };
+
+    {
+        // A training set streamed in for the previous core, or a training run still going on it, no longer counts
+        std::lock_guard<std::mutex> training_lock(this->training_mutex);
+        this->training_sample.reset();
+        this->training_samples = 0;
+        this->training_seen = 0;
+        this->training_step = 0;
+        this->training_steps = 0;
+        this->training_error.clear();
+        this->index_description = describeIndex(*this->core->index);
+        this->tuned_recall = 0;
+        this->tuned_qps = 0;
+    }
+
+    std::string output("Initialized cache");
+    session->respond(args, std::make_shared<MessageResponse>(output));
 
     this->status = INITIALIZED;
 }
 
-void Cache::train(std::shared_ptr<Session> session) {
-    std::shared_ptr<TrainArgs> args = std::dynamic_pointer_cast<TrainArgs>(session->args);
-    faiss::idx_t nTrainingVecs = (faiss::idx_t)args->size / sizeof(float) / this->core->d;
+void Cache::train(std::shared_ptr<Session> session, std::shared_ptr<Args> command_args) {
+    std::shared_ptr<TrainArgs> args = std::dynamic_pointer_cast<TrainArgs>(command_args);
+    std::shared_ptr<Core> core;
+    {
+        std::shared_lock<std::shared_mutex> lock(this->core_mutex);
+        core = this->core;
+    }
+    if (args->size % (sizeof(float) * core->d) != 0) {
+        session->respond(args, std::make_shared<MessageResponse>("Training data isn't a whole number of vectors of dimension " + std::to_string(core->d)));
+        return;
+    }
+    faiss::idx_t nTrainingVecs = (faiss::idx_t)args->size / sizeof(float) / core->d;
 
-    // TODO: Make this async so the server can respond while the core is training.
-    this->core->train(nTrainingVecs, args->training_data.get());
-    assert(this->core->index->is_trained);
-    this->status = READY;
+    // Chunks are sampled as they arrive so only the sample is ever held in memory
+    std::shared_ptr<ReservoirSampler> sample;
+    {
+        std::lock_guard<std::mutex> lock(this->training_mutex);
+        if (!this->training_sample) {
+            this->training_sample = std::make_shared<ReservoirSampler>(core->d, args->max_samples);
+        }
+        this->training_sample->add(nTrainingVecs, args->training_data.get());
+        this->training_samples = this->training_sample->size();
+        this->training_seen = this->training_sample->seen();
+        if (!args->last) {
+            session->respond(args, std::make_shared<MessageResponse>("Received training chunk"));
+            return;
+        }
+        // Without tuning, which picks nCells to fit the sample, k-means needs a vector for every cell. The sample
+        // is kept so more vectors can be sent before training again.
+        if (core->target_recall <= 0 && this->training_sample->size() < core->nCells) {
+            session->respond(args, std::make_shared<MessageResponse>("Training needs at least " + std::to_string(core->nCells)
+                + " vectors, one for each cell, but only " + std::to_string(this->training_sample->size()) + " were sampled"));
+            return;
+        }
+        sample = std::move(this->training_sample);
+        this->training_step = 0;
+        this->training_steps = 0;
+        this->training_error.clear();
+        this->status = TRAINING;
+    }
+    session->respond(args, std::make_shared<MessageResponse>("Training started"));
 
-    std::string output("Trained cache");
-    output.copy(session->output_buf, 1024);
+    // k-means takes a while, so it runs in the background and STATUS reports how far along it is
+    asio::post(this->fetch_pool, [this, core, sample]() {
+        std::string error;
+        try {
+            core->train(sample->size(), sample->data(), [this](size_t step, size_t steps) {
+                std::lock_guard<std::mutex> lock(this->training_mutex);
+                this->training_step = step;
+                this->training_steps = steps;
+            });
+            assert(core->index->is_trained);
+        } catch (const std::exception& e) {
+            std::cerr << "Failed to train: " << e.what() << std::endl;
+            error = e.what();
+        }
+
+        std::unique_lock<std::shared_mutex> lock(this->core_mutex);
+        if (this->core != core) {
+            // Re-initialized while training
+            return;
+        }
+        std::lock_guard<std::mutex> training_lock(this->training_mutex);
+        this->training_error = error;
+        this->index_description = describeIndex(*core->index);
+        this->tuned_recall = core->tuning.recall;
+        this->tuned_qps = core->tuning.qps;
+        this->status = error.empty() ? READY : INITIALIZED;
+    });
+}
+
+void Cache::load(std::shared_ptr<Session> session, std::shared_ptr<Args> command_args) {
+    std::shared_ptr<LoadArgs> args = std::dynamic_pointer_cast<LoadArgs>(command_args);
+    std::shared_ptr<Core> core;
+    {
+        std::shared_lock<std::shared_mutex> lock(this->core_mutex);
+        core = this->core;
+    }
+
+    if (!args->wait) {
+        // Fire and forget: acknowledge right away and let the cells become resident in the background
+        session->respond(args, std::make_shared<MessageResponse>("Loading cell"));
+    }
 
-    session->async_write(output.size());
+    // Fetching from the database is slow, so it runs on the fetch pool to keep the I/O threads free
+    asio::post(this->fetch_pool, [core, args, session]() {
+        std::string output;
+        try {
+            LoadSources sources = core->loadCellWithVec(args->xq, args->nload);
+            output = "Loaded cell ram=" + std::to_string(sources.ram) + " disk=" + std::to_string(sources.disk)
+                + " db=" + std::to_string(sources.db);
+        } catch (const HttpException& e) {
+            output = e.what();
+        } catch (const std::exception& e) {
+            std::cerr << "Failed to load cells: " << e.what() << std::endl;
+            output = e.what();
+        }
+        if (args->wait) {
+            session->respond(args, std::make_shared<MessageResponse>(output));
+        }
+    });
 }
 
-void Cache::load(std::shared_ptr<Session> session) {
-    std::shared_ptr<LoadArgs> args = std::dynamic_pointer_cast<LoadArgs>(session->args);
-    std::string output("Loaded cell");
-    try {
-        this->core->loadCellWithVec(args->xq, args->nload);
-    } catch (const HttpException& e) {
-        output = e.what();
+static SearchOptions searchOptions(const SearchArgs& args) {
+    SearchOptions options;
+    options.refine_factor = args.refine_factor;
+    options.max_distance = args.max_distance;
+    options.min_similarity = args.min_similarity;
+    options.min_coverage = args.min_coverage;
+    // Embeddings are only decoded when they're sent as floats
+    options.decode_embeddings = (args.fields & FIELD_EMBEDDING) && !args.compact_embeddings;
+    return options;
+}
+
+void Cache::search(std::shared_ptr<Session> session, std::shared_ptr<Args> command_args) {
+    std::shared_ptr<SearchArgs> args = std::dynamic_pointer_cast<SearchArgs>(command_args);
+    std::shared_ptr<Core> core;
+    {
+        std::shared_lock<std::shared_mutex> lock(this->core_mutex);
+        core = this->core;
     }
-    output.copy(session->output_buf, 1024);
-    session->async_write(output.size());
+
+    // The core writes its results straight into the response, which is then sent without copying the payloads
+    std::shared_ptr<SearchResponse> response = std::make_shared<SearchResponse>(args->n, args->k, args->fields, args->compact_embeddings);
+    std::vector<faiss::idx_t> missing;
+    core->search(args->n, args->xq.get(), args->k, args->nprobe, args->require_all, response->results.data(), response->cacheHits.data(),
+        args->read_through ? &missing : nullptr, searchOptions(*args), response->distances.data(), response->coverage.data());
+
+    if (missing.empty()) {
+        response->serialize();
+        session->respond(args, response);
+        return;
+    }
+
+    if (args->wait_ms == 0) {
+        // Answer with the misses right away and let the loads warm the cache for later queries. Claiming the cells
+        // skips any another query is already loading.
+        this->loadInBackground(core, core->claimCells(missing));
+        response->serialize();
+        session->respond(args, response);
+        return;
+    }
+
+    // The waiter is registered before the cells are claimed so it hears about loads which finish straight away
+    std::shared_ptr<ReadThroughWaiter> waiter = std::make_shared<ReadThroughWaiter>(session, args, core, session->get_executor());
+    {
+        std::lock_guard<std::mutex> lock(this->waiters_mutex);
+        for (faiss::idx_t cell : missing) {
+            waiter->pending.insert(cell);
+            this->cell_waiters[cell].push_back(waiter);
+        }
+    }
+    this->loadInBackground(core, core->claimCells(missing));
+
+    // Cells another request finished loading after the search ran won't be announced again
+    std::vector<faiss::idx_t> resident;
+    {
+        std::shared_lock<std::shared_mutex> lock(core->mutex);
+        for (faiss::idx_t cell : missing) {
+            if (core->residence_statuses[cell] >= 0) {
+                resident.push_back(cell);
+            }
+        }
+    }
+    this->settleCells(resident);
+
+    // If the loads take too long, answer with whatever is resident by the deadline. Pipelined searches run on the
+    // work executor, so the timer is armed on the session's strand, where finishReadThrough cancels it. If the search
+    // was finished before then there's nothing left to wait for.
+    asio::post(waiter->deadline.get_executor(), [this, waiter]() {
+        if (waiter->done) {
+            return;
+        }
+        waiter->deadline.expires_after(std::chrono::milliseconds(waiter->args->wait_ms));
+        waiter->deadline.async_wait([this, waiter](const std::error_code& ec) {
+            if (!ec) {
+                this->expireReadThrough(waiter);
+            }
+        });
+    });
 }
 
-void Cache::search(std::shared_ptr<Session> session) {
-    std::shared_ptr<SearchArgs> args = std::dynamic_pointer_cast<SearchArgs>(session->args);
-    Data results[args->n * args->k];
-    int cacheHits[args->n];
+std::shared_ptr<DiskTier> Cache::createDiskTier() {
+    if (this->config.disk_tier_path.empty()) {
+        return nullptr;
+    }
+    return std::make_shared<DiskTier>(this->config.disk_tier_path, this->config.disk_tier_capacity * 1024 * 1024);
+}
 
-    bool require_all = true;
-    this->core->search(args->n, args->xq.get(), args->k, args->nprobe, args->require_all, results, cacheHits);
+void Cache::respondToSearch(std::shared_ptr<Core> core, std::shared_ptr<SearchArgs> args, std::shared_ptr<Session> session) {
+    std::shared_ptr<SearchResponse> response = std::make_shared<SearchResponse>(args->n, args->k, args->fields, args->compact_embeddings);
+    core->search(args->n, args->xq.get(), args->k, args->nprobe, args->require_all, response->results.data(), response->cacheHits.data(),
+        nullptr, searchOptions(*args), response->distances.data(), response->coverage.data());
+    response->serialize();
+    session->respond(args, response);
+}
 
-    for (size_t i = 0; i < args->n; i++) {
-        std::memcpy(session->output_buf, &cacheHits[i], sizeof(int));
-        session->sync_write(sizeof(int));
-        for (int j = 0; cacheHits[i] > -1 && j < cacheHits[i]; j++) {
-            std::vector<char> bytes;
-            results[(i * args->k) + j].serialize(bytes);
-            size_t l = 0;
+void Cache::loadInBackground(std::shared_ptr<Core> core, std::vector<faiss::idx_t> cells) {
+    if (cells.empty()) {
+        return;
+    }
+    asio::post(this->fetch_pool, [core, cells]() {
+        try {
+            core->loadCells(cells);
+        } catch (const std::exception& e) {
+            std::cerr << "Failed to read through cells: " << e.what() << std::endl;
+        }
+    });
+}
 
-            for (; bytes.size() >= Session::max_length && l < bytes.size() - Session::max_length; l += Session::max_length) {
-                std::memcpy(session->output_buf, &bytes.data()[l], Session::max_length);
-                session->sync_write(Session::max_length);
+// Called when cells have finished loading, successfully or not. Searches which were only waiting on those cells
+// are finished.
+void Cache::settleCells(const std::vector<faiss::idx_t>& cells) {
+    std::vector<std::shared_ptr<ReadThroughWaiter>> ready;
+    {
+        std::lock_guard<std::mutex> lock(this->waiters_mutex);
+        for (faiss::idx_t cell : cells) {
+            auto itr = this->cell_waiters.find(cell);
+            if (itr == this->cell_waiters.end()) {
+                continue;
+            }
+            for (auto& waiter : itr->second) {
+                if (waiter->pending.erase(cell) > 0 && waiter->pending.empty()) {
+                    ready.push_back(waiter);
+                }
             }
+            this->cell_waiters.erase(itr);
+        }
+    }
+    for (auto& waiter : ready) {
+        this->finishReadThrough(waiter);
+    }
+}
 
-            std::memcpy(session->output_buf, &bytes.data()[l], bytes.size() - l);
-            session->sync_write(bytes.size() - l);
+// Called when a read-through search's deadline passes. It stops waiting on the cells still loading, so the lists of
+// waiters of cells which are slow to settle don't hold on to it, and is answered with what's resident.
+void Cache::expireReadThrough(std::shared_ptr<ReadThroughWaiter> waiter) {
+    {
+        std::lock_guard<std::mutex> lock(this->waiters_mutex);
+        for (faiss::idx_t cell : waiter->pending) {
+            auto itr = this->cell_waiters.find(cell);
+            if (itr == this->cell_waiters.end()) {
+                continue;
+            }
+            auto& waiters = itr->second;
+            waiters.erase(std::remove(waiters.begin(), waiters.end(), waiter), waiters.end());
+            if (waiters.empty()) {
+                this->cell_waiters.erase(itr);
+            }
         }
+        waiter->pending.clear();
     }
+    this->finishReadThrough(waiter);
 }
 
-void Cache::evict(std::shared_ptr<Session> session) {
-    std::shared_ptr<EvictArgs> args = std::dynamic_pointer_cast<EvictArgs>(session->args);
+void Cache::finishReadThrough(std::shared_ptr<ReadThroughWaiter> waiter) {
+    if (waiter->done.exchange(true)) {
+        return;
+    }
+    // The timer belongs to the session's strand, so it's cancelled from there
+    asio::post(waiter->deadline.get_executor(), [waiter]() {
+        waiter->deadline.cancel();
+    });
+    this->respondToSearch(waiter->core, waiter->args, waiter->session);
+}
+
+void Cache::evict(std::shared_ptr<Session> session, std::shared_ptr<Args> command_args) {
+    std::shared_ptr<EvictArgs> args = std::dynamic_pointer_cast<EvictArgs>(command_args);
+    std::shared_lock<std::shared_mutex> lock(this->core_mutex);
     this->core->evictCellWithVec(args->xq, args->nevict);
     
     std::string output("Evicted cell");
-    output.copy(session->output_buf, 1024);
-    session->async_write(output.size());
+    session->respond(args, std::make_shared<MessageResponse>(output));
 }
 
-void Cache::add(std::shared_ptr<Session> session) {
-    std::shared_ptr<AddArgs> args = std::dynamic_pointer_cast<AddArgs>(session->args);
+void Cache::add(std::shared_ptr<Session> session, std::shared_ptr<Args> command_args) {
+    std::shared_ptr<AddArgs> args = std::dynamic_pointer_cast<AddArgs>(command_args);
+    std::shared_lock<std::shared_mutex> lock(this->core_mutex);
     std::cout << "Adding " << args->num_docs << " vectors" << std::endl;
-    this->core->add(args->num_docs, args->ids, args->embeddings);
+    this->core->add(args->num_docs, args->ids, args->embeddings, args->with_payloads ? &args->payloads : nullptr);
 
     std::string output("Added vectors");
-    output.copy(session->output_buf, 1024);
-    session->async_write(output.size());
+    session->respond(args, std::make_shared<MessageResponse>(output));
+}
+
+void Cache::remove(std::shared_ptr<Session> session, std::shared_ptr<Args> command_args) {
+    std::shared_ptr<DeleteArgs> args = std::dynamic_pointer_cast<DeleteArgs>(command_args);
+    std::shared_lock<std::shared_mutex> lock(this->core_mutex);
+    std::cout << "Deleting " << args->num_ids << " vectors" << std::endl;
+    size_t removed = this->core->remove(args->num_ids, args->ids);
+
+    std::string output("Deleted " + std::to_string(removed) + " vectors");
+    session->respond(args, std::make_shared<MessageResponse>(output));
+}
+
+void Cache::upsert(std::shared_ptr<Session> session, std::shared_ptr<Args> command_args) {
+    std::shared_ptr<UpsertArgs> args = std::dynamic_pointer_cast<UpsertArgs>(command_args);
+    std::shared_lock<std::shared_mutex> lock(this->core_mutex);
+    std::cout << "Upserting " << args->num_docs << " vectors" << std::endl;
+    this->core->upsert(args->num_docs, args->ids, args->embeddings, args->with_payloads ? &args->payloads : nullptr);
+
+    std::string output("Upserted vectors");
+    session->respond(args, std::make_shared<MessageResponse>(output));
+}
+
+void Cache::snapshot(std::shared_ptr<Session> session, std::shared_ptr<Args> command_args) {
+    std::shared_ptr<SnapshotArgs> args = std::dynamic_pointer_cast<SnapshotArgs>(command_args);
+    std::shared_ptr<Core> core;
+    {
+        std::shared_lock<std::shared_mutex> lock(this->core_mutex);
+        core = this->core;
+    }
+
+    // Writing out the resident cells can take a while, so it runs on the fetch pool like a load
+    asio::post(this->fetch_pool, [core, args, session]() {
+        std::string output("Saved snapshot");
+        try {
+            core->writeSnapshot(std::string(args->path.get()), args->include_cells);
+        } catch (const std::exception& e) {
+            std::cerr << "Failed to save snapshot: " << e.what() << std::endl;
+            output = e.what();
+        }
+        session->respond(args, std::make_shared<MessageResponse>(output));
+    });
+}
+
+void Cache::reportStatus(std::shared_ptr<Session> session, std::shared_ptr<Args> args) {
+    static const char *names[] = {"UNINITIALIZED", "INITIALIZED", "TRAINING", "READY"};
+    std::string output;
+    {
+        std::lock_guard<std::mutex> lock(this->training_mutex);
+        output = std::string("status=") + names[this->status] + " samples=" + std::to_string(this->training_samples)
+            + " seen=" + std::to_string(this->training_seen) + " step=" + std::to_string(this->training_step)
+            + " steps=" + std::to_string(this->training_steps) + " index=" + this->index_description;
+        // Only reported once the index has been tuned
+        if (this->tuned_recall > 0) {
+            output += " recall=" + std::to_string(this->tuned_recall) + " qps=" + std::to_string(this->tuned_qps);
+        }
+        // The error goes last since it can contain spaces
+        if (!this->training_error.empty()) {
+            output += " error=" + this->training_error;
+        }
+    }
+    session->respond(args, std::make_shared<MessageResponse>(output));
+}
+
+void Cache::reportStats(std::shared_ptr<Session> session, std::shared_ptr<Args> command_args) {
+    std::shared_ptr<StatsArgs> args = std::dynamic_pointer_cast<StatsArgs>(command_args);
+    session->respond(args, std::make_shared<TextResponse>(this->renderMetrics(args->include_cells)));
+}
+
+// The per cell series are only included when asked for, since there can be tens of thousands of cells
+std::string Cache::renderMetrics(bool include_cells) {
+    std::string out;
+    metrics().render(out);
+
+    std::shared_lock<std::shared_mutex> lock(this->core_mutex);
+    bool ready = this->status == READY && this->core != nullptr;
+    renderHeader(out, "periplus_ready", "gauge", "Whether the index is trained and searches are served.");
+    renderSample(out, "periplus_ready", "", ready);
+    if (!ready) {
+        return out;
+    }
+
+    std::shared_ptr<Core> core = this->core;
+    std::shared_lock<std::shared_mutex> coreLock(core->mutex);
+    size_t residentCells = 0;
+    for (size_t cell = 0; cell < core->nCells; cell++) {
+        if (core->residence_statuses[cell] >= 0) {
+            residentCells++;
+        }
+    }
+    auto gauge = [&out](const char *name, const char *help, double value) {
+        renderHeader(out, name, "gauge", help);
+        renderSample(out, name, "", value);
+    };
+    gauge("periplus_cells", "Cells in the index.", core->nCells);
+    gauge("periplus_resident_cells", "Cells which are resident.", residentCells);
+    gauge("periplus_resident_bytes", "Bytes taken by the resident cells.", core->resident_bytes);
+    gauge("periplus_max_memory_bytes", "Memory budget for resident cells, 0 for no limit.", core->max_mem);
+    gauge("periplus_resident_vectors", "Vectors in the resident cells.", core->index->ntotal);
+    gauge("periplus_ids", "Ids which have been added.", core->directory.size());
+    gauge("periplus_id_directory_bytes", "Bytes taken by the id directory.", core->directory.memoryUsage());
+    if (core->disk_tier) {
+        gauge("periplus_disk_tier_cells", "Cells kept on the disk tier.", core->disk_tier->cells());
+        gauge("periplus_disk_tier_bytes", "Bytes of the disk tier's segment files.", core->disk_tier->bytes());
+    }
+
+    if (include_cells) {
+        renderHeader(out, "periplus_cell_probes_total", "counter", "Times the cell was among the nprobe nearest of a query.");
+        for (size_t cell = 0; cell < core->nCells; cell++) {
+            renderSample(out, "periplus_cell_probes_total", "cell=\"" + std::to_string(cell) + "\"", core->cell_probes[cell].load(std::memory_order_relaxed));
+        }
+        renderHeader(out, "periplus_cell_vectors", "gauge", "Ids which have been added to the cell.");
+        for (size_t cell = 0; cell < core->nCells; cell++) {
+            renderSample(out, "periplus_cell_vectors", "cell=\"" + std::to_string(cell) + "\"", core->directory.cellSize(cell));
+        }
+        renderHeader(out, "periplus_cell_resident", "gauge", "Whether the cell is resident.");
+        for (size_t cell = 0; cell < core->nCells; cell++) {
+            renderSample(out, "periplus_cell_resident", "cell=\"" + std::to_string(cell) + "\"", core->residence_statuses[cell] >= 0);
+        }
+    }
+    return out;
+}
+
+// Brings the cache back to the state a snapshot was taken in, ready to serve commands
+void Cache::restore(const std::string& path) {
+    std::unique_lock<std::shared_mutex> lock(this->core_mutex);
+    std::string dir = locateSnapshot(path);
+    SnapshotMeta meta = SnapshotMeta::read(dir);
+    if (meta.eviction_policy > TWO_Q) {
+        throw std::runtime_error("Unknown eviction policy in snapshot: " + std::to_string(meta.eviction_policy));
+    }
+
+    std::shared_ptr<char[]> db_url(new char[meta.db_url.size() + 1]);
+    std::memcpy(db_url.get(), meta.db_url.c_str(), meta.db_url.size() + 1);
+    std::shared_ptr<DBClient> db_client = std::make_shared<DBClient>(meta.d, db_url);
+
+    // The index and quantizer types don't matter here, the snapshot's index replaces them
+    std::shared_ptr<Core> core = std::make_shared<Core>(meta.d, db_client, meta.nCells, meta.nTotal, true, meta.max_mem, (EvictionPolicyType)meta.eviction_policy);
+    core->readSnapshot(dir);
+    core->disk_tier = this->createDiskTier();
+    core->on_cells_settled = [this](const std::vector<faiss::idx_t>& cells) {
+        this->settleCells(cells);
+    };
+    this->core = core;
+    {
+        std::lock_guard<std::mutex> training_lock(this->training_mutex);
+        this->index_description = describeIndex(*core->index);
+    }
+    this->status = READY;
+    std::cout << "Restored snapshot " << dir << " with " << core->directory.size() << " ids and "
+              << core->store.size() << " resident records" << std::endl;
 }
 
 Cache::~Cache() {
+    this->fetch_pool.join();
     std::cout << "Cache destructed" << std::endl;
 }
\ No newline at end of file
@@ -8,9 +8,18 @@ the Core. It is aware that there are cells which are evicted and loaded and read
 #define CACHE_H
 
 #include <memory>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <asio.hpp>
 
 #include "core.h"
 #include "args.h"
+#include "reservoir_sampler.h"
 
 // Forward declaration to avoid ciruclar dependencies.
 class Session;
@@ -23,23 +32,93 @@ enum Status {
     READY
 };
 
+// Server level settings which are fixed when Periplus starts up
+struct CacheConfig {
+    // Number of threads cells are fetched from the database on, off of the I/O threads
+    size_t fetch_threads = 8;
+    // Snapshot directory to restore on startup instead of starting uninitialized
+    std::string restore_path;
+    // Directory of the disk tier evicted cells are kept in, empty to disable it
+    std::string disk_tier_path;
+    // Capacity of the disk tier in megabytes
+    size_t disk_tier_capacity = 10240;
+    // Port the plain text /metrics listener is served on, 0 to disable it
+    unsigned short metrics_port = 0;
+};
+
+// A read-through search waiting for the cells behind its cache misses to finish loading
+struct ReadThroughWaiter {
+    std::shared_ptr<Session> session;
+    std::shared_ptr<SearchArgs> args;
+    std::shared_ptr<Core> core;
+    // Cells which haven't finished loading yet, guarded by Cache::waiters_mutex
+    std::unordered_set<faiss::idx_t> pending;
+    // Set by whichever of the last load or the deadline finishes the search first
+    std::atomic<bool> done{false};
+    asio::steady_timer deadline;
+
+    ReadThroughWaiter(std::shared_ptr<Session> session, std::shared_ptr<SearchArgs> args, std::shared_ptr<Core> core, asio::any_io_executor executor)
+        : session(session), args(args), core(core), deadline(executor) {}
+};
+
 class Cache {
 public:
-    Cache();
-    void processCommand(std::shared_ptr<Session> session, std::string command);
-    void process_args(std::shared_ptr<Session> session);
+    explicit Cache(const CacheConfig& config);
+    // Virtual so tests can drive a session with a cache that scripts its responses
+    virtual void processCommand(std::shared_ptr<Session> session, std::string command);
+    virtual void process_args(std::shared_ptr<Session> session, std::shared_ptr<Args> args);
     static size_t determineNCells(size_t nTotal); 
-    void initialize(std::shared_ptr<Session> session);
-    void train(std::shared_ptr<Session> session);
-    void load(std::shared_ptr<Session> session);
-    void search(std::shared_ptr<Session> session);
-    void evict(std::shared_ptr<Session> session);
-    void add(std::shared_ptr<Session> session);
-    ~Cache();
+    void initialize(std::shared_ptr<Session> session, std::shared_ptr<Args> args);
+    void train(std::shared_ptr<Session> session, std::shared_ptr<Args> args);
+    void load(std::shared_ptr<Session> session, std::shared_ptr<Args> args);
+    void search(std::shared_ptr<Session> session, std::shared_ptr<Args> args);
+    void evict(std::shared_ptr<Session> session, std::shared_ptr<Args> args);
+    void add(std::shared_ptr<Session> session, std::shared_ptr<Args> args);
+    void remove(std::shared_ptr<Session> session, std::shared_ptr<Args> args);
+    void upsert(std::shared_ptr<Session> session, std::shared_ptr<Args> args);
+    void snapshot(std::shared_ptr<Session> session, std::shared_ptr<Args> args);
+    void reportStatus(std::shared_ptr<Session> session, std::shared_ptr<Args> args);
+    void reportStats(std::shared_ptr<Session> session, std::shared_ptr<Args> args);
+    // Metrics in the Prometheus text format, for STATS and the /metrics listener
+    std::string renderMetrics(bool include_cells);
+    virtual ~Cache();
 
 private:
-    Status status;
-    std::unique_ptr<Core> core;
+    CacheConfig config;
+    std::atomic<Status> status;
+    // Commands run concurrently on the server's I/O threads. Every command holds a shared lock on this mutex
+    // while it uses the core, and INITIALIZE / TRAIN hold an exclusive lock so the core is never replaced or
+    // trained underneath a running command. Finer grained synchronization is handled by the core itself.
+    std::shared_mutex core_mutex;
+    // Background work holds its own reference so the core outlives it even if INITIALIZE replaces it
+    std::shared_ptr<Core> core;
+    asio::thread_pool fetch_pool;
+
+    // The training set streamed in by TRAIN so far, and the progress of training once the last chunk has arrived.
+    // Guarded by training_mutex.
+    std::mutex training_mutex;
+    std::shared_ptr<ReservoirSampler> training_sample;
+    size_t training_samples = 0;
+    size_t training_seen = 0;
+    size_t training_step = 0;
+    size_t training_steps = 0;
+    std::string training_error;
+    // The index the core is built with, and how it did on the held out part of the sample if it was tuned
+    std::string index_description;
+    float tuned_recall = 0;
+    float tuned_qps = 0;
+
+    // Read-through searches waiting on each cell
+    std::mutex waiters_mutex;
+    std::unordered_map<faiss::idx_t, std::vector<std::shared_ptr<ReadThroughWaiter>>> cell_waiters;
+
+    void restore(const std::string& path);
+    std::shared_ptr<DiskTier> createDiskTier();
+    void respondToSearch(std::shared_ptr<Core> core, std::shared_ptr<SearchArgs> args, std::shared_ptr<Session> session);
+    void loadInBackground(std::shared_ptr<Core> core, std::vector<faiss::idx_t> cells);
+    void settleCells(const std::vector<faiss::idx_t>& cells);
+    void expireReadThrough(std::shared_ptr<ReadThroughWaiter> waiter);
+    void finishReadThrough(std::shared_ptr<ReadThroughWaiter> waiter);
 };
 
 
@@ -0,0 +1,194 @@
+#include "cell_store.h"
+#include "data.h"
+#include "embedding_codec.h"
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+
+CellArena::CellArena(size_t d, const std::vector<const Data*>& records, EmbeddingPrecision precision)
+    : n(records.size()), d(d), precision(precision) {
+    size_t tableBytes = sizeof(RecordOffsets) * this->n;
+    size_t codeSize = embeddingCodeSize(this->d, this->precision);
+    size_t embeddingBytes = codeSize * this->n;
+    size_t stringBytes = 0;
+    for (const Data *record : records) {
+        // Strings are kept null terminated
+        stringBytes += record->id_len + record->document_len + record->metadata_len + 3;
+    }
+    this->bytes = tableBytes + embeddingBytes + stringBytes;
+    this->block = std::shared_ptr<char[]>(new char[std::max<size_t>(this->bytes, 1)]);
+
+    RecordOffsets *table = reinterpret_cast<RecordOffsets *>(this->block.get());
+    char *embeddings = &this->block[tableBytes];
+    size_t next = tableBytes + embeddingBytes;
+    auto copyString = [this, &next](const char *str, size_t len) {
+        size_t offset = next;
+        if (len > 0) {
+            std::memcpy(&this->block[offset], str, len);
+        }
+        this->block[offset + len] = '\0';
+        next += len + 1;
+        return offset;
+    };
+
+    for (size_t slot = 0; slot < this->n; slot++) {
+        const Data *record = records[slot];
+        encodeEmbedding(record->embedding.get(), this->d, this->precision, &embeddings[slot * codeSize]);
+        table[slot].id_len = record->id_len;
+        table[slot].id = copyString(record->id.get(), record->id_len);
+        table[slot].document_len = record->document_len;
+        table[slot].document = copyString(record->document.get(), record->document_len);
+        table[slot].metadata_len = record->metadata_len;
+        table[slot].metadata = copyString(record->metadata.get(), record->metadata_len);
+    }
+}
+
+CellArena::CellArena(size_t d, size_t n, size_t bytes, std::shared_ptr<char[]> block, EmbeddingPrecision precision)
+    : n(n), d(d), precision(precision), bytes(bytes), block(block) {
+    if (bytes < (sizeof(RecordOffsets) + embeddingCodeSize(d, precision)) * n) {
+        throw std::runtime_error("Arena of " + std::to_string(bytes) + " bytes is too small for " + std::to_string(n) + " records");
+    }
+}
+
+CellArena::CellArena(const CellArena& source, const std::vector<size_t>& slots, const std::vector<const Data*>& appended)
+    : n(slots.size() + appended.size()), d(source.d), precision(source.precision) {
+    const RecordOffsets *sourceTable = source.offsets();
+    size_t tableBytes = sizeof(RecordOffsets) * this->n;
+    size_t codeSize = embeddingCodeSize(this->d, this->precision);
+    size_t embeddingBytes = codeSize * this->n;
+    size_t stringBytes = 0;
+    for (size_t slot : slots) {
+        stringBytes += sourceTable[slot].id_len + sourceTable[slot].document_len + sourceTable[slot].metadata_len + 3;
+    }
+    for (const Data *record : appended) {
+        stringBytes += record->id_len + record->document_len + record->metadata_len + 3;
+    }
+    this->bytes = tableBytes + embeddingBytes + stringBytes;
+    this->block = std::shared_ptr<char[]>(new char[std::max<size_t>(this->bytes, 1)]);
+
+    RecordOffsets *table = reinterpret_cast<RecordOffsets *>(this->block.get());
+    char *embeddings = &this->block[tableBytes];
+    size_t next = tableBytes + embeddingBytes;
+    auto copyString = [this, &next](const char *str, size_t len) {
+        size_t offset = next;
+        if (len > 0) {
+            std::memcpy(&this->block[offset], str, len);
+        }
+        this->block[offset + len] = '\0';
+        next += len + 1;
+        return offset;
+    };
+
+    for (size_t i = 0; i < slots.size(); i++) {
+        const RecordOffsets& offsets = sourceTable[slots[i]];
+        std::memcpy(&embeddings[i * codeSize], source.embeddingCode(slots[i]), codeSize);
+        table[i].id_len = offsets.id_len;
+        table[i].id = copyString(&source.block[offsets.id], offsets.id_len);
+        table[i].document_len = offsets.document_len;
+        table[i].document = copyString(&source.block[offsets.document], offsets.document_len);
+        table[i].metadata_len = offsets.metadata_len;
+        table[i].metadata = copyString(&source.block[offsets.metadata], offsets.metadata_len);
+    }
+    for (size_t i = slots.size(); i < this->n; i++) {
+        const Data *record = appended[i - slots.size()];
+        encodeEmbedding(record->embedding.get(), this->d, this->precision, &embeddings[i * codeSize]);
+        table[i].id_len = record->id_len;
+        table[i].id = copyString(record->id.get(), record->id_len);
+        table[i].document_len = record->document_len;
+        table[i].document = copyString(record->document.get(), record->document_len);
+        table[i].metadata_len = record->metadata_len;
+        table[i].metadata = copyString(record->metadata.get(), record->metadata_len);
+    }
+}
+
+const RecordOffsets *CellArena::offsets() const {
+    return reinterpret_cast<const RecordOffsets *>(this->block.get());
+}
+
+const char *CellArena::embeddingCode(size_t slot) const {
+    return &this->block[(sizeof(RecordOffsets) * this->n) + (slot * embeddingCodeSize(this->d, this->precision))];
+}
+
+const float *CellArena::embedding(size_t slot, float *buffer) const {
+    if (this->precision == PRECISION_FP32) {
+        return reinterpret_cast<const float *>(this->embeddingCode(slot));
+    }
+    decodeEmbedding(this->embeddingCode(slot), this->d, this->precision, buffer);
+    return buffer;
+}
+
+Data CellArena::get(size_t slot, bool decode) const {
+    const RecordOffsets& offsets = this->offsets()[slot];
+    Data data;
+    data.id_len = offsets.id_len;
+    data.id = std::shared_ptr<char[]>(this->block, &this->block[offsets.id]);
+    data.embedding_len = this->d;
+    char *code = const_cast<char *>(this->embeddingCode(slot));
+    if (this->precision == PRECISION_FP32) {
+        data.embedding = std::shared_ptr<float[]>(this->block, reinterpret_cast<float *>(code));
+    } else {
+        data.embedding_precision = this->precision;
+        data.embedding_code = std::shared_ptr<char[]>(this->block, code);
+        if (decode) {
+            data.embedding = std::shared_ptr<float[]>(new float[this->d]);
+            decodeEmbedding(code, this->d, this->precision, data.embedding.get());
+        }
+    }
+    data.document_len = offsets.document_len;
+    data.document = std::shared_ptr<char[]>(this->block, &this->block[offsets.document]);
+    data.metadata_len = offsets.metadata_len;
+    data.metadata = std::shared_ptr<char[]>(this->block, &this->block[offsets.metadata]);
+    return data;
+}
+
+
+CellStore::CellStore(size_t nCells, size_t d) : d(d), arenas(nCells) {}
+
+void CellStore::install(faiss::idx_t cell, std::shared_ptr<CellArena> arena) {
+    if (this->arenas[cell] != nullptr) {
+        throw std::runtime_error("Installing a cell which is already in the cell store");
+    }
+    this->nRecords += arena->n;
+    this->arenas[cell] = std::move(arena);
+}
+
+void CellStore::evict(faiss::idx_t cell) {
+    if (this->arenas[cell] != nullptr) {
+        this->nRecords -= this->arenas[cell]->n;
+        this->arenas[cell].reset();
+    }
+}
+
+Data CellStore::get(faiss::idx_t cell, size_t slot, bool decode) const {
+    return this->arenas[cell]->get(slot, decode);
+}
+
+Data CellStore::get(faiss::idx_t label, bool decode) const {
+    // store_pairs labels pack the list number into the upper 32 bits and the offset into the lower 32 bits
+    return this->get(label >> 32, label & 0xffffffff, decode);
+}
+
+const float *CellStore::embedding(faiss::idx_t label, float *buffer) const {
+    return this->arenas[label >> 32]->embedding(label & 0xffffffff, buffer);
+}
+
+std::shared_ptr<const CellArena> CellStore::arena(faiss::idx_t cell) const {
+    return this->arenas[cell];
+}
+
+size_t CellStore::cellSize(faiss::idx_t cell) const {
+    return this->arenas[cell] == nullptr ? 0 : this->arenas[cell]->n;
+}
+
+size_t CellStore::cellBytes(faiss::idx_t cell) const {
+    return this->arenas[cell] == nullptr ? 0 : this->arenas[cell]->bytes;
+}
+
+size_t CellStore::size() const {
+    return this->nRecords;
+}
@@ -0,0 +1,79 @@
+/*
+The cell store holds the data of resident records. Each resident cell owns a single arena allocation laid out as
+    [offset table: one RecordOffsets per record][embeddings: n codes][ids, documents and metadata]
+where each embedding is coded at the arena's precision, full precision floats unless a reduced precision was chosen
+(see embedding_codec.h), and a record's slot in the arena matches its offset in the cell's inverted list. Searches run with FAISS's
+store_pairs labels (list number, offset), which makes looking up a result two array indexes, and evicting a cell
+releases its arena in one go. The Data handed out by get() alias the arena instead of owning copies, so an arena
+stays alive until the last search response using it has been sent.
+*/
+
+#ifndef CELL_STORE_H
+#define CELL_STORE_H
+
+#include "data.h"
+#include "embedding_codec.h"
+
+#include <memory>
+#include <vector>
+
+#include <faiss/Index.h>
+
+struct RecordOffsets {
+    size_t id;
+    size_t id_len;
+    size_t document;
+    size_t document_len;
+    size_t metadata;
+    size_t metadata_len;
+};
+
+struct CellArena {
+    size_t n = 0;
+    size_t d = 0;
+    EmbeddingPrecision precision = PRECISION_FP32;
+    size_t bytes = 0;
+    std::shared_ptr<char[]> block;
+
+    // Copies the records into a new arena, in the order given, encoding their embeddings at the precision
+    CellArena(size_t d, const std::vector<const Data*>& records, EmbeddingPrecision precision = PRECISION_FP32);
+    // Adopts a block already laid out as an arena, e.g. one mapped from a snapshot
+    CellArena(size_t d, size_t n, size_t bytes, std::shared_ptr<char[]> block, EmbeddingPrecision precision = PRECISION_FP32);
+    // Copies the records in the slots of source into a new arena, in the order given, keeping their embedding codes,
+    // followed by the appended records
+    CellArena(const CellArena& source, const std::vector<size_t>& slots, const std::vector<const Data*>& appended = {});
+
+    const RecordOffsets *offsets() const;
+    const char *embeddingCode(size_t slot) const;
+    // Returns the full precision embedding in the slot, decoded into buffer if the arena holds reduced precision codes
+    const float *embedding(size_t slot, float *buffer) const;
+    // The embedding of a reduced precision arena is only decoded into a new array when decode is set
+    Data get(size_t slot, bool decode = true) const;
+};
+
+class CellStore {
+public:
+    CellStore(size_t nCells, size_t d);
+
+    void install(faiss::idx_t cell, std::shared_ptr<CellArena> arena);
+    void evict(faiss::idx_t cell);
+    Data get(faiss::idx_t cell, size_t slot, bool decode = true) const;
+    // Looks up a label returned by a search run with store_pairs
+    Data get(faiss::idx_t label, bool decode = true) const;
+    // Full precision embedding of the record behind a store_pairs label, decoded into buffer (d floats) if needed
+    const float *embedding(faiss::idx_t label, float *buffer) const;
+    // Null if the cell isn't resident
+    std::shared_ptr<const CellArena> arena(faiss::idx_t cell) const;
+
+    size_t cellSize(faiss::idx_t cell) const;
+    size_t cellBytes(faiss::idx_t cell) const;
+    // Total number of resident records
+    size_t size() const;
+
+private:
+    size_t d;
+    size_t nRecords = 0;
+    std::vector<std::shared_ptr<CellArena>> arenas;
+};
+
+#endif
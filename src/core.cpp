@@ -2,6 +2,10 @@
 #include "db_client.h"
 #include "data.h"
 #include "exceptions.h"
+#include "snapshot.h"
+#include "distances.h"
+#include "auto_tuner.h"
+#include "metrics.h"
 
 #include <math.h>
 #include <memory>
@@ -10,38 +14,99 @@
 #include <algorithm>
 #include <stdexcept>
 #include <fstream>
+#include <filesystem>
+#include <mutex>
+#include <shared_mutex>
+#include <future>
+#include <unordered_map>
+#include <unordered_set>
+#include <numeric>
+#include <random>
+#include <cstring>
 
-#include <faiss/IndexIVFFlat.h>
-#include <faiss/IndexIVFPQ.h>
 #include <faiss/IndexFlat.h>
+#include <faiss/clone_index.h>
+#include <faiss/index_io.h>
 
 
-Core::Core(size_t d, std::shared_ptr<DBClient> db, size_t nCells, float nTotal, bool use_flat) : d{d}, db{db}, nCells{nCells}, nTotal{nTotal}  {
-    this->quantizer = std::shared_ptr<faiss::IndexFlatL2>(new faiss::IndexFlatL2(this->d));
-    size_t m = 16; // TODO: adjust m to fit d (AutoTune?)
+Core::Core(size_t d, std::shared_ptr<DBClient> db, size_t nCells, float nTotal, bool use_flat, size_t max_mem, EvictionPolicyType eviction_policy,
+    QuantizerType quantizer_type)
+    : d{d}, db{db}, nCells{nCells}, nTotal{nTotal}, directory{nCells}, store{nCells, d}, max_mem{max_mem}, quantizer_type{quantizer_type}  {
+    this->configure(IndexConfig::defaults(this->d, this->nCells, use_flat));
+    this->eviction_policy = EvictionPolicy::create(eviction_policy);
+}
 
-    // Low dimensional embeddings don't need to be product quantization
-    // Embeddings with dimensions no divisible by m can't be quantized
-    if (use_flat || (d < 64 || d % 8 != 0)) {
-        std::cout << "instantiating IndexIVFFlat" << "\n";
-        this->index = std::unique_ptr<faiss::IndexIVFFlat>(new faiss::IndexIVFFlat(this->quantizer.get(), this->d, this->nCells));
-    } else {
-        std::cout << "instantiating IndexIVFPQ" << "\n";
-        this->index = std::unique_ptr<faiss::IndexIVFPQ>(new faiss::IndexIVFPQ(this->quantizer.get(), this->d, this->nCells, m, 8));
-    }
+// Replaces the untrained index with one built from config, resizing everything kept per cell to its nCells.
+// Caller must hold an exclusive lock on the core mutex, and nothing may have been added yet.
+void Core::configure(const IndexConfig& config) {
+    this->resizeCells(config.nCells);
+    this->quantizer = createQuantizer(this->d, this->quantizer_type);
+    this->index = config.createIndex(this->quantizer.get(), this->d);
+    std::cout << "instantiating " << describeIndex(*this->index) << "\n";
+}
+
+void Core::resizeCells(size_t nCells) {
+    this->nCells = nCells;
+    this->directory = IdDirectory(this->nCells);
+    this->store = CellStore(this->nCells, this->d);
     this->residence_statuses = std::unique_ptr<float[]>(new float[this->nCells]);
     for (size_t i = 0; i < this->nCells; i++) {
-        this->residence_statuses[i] = -1;
-        this->ids_by_cell.push_back(std::vector<std::string>());
+        this->residence_statuses[i] = NOT_RESIDENT;
     }
+    this->cell_bytes = std::vector<size_t>(this->nCells, 0);
+    this->cell_stats = std::unique_ptr<CellStats[]>(new CellStats[this->nCells]);
+    this->cell_probes = std::unique_ptr<std::atomic<uint64_t>[]>(new std::atomic<uint64_t>[this->nCells]());
+}
+
+
+std::shared_ptr<faiss::Index> Core::createQuantizer(size_t d, QuantizerType type) {
+    if (type == HNSW_QUANTIZER) {
+        std::cout << "instantiating IndexHNSWFlat quantizer" << "\n";
+        std::shared_ptr<faiss::IndexHNSWFlat> quantizer = std::make_shared<faiss::IndexHNSWFlat>(d, hnsw_m);
+        quantizer->hnsw.efConstruction = hnsw_ef_construction;
+        quantizer->hnsw.efSearch = hnsw_ef_search;
+        return quantizer;
+    }
+    return std::make_shared<faiss::IndexFlatL2>(d);
 }
 
 
 // Another layer will receive a stream of data, select a subset, and pass it here.
-void Core::train(faiss::idx_t n, const float* x) {
+void Core::train(faiss::idx_t n, const float* x, TrainingProgress on_progress) {
     // Check this in case the training is done manually for testing purposes
-    if (!this->index->is_trained) {
+    bool trained;
+    {
+        std::shared_lock<std::shared_mutex> lock(this->mutex);
+        trained = this->index->is_trained;
+        if (!trained && this->target_recall > 0 && this->directory.size() > 0) {
+            throw std::runtime_error("Can't tune the index once ids have been added to it");
+        }
+    }
+
+    // Tuning and k-means only read the sample and the settings only TRAIN changes, so they run without the lock
+    // and the lock is only taken to install what they produce
+    std::vector<float> centroids;
+    if (!trained) {
+        if (this->target_recall > 0) {
+            AutoTuner tuner(this->d, this->target_recall, this->index_mem);
+            TuningResult tuning = tuner.tune(n, x, this->nTotal, this->nCells, this->tuning_nprobe);
+            std::unique_lock<std::shared_mutex> lock(this->mutex);
+            this->tuning = tuning;
+            this->configure(tuning.config);
+        }
+        centroids = this->kmeans(n, x, on_progress);
+    }
+
+    std::unique_lock<std::shared_mutex> lock(this->mutex);
+    if (!trained) {
+        this->quantizer->reset();
+        this->quantizer->add(this->nCells, centroids.data());
+        // The quantizer already holds nCells centroids so FAISS only trains what the index needs on top of it,
+        // e.g. the PQ codebooks
         this->index->train(n, x);
+        if (on_progress) {
+            on_progress(kmeans_iterations + 1, kmeans_iterations + 1);
+        }
     }
     // Initialize an array of centroids that are stacked on each other
     // TODO: Is this the standard way of dealing with no knowing d at compile time?
@@ -49,133 +114,698 @@ void Core::train(faiss::idx_t n, const float* x) {
     this->quantizer->reconstruct_n(0, this->nCells, this->centroids.get());
 }
 
-void Core::loadCellWithVec(std::shared_ptr<float[]> xq, size_t nload) {
-    faiss::idx_t centroidIndices[nload];
-    float distances[nload];
-    this->quantizer->search(1, xq.get(), nload, distances, centroidIndices);
+// Lloyd's k-means over the training set, run here rather than inside IndexIVF::train so progress can be reported
+// after every iteration. Centroids are seeded with distinct training vectors and each iteration assigns every
+// vector to its nearest centroid with an IndexFlatL2, then moves each centroid to the mean of its vectors. A
+// centroid left without vectors takes half of the largest cluster, the way FAISS splits clusters.
+std::vector<float> Core::kmeans(faiss::idx_t n, const float* x, TrainingProgress on_progress) {
+    size_t k = this->nCells;
+    if ((size_t)n < k) {
+        throw std::runtime_error("Training needs at least " + std::to_string(k) + " vectors, one for each cell, got " + std::to_string(n));
+    }
 
-    for (size_t i = 0; i < nload; i++) {
-        if (this->residence_statuses[centroidIndices[i]] > -1) {
-            std::cout << "Found cell already loaded: skipping\n";
-            // throw std::runtime_error("Attempting to load cell already in residence. Must evict before loading again.");
-            continue;
+    std::mt19937_64 rng(1234);
+    std::vector<faiss::idx_t> order(n);
+    std::iota(order.begin(), order.end(), 0);
+    for (size_t c = 0; c < k; c++) {
+        std::uniform_int_distribution<faiss::idx_t> pick(c, n - 1);
+        std::swap(order[c], order[pick(rng)]);
+    }
+    std::vector<float> centroids(k * this->d);
+    for (size_t c = 0; c < k; c++) {
+        std::memcpy(&centroids[c * this->d], &x[order[c] * this->d], sizeof(float) * this->d);
+    }
+
+    std::vector<float> distances(n);
+    std::vector<faiss::idx_t> assignments(n);
+    std::vector<double> sums(k * this->d);
+    std::vector<size_t> counts(k);
+    for (size_t iteration = 0; iteration < kmeans_iterations; iteration++) {
+        faiss::IndexFlatL2 assigner(this->d);
+        assigner.add(k, centroids.data());
+        assigner.search(n, x, 1, distances.data(), assignments.data());
+
+        std::fill(sums.begin(), sums.end(), 0.0);
+        std::fill(counts.begin(), counts.end(), 0);
+        for (faiss::idx_t i = 0; i < n; i++) {
+            size_t c = assignments[i];
+            counts[c]++;
+            for (size_t j = 0; j < this->d; j++) {
+                sums[(c * this->d) + j] += x[(i * this->d) + j];
+            }
+        }
+        for (size_t c = 0; c < k; c++) {
+            if (counts[c] == 0) {
+                continue;
+            }
+            for (size_t j = 0; j < this->d; j++) {
+                centroids[(c * this->d) + j] = sums[(c * this->d) + j] / counts[c];
+            }
+        }
+
+        // Nudging the two halves apart in opposite directions lets the next assignment separate them. The nudge is
+        // added rather than scaled so components which are zero move too.
+        const float epsilon = 1.0f / 1024.0f;
+        for (size_t c = 0; c < k; c++) {
+            if (counts[c] > 0) {
+                continue;
+            }
+            size_t largest = std::max_element(counts.begin(), counts.end()) - counts.begin();
+            for (size_t j = 0; j < this->d; j++) {
+                float value = centroids[(largest * this->d) + j];
+                float nudge = (j % 2 == 0) ? epsilon : -epsilon;
+                centroids[(c * this->d) + j] = value + nudge;
+                centroids[(largest * this->d) + j] = value - nudge;
+            }
+            counts[c] = counts[largest] / 2;
+            counts[largest] -= counts[c];
+        }
+
+        if (on_progress) {
+            on_progress(iteration + 1, kmeans_iterations + 1);
         }
-        this->loadCell(centroidIndices[i]);
     }
+    return centroids;
+}
+
+LoadSources Core::loadCellWithVec(std::shared_ptr<float[]> xq, size_t nload) {
+    nload = std::min(nload, this->nCells);
+    std::vector<faiss::idx_t> centroidIndices(nload);
+    std::vector<float> distances(nload);
+    // The quantizer is only modified by training so it's safe to search without holding the lock
+    this->quantizer->search(1, xq.get(), nload, distances.data(), centroidIndices.data());
+
+    std::vector<faiss::idx_t> claimed = this->claimCells(centroidIndices);
+    LoadSources sources = this->loadCells(claimed);
+    // An HNSW quantizer can return fewer cells than asked for, padding with -1, which claimCells skips
+    size_t found = std::count_if(centroidIndices.begin(), centroidIndices.end(), [](faiss::idx_t cell) { return cell >= 0; });
+    sources.ram = found - claimed.size();
+    return sources;
 }
 
 void Core::evictCellWithVec(std::shared_ptr<float[]> xq, size_t nevict) {
-    faiss::idx_t centroidIndices[nevict];
-    float distances[nevict];
-    this->quantizer->search(1, xq.get(), nevict, distances, centroidIndices);
-    for (size_t i = 0; i < nevict; i++) {
-        if (this->residence_statuses[centroidIndices[i]] < 0) {
-            continue;
+    {
+        std::unique_lock<std::shared_mutex> lock(this->mutex);
+        faiss::idx_t centroidIndices[nevict];
+        float distances[nevict];
+        this->quantizer->search(1, xq.get(), nevict, distances, centroidIndices);
+        for (size_t i = 0; i < nevict; i++) {
+            if (centroidIndices[i] < 0 || this->residence_statuses[centroidIndices[i]] < 0) {
+                continue;
+            }
+            this->evictCellLocked(centroidIndices[i]);
         }
-        this->evictCell(centroidIndices[i]);
     }
+    this->flushDiskWrites();
 }
 
 // Load cell function based on id look up 
 void Core::loadCell(faiss::idx_t target_centroid) {
-    Data *x = new Data[this->ids_by_cell[target_centroid].size()];
-    // TODO: return the size so if an id doesn't exist anymore it's okay
+    this->loadCells(this->claimCells({target_centroid}));
+}
+
+// Marks the cells which aren't in residence as loading and returns them. Cells that are already resident, or
+// are being loaded by another request, are skipped so concurrent loads of the same cell are deduplicated.
+std::vector<faiss::idx_t> Core::claimCells(const std::vector<faiss::idx_t>& cells) {
+    std::unique_lock<std::shared_mutex> lock(this->mutex);
+    std::vector<faiss::idx_t> claimed;
+    for (faiss::idx_t cell : cells) {
+        if (cell < 0 || this->residence_statuses[cell] != NOT_RESIDENT) {
+            std::cout << "Found cell already loaded: skipping\n";
+            // throw std::runtime_error("Attempting to load cell already in residence. Must evict before loading again.");
+            continue;
+        }
+        this->residence_statuses[cell] = LOADING;
+        claimed.push_back(cell);
+    }
+    return claimed;
+}
+
+// Loads cells claimed with claimCells from the disk tier, or failing that the database, and makes them resident.
+// The lock isn't held during the fetch so searches continue to be served, and the cells become visible to
+// searches atomically once they have been installed. Cells which ADD gave more ids while they were being fetched
+// are fetched again. If the load fails, the cells which weren't installed are released so they can be loaded again.
+LoadSources Core::loadCells(const std::vector<faiss::idx_t>& cells) {
+    LoadSources sources;
+    if (cells.empty()) {
+        return sources;
+    }
+    ScopedLatency latency(metrics().load);
+
     try {
-        this->db->search(this->ids_by_cell[target_centroid], x);
-    } catch (const HttpException& e) {
-        // deallocate x and rethrow
-        delete[] x;
-        throw e;
-    }
-
-    faiss::idx_t centroid;
-    float distances[1];
-    for (size_t i = 0; i < this->ids_by_cell[target_centroid].size(); i++) {
-        assert(x[i].embedding.get() != nullptr);
-        this->quantizer->search(1, x[i].embedding.get(), 1, distances, &centroid);
-        if (centroid == target_centroid) {
-            assert(this->id_map.find(std::string(x[i].id.get())) != this->id_map.end());
-            faiss::idx_t id_num = this->id_map[std::string(x[i].id.get())];
-
-            // Assert that this data doesn't already exist in the data map
-            assert(this->data_map.find(id_num) == this->data_map.end());
-            this->data_map.insert({id_num, x[i]});
-
-            // TODO: look into doing this as a group operation instead of 1 at a time
-            this->index->add_with_ids(1, x[i].embedding.get(), &id_num);
-        } else {
-            std::cerr << "Queried vector does not belong to the target cell" << std::endl;
-            std::cerr << "Expected " << target_centroid << ", but quantizer search returned " << centroid << std::endl;
+        std::vector<faiss::idx_t> pending = cells;
+        for (size_t attempt = 1; !pending.empty(); attempt++) {
+            bool lastAttempt = attempt >= max_load_attempts;
+
+            // Cells on the disk tier are mapped back. A copy written before ADD gave the cell more ids is stale.
+            std::vector<std::pair<faiss::idx_t, std::shared_ptr<DiskCell>>> diskCells;
+            std::vector<faiss::idx_t> dbCells;
+            for (faiss::idx_t cell : pending) {
+                std::shared_ptr<DiskCell> diskCell = this->disk_tier ? this->disk_tier->get(cell) : nullptr;
+                if (diskCell != nullptr) {
+                    std::shared_lock<std::shared_mutex> lock(this->mutex);
+                    if (diskCell->members == this->directory.cellSize(cell) && diskCell->code_size == this->index->code_size
+                        && diskCell->arena->precision == this->payload_precision) {
+                        diskCells.push_back({cell, diskCell});
+                        continue;
+                    }
+                    this->disk_tier->drop(cell);
+                }
+                dbCells.push_back(cell);
+            }
+
+            // Gather the ids of every target cell so they can all be fetched together
+            // The views point into the directory's string pool, which never moves or shrinks
+            std::vector<std::string_view> ids;
+            {
+                std::shared_lock<std::shared_mutex> lock(this->mutex);
+                for (faiss::idx_t cell : dbCells) {
+                    for (faiss::idx_t internal : this->directory.cell(cell)) {
+                        ids.push_back(this->directory.get(internal));
+                    }
+                }
+            }
+
+            // TODO: return the size so if an id doesn't exist anymore it's okay
+            std::unique_ptr<Data[]> x(new Data[ids.size()]);
+            std::vector<faiss::idx_t> assignments(ids.size());
+            if (!dbCells.empty()) {
+                this->fetch(ids, x.get());
+                // Assign the vectors to cells before taking the exclusive lock so searches aren't held up by the quantizer
+                this->assignRecords(x.get(), ids.size(), assignments.data());
+            }
+
+            std::unique_lock<std::shared_mutex> lock(this->mutex);
+            std::vector<faiss::idx_t> refetch;
+            for (const auto& diskCell : diskCells) {
+                // DELETE, UPSERT and ADD change the cell's ids, and DELETE and UPSERT drop it from the disk tier, so the
+                // copy is stale if one did while the lock wasn't held. The cell is fetched again rather than installed.
+                if (!this->disk_tier->contains(diskCell.first) || diskCell.second->members != this->directory.cellSize(diskCell.first)) {
+                    if (lastAttempt) {
+                        this->residence_statuses[diskCell.first] = NOT_RESIDENT;
+                    } else {
+                        this->residence_statuses[diskCell.first] = LOADING;
+                        refetch.push_back(diskCell.first);
+                    }
+                    continue;
+                }
+                this->installDiskCell(diskCell.first, *diskCell.second);
+                sources.disk++;
+            }
+
+            // The fetch missed the ids ADD gave a cell while it was running. Out of attempts the cell is installed
+            // without them, and stays stale until it's loaded again.
+            std::vector<faiss::idx_t> installing;
+            std::unordered_set<faiss::idx_t> skipped;
+            for (faiss::idx_t cell : dbCells) {
+                if (this->residence_statuses[cell] == LOADING_STALE && !lastAttempt) {
+                    this->residence_statuses[cell] = LOADING;
+                    refetch.push_back(cell);
+                    skipped.insert(cell);
+                } else {
+                    installing.push_back(cell);
+                }
+            }
+            if (!skipped.empty()) {
+                for (faiss::idx_t& assignment : assignments) {
+                    if (skipped.find(assignment) != skipped.end()) {
+                        assignment = -1;
+                    }
+                }
+            }
+            if (!installing.empty()) {
+                this->installCells(installing, x.get(), ids.size(), assignments.data());
+            }
+            sources.db += installing.size();
+            pending = std::move(refetch);
+            // Cells evicted to make room are written to the disk tier without holding up searches
+            lock.unlock();
+            this->flushDiskWrites();
+        }
+    } catch (...) {
+        {
+            // Cells installed before the failure stay resident
+            std::unique_lock<std::shared_mutex> lock(this->mutex);
+            for (faiss::idx_t cell : cells) {
+                if (this->residence_statuses[cell] < 0) {
+                    this->residence_statuses[cell] = NOT_RESIDENT;
+                }
+            }
+        }
+        this->flushDiskWrites();
+        if (this->on_cells_settled) {
+            this->on_cells_settled(cells);
+        }
+        throw;
+    }
+    if (this->on_cells_settled) {
+        this->on_cells_settled(cells);
+    }
+    metrics().cells_loaded_disk.fetch_add(sources.disk, std::memory_order_relaxed);
+    metrics().cells_loaded_db.fetch_add(sources.db, std::memory_order_relaxed);
+    return sources;
+}
+
+// Fetches the records for the ids from the database in batches of at most DBClient::max_batch_size ids,
+// with up to DBClient::max_concurrent_requests of those requests in flight at a time.
+void Core::fetch(const std::vector<std::string_view>& ids, Data *x) {
+    if (ids.size() <= DBClient::max_batch_size) {
+        this->db->search(ids, x);
+        return;
+    }
+
+    size_t wave = DBClient::max_batch_size * DBClient::max_concurrent_requests;
+    for (size_t waveStart = 0; waveStart < ids.size(); waveStart += wave) {
+        std::vector<std::future<void>> requests;
+        size_t waveEnd = std::min(waveStart + wave, ids.size());
+        for (size_t start = waveStart; start < waveEnd; start += DBClient::max_batch_size) {
+            size_t end = std::min(start + DBClient::max_batch_size, waveEnd);
+            requests.push_back(std::async(std::launch::async, [this, &ids, x, start, end]() {
+                this->db->search(std::vector<std::string_view>(ids.begin() + start, ids.begin() + end), &x[start]);
+            }));
+        }
+        // Rethrows the first failed request. Any requests still in flight are waited on when the futures are destroyed.
+        for (auto& request : requests) {
+            request.get();
+        }
+    }
+}
+
+// Assigns each fetched record to its cell with a single quantizer search. Records without a usable embedding
+// are assigned -1.
+void Core::assignRecords(Data *x, size_t n, faiss::idx_t *assignments) {
+    std::vector<size_t> records;
+    records.reserve(n);
+    for (size_t i = 0; i < n; i++) {
+        assignments[i] = -1;
+        if (x[i].embedding.get() == nullptr || x[i].embedding_len != this->d || x[i].id.get() == nullptr) {
+            std::cerr << "Skipping record with a missing id or embedding" << std::endl;
+            continue;
         }
+        records.push_back(i);
+    }
+
+    std::vector<float> embeddings(records.size() * this->d);
+    for (size_t r = 0; r < records.size(); r++) {
+        std::memcpy(&embeddings[r * this->d], x[records[r]].embedding.get(), sizeof(float) * this->d);
     }
+    std::vector<faiss::idx_t> labels(records.size());
+    std::vector<float> distances(records.size());
+    this->quantizer->search(records.size(), embeddings.data(), 1, distances.data(), labels.data());
 
-    this->residence_statuses[target_centroid] = this->ids_by_cell[target_centroid].size();
-    delete[] x;
+    for (size_t r = 0; r < records.size(); r++) {
+        assignments[records[r]] = labels[r];
+    }
 }
 
-// TODO: return distances also
-void Core::search(size_t n, float *xq, size_t k, size_t nprobe, bool require_all, Data *data, int *cacheHits) {
+// Caller must hold an exclusive lock on the core mutex
+void Core::installCells(const std::vector<faiss::idx_t>& cells, Data *x, size_t n, const faiss::idx_t *assignments) {
+    std::unordered_set<faiss::idx_t> targets(cells.begin(), cells.end());
+
+    std::vector<float> xb;
+    std::vector<faiss::idx_t> xids;
+    std::vector<faiss::idx_t> xassign;
+    // Records of each cell in the order they're added to its inverted list, which is their slot in its arena
+    std::unordered_map<faiss::idx_t, std::vector<const Data*>> cellRecords;
+    xb.reserve(n * this->d);
+    xids.reserve(n);
+    xassign.reserve(n);
+    for (size_t i = 0; i < n; i++) {
+        if (assignments[i] == -1) {
+            continue;
+        }
+        if (targets.find(assignments[i]) == targets.end()) {
+            std::cerr << "Queried vector does not belong to any of the target cells" << std::endl;
+            std::cerr << "Quantizer search returned " << assignments[i] << std::endl;
+            continue;
+        }
+        faiss::idx_t id_num = this->directory.find(std::string_view(x[i].id.get()));
+        if (id_num == -1) {
+            std::cerr << "Skipping record with unknown id: " << x[i].id.get() << std::endl;
+            continue;
+        }
+        // The id was deleted, or upserted into another cell, while the records were being fetched
+        if (this->directory.cellOf(id_num) != assignments[i]) {
+            std::cerr << "Skipping record which has moved to another cell: " << x[i].id.get() << std::endl;
+            continue;
+        }
+
+        xb.insert(xb.end(), x[i].embedding.get(), x[i].embedding.get() + this->d);
+        xids.push_back(id_num);
+        xassign.push_back(assignments[i]);
+        cellRecords[assignments[i]].push_back(&x[i]);
+    }
+
+    // Pack each cell's records into its arena and count what the cells will take up, index codes and ids included
+    std::unordered_map<faiss::idx_t, std::shared_ptr<CellArena>> arenas;
+    std::unordered_map<faiss::idx_t, size_t> incomingBytes;
+    size_t incoming = 0;
+    for (faiss::idx_t cell : cells) {
+        // Slots only line up with inverted list offsets if the list starts out empty
+        assert(this->index->get_list_size(cell) == 0);
+        arenas[cell] = std::make_shared<CellArena>(this->d, cellRecords[cell], this->payload_precision);
+        incomingBytes[cell] = arenas[cell]->bytes + (arenas[cell]->n * (this->index->code_size + sizeof(faiss::idx_t)));
+        incoming += incomingBytes[cell];
+    }
+
+    // Evict before inserting so memory use never goes over the budget
+    this->makeRoom(incoming);
+
+    // The cell assignments are already known, so every vector is added with one call which skips the quantizer
+    if (!xids.empty()) {
+        this->index->add_core(xids.size(), xb.data(), xids.data(), xassign.data());
+    }
+
+    for (faiss::idx_t cell : cells) {
+        this->store.install(cell, arenas[cell]);
+        // Only the records which were fetched and installed count, so ids added during the fetch, or missing from
+        // the database, leave the cell stale
+        this->markResident(cell, incomingBytes[cell], arenas[cell]->n);
+    }
+}
+
+// Installs a cell mapped back from the disk tier. Its codes were encoded by this index, so they're appended to the
+// inverted list as they are. Caller must hold an exclusive lock on the core mutex.
+void Core::installDiskCell(faiss::idx_t cell, const DiskCell& diskCell) {
+    assert(this->index->get_list_size(cell) == 0);
+    size_t incoming = diskCell.arena->bytes + (diskCell.n * (this->index->code_size + sizeof(faiss::idx_t)));
+    this->makeRoom(incoming);
+
+    if (diskCell.n > 0) {
+        this->index->invlists->add_entries(cell, diskCell.n, diskCell.ids, diskCell.codes);
+        this->index->ntotal += diskCell.n;
+    }
+    this->store.install(cell, diskCell.arena);
+    this->markResident(cell, incoming, diskCell.members);
+}
+
+// Caller must hold an exclusive lock on the core mutex
+void Core::markResident(faiss::idx_t cell, size_t bytes, size_t members) {
+    this->residence_statuses[cell] = members;
+    this->cell_bytes[cell] = bytes;
+    this->resident_bytes += bytes;
+    this->cell_stats[cell].loaded_at = this->access_clock.fetch_add(1, std::memory_order_relaxed);
+    this->cell_stats[cell].last_access.store(this->cell_stats[cell].loaded_at, std::memory_order_relaxed);
+    this->cell_stats[cell].accesses.store(0, std::memory_order_relaxed);
+}
+
+// Evicts resident cells in the order chosen by the eviction policy until another incoming bytes fit in the memory
+// budget. Caller must hold an exclusive lock on the core mutex, and call flushDiskWrites once it has been released.
+void Core::makeRoom(size_t incoming) {
+    if (this->max_mem == 0 || this->resident_bytes + incoming <= this->max_mem) {
+        return;
+    }
+    if (incoming > this->max_mem) {
+        throw std::runtime_error("Cells being loaded need " + std::to_string(incoming) + " bytes which exceeds the memory budget of "
+            + std::to_string(this->max_mem) + " bytes");
+    }
+
+    std::vector<faiss::idx_t> resident;
+    for (size_t cell = 0; cell < this->nCells; cell++) {
+        if (this->residence_statuses[cell] >= 0) {
+            resident.push_back(cell);
+        }
+    }
+    this->eviction_policy->rank(resident, this->cell_stats.get());
+
+    for (faiss::idx_t cell : resident) {
+        if (this->resident_bytes + incoming <= this->max_mem) {
+            break;
+        }
+        std::cout << "Evicting cell " << cell << " to stay within the memory budget\n";
+        this->evictCellLocked(cell);
+    }
+}
+
+void Core::search(size_t n, float *xq, size_t k, size_t nprobe, bool require_all, Data *data, int *cacheHits, std::vector<faiss::idx_t> *missing,
+    const SearchOptions& options, float *resultDistances, float *coverage) {
+    ScopedLatency latency(metrics().search);
+    std::shared_lock<std::shared_mutex> lock(this->mutex);
+
+    // The quantizer pads its results with -1 when asked for more centroids than there are cells
+    nprobe = std::min(nprobe, this->nCells);
+
+    // Pass nprobe per call rather than setting it on the shared index so concurrent searches don't race
+    faiss::IVFSearchParameters params;
+    params.nprobe = nprobe;
+
     // Check residency status
-    this->index->nprobe = nprobe;
-    faiss::idx_t centroidIndices[n * nprobe];
-    float centroidDistances[n * nprobe];
-
-    this->quantizer->search(n, xq, nprobe, centroidDistances, centroidIndices);
-    for (int i = 0; i < n; i++) {
-        bool cacheHit = this->residence_statuses[centroidIndices[i * nprobe]] > -1;
-        if (require_all) {
-            for (int j = 1; cacheHit && j < nprobe; j++) {
-                if (this->residence_statuses[centroidIndices[(i * nprobe) + j]] == -1) {
-                    // Found nearby centroid not in residence
-                    cacheHit = false;
-                }
+    std::vector<faiss::idx_t> centroidIndices(n * nprobe);
+    std::vector<float> centroidDistances(n * nprobe);
+    this->quantizer->search(n, xq, nprobe, centroidDistances.data(), centroidIndices.data());
+
+    std::vector<size_t> hits;
+    std::unordered_set<faiss::idx_t> missingCells;
+    hits.reserve(n);
+    bool partial = options.min_coverage >= 0;
+    for (size_t i = 0; i < n; i++) {
+        faiss::idx_t *probes = &centroidIndices[i * nprobe];
+
+        // Coverage is weighted by the number of vectors in each cell, or by cell if none of them have any yet. An HNSW
+        // quantizer can return fewer than nprobe cells, padding its results with -1, which aren't counted.
+        size_t probedCells = 0;
+        size_t residentCells = 0;
+        size_t residentVectors = 0;
+        size_t totalVectors = 0;
+        for (size_t j = 0; j < nprobe; j++) {
+            if (probes[j] < 0) {
+                continue;
             }
+            probedCells++;
+            this->cell_probes[probes[j]].fetch_add(1, std::memory_order_relaxed);
+            size_t cellSize = this->directory.cellSize(probes[j]);
+            totalVectors += cellSize;
+            if (this->residence_statuses[probes[j]] >= 0) {
+                residentCells++;
+                residentVectors += cellSize;
+            }
+        }
+        float queryCoverage = totalVectors > 0 ? (float)residentVectors / totalVectors : probedCells > 0 ? (float)residentCells / probedCells : 0;
+        if (coverage != nullptr) {
+            coverage[i] = queryCoverage;
         }
+
+        bool cacheHit;
+        if (partial) {
+            cacheHit = residentCells > 0 && queryCoverage >= options.min_coverage;
+        } else if (require_all) {
+            cacheHit = probedCells > 0 && residentCells == probedCells;
+        } else {
+            cacheHit = probes[0] >= 0 && this->residence_statuses[probes[0]] >= 0;
+        }
+
         if (cacheHit) {
             // cell is in residence
             cacheHits[i] = 0;
-            faiss::idx_t labels[k];
-            float distances[k];
-            this->index->search(1, &xq[i], k, distances, labels);
-            for (int j = 0; j < k; j++) {
-                if (labels[j] == -1) {
-                    // Fewer than k results, padded with -1
-                    data[(i * k) + j] = Data();
-                } else {
-                    // Use copy constructor
-                    // If this assertion is violtated, it means there is is inconsistency between the index and data map
-                    assert(this->data_map.find(labels[j]) != this->data_map.end());
-                    data[(i * k) + j] = this->data_map[labels[j]];
-                    cacheHits[i]++;
+            hits.push_back(i);
+            // Cells which aren't resident have empty lists, so they're left out of the search instead of probed.
+            // FAISS skips lists numbered -1.
+            for (size_t j = 0; j < nprobe; j++) {
+                if (probes[j] >= 0 && this->residence_statuses[probes[j]] < 0) {
+                    probes[j] = -1;
                 }
             }
         } else {
             cacheHits[i] = -1;
             // Should we copy any data into the embeddigns array or leave it random data?
+            if (missing != nullptr) {
+                // Only the nearest cell is needed for a hit unless every probed cell is required or counts towards
+                // the coverage
+                size_t nRequired = require_all || partial ? nprobe : 1;
+                for (size_t j = 0; j < nRequired; j++) {
+                    faiss::idx_t cell = centroidIndices[(i * nprobe) + j];
+                    if (cell >= 0 && this->residence_statuses[cell] < 0) {
+                        missingCells.insert(cell);
+                    }
+                }
+            }
+        }
+    }
+    if (missing != nullptr) {
+        missing->assign(missingCells.begin(), missingCells.end());
+    }
+
+    size_t nHits = hits.size();
+    metrics().queries.fetch_add(n, std::memory_order_relaxed);
+    metrics().cache_hits.fetch_add(nHits, std::memory_order_relaxed);
+    if (nHits == 0) {
+        return;
+    }
+
+    // Record which resident cells were used for the eviction policy. Only one tick of the clock is taken for
+    // the whole batch.
+    uint64_t tick = this->access_clock.fetch_add(1, std::memory_order_relaxed);
+    for (size_t i : hits) {
+        for (size_t j = 0; j < nprobe; j++) {
+            // Only resident cells are left in the assignments of a hit
+            faiss::idx_t cell = centroidIndices[(i * nprobe) + j];
+            if (cell >= 0) {
+                this->cell_stats[cell].accesses.fetch_add(1, std::memory_order_relaxed);
+                this->cell_stats[cell].last_access.store(tick, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Gather the cache hits into contiguous blocks so the whole batch is searched with a single call to the
+    // index, which lets FAISS parallelize across queries. The centroid assignments computed above are reused
+    // instead of running the quantizer a second time. When every query hits, the inputs are used in place.
+    const float *xHits = xq;
+    const faiss::idx_t *assignHits = centroidIndices.data();
+    const float *distHits = centroidDistances.data();
+    std::vector<float> xGathered;
+    std::vector<faiss::idx_t> assignGathered;
+    std::vector<float> distGathered;
+    if (nHits < n) {
+        xGathered.resize(nHits * this->d);
+        assignGathered.resize(nHits * nprobe);
+        distGathered.resize(nHits * nprobe);
+        for (size_t h = 0; h < nHits; h++) {
+            size_t i = hits[h];
+            std::memcpy(&xGathered[h * this->d], &xq[i * this->d], sizeof(float) * this->d);
+            std::memcpy(&assignGathered[h * nprobe], &centroidIndices[i * nprobe], sizeof(faiss::idx_t) * nprobe);
+            std::memcpy(&distGathered[h * nprobe], &centroidDistances[i * nprobe], sizeof(float) * nprobe);
+        }
+        xHits = xGathered.data();
+        assignHits = assignGathered.data();
+        distHits = distGathered.data();
+    }
+
+    // A refined search takes more candidates than it returns, and only the first k of each query's are kept
+    size_t kCandidates = k * std::max<size_t>(options.refine_factor, 1);
+    std::vector<faiss::idx_t> labels(nHits * kCandidates);
+    std::vector<float> distances(nHits * kCandidates);
+    // With store_pairs the labels are (cell, offset) pairs which index straight into the cell store
+    this->index->search_preassigned(nHits, xHits, kCandidates, assignHits, distHits, distances.data(), labels.data(), true, &params);
+    if (kCandidates > k) {
+        this->refine(nHits, xHits, kCandidates, k, labels.data(), distances.data());
+    }
+
+    // Scatter the results back into the layout of the original queries. Results are sorted best first, so the ones
+    // past the threshold are all at the end.
+    bool innerProductMetric = this->index->metric_type == faiss::METRIC_INNER_PRODUCT;
+    for (size_t h = 0; h < nHits; h++) {
+        size_t i = hits[h];
+        for (size_t j = 0; j < k; j++) {
+            faiss::idx_t label = labels[(h * kCandidates) + j];
+            float distance = distances[(h * kCandidates) + j];
+            bool withinThreshold = innerProductMetric ? distance >= options.min_similarity : distance <= options.max_distance;
+            if (label == -1 || !withinThreshold) {
+                // Fewer than k results (padded with -1) or past the threshold
+                data[(i * k) + j] = Data();
+            } else {
+                data[(i * k) + j] = this->store.get(label, options.decode_embeddings);
+                if (resultDistances != nullptr) {
+                    resultDistances[(i * k) + j] = distance;
+                }
+                cacheHits[i]++;
+            }
+        }
+    }
+}
+
+// Caller must hold a lock on the core mutex so the cells the labels point into stay resident
+void Core::refine(size_t n, const float *xq, size_t kCandidates, size_t k, faiss::idx_t *labels, float *distances) {
+    bool innerProductMetric = this->index->metric_type == faiss::METRIC_INNER_PRODUCT;
+    std::vector<size_t> order(kCandidates);
+    std::vector<faiss::idx_t> refinedLabels(k);
+    std::vector<float> refinedDistances(k);
+    std::vector<float> decoded(this->d);
+    for (size_t i = 0; i < n; i++) {
+        const float *query = &xq[i * this->d];
+        faiss::idx_t *queryLabels = &labels[i * kCandidates];
+        float *queryDistances = &distances[i * kCandidates];
+
+        // Results padded with -1 are at the end and stay there
+        size_t nCandidates = 0;
+        while (nCandidates < kCandidates && queryLabels[nCandidates] != -1) {
+            const float *embedding = this->store.embedding(queryLabels[nCandidates], decoded.data());
+            queryDistances[nCandidates] = innerProductMetric ? innerProduct(query, embedding, this->d) : l2Sqr(query, embedding, this->d);
+            nCandidates++;
+        }
+
+        size_t nKept = std::min(k, nCandidates);
+        std::iota(order.begin(), order.begin() + nCandidates, 0);
+        std::partial_sort(order.begin(), order.begin() + nKept, order.begin() + nCandidates, [&](size_t a, size_t b) {
+            return innerProductMetric ? queryDistances[a] > queryDistances[b] : queryDistances[a] < queryDistances[b];
+        });
+        for (size_t j = 0; j < nKept; j++) {
+            refinedLabels[j] = queryLabels[order[j]];
+            refinedDistances[j] = queryDistances[order[j]];
+        }
+        for (size_t j = 0; j < k; j++) {
+            queryLabels[j] = j < nKept ? refinedLabels[j] : -1;
+            queryDistances[j] = j < nKept ? refinedDistances[j] : 0;
         }
     }
 }
 
 void Core::evictCell(faiss::idx_t centroidIndex) {
-    if (this->residence_statuses[centroidIndex] == -1) {
+    {
+        std::unique_lock<std::shared_mutex> lock(this->mutex);
+        this->evictCellLocked(centroidIndex);
+    }
+    this->flushDiskWrites();
+}
+
+// Caller must hold an exclusive lock on the core mutex, and call flushDiskWrites once it has been released
+void Core::evictCellLocked(faiss::idx_t centroidIndex) {
+    if (this->residence_statuses[centroidIndex] < 0) {
         throw std::runtime_error("Eviciting a cell not in residence");
     }
+    ScopedLatency latency(metrics().evict);
+    metrics().cells_evicted.fetch_add(1, std::memory_order_relaxed);
 
-    size_t cellSize = this->index->get_list_size(centroidIndex);
-    std::vector<faiss::idx_t> idsToRemove(cellSize);
-    // Copy ids that need to be removed from the data map
-    memcpy(idsToRemove.data(), this->index->invlists->get_ids(centroidIndex), sizeof(faiss::idx_t) * cellSize);
+    // Keep the cell on the disk tier so loading it again doesn't go back to the database. A copy already there is
+    // still current unless ADD has given the cell more ids since it was loaded. The inverted list is copied and the
+    // arena is kept alive so they're written by flushDiskWrites once the lock is released.
+    if (this->disk_tier && !(this->disk_tier->contains(centroidIndex) && this->residence_statuses[centroidIndex] == this->directory.cellSize(centroidIndex))) {
+        std::shared_ptr<const CellArena> arena = this->store.arena(centroidIndex);
+        size_t n = this->index->get_list_size(centroidIndex);
+        if (arena != nullptr && arena->n == n) {
+            const faiss::idx_t *ids = this->index->invlists->get_ids(centroidIndex);
+            const uint8_t *codes = this->index->invlists->get_codes(centroidIndex);
+            PendingDiskWrite write;
+            write.cell = centroidIndex;
+            write.members = this->residence_statuses[centroidIndex];
+            write.ticket = this->disk_tier->ticket();
+            write.ids.assign(ids, ids + n);
+            write.codes.assign(codes, codes + (n * this->index->code_size));
+            write.code_size = this->index->code_size;
+            write.arena = arena;
+            std::lock_guard<std::mutex> writes_lock(this->disk_writes_mutex);
+            this->disk_writes.push_back(std::move(write));
+        }
+    }
 
     // Remove data from the index by deleting relevant invlist
+    this->index->ntotal -= this->index->get_list_size(centroidIndex);
     this->index->invlists->resize(centroidIndex, 0);
 
-    // Remove data from the data map
-    for (auto itr = idsToRemove.begin(); itr != idsToRemove.end(); itr++) {
-        this->data_map.erase(*itr);
-    }
+    // Release the cell's arena
+    this->store.evict(centroidIndex);
 
     // Update cell residency status
-    this->residence_statuses[centroidIndex] = -1;
+    this->residence_statuses[centroidIndex] = NOT_RESIDENT;
+    this->resident_bytes -= this->cell_bytes[centroidIndex];
+    this->cell_bytes[centroidIndex] = 0;
+}
+
+void Core::flushDiskWrites() {
+    std::vector<PendingDiskWrite> writes;
+    {
+        std::lock_guard<std::mutex> writes_lock(this->disk_writes_mutex);
+        writes.swap(this->disk_writes);
+    }
+    if (!this->disk_tier) {
+        return;
+    }
+    for (const PendingDiskWrite& write : writes) {
+        try {
+            this->disk_tier->put(write.cell, write.members, write.ids.size(), write.ids.data(), write.codes.data(), write.code_size, *write.arena, write.ticket);
+        } catch (const std::exception& e) {
+            std::cerr << "Failed to write cell " << write.cell << " to the disk tier: " << e.what() << std::endl;
+        }
+    }
 }
 
 // TODO: Remove this check
@@ -189,20 +819,354 @@ bool Core::isNullTerminated(const char* str, size_t max_length) {
 }
 
 
-void Core::add(size_t num_docs, std::vector<std::shared_ptr<char[]>>& ids, std::shared_ptr<float[]> embeddings) {
+void Core::add(size_t num_docs, std::vector<std::shared_ptr<char[]>>& ids, std::shared_ptr<float[]> embeddings,
+    const std::vector<Payload> *payloads) {
+    {
+        std::unique_lock<std::shared_mutex> lock(this->mutex);
+        this->addLocked(num_docs, ids, embeddings.get(), payloads);
+    }
+    // Writing through can evict cells to make room
+    this->flushDiskWrites();
+}
+
+// Caller must hold an exclusive lock on the core mutex
+void Core::addLocked(size_t num_docs, std::vector<std::shared_ptr<char[]>>& ids, const float *embeddings, const std::vector<Payload> *payloads) {
     // Ensure the number of embeddings matches the number of ids
     faiss::idx_t *updated_centroids = new faiss::idx_t[num_docs];
     float *distances = new float[num_docs];
-    this->quantizer->search(num_docs, embeddings.get(), 1, distances, updated_centroids);
+    this->quantizer->search(num_docs, embeddings, 1, distances, updated_centroids);
     delete[] distances;
+    // Records of the vectors landing in resident cells, grouped by cell, when their payloads were sent
+    std::vector<Data> records(payloads != nullptr ? num_docs : 0);
+    std::unordered_map<faiss::idx_t, std::pair<std::vector<faiss::idx_t>, std::vector<const Data*>>> writeThrough;
     for (size_t i = 0; i < num_docs; i++) {
         assert(this->isNullTerminated(ids[i].get(), 100));
-        std::string id(ids[i].get());
-        this->ids_by_cell[updated_centroids[i]].push_back(id);
-        this->id_map.insert({std::string(ids[i].get()), this->next_id});
-        this->next_id++;
+        faiss::idx_t internal = this->directory.insert(std::string_view(ids[i].get()), updated_centroids[i]);
+        if (internal == -1) {
+            std::cerr << "Skipping id which has already been added: " << ids[i].get() << std::endl;
+            continue;
+        }
+        // A fetch of the cell which is under way gathered its ids before this one, so it's fetched again
+        if (updated_centroids[i] >= 0 && this->residence_statuses[updated_centroids[i]] == LOADING) {
+            this->residence_statuses[updated_centroids[i]] = LOADING_STALE;
+        }
+        if (payloads == nullptr || updated_centroids[i] < 0 || this->residence_statuses[updated_centroids[i]] < 0) {
+            continue;
+        }
+
+        // The record only lives until it's copied into the cell's arena, so it borrows the embedding
+        Data& record = records[i];
+        record.id_len = std::strlen(ids[i].get());
+        record.id = ids[i];
+        record.embedding_len = this->d;
+        record.embedding = std::shared_ptr<float[]>(std::shared_ptr<float[]>(), const_cast<float *>(&embeddings[i * this->d]));
+        record.document_len = (*payloads)[i].document_len;
+        record.document = (*payloads)[i].document;
+        record.metadata_len = (*payloads)[i].metadata_len;
+        record.metadata = (*payloads)[i].metadata;
+        writeThrough[updated_centroids[i]].first.push_back(internal);
+        writeThrough[updated_centroids[i]].second.push_back(&record);
     }
     delete[] updated_centroids;
+
+    for (const auto& [cell, appended] : writeThrough) {
+        this->appendToCell(cell, appended.first, appended.second);
+    }
+}
+
+// The cell's arena is rebuilt with the records on the end, in the order their vectors are added to the inverted
+// list so slots keep matching offsets. If the cell has to be evicted to make room for them, they're loaded with it
+// the next time instead. Caller must hold an exclusive lock on the core mutex.
+void Core::appendToCell(faiss::idx_t cell, const std::vector<faiss::idx_t>& internals, const std::vector<const Data*>& records) {
+    std::shared_ptr<const CellArena> arena = this->store.arena(cell);
+    size_t n = this->index->get_list_size(cell);
+    if (arena == nullptr || arena->n != n) {
+        return;
+    }
+    std::vector<size_t> slots(n);
+    std::iota(slots.begin(), slots.end(), 0);
+    auto grown = std::make_shared<CellArena>(*arena, slots, records);
+    size_t bytes = grown->bytes + (grown->n * (this->index->code_size + sizeof(faiss::idx_t)));
+
+    try {
+        this->makeRoom(bytes - this->cell_bytes[cell]);
+    } catch (const std::exception& e) {
+        std::cerr << "Not writing added vectors through to cell " << cell << ": " << e.what() << std::endl;
+        return;
+    }
+    if (this->residence_statuses[cell] < 0) {
+        return;
+    }
+
+    std::vector<float> xb;
+    xb.reserve(records.size() * this->d);
+    for (const Data *record : records) {
+        xb.insert(xb.end(), record->embedding.get(), record->embedding.get() + this->d);
+    }
+    std::vector<faiss::idx_t> assignments(records.size(), cell);
+    this->index->add_core(records.size(), xb.data(), internals.data(), assignments.data());
+
+    this->store.evict(cell);
+    this->store.install(cell, grown);
+    this->resident_bytes = this->resident_bytes - this->cell_bytes[cell] + bytes;
+    this->cell_bytes[cell] = bytes;
+    // The status keeps up with the directory, so a cell which was current stays current
+    this->residence_statuses[cell] += records.size();
+    // The copy on the disk tier is missing the records now, and would be kept over a current one on eviction
+    if (this->disk_tier) {
+        this->disk_tier->drop(cell);
+    }
+}
+
+size_t Core::remove(size_t num_ids, const std::vector<std::shared_ptr<char[]>>& ids) {
+    std::unique_lock<std::shared_mutex> lock(this->mutex);
+    return this->removeLocked(num_ids, ids);
+}
+
+// Removed ids free their internal ids for reuse by later adds. The vectors of resident cells are dropped so searches
+// stop returning them, and copies of the cells on the disk tier are dropped since they no longer match the
+// directory. Caller must hold an exclusive lock on the core mutex.
+size_t Core::removeLocked(size_t num_ids, const std::vector<std::shared_ptr<char[]>>& ids) {
+    std::unordered_map<faiss::idx_t, std::unordered_set<faiss::idx_t>> removed;
+    size_t count = 0;
+    for (size_t i = 0; i < num_ids; i++) {
+        std::string_view id(ids[i].get());
+        faiss::idx_t internal = this->directory.find(id);
+        if (internal == -1) {
+            continue;
+        }
+        removed[this->directory.cellOf(internal)].insert(internal);
+        this->directory.remove(id);
+        count++;
+    }
+
+    for (const auto& [cell, internals] : removed) {
+        if (this->disk_tier) {
+            this->disk_tier->drop(cell);
+        }
+        if (this->residence_statuses[cell] >= 0) {
+            this->compactCell(cell, internals);
+        }
+    }
+    return count;
+}
+
+// Rebuilds the cell's inverted list and arena without the removed vectors, keeping the slots of the rest in line
+// with their list offsets. Caller must hold an exclusive lock on the core mutex.
+void Core::compactCell(faiss::idx_t cell, const std::unordered_set<faiss::idx_t>& removed) {
+    size_t n = this->index->get_list_size(cell);
+    size_t code_size = this->index->code_size;
+    const faiss::idx_t *ids = this->index->invlists->get_ids(cell);
+    const uint8_t *codes = this->index->invlists->get_codes(cell);
+
+    std::vector<size_t> kept;
+    std::vector<faiss::idx_t> keptIds;
+    std::vector<uint8_t> keptCodes;
+    for (size_t offset = 0; offset < n; offset++) {
+        if (removed.find(ids[offset]) != removed.end()) {
+            continue;
+        }
+        kept.push_back(offset);
+        keptIds.push_back(ids[offset]);
+        keptCodes.insert(keptCodes.end(), codes + (offset * code_size), codes + ((offset + 1) * code_size));
+    }
+    if (kept.size() == n) {
+        // Only ids added since the cell was loaded were removed
+        return;
+    }
+
+    this->index->invlists->resize(cell, 0);
+    if (!kept.empty()) {
+        this->index->invlists->add_entries(cell, kept.size(), keptIds.data(), keptCodes.data());
+    }
+    this->index->ntotal -= n - kept.size();
+
+    std::shared_ptr<const CellArena> arena = this->store.arena(cell);
+    auto compacted = std::make_shared<CellArena>(*arena, kept);
+    this->store.evict(cell);
+    this->store.install(cell, compacted);
+
+    size_t bytes = compacted->bytes + (kept.size() * (code_size + sizeof(faiss::idx_t)));
+    this->resident_bytes = this->resident_bytes - this->cell_bytes[cell] + bytes;
+    this->cell_bytes[cell] = bytes;
+    // The status stays one behind the directory if ids were added since the load, so the cell is still seen as stale
+    this->residence_statuses[cell] -= n - kept.size();
+}
+
+void Core::upsert(size_t num_docs, std::vector<std::shared_ptr<char[]>>& ids, std::shared_ptr<float[]> embeddings,
+    const std::vector<Payload> *payloads) {
+    {
+        std::unique_lock<std::shared_mutex> lock(this->mutex);
+        this->removeLocked(num_docs, ids);
+        this->addLocked(num_docs, ids, embeddings.get(), payloads);
+    }
+    this->flushDiskWrites();
+}
+
+
+// The snapshot is written to a temporary directory which replaces dir once it's complete, so a failed snapshot
+// never clobbers the previous one. Searches keep being served while it's written.
+void Core::writeSnapshot(const std::string& dir, bool include_cells) {
+    std::string tmp = dir + ".tmp";
+    std::filesystem::remove_all(tmp);
+    std::filesystem::create_directories(tmp);
+
+    {
+        std::shared_lock<std::shared_mutex> lock(this->mutex);
+        if (!this->index->is_trained) {
+            throw std::runtime_error("Can't snapshot an index which hasn't been trained");
+        }
+
+        SnapshotMeta meta;
+        meta.d = this->d;
+        meta.nCells = this->nCells;
+        meta.nTotal = this->nTotal;
+        meta.max_mem = this->max_mem;
+        meta.eviction_policy = this->eviction_policy->type();
+        meta.include_cells = include_cells;
+        meta.payload_precision = this->payload_precision;
+        meta.db_url = this->db->db_url ? std::string(this->db->db_url.get()) : std::string();
+        meta.write(tmp);
+
+        std::string indexPath = tmp + "/" + snapshot_index_file;
+        if (include_cells) {
+            faiss::write_index(this->index.get(), indexPath.c_str());
+        } else {
+            // Only the trained index is kept, the inverted lists of the resident cells are left out
+            std::unique_ptr<faiss::Index> empty(faiss::clone_index(this->index.get()));
+            empty->reset();
+            faiss::write_index(empty.get(), indexPath.c_str());
+        }
+
+        SnapshotWriter ids(tmp + "/" + snapshot_ids_file);
+        this->directory.write(ids);
+        ids.close();
+
+        if (include_cells) {
+            // Layout: d and the number of cells, a table of (cell, records, bytes, file offset, members) entries, then
+            // each cell's arena aligned to a cache line. members is the cell's residency status, so a stale cell is
+            // still stale once restored.
+            std::vector<std::shared_ptr<const CellArena>> arenas;
+            std::vector<faiss::idx_t> resident;
+            for (size_t cell = 0; cell < this->nCells; cell++) {
+                std::shared_ptr<const CellArena> arena = this->store.arena(cell);
+                if (arena != nullptr) {
+                    arenas.push_back(arena);
+                    resident.push_back(cell);
+                }
+            }
+
+            SnapshotWriter cells(tmp + "/" + snapshot_cells_file);
+            cells.write<uint64_t>(this->d);
+            cells.write<uint64_t>(resident.size());
+            size_t offset = cells.offset() + resident.size() * snapshot_cell_entry * sizeof(uint64_t);
+            for (size_t i = 0; i < resident.size(); i++) {
+                offset = ((offset + snapshot_alignment - 1) / snapshot_alignment) * snapshot_alignment;
+                cells.write<uint64_t>(resident[i]);
+                cells.write<uint64_t>(arenas[i]->n);
+                cells.write<uint64_t>(arenas[i]->bytes);
+                cells.write<uint64_t>(offset);
+                cells.write<uint64_t>(this->residence_statuses[resident[i]]);
+                offset += arenas[i]->bytes;
+            }
+            for (const auto& arena : arenas) {
+                cells.align(snapshot_alignment);
+                cells.writeBytes(arena->block.get(), arena->bytes);
+            }
+            cells.close();
+        }
+    }
+
+    // The previous snapshot is moved aside rather than removed, and only removed once the new one has been renamed
+    // into place, so a complete snapshot is always at dir or, for locateSnapshot, beside it
+    std::string previous = dir + snapshot_previous_suffix;
+    bool replacing = std::filesystem::exists(dir);
+    if (replacing) {
+        std::filesystem::remove_all(previous);
+        std::filesystem::rename(dir, previous);
+    }
+    try {
+        std::filesystem::rename(tmp, dir);
+    } catch (...) {
+        if (replacing) {
+            std::filesystem::rename(previous, dir);
+        }
+        throw;
+    }
+    // Also clears a previous snapshot left beside dir by an interrupted one
+    std::filesystem::remove_all(previous);
+}
+
+void Core::readSnapshot(const std::string& dir) {
+    SnapshotMeta meta = SnapshotMeta::read(dir);
+    std::unique_lock<std::shared_mutex> lock(this->mutex);
+    if (meta.d != this->d) {
+        throw std::runtime_error("Snapshot has d = " + std::to_string(meta.d) + " but the core has d = " + std::to_string(this->d));
+    }
+    if (meta.payload_precision > PRECISION_INT8) {
+        throw std::runtime_error("Unknown payload precision in snapshot: " + std::to_string(meta.payload_precision));
+    }
+    this->payload_precision = (EmbeddingPrecision)meta.payload_precision;
+    // A tuned index may have fewer cells than the core was initialized with
+    if (meta.nCells != this->nCells) {
+        this->resizeCells(meta.nCells);
+    }
+
+    std::string indexPath = dir + "/" + snapshot_index_file;
+    std::unique_ptr<faiss::Index> read(faiss::read_index(indexPath.c_str()));
+    faiss::IndexIVF *index = dynamic_cast<faiss::IndexIVF*>(read.get());
+    // The snapshot's quantizer, flat or HNSW, replaces the core's
+    faiss::Index *quantizer = index == nullptr ? nullptr : index->quantizer;
+    if (quantizer == nullptr || quantizer->ntotal != (faiss::idx_t)this->nCells || index->nlist != this->nCells || (size_t)index->d != this->d || !index->is_trained) {
+        throw std::runtime_error("Snapshot index isn't a trained IVF index matching the core");
+    }
+    // The core owns the quantizer alongside the index
+    index->own_fields = false;
+    read.release();
+    this->index = std::unique_ptr<faiss::IndexIVF>(index);
+    this->quantizer = std::shared_ptr<faiss::Index>(quantizer);
+    this->centroids = std::unique_ptr<float[]>(new float[this->d * this->nCells]);
+    this->quantizer->reconstruct_n(0, this->nCells, this->centroids.get());
+
+    SnapshotReader ids(dir + "/" + snapshot_ids_file);
+    this->directory.read(ids);
+
+    if (meta.include_cells) {
+        SnapshotReader cells(dir + "/" + snapshot_cells_file);
+        if (cells.read<uint64_t>() != this->d) {
+            throw std::runtime_error("Snapshot cells don't match the core's dimensionality");
+        }
+        uint64_t nResident = cells.read<uint64_t>();
+        std::vector<uint64_t> entries(nResident * snapshot_cell_entry);
+        for (auto& entry : entries) {
+            entry = cells.read<uint64_t>();
+        }
+
+        for (size_t i = 0; i < nResident; i++) {
+            faiss::idx_t cell = entries[i * snapshot_cell_entry];
+            size_t n = entries[i * snapshot_cell_entry + 1];
+            size_t bytes = entries[i * snapshot_cell_entry + 2];
+            size_t members = entries[i * snapshot_cell_entry + 4];
+            if (cell < 0 || (size_t)cell >= this->nCells || this->index->get_list_size(cell) != n) {
+                throw std::runtime_error("Snapshot cell " + std::to_string(cell) + " doesn't match the index");
+            }
+            // The arena is used in place in the mapping
+            cells.seek(entries[i * snapshot_cell_entry + 3]);
+            this->store.install(cell, std::make_shared<CellArena>(this->d, n, bytes, cells.alias(cells.take(bytes)), this->payload_precision));
+
+            this->residence_statuses[cell] = members;
+            this->cell_bytes[cell] = bytes + (n * (this->index->code_size + sizeof(faiss::idx_t)));
+            this->resident_bytes += this->cell_bytes[cell];
+            this->cell_stats[cell].loaded_at = this->access_clock.fetch_add(1, std::memory_order_relaxed);
+            this->cell_stats[cell].last_access.store(this->cell_stats[cell].loaded_at, std::memory_order_relaxed);
+        }
+    }
+
+    for (size_t cell = 0; cell < this->nCells; cell++) {
+        if (this->residence_statuses[cell] < 0 && this->index->get_list_size(cell) != 0) {
+            throw std::runtime_error("Snapshot index holds vectors of cell " + std::to_string(cell) + " without its data");
+        }
+    }
 }
 
 
@@ -3,51 +3,227 @@
 
 #include "db_client.h"
 #include "data.h"
-
+#include "cell_store.h"
+#include "id_directory.h"
+#include "eviction_policy.h"
+#include "disk_tier.h"
+#include "auto_tuner.h"
+
+#include <atomic>
+#include <functional>
+#include <limits>
 #include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_set>
 
 #include <faiss/IndexIVF.h>
 #include <faiss/IndexFlat.h>
 #include <faiss/IndexIDMap.h>
+#include <faiss/IndexHNSW.h>
+
+// Coarse quantizers which assign vectors and queries to cells. The flat quantizer compares against every centroid,
+// while the HNSW quantizer searches a graph over the centroids in sublinear time, which pays off once there are
+// tens of thousands of cells.
+enum QuantizerType : uint8_t {
+    FLAT_QUANTIZER,
+    HNSW_QUANTIZER
+};
+
+// Optional settings of a search, the defaults give a plain IVF search
+struct SearchOptions {
+    // With a refine_factor above 1, k * refine_factor candidates are taken from the index and re-ranked by their
+    // exact distances to the query, computed from the full precision embeddings in the cell store
+    size_t refine_factor = 1;
+    // Results further than max_distance (L2 metrics) or less similar than min_similarity (inner product) are dropped
+    float max_distance = std::numeric_limits<float>::infinity();
+    float min_similarity = -std::numeric_limits<float>::infinity();
+    // When not negative, only the resident cells among the nprobe nearest are probed, and a query is a hit when they
+    // hold at least this fraction of the vectors in the nprobe nearest cells. require_all is ignored.
+    float min_coverage = -1;
+    // Whether embeddings kept at reduced precision are decoded into the results. Without decoding, results only
+    // carry the codes as stored.
+    bool decode_embeddings = true;
+};
+
+// Where the cells asked for by a load were served from
+struct LoadSources {
+    // Already resident, or being loaded by another request
+    size_t ram = 0;
+    // Mapped back from the disk tier
+    size_t disk = 0;
+    // Fetched from the database
+    size_t db = 0;
+};
+
+// Copy of a cell evicted under the core mutex, written to the disk tier once the mutex has been released
+struct PendingDiskWrite {
+    faiss::idx_t cell;
+    size_t members;
+    uint64_t ticket;
+    std::vector<faiss::idx_t> ids;
+    std::vector<uint8_t> codes;
+    size_t code_size;
+    std::shared_ptr<const CellArena> arena;
+};
 
 struct Core {
 
     static constexpr const double nGuessCoeff = 2;
     static constexpr const double guessScalar = 2;
+    static constexpr const size_t kmeans_iterations = 20;
+    // Graph parameters of the HNSW quantizer. efSearch is raised to nprobe by FAISS when nprobe is larger.
+    static constexpr const int hnsw_m = 32;
+    static constexpr const int hnsw_ef_construction = 40;
+    static constexpr const int hnsw_ef_search = 64;
+
+    // Residency states held in residence_statuses. A resident cell instead holds the number of the directory's
+    // ids in its cell which it was loaded with, so it's stale when the directory has more. A loading cell is marked
+    // LOADING_STALE when ADD gives it ids the fetch missed, and is fetched again up to max_load_attempts times.
+    static constexpr const float NOT_RESIDENT = -1;
+    static constexpr const float LOADING = -2;
+    static constexpr const float LOADING_STALE = -3;
+    static constexpr const size_t max_load_attempts = 3;
 
     float nTotal = 0;
     size_t d = 0;
     size_t nCells = 0;
     std::unique_ptr<float[]> centroids;
     std::unique_ptr<float[]> residence_statuses;
-    std::shared_ptr<faiss::IndexFlat> quantizer;
+    std::shared_ptr<faiss::Index> quantizer;
     std::unique_ptr<faiss::IndexIVF> index;
     std::shared_ptr<DBClient> db;    
 
-    // TODO: look into other ways to generate ids, this will cause problems when next_id overflows and there's id overlap
-    faiss::idx_t next_id = 0;
-    std::vector<std::vector<std::string>> ids_by_cell;
+    // External ids of every added vector, their internal ids and the cells they belong to
+    IdDirectory directory;
     std::vector<Data> data;
-    std::unordered_map<faiss::idx_t, Data> data_map;
-    std::unordered_map<std::string, faiss::idx_t> id_map;
-    
-
-    Core(size_t d, std::shared_ptr<DBClient> db, size_t nCells, float nTotal, bool use_flat);
+    // Data of the resident records, one arena per resident cell
+    CellStore store;
+
+    // Memory budget for resident cells in bytes, 0 means unlimited. Loads which would exceed it first evict the
+    // cells chosen by the eviction policy. A cell's bytes cover its index codes, ids and data payloads.
+    size_t max_mem = 0;
+    size_t resident_bytes = 0;
+    std::vector<size_t> cell_bytes;
+    std::unique_ptr<CellStats[]> cell_stats;
+    // Times each cell has been among the nprobe nearest of a query since the index was built, resident or not
+    std::unique_ptr<std::atomic<uint64_t>[]> cell_probes;
+    std::atomic<uint64_t> access_clock{0};
+    std::unique_ptr<EvictionPolicy> eviction_policy;
+
+    // Precision the cell arenas keep embeddings at. Below full precision, searches decode the embeddings they return
+    // and re-ranking decodes the candidates' embeddings.
+    EmbeddingPrecision payload_precision = PRECISION_FP32;
+
+    // Coarse quantizer the index is built with
+    QuantizerType quantizer_type = FLAT_QUANTIZER;
+    // When above 0, training first tunes the index family, its parameters and nCells on the training sample for
+    // the smallest codes, then the most cells, reaching this recall when searched with tuning_nprobe. index_mem
+    // bounds the bytes the codes and ids of nTotal vectors may take, 0 for no limit. The outcome is kept in tuning.
+    float target_recall = 0;
+    size_t index_mem = 0;
+    size_t tuning_nprobe = 1;
+    TuningResult tuning;
+
+    // Optional second tier on local disk. Evicted cells are written to it and loads map them back from it.
+    std::shared_ptr<DiskTier> disk_tier;
+    // Cells evicted since the core mutex was taken which are waiting to be written to the disk tier
+    std::mutex disk_writes_mutex;
+    std::vector<PendingDiskWrite> disk_writes;
+
+    // Called once cells claimed with claimCells are either resident or, if their load failed, released again
+    std::function<void(const std::vector<faiss::idx_t>&)> on_cells_settled;
+
+    // Guards the index, the cell store and the residency statuses. SEARCH only reads this state so it
+    // takes a shared lock, while LOAD, EVICT, ADD, DELETE, UPSERT and TRAIN modify it and take an exclusive lock.
+    std::shared_mutex mutex;
+
+    Core(size_t d, std::shared_ptr<DBClient> db, size_t nCells, float nTotal, bool use_flat, size_t max_mem = 0, EvictionPolicyType eviction_policy = LRU,
+        QuantizerType quantizer_type = FLAT_QUANTIZER);
+
+    static std::shared_ptr<faiss::Index> createQuantizer(size_t d, QuantizerType type);
+    void configure(const IndexConfig& config);
+    // Resets the directory, cell store and per cell state for nCells cells
+    void resizeCells(size_t nCells);
     bool isNullTerminated(const char* str, size_t max_length);
 
-    void train(faiss::idx_t n, const float* x);
+    // Called after each step of training with the number of steps completed and the total number of steps
+    typedef std::function<void(size_t, size_t)> TrainingProgress;
+
+    void train(faiss::idx_t n, const float* x, TrainingProgress on_progress = nullptr);
+
+    std::vector<float> kmeans(faiss::idx_t n, const float* x, TrainingProgress on_progress);
 
-    void loadCellWithVec(std::shared_ptr<float[]> xq, size_t nload);
+    LoadSources loadCellWithVec(std::shared_ptr<float[]> xq, size_t nload);
 
     void evictCellWithVec(std::shared_ptr<float[]> xq, size_t nevict);
     
     void loadCell(faiss::idx_t centroidIndex);
 
-    void search(size_t n, float *xq, size_t k, size_t nprobe, bool require_all, Data *data, int *cacheHits);
+    std::vector<faiss::idx_t> claimCells(const std::vector<faiss::idx_t>& cells);
+
+    LoadSources loadCells(const std::vector<faiss::idx_t>& cells);
+
+    void fetch(const std::vector<std::string_view>& ids, Data *x);
+
+    void assignRecords(Data *x, size_t n, faiss::idx_t *assignments);
+
+    void installCells(const std::vector<faiss::idx_t>& cells, Data *x, size_t n, const faiss::idx_t *assignments);
+
+    void installDiskCell(faiss::idx_t cell, const DiskCell& diskCell);
+
+    void markResident(faiss::idx_t cell, size_t bytes, size_t members);
+
+    void makeRoom(size_t incoming);
+
+    // When missing is given, the cells which caused cache misses are written to it without duplicates. When distances
+    // is given, each result's distance is written to it in the same layout as data, and cacheHits counts the results
+    // kept after the thresholds in options. When coverage is given, each query's coverage is written to it: the
+    // fraction of the vectors in its nprobe nearest cells which are resident.
+    void search(size_t n, float *xq, size_t k, size_t nprobe, bool require_all, Data *data, int *cacheHits, std::vector<faiss::idx_t> *missing = nullptr,
+        const SearchOptions& options = SearchOptions(), float *distances = nullptr, float *coverage = nullptr);
+
+    // Re-ranks the kCandidates labels of each of the n queries in place by exact distance, keeping the best k
+    void refine(size_t n, const float *xq, size_t kCandidates, size_t k, faiss::idx_t *labels, float *distances);
 
     void evictCell(faiss::idx_t centroidIndex);
 
-    void add(size_t num_docs, std::vector<std::shared_ptr<char[]>>& ids, std::shared_ptr<float[]> embeddings);
+    void evictCellLocked(faiss::idx_t centroidIndex);
+
+    // Writes the cells evicted so far to the disk tier. Called without holding the core mutex.
+    void flushDiskWrites();
+
+    // When payloads are given, vectors which land in resident cells are written through to them and searched
+    // straight away. Otherwise they're searched once their cells are next loaded.
+    void add(size_t num_docs, std::vector<std::shared_ptr<char[]>>& ids, std::shared_ptr<float[]> embeddings,
+        const std::vector<Payload> *payloads = nullptr);
+
+    void addLocked(size_t num_docs, std::vector<std::shared_ptr<char[]>>& ids, const float *embeddings, const std::vector<Payload> *payloads);
+
+    // Appends records added to a resident cell to its inverted list and arena
+    void appendToCell(faiss::idx_t cell, const std::vector<faiss::idx_t>& internals, const std::vector<const Data*>& records);
+
+    // Removes the ids, dropping their vectors from resident cells straight away. Returns how many of the ids had
+    // been added.
+    size_t remove(size_t num_ids, const std::vector<std::shared_ptr<char[]>>& ids);
+
+    size_t removeLocked(size_t num_ids, const std::vector<std::shared_ptr<char[]>>& ids);
+
+    // Drops the vectors with the removed internal ids from a resident cell
+    void compactCell(faiss::idx_t cell, const std::unordered_set<faiss::idx_t>& removed);
+
+    // Removes the ids and adds them back with the new embeddings, moving them to the cells the embeddings are
+    // assigned to. As with ADD, the new vectors are written through to resident cells when payloads are given.
+    void upsert(size_t num_docs, std::vector<std::shared_ptr<char[]>>& ids, std::shared_ptr<float[]> embeddings,
+        const std::vector<Payload> *payloads = nullptr);
+
+    // Persists the trained index, the id directory and optionally the resident cells to the directory dir
+    void writeSnapshot(const std::string& dir, bool include_cells);
+
+    // Restores a snapshot into a core which hasn't been trained, with the same d as the snapshot
+    void readSnapshot(const std::string& dir);
 
 
     ~Core();
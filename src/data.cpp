@@ -7,20 +7,22 @@
 
 
 Data::Data()
-    : id_len(0), embedding_len(0), document_len(0), metadata_len(0), id(nullptr), embedding(nullptr), document(nullptr), metadata(nullptr) {}
+    : id_len(0), embedding_len(0), document_len(0), metadata_len(0), id(nullptr), embedding(nullptr), document(nullptr), metadata(nullptr), embedding_precision(PRECISION_FP32), embedding_code(nullptr) {}
 
 
 // Copy Constructor
 Data::Data(const Data& other) : id_len(other.id_len), embedding_len(other.embedding_len), document_len(other.document_len), metadata_len(other.metadata_len),
-    id(other.id), embedding(other.embedding), document(other.document), metadata(other.metadata)  {}
+    id(other.id), embedding(other.embedding), document(other.document), metadata(other.metadata), embedding_precision(other.embedding_precision),
+    embedding_code(other.embedding_code)  {}
 
 // Move Constructor
 Data::Data(Data&& other) noexcept : id_len(other.id_len), embedding_len(other.embedding_len), document_len(other.document_len), metadata_len(other.metadata_len),
-    id(std::move(other.id)), embedding(std::move(other.embedding)), document(std::move(other.document)), metadata(std::move(other.metadata)) {}
+    id(std::move(other.id)), embedding(std::move(other.embedding)), document(std::move(other.document)), metadata(std::move(other.metadata)),
+    embedding_precision(other.embedding_precision), embedding_code(std::move(other.embedding_code)) {}
 
 
 Data::Data(size_t id_len, size_t embedding_len, size_t document_len, size_t metadata_len, char *id, float *embedding, char *document, char *metadata)
-    : id_len(id_len), embedding_len(embedding_len), document_len(document_len), metadata_len(metadata_len) {
+    : id_len(id_len), embedding_len(embedding_len), document_len(document_len), metadata_len(metadata_len), embedding_precision(PRECISION_FP32) {
 
         this->id = std::shared_ptr<char[]>(new char[id_len]);
         this->embedding = std::shared_ptr<float[]>(new float[embedding_len]);
@@ -45,6 +47,8 @@ Data::Data(size_t id_len, size_t embedding_len, size_t document_len, size_t meta
         this->embedding = other.embedding;
         this->document = other.document;
         this->metadata = other.metadata;
+        this->embedding_precision = other.embedding_precision;
+        this->embedding_code = other.embedding_code;
     }
     return *this;
 }
@@ -61,6 +65,8 @@ Data& Data::operator=(Data&& other) noexcept {
         this->embedding = std::move(other.embedding);
         this->document = std::move(other.document);
         this->metadata = std::move(other.metadata);
+        this->embedding_precision = other.embedding_precision;
+        this->embedding_code = std::move(other.embedding_code);
     }
     return *this;
 }
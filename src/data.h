@@ -1,6 +1,8 @@
 #ifndef DATA_H
 #define DATA_H
 
+#include "embedding_codec.h"
+
 #include <memory>
 #include <cstddef>
 #include <iostream>
@@ -18,6 +20,11 @@ struct Data {
     std::shared_ptr<char[]> document;
     std::shared_ptr<char[]> metadata;
 
+    // Resident records whose embeddings are kept at reduced precision also carry the code as stored, and only have
+    // embedding set when it was decoded
+    EmbeddingPrecision embedding_precision;
+    std::shared_ptr<char[]> embedding_code;
+
     Data();
 
     Data(const Data& other);
@@ -36,4 +43,12 @@ struct Data {
     ~Data();
 };
 
+// Document and metadata of a vector, sent along with its embedding by ADD or UPSERT
+struct Payload {
+    size_t document_len = 0;
+    size_t metadata_len = 0;
+    std::shared_ptr<char[]> document;
+    std::shared_ptr<char[]> metadata;
+};
+
 #endif
\ No newline at end of file
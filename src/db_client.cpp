@@ -1,9 +1,13 @@
 #include "db_client.h"
 #include "data.h"
 #include "exceptions.h"
+#include "metrics.h"
 
+#include <cstdint>
+#include <cstring>
 #include <iostream>
 #include <memory>
+#include <stdexcept>
 
 #include <curl/curl.h>
 #include <rapidjson/document.h>
@@ -27,16 +31,31 @@ DBClient::DBClient(size_t d, std::shared_ptr<char[]> db_url) {
 
 DBClient::~DBClient() {}
 
+std::unique_ptr<cpr::Session> DBClient::acquire_session() {
+    std::lock_guard<std::mutex> lock(this->session_mutex);
+    if (this->idle_sessions.empty()) {
+        return std::make_unique<cpr::Session>();
+    }
+    std::unique_ptr<cpr::Session> session = std::move(this->idle_sessions.back());
+    this->idle_sessions.pop_back();
+    return session;
+}
+
+void DBClient::release_session(std::unique_ptr<cpr::Session> session) {
+    std::lock_guard<std::mutex> lock(this->session_mutex);
+    this->idle_sessions.push_back(std::move(session));
+}
+
 
 // Function to construct the JSON body from a vector of strings
-std::string constructJsonBody(const std::vector<std::string>& ids) {
+std::string constructJsonBody(const std::vector<std::string_view>& ids) {
     rapidjson::Document d;
     d.SetObject();
     rapidjson::Document::AllocatorType& allocator = d.GetAllocator();
 
     rapidjson::Value idArray(rapidjson::kArrayType);
     for (const auto& id : ids) {
-        idArray.PushBack(rapidjson::Value().SetString(id.c_str(), allocator), allocator);
+        idArray.PushBack(rapidjson::Value().SetString(id.data(), id.size(), allocator), allocator);
     }
 
     d.AddMember("ids", idArray, allocator);
@@ -49,7 +68,146 @@ std::string constructJsonBody(const std::vector<std::string>& ids) {
 }
 
 
-void DBClient::search(std::vector<std::string> ids, Data *x) {
+// Bounds checked reader over a binary proxy response
+struct BinaryReader {
+    const char *data;
+    size_t size;
+    size_t offset = 0;
+
+    BinaryReader(const std::string& body) : data(body.data()), size(body.size()) {}
+
+    const char *take(size_t n) {
+        if (n > this->size - this->offset) {
+            throw std::runtime_error("Binary proxy response is truncated");
+        }
+        const char *ptr = &this->data[this->offset];
+        this->offset += n;
+        return ptr;
+    }
+
+    uint64_t read_u64() {
+        uint64_t value;
+        std::memcpy(&value, this->take(sizeof(value)), sizeof(value));
+        return value;
+    }
+};
+
+// Decodes an application/octet-stream response. All values are little-endian:
+//     u64 n, u64 d
+//     n x (u64 id_len, id bytes)
+//     n x d float32 embeddings
+//     n x (u64 document_len, document bytes)
+//     n x (u64 metadata_len, metadata bytes)
+// Every record is copied into one block allocated for the whole response, with the embeddings at the front so
+// they stay aligned. The records' fields alias that block instead of owning separate allocations.
+size_t DBClient::decodeBinaryResponse(const std::string& body, size_t n_ids, Data *x) {
+    BinaryReader reader(body);
+    size_t n = reader.read_u64();
+    size_t d = reader.read_u64();
+    if (n > n_ids) {
+        throw std::runtime_error("Binary proxy response has more records than ids requested");
+    }
+
+    // First pass locates every field so the block can be sized
+    std::vector<std::pair<const char *, size_t>> strings(3 * n);
+    for (size_t i = 0; i < n; i++) {
+        size_t len = reader.read_u64();
+        strings[i] = {reader.take(len), len};
+    }
+    if (d != 0 && n > SIZE_MAX / sizeof(float) / d) {
+        throw std::runtime_error("Binary proxy response has an invalid embedding block");
+    }
+    const char *embeddings = reader.take(n * d * sizeof(float));
+    for (size_t i = n; i < 3 * n; i++) {
+        size_t len = reader.read_u64();
+        strings[i] = {reader.take(len), len};
+    }
+
+    size_t embeddingBytes = n * d * sizeof(float);
+    size_t blockSize = embeddingBytes;
+    for (const auto& str : strings) {
+        blockSize += str.second + 1;
+    }
+
+    std::shared_ptr<char[]> block(new char[blockSize]);
+    std::memcpy(block.get(), embeddings, embeddingBytes);
+    char *next = &block[embeddingBytes];
+    std::vector<std::shared_ptr<char[]>> fields(strings.size());
+    for (size_t i = 0; i < strings.size(); i++) {
+        std::memcpy(next, strings[i].first, strings[i].second);
+        next[strings[i].second] = '\0';
+        fields[i] = std::shared_ptr<char[]>(block, next);
+        next += strings[i].second + 1;
+    }
+
+    float *embeddingBlock = reinterpret_cast<float *>(block.get());
+    for (size_t i = 0; i < n; i++) {
+        x[i].id_len = strings[i].second;
+        x[i].id = fields[i];
+        x[i].embedding_len = d;
+        x[i].embedding = std::shared_ptr<float[]>(block, &embeddingBlock[i * d]);
+        x[i].document_len = strings[n + i].second;
+        x[i].document = fields[n + i];
+        x[i].metadata_len = strings[(2 * n) + i].second;
+        x[i].metadata = fields[(2 * n) + i];
+    }
+    return n;
+}
+
+size_t DBClient::decodeJsonResponse(const std::string& body, size_t n_ids, Data *x) {
+    rapidjson::Document document;
+    document.Parse(body.c_str());
+
+    size_t i = 0;
+    if (document.HasParseError()) {
+        std::cerr << "Parse error: " << document.GetParseError() << std::endl;
+    } else if (document.HasMember("results") && document["results"].IsArray()) {
+        if (document["results"].Size() > n_ids) {
+            throw std::runtime_error("JSON proxy response has more records than ids requested");
+        }
+        for (const auto& item : document["results"].GetArray()) {
+            if (item.HasMember("id") && item["id"].IsString()) {
+                const char* id_str = item["id"].GetString();
+                x[i].id_len = std::strlen(id_str);
+                x[i].id = std::shared_ptr<char[]>(new char[x[i].id_len + 1]);
+                std::strcpy(x[i].id.get(), id_str);
+            }
+            if (item.HasMember("embedding") && item["embedding"].IsArray()) {
+                x[i].embedding_len = item["embedding"].Size();
+                x[i].embedding = std::shared_ptr<float[]>(new float[x[i].embedding_len]);
+                size_t index = 0;
+                for (const auto& val : item["embedding"].GetArray()) {
+                    if (val.IsFloat()) {
+                        x[i].embedding[index++] = val.GetFloat();
+                    }
+                }
+            } else {
+                std::cerr << "document has no embedding associated with it" << std::endl;
+            }
+            if (item.HasMember("document") && item["document"].IsString()) {
+                const char* document_str = item["document"].GetString();
+                x[i].document_len = std::strlen(document_str);
+                x[i].document = std::shared_ptr<char[]>(new char[x[i].document_len + 1]);
+                std::strcpy(x[i].document.get(), document_str);
+            }
+            if (item.HasMember("metadata") && item["metadata"].IsString()) {
+                const char* metadata_str = item["metadata"].GetString();
+                x[i].metadata_len = std::strlen(metadata_str);
+                x[i].metadata = std::shared_ptr<char[]>(new char[x[i].metadata_len + 1]);
+                std::strcpy(x[i].metadata.get(), metadata_str);
+            }
+            i++;
+        }
+    } else {
+        std::cout << "JSON wasn't an array" << std::endl;
+    }
+    return i;
+}
+
+
+void DBClient::search(const std::vector<std::string_view>& ids, Data *x) {
+    ScopedLatency latency(metrics().db_fetch);
+    metrics().db_requests.fetch_add(1, std::memory_order_relaxed);
 
     // Get the url
     std::ostringstream urlStream;
@@ -60,67 +218,31 @@ void DBClient::search(std::vector<std::string> ids, Data *x) {
     std::string jsonBody = constructJsonBody(ids);
 
 
-    // Make a POST request
-    this->session.SetUrl(cpr::Url{url});
-    this->session.SetHeader(cpr::Header{{"Content-Type", "application/json"}});
-    this->session.SetBody(cpr::Body{jsonBody});
-    auto response = this->session.Post();
+    // Make a POST request. Proxies that support it answer with the binary format, others fall back to JSON.
+    std::unique_ptr<cpr::Session> session = this->acquire_session();
+    session->SetUrl(cpr::Url{url});
+    session->SetHeader(cpr::Header{{"Content-Type", "application/json"}, {"Accept", std::string(binary_content_type) + ", application/json;q=0.9"}});
+    session->SetBody(cpr::Body{jsonBody});
+    auto response = session->Post();
+    this->release_session(std::move(session));
 
     if (response.status_code != 200) {
         std::cerr << "Request response status: " << response.status_code << "\n";
         std::cerr << "response.text: " << response.text << std::endl;
         std::cerr << "Request failed. Error: " << response.error.message << std::endl;
+        metrics().db_errors.fetch_add(1, std::memory_order_relaxed);
 
         throw HttpException(response.status_code, "Request to vector db failed with status code: " + std::to_string(response.status_code));
-    } else {
-        rapidjson::Document document;
-        document.Parse(response.text.c_str());
-
-        if (document.HasParseError()) {
-            std::cerr << "Parse error: " << document.GetParseError() << std::endl;
-        } else if (document.HasMember("results") && document["results"].IsArray()) {
-            size_t i = 0;
-            for (const auto& item : document["results"].GetArray()) {
-                if (item.HasMember("id") && item["id"].IsString()) {
-                    const char* id_str = item["id"].GetString();
-                    x[i].id_len = std::strlen(id_str);
-                    x[i].id = std::shared_ptr<char[]>(new char[x[i].id_len + 1]);
-                    std::strcpy(x[i].id.get(), id_str);
-                }
-                if (item.HasMember("embedding") && item["embedding"].IsArray()) {
-                    x[i].embedding_len = item["embedding"].Size();
-                    x[i].embedding = std::shared_ptr<float[]>(new float[x[i].embedding_len]);
-                    size_t index = 0;
-                    for (const auto& val : item["embedding"].GetArray()) {
-                        if (val.IsFloat()) {
-                            x[i].embedding[index++] = val.GetFloat();
-                        }
-                    }
-                    assert(x[i].embedding.get() != nullptr);
-                } else {
-                    std::cerr << "document has no embedding associated with it" << std::endl;
-                    assert(x[i].embedding.get() != nullptr);
-                }
-                if (item.HasMember("document") && item["document"].IsString()) {
-                    const char* document_str = item["document"].GetString();
-                    x[i].document_len = std::strlen(document_str);
-                    x[i].document = std::shared_ptr<char[]>(new char[x[i].document_len + 1]);
-                    std::strcpy(x[i].document.get(), document_str);
-                }
-                if (item.HasMember("metadata") && item["metadata"].IsString()) {
-                    const char* metadata_str = item["metadata"].GetString();
-                    x[i].metadata_len = std::strlen(metadata_str);
-                    x[i].metadata = std::shared_ptr<char[]>(new char[x[i].metadata_len + 1]);
-                    std::strcpy(x[i].metadata.get(), metadata_str);
-                }
+    }
 
-                assert(x[i].embedding.get() != nullptr);
-                i++;
-            }
-        } else {
-            std::cout << "JSON wasn't an array" << std::endl;
-        }
+    size_t decoded;
+    auto contentType = response.header.find("Content-Type");
+    if (contentType != response.header.end() && contentType->second.rfind(binary_content_type, 0) == 0) {
+        decoded = decodeBinaryResponse(response.text, ids.size(), x);
+    } else {
+        decoded = decodeJsonResponse(response.text, ids.size(), x);
     }
+    metrics().db_records.fetch_add(decoded, std::memory_order_relaxed);
 }
 
 
@@ -141,8 +263,12 @@ void DBClient_Mock::loadDB(faiss::idx_t n, Data *data) {
     this->size = n;
 }
 
-void DBClient_Mock::search(std::vector<std::string> ids, Data *x) {
+void DBClient_Mock::search(const std::vector<std::string_view>& ids, Data *x) {
+    this->n_searches++;
     for (size_t i = 0; i < ids.size(); i++) {
-        new(&x[i]) Data(this->data_map[ids[i]]);
+        auto itr = this->data_map.find(std::string(ids[i]));
+        if (itr != this->data_map.end()) {
+            x[i] = itr->second;
+        }
     }
 }
\ No newline at end of file
@@ -4,28 +4,54 @@
 #include "data.h"
 
 #include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <atomic>
+#include <vector>
 
 #include <faiss/IndexFlat.h>
 #include <cpr/cpr.h>
 
 struct DBClient {
+    // Larger fetches are split into requests of at most max_batch_size ids, max_concurrent_requests at a time
+    static constexpr const size_t max_batch_size = 10000;
+    static constexpr const size_t max_concurrent_requests = 4;
+    // Content type of the binary response format proxies can answer with instead of JSON
+    static constexpr const char *binary_content_type = "application/octet-stream";
+
     size_t d;
     size_t size;
     std::shared_ptr<char[]> db_url;
-    cpr::Session session;
 
     DBClient(size_t d, std::shared_ptr<char[]> db_url);
     ~DBClient();      
-    virtual void search(std::vector<std::string> ids, Data *x);
+    virtual void search(const std::vector<std::string_view>& ids, Data *x);
+
+    // Decode a proxy's response into x, which has room for the n_ids records requested, and return how many
+    // records it held. Responses come from outside Periplus, so malformed ones throw instead of being read past.
+    static size_t decodeBinaryResponse(const std::string& body, size_t n_ids, Data *x);
+    static size_t decodeJsonResponse(const std::string& body, size_t n_ids, Data *x);
+
+private:
+    // cpr sessions can't be shared between threads, so each concurrent fetch borrows its own. Idle sessions
+    // are kept so later fetches can reuse their connections.
+    std::mutex session_mutex;
+    std::vector<std::unique_ptr<cpr::Session>> idle_sessions;
+
+    std::unique_ptr<cpr::Session> acquire_session();
+    void release_session(std::unique_ptr<cpr::Session> session);
 };
 
 
 struct DBClient_Mock : DBClient {
     std::unordered_map<std::string, Data> data_map; 
+    std::atomic<size_t> n_searches{0};
     
     DBClient_Mock(size_t d);
     void loadDB(faiss::idx_t n, Data *data);
-    void search(std::vector<std::string> ids, Data *x) override;
+    void search(const std::vector<std::string_view>& ids, Data *x) override;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,220 @@
+#include "disk_tier.h"
+#include "cell_store.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+
+static std::atomic<uint64_t> next_tier{0};
+
+DiskTier::DiskTier(const std::string& dir, size_t capacity, size_t segment_size)
+    : capacity(capacity), segment_size(segment_size), page_size(sysconf(_SC_PAGESIZE)) {
+    // Every tier gets its own subdirectory since a core replaced by INITIALIZE can outlive its replacement for a
+    // little while. Subdirectories left behind by earlier runs of the server are removed.
+    std::string pid = std::to_string(::getpid());
+    std::filesystem::create_directories(dir);
+    for (const auto& file : std::filesystem::directory_iterator(dir)) {
+        std::string name = file.path().filename().string();
+        if (name.rfind("tier-", 0) == 0 && name.rfind("tier-" + pid + "-", 0) != 0) {
+            std::filesystem::remove_all(file.path());
+        }
+    }
+    this->dir = dir + "/tier-" + pid + "-" + std::to_string(next_tier++);
+    std::filesystem::create_directories(this->dir);
+    this->segments[this->current_segment] = Segment();
+}
+
+DiskTier::~DiskTier() {
+    std::error_code ec;
+    std::filesystem::remove_all(this->dir, ec);
+}
+
+std::string DiskTier::segmentPath(uint64_t segment) const {
+    return this->dir + "/segment-" + std::to_string(segment);
+}
+
+uint64_t DiskTier::ticket() {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    return this->drops;
+}
+
+// Layout of an entry: ids (n x idx_t), codes (n x code_size), padding to a cache line, then the arena
+bool DiskTier::put(faiss::idx_t cell, size_t members, size_t n, const faiss::idx_t *ids, const uint8_t *codes, size_t code_size, const CellArena& arena,
+    uint64_t ticket) {
+    size_t idsBytes = sizeof(faiss::idx_t) * n;
+    size_t codesBytes = code_size * n;
+    size_t arenaOffset = ((idsBytes + codesBytes + 63) / 64) * 64;
+    size_t length = arenaOffset + arena.bytes;
+
+    std::lock_guard<std::mutex> lock(this->mutex);
+    auto dropped = this->dropped_at.find(cell);
+    if (dropped != this->dropped_at.end() && dropped->second > ticket) {
+        return false;
+    }
+    this->dropLocked(cell);
+    if (length > this->capacity) {
+        return false;
+    }
+
+    // Entries start on a page boundary, and go into a new segment when they'd take the current one past its size
+    Segment *segment = nullptr;
+    size_t offset = 0;
+    size_t growth = 0;
+    auto place = [&]() {
+        segment = &this->segments[this->current_segment];
+        offset = ((segment->size + this->page_size - 1) / this->page_size) * this->page_size;
+        if (segment->size > 0 && offset + length > this->segment_size) {
+            this->current_segment++;
+            segment = &this->segments[this->current_segment];
+            offset = 0;
+        }
+        growth = offset + length - segment->size;
+    };
+    place();
+
+    // Make room by dropping the segment of the least recently used cell. Only a segment with no live cells left is
+    // removed, so all of its cells go. Dropping can empty and truncate the current segment, so the entry is placed
+    // again after each one.
+    while (this->disk_bytes + growth > this->capacity && !this->entries.empty()) {
+        auto lru = std::min_element(this->entries.begin(), this->entries.end(), [](const auto& a, const auto& b) {
+            return a.second.last_used < b.second.last_used;
+        });
+        uint64_t victim = lru->second.segment;
+        for (auto itr = this->entries.begin(); itr != this->entries.end();) {
+            auto next = std::next(itr);
+            if (itr->second.segment == victim) {
+                this->dropLocked(itr->first);
+            }
+            itr = next;
+        }
+        place();
+    }
+    if (this->disk_bytes + growth > this->capacity) {
+        return false;
+    }
+
+    int fd = ::open(this->segmentPath(this->current_segment).c_str(), O_WRONLY | O_CREAT, 0644);
+    if (fd == -1) {
+        throw std::runtime_error("Failed to open disk tier segment " + this->segmentPath(this->current_segment));
+    }
+    auto writeAt = [fd, this](const void *data, size_t bytes, size_t at) {
+        const char *ptr = static_cast<const char *>(data);
+        while (bytes > 0) {
+            ssize_t written = ::pwrite(fd, ptr, bytes, at);
+            if (written <= 0) {
+                ::close(fd);
+                throw std::runtime_error("Failed to write disk tier segment " + this->segmentPath(this->current_segment));
+            }
+            ptr += written;
+            bytes -= written;
+            at += written;
+        }
+    };
+    writeAt(ids, idsBytes, offset);
+    writeAt(codes, codesBytes, offset + idsBytes);
+    writeAt(arena.block.get(), arena.bytes, offset + arenaOffset);
+    ::close(fd);
+
+    segment->size = offset + length;
+    segment->live += length;
+    this->disk_bytes += growth;
+    this->entries[cell] = Entry{this->current_segment, offset, length, members, n, arena.d, arena.precision, code_size, arenaOffset, arena.bytes, this->clock++};
+    return true;
+}
+
+std::shared_ptr<DiskCell> DiskTier::get(faiss::idx_t cell) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    auto itr = this->entries.find(cell);
+    if (itr == this->entries.end()) {
+        return nullptr;
+    }
+    Entry& entry = itr->second;
+    entry.last_used = this->clock++;
+
+    int fd = ::open(this->segmentPath(entry.segment).c_str(), O_RDONLY);
+    if (fd == -1) {
+        std::cerr << "Failed to open disk tier segment " << this->segmentPath(entry.segment) << std::endl;
+        this->dropLocked(cell);
+        return nullptr;
+    }
+    // Mapped privately so the arena can be written to like one built in memory
+    void *data = ::mmap(nullptr, std::max<size_t>(entry.length, 1), PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, entry.offset);
+    ::close(fd);
+    if (data == MAP_FAILED) {
+        std::cerr << "Failed to map cell " << cell << " from the disk tier" << std::endl;
+        this->dropLocked(cell);
+        return nullptr;
+    }
+    size_t length = std::max<size_t>(entry.length, 1);
+    std::shared_ptr<char[]> mapping(static_cast<char *>(data), [length](char *ptr) { ::munmap(ptr, length); });
+
+    std::shared_ptr<DiskCell> diskCell = std::make_shared<DiskCell>();
+    diskCell->n = entry.n;
+    diskCell->code_size = entry.code_size;
+    diskCell->members = entry.members;
+    diskCell->ids = reinterpret_cast<const faiss::idx_t *>(mapping.get());
+    diskCell->codes = reinterpret_cast<const uint8_t *>(&mapping[sizeof(faiss::idx_t) * entry.n]);
+    diskCell->arena = std::make_shared<CellArena>(entry.d, entry.n, entry.arena_bytes,
+        std::shared_ptr<char[]>(mapping, &mapping[entry.arena_offset]), entry.precision);
+    return diskCell;
+}
+
+bool DiskTier::contains(faiss::idx_t cell) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    return this->entries.find(cell) != this->entries.end();
+}
+
+void DiskTier::drop(faiss::idx_t cell) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->dropped_at[cell] = ++this->drops;
+    this->dropLocked(cell);
+}
+
+size_t DiskTier::bytes() {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    return this->disk_bytes;
+}
+
+size_t DiskTier::cells() {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    return this->entries.size();
+}
+
+void DiskTier::dropLocked(faiss::idx_t cell) {
+    auto itr = this->entries.find(cell);
+    if (itr == this->entries.end()) {
+        return;
+    }
+    uint64_t segmentId = itr->second.segment;
+    Segment& segment = this->segments[segmentId];
+    segment.live -= itr->second.length;
+    this->entries.erase(itr);
+
+    if (segment.live == 0) {
+        if (segmentId == this->current_segment) {
+            // Nothing in the current segment is live anymore, so it's truncated and reused
+            this->disk_bytes -= segment.size;
+            segment.size = 0;
+            std::remove(this->segmentPath(segmentId).c_str());
+        } else {
+            this->removeSegmentLocked(segmentId);
+        }
+    }
+}
+
+void DiskTier::removeSegmentLocked(uint64_t segment) {
+    this->disk_bytes -= this->segments[segment].size;
+    this->segments.erase(segment);
+    std::remove(this->segmentPath(segment).c_str());
+}
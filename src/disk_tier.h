@@ -0,0 +1,102 @@
+/*
+The disk tier is an optional second tier of the cache on local disk. When a cell is evicted from memory, its inverted
+list (ids and codes) and its arena are appended to a segment file, and a later load maps them back and installs them
+without a database round trip or any parsing. Segments are append-only: replacing or dropping a cell only marks its
+old copy dead, and a segment file is deleted once none of the cells in it are live. The tier has its own capacity,
+counted in segment file bytes. Since dropping a cell only frees space once its whole segment is dead, the tier makes
+room by dropping every cell of the segment holding the least recently used cell.
+*/
+
+#ifndef DISK_TIER_H
+#define DISK_TIER_H
+
+#include "cell_store.h"
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include <faiss/Index.h>
+
+// A cell mapped back from a segment file. The pointers stay valid for as long as the DiskCell is alive, even if the
+// cell is dropped from the tier in the meantime.
+struct DiskCell {
+    size_t n = 0;
+    size_t code_size = 0;
+    // Number of ids the directory had for the cell when it was written, to tell whether ADD has changed it since
+    size_t members = 0;
+    const faiss::idx_t *ids = nullptr;
+    const uint8_t *codes = nullptr;
+    std::shared_ptr<CellArena> arena;
+};
+
+class DiskTier {
+public:
+    static constexpr const size_t default_segment_size = 256 * 1024 * 1024;
+
+    // Segments are kept in a subdirectory of dir. Segments left in dir by a previous run are removed, a restarted
+    // server can't trust them.
+    DiskTier(const std::string& dir, size_t capacity, size_t segment_size = default_segment_size);
+    ~DiskTier();
+
+    // Taken when a copy of a cell is made to be put later. The put is refused if the cell was dropped in between,
+    // since the copy may hold records which were removed.
+    uint64_t ticket();
+    // Appends the cell to the current segment, replacing an older copy of it. Returns false if the cell doesn't
+    // fit in the tier at all, or was dropped since the ticket was taken.
+    bool put(faiss::idx_t cell, size_t members, size_t n, const faiss::idx_t *ids, const uint8_t *codes, size_t code_size, const CellArena& arena,
+        uint64_t ticket);
+    // Maps the cell back, or returns null if it isn't on disk
+    std::shared_ptr<DiskCell> get(faiss::idx_t cell);
+    bool contains(faiss::idx_t cell);
+    void drop(faiss::idx_t cell);
+
+    // Bytes of segment files on disk, dead copies included
+    size_t bytes();
+    size_t cells();
+
+private:
+    struct Entry {
+        uint64_t segment;
+        size_t offset;
+        size_t length;
+        size_t members;
+        size_t n;
+        size_t d;
+        EmbeddingPrecision precision;
+        size_t code_size;
+        size_t arena_offset;
+        size_t arena_bytes;
+        uint64_t last_used;
+    };
+
+    struct Segment {
+        size_t size = 0;
+        size_t live = 0;
+    };
+
+    std::string dir;
+    size_t capacity;
+    size_t segment_size;
+    // Entries start on a page boundary so each one can be mapped on its own
+    size_t page_size;
+
+    std::mutex mutex;
+    std::unordered_map<faiss::idx_t, Entry> entries;
+    std::unordered_map<uint64_t, Segment> segments;
+    uint64_t current_segment = 0;
+    size_t disk_bytes = 0;
+    uint64_t clock = 0;
+    // Number of drops so far, and the count at each cell's last drop
+    uint64_t drops = 0;
+    std::unordered_map<faiss::idx_t, uint64_t> dropped_at;
+
+    std::string segmentPath(uint64_t segment) const;
+    // Caller must hold the mutex
+    void dropLocked(faiss::idx_t cell);
+    void removeSegmentLocked(uint64_t segment);
+};
+
+#endif
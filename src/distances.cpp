@@ -0,0 +1,157 @@
+#include "distances.h"
+
+#include <cstddef>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define PERIPLUS_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+
+static float l2SqrScalar(const float *x, const float *y, size_t d) {
+    float sum = 0;
+    for (size_t i = 0; i < d; i++) {
+        float diff = x[i] - y[i];
+        sum += diff * diff;
+    }
+    return sum;
+}
+
+static float innerProductScalar(const float *x, const float *y, size_t d) {
+    float sum = 0;
+    for (size_t i = 0; i < d; i++) {
+        sum += x[i] * y[i];
+    }
+    return sum;
+}
+
+#ifdef PERIPLUS_X86_KERNELS
+
+// The kernels below are compiled for their instruction set with target attributes and only called once the CPU is
+// known to support it. The tail which doesn't fill a register is handled with the scalar kernel.
+
+__attribute__((target("avx2,fma")))
+static float horizontalSum(__m256 v) {
+    __m128 sum = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+    sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+    return _mm_cvtss_f32(sum);
+}
+
+__attribute__((target("avx2,fma")))
+static float l2SqrAvx2(const float *x, const float *y, size_t d) {
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= d; i += 16) {
+        __m256 diff0 = _mm256_sub_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i));
+        __m256 diff1 = _mm256_sub_ps(_mm256_loadu_ps(x + i + 8), _mm256_loadu_ps(y + i + 8));
+        acc0 = _mm256_fmadd_ps(diff0, diff0, acc0);
+        acc1 = _mm256_fmadd_ps(diff1, diff1, acc1);
+    }
+    for (; i + 8 <= d; i += 8) {
+        __m256 diff = _mm256_sub_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i));
+        acc0 = _mm256_fmadd_ps(diff, diff, acc0);
+    }
+    return horizontalSum(_mm256_add_ps(acc0, acc1)) + l2SqrScalar(x + i, y + i, d - i);
+}
+
+__attribute__((target("avx2,fma")))
+static float innerProductAvx2(const float *x, const float *y, size_t d) {
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= d; i += 16) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i), acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i + 8), _mm256_loadu_ps(y + i + 8), acc1);
+    }
+    for (; i + 8 <= d; i += 8) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i), acc0);
+    }
+    return horizontalSum(_mm256_add_ps(acc0, acc1)) + innerProductScalar(x + i, y + i, d - i);
+}
+
+// _mm512_reduce_add_ps trips -Wuninitialized inside some versions of GCC's headers, so the lanes are summed by hand
+__attribute__((target("avx512f")))
+static float horizontalSum(__m512 v) {
+    alignas(64) float lanes[16];
+    _mm512_store_ps(lanes, v);
+    float sum = 0;
+    for (float lane : lanes) {
+        sum += lane;
+    }
+    return sum;
+}
+
+__attribute__((target("avx512f")))
+static float l2SqrAvx512(const float *x, const float *y, size_t d) {
+    __m512 acc = _mm512_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= d; i += 16) {
+        __m512 diff = _mm512_sub_ps(_mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i));
+        acc = _mm512_fmadd_ps(diff, diff, acc);
+    }
+    if (i < d) {
+        // Masked loads cover the tail without reading past the end of either vector
+        __mmask16 mask = (__mmask16)((1u << (d - i)) - 1);
+        __m512 diff = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, x + i), _mm512_maskz_loadu_ps(mask, y + i));
+        acc = _mm512_fmadd_ps(diff, diff, acc);
+    }
+    return horizontalSum(acc);
+}
+
+__attribute__((target("avx512f")))
+static float innerProductAvx512(const float *x, const float *y, size_t d) {
+    __m512 acc = _mm512_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= d; i += 16) {
+        acc = _mm512_fmadd_ps(_mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i), acc);
+    }
+    if (i < d) {
+        __mmask16 mask = (__mmask16)((1u << (d - i)) - 1);
+        acc = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, x + i), _mm512_maskz_loadu_ps(mask, y + i), acc);
+    }
+    return horizontalSum(acc);
+}
+
+#endif
+
+typedef float (*DistanceKernel)(const float *, const float *, size_t);
+
+struct DistanceKernels {
+    const char *name = "scalar";
+    DistanceKernel l2Sqr = l2SqrScalar;
+    DistanceKernel innerProduct = innerProductScalar;
+
+    DistanceKernels() {
+#ifdef PERIPLUS_X86_KERNELS
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f")) {
+            this->name = "avx512";
+            this->l2Sqr = l2SqrAvx512;
+            this->innerProduct = innerProductAvx512;
+        } else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+            this->name = "avx2";
+            this->l2Sqr = l2SqrAvx2;
+            this->innerProduct = innerProductAvx2;
+        }
+#endif
+    }
+};
+
+static const DistanceKernels& kernels() {
+    static const DistanceKernels kernels;
+    return kernels;
+}
+
+float l2Sqr(const float *x, const float *y, size_t d) {
+    return kernels().l2Sqr(x, y, d);
+}
+
+float innerProduct(const float *x, const float *y, size_t d) {
+    return kernels().innerProduct(x, y, d);
+}
+
+const char *distanceKernel() {
+    return kernels().name;
+}
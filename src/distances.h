@@ -0,0 +1,21 @@
+/*
+Exact distance kernels used to re-rank the candidates of a quantized search against the full precision embeddings
+in the cell store. On x86 the AVX-512 or AVX2 kernel is picked at startup based on what the CPU supports, so the
+binary doesn't need to be built for a particular machine. Everything else uses the scalar kernel.
+*/
+
+#ifndef DISTANCES_H
+#define DISTANCES_H
+
+#include <cstddef>
+
+// Squared L2 distance between two vectors of d floats
+float l2Sqr(const float *x, const float *y, size_t d);
+
+// Inner product of two vectors of d floats
+float innerProduct(const float *x, const float *y, size_t d);
+
+// Name of the kernels in use: "avx512", "avx2" or "scalar"
+const char *distanceKernel();
+
+#endif
@@ -2,12 +2,15 @@
 
 #include <iostream>
 #include <memory>
+#include <thread>
 #include <asio.hpp>
 
 
 int main(int argc, char *argv[]) {
     bool help = false;
     short port = 13;
+    unsigned int nThreads = std::thread::hardware_concurrency();
+    CacheConfig config;
 
     for (int i = 1; i < argc; ++i) {
         if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
@@ -19,24 +22,70 @@ int main(int argc, char *argv[]) {
                 std::cerr << "-p option requires one argument." << std::endl;
                 return 1;
             }
+        } else if (strcmp(argv[i], "-t") == 0) {
+            if (i + 1 < argc) {
+                nThreads = static_cast<unsigned int>(std::stoi(argv[++i]));
+            } else {
+                std::cerr << "-t option requires one argument." << std::endl;
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-f") == 0) {
+            if (i + 1 < argc) {
+                config.fetch_threads = static_cast<size_t>(std::stoi(argv[++i]));
+            } else {
+                std::cerr << "-f option requires one argument." << std::endl;
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-r") == 0) {
+            if (i + 1 < argc) {
+                config.restore_path = argv[++i];
+            } else {
+                std::cerr << "-r option requires one argument." << std::endl;
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-d") == 0) {
+            if (i + 1 < argc) {
+                config.disk_tier_path = argv[++i];
+            } else {
+                std::cerr << "-d option requires one argument." << std::endl;
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-D") == 0) {
+            if (i + 1 < argc) {
+                config.disk_tier_capacity = static_cast<size_t>(std::stoull(argv[++i]));
+            } else {
+                std::cerr << "-D option requires one argument." << std::endl;
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-m") == 0) {
+            if (i + 1 < argc) {
+                config.metrics_port = static_cast<unsigned short>(std::stoi(argv[++i]));
+            } else {
+                std::cerr << "-m option requires one argument." << std::endl;
+                return 1;
+            }
         }
     }
 
     if (help) {
-        std::cout << "Usage: ./program [-p port] [-h]" << std::endl;
+        std::cout << "Usage: ./program [-p port] [-t threads] [-f fetch_threads] [-r snapshot_dir] [-d disk_tier_dir] [-D disk_tier_mb] [-m metrics_port] [-h]" << std::endl;
         return 0;
     }
 
+    // hardware_concurrency is allowed to return 0 when it can't be determined
+    if (nThreads == 0) {
+        nThreads = 1;
+    }
+
     try {
         asio::io_context io_context;
 
         // Need to give io_context work before calling run
-        TcpServer server(io_context, port);
-        std::cout << "Periplus starting up on port: " << port << std::endl;
+        TcpServer server(io_context, port, config);
+        std::cout << "Periplus starting up on port: " << port << " with " << nThreads << " threads" << std::endl;
 
         std::vector<std::thread> threads;
-        // TODO: Enable multithreading (requires synchronization)
-        for(int i = 0; i < 1 /* std::thread::hardware_concurrency()*/; ++i) {
+        for(unsigned int i = 0; i < nThreads; ++i) {
             threads.emplace_back([&io_context](){
                 io_context.run();
             });
@@ -0,0 +1,234 @@
+#include "embedding_codec.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define PERIPLUS_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+
+// Float to half with round to nearest even, handling subnormals, infinities and NaN
+static uint16_t floatToHalf(float value) {
+    const uint32_t infinity = 255u << 23;
+    const uint32_t halfOverflow = (127u + 16) << 23;
+    const uint32_t denormMagic = ((127u - 15) + (23 - 10) + 1) << 23;
+    uint32_t f;
+    std::memcpy(&f, &value, sizeof(f));
+    uint32_t sign = f & 0x80000000u;
+    f ^= sign;
+
+    uint16_t half;
+    if (f >= halfOverflow) {
+        half = f > infinity ? 0x7e00 : 0x7c00;
+    } else if (f < (113u << 23)) {
+        // Adding the magic number lines the mantissa up with a half subnormal and rounds it
+        float shifted;
+        float magic;
+        std::memcpy(&shifted, &f, sizeof(f));
+        std::memcpy(&magic, &denormMagic, sizeof(magic));
+        shifted += magic;
+        std::memcpy(&f, &shifted, sizeof(f));
+        half = f - denormMagic;
+    } else {
+        uint32_t mantissaOdd = (f >> 13) & 1;
+        f += ((uint32_t)(15 - 127) << 23) + 0xfff;
+        f += mantissaOdd;
+        half = f >> 13;
+    }
+    return (sign >> 16) | half;
+}
+
+static float halfToFloat(uint16_t half) {
+    const uint32_t shiftedExponent = 0x7c00u << 13;
+    uint32_t f = (half & 0x7fffu) << 13;
+    uint32_t exponent = shiftedExponent & f;
+    f += (127u - 15) << 23;
+    if (exponent == shiftedExponent) {
+        // Infinity or NaN
+        f += (128u - 16) << 23;
+    } else if (exponent == 0) {
+        // Subnormal, renormalized by subtracting the implicit bit back out
+        const uint32_t magicBits = 113u << 23;
+        float magic;
+        float value;
+        f += 1u << 23;
+        std::memcpy(&magic, &magicBits, sizeof(magic));
+        std::memcpy(&value, &f, sizeof(f));
+        value -= magic;
+        std::memcpy(&f, &value, sizeof(f));
+    }
+    f |= (uint32_t)(half & 0x8000u) << 16;
+    float value;
+    std::memcpy(&value, &f, sizeof(value));
+    return value;
+}
+
+// Float to bf16 with round to nearest even, keeping NaN a NaN
+static uint16_t floatToBfloat(float value) {
+    uint32_t f;
+    std::memcpy(&f, &value, sizeof(f));
+    if ((f & 0x7fffffffu) > 0x7f800000u) {
+        return (f >> 16) | 0x40;
+    }
+    f += 0x7fff + ((f >> 16) & 1);
+    return f >> 16;
+}
+
+static float bfloatToFloat(uint16_t bfloat) {
+    uint32_t f = (uint32_t)bfloat << 16;
+    float value;
+    std::memcpy(&value, &f, sizeof(value));
+    return value;
+}
+
+static void decodeHalfScalar(const uint16_t *code, size_t d, float *x) {
+    for (size_t i = 0; i < d; i++) {
+        x[i] = halfToFloat(code[i]);
+    }
+}
+
+static void decodeBfloatScalar(const uint16_t *code, size_t d, float *x) {
+    for (size_t i = 0; i < d; i++) {
+        x[i] = bfloatToFloat(code[i]);
+    }
+}
+
+static void decodeInt8Scalar(const int8_t *code, float scale, size_t d, float *x) {
+    for (size_t i = 0; i < d; i++) {
+        x[i] = code[i] * scale;
+    }
+}
+
+#ifdef PERIPLUS_X86_KERNELS
+
+// Compiled for AVX2 with target attributes and only called once the CPU is known to support it. The tail which
+// doesn't fill a register is handled with the scalar kernel.
+
+__attribute__((target("avx2,f16c")))
+static void decodeHalfAvx2(const uint16_t *code, size_t d, float *x) {
+    size_t i = 0;
+    for (; i + 8 <= d; i += 8) {
+        __m128i half = _mm_loadu_si128(reinterpret_cast<const __m128i *>(code + i));
+        _mm256_storeu_ps(x + i, _mm256_cvtph_ps(half));
+    }
+    decodeHalfScalar(code + i, d - i, x + i);
+}
+
+__attribute__((target("avx2")))
+static void decodeBfloatAvx2(const uint16_t *code, size_t d, float *x) {
+    size_t i = 0;
+    for (; i + 8 <= d; i += 8) {
+        __m256i widened = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(code + i)));
+        _mm256_storeu_ps(x + i, _mm256_castsi256_ps(_mm256_slli_epi32(widened, 16)));
+    }
+    decodeBfloatScalar(code + i, d - i, x + i);
+}
+
+__attribute__((target("avx2")))
+static void decodeInt8Avx2(const int8_t *code, float scale, size_t d, float *x) {
+    __m256 scales = _mm256_set1_ps(scale);
+    size_t i = 0;
+    for (; i + 8 <= d; i += 8) {
+        __m256i widened = _mm256_cvtepi8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(code + i)));
+        _mm256_storeu_ps(x + i, _mm256_mul_ps(_mm256_cvtepi32_ps(widened), scales));
+    }
+    decodeInt8Scalar(code + i, scale, d - i, x + i);
+}
+
+#endif
+
+struct CodecKernels {
+    const char *name = "scalar";
+    void (*decodeHalf)(const uint16_t *, size_t, float *) = decodeHalfScalar;
+    void (*decodeBfloat)(const uint16_t *, size_t, float *) = decodeBfloatScalar;
+    void (*decodeInt8)(const int8_t *, float, size_t, float *) = decodeInt8Scalar;
+
+    CodecKernels() {
+#ifdef PERIPLUS_X86_KERNELS
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("f16c")) {
+            this->name = "avx2";
+            this->decodeHalf = decodeHalfAvx2;
+            this->decodeBfloat = decodeBfloatAvx2;
+            this->decodeInt8 = decodeInt8Avx2;
+        }
+#endif
+    }
+};
+
+static const CodecKernels& kernels() {
+    static const CodecKernels kernels;
+    return kernels;
+}
+
+size_t embeddingCodeSize(size_t d, EmbeddingPrecision precision) {
+    switch (precision) {
+    case PRECISION_FP16:
+    case PRECISION_BF16:
+        return sizeof(uint16_t) * d;
+    case PRECISION_INT8:
+        return sizeof(float) + d;
+    default:
+        return sizeof(float) * d;
+    }
+}
+
+void encodeEmbedding(const float *x, size_t d, EmbeddingPrecision precision, char *code) {
+    switch (precision) {
+    case PRECISION_FP16:
+        for (size_t i = 0; i < d; i++) {
+            uint16_t half = floatToHalf(x[i]);
+            std::memcpy(code + (i * sizeof(half)), &half, sizeof(half));
+        }
+        break;
+    case PRECISION_BF16:
+        for (size_t i = 0; i < d; i++) {
+            uint16_t bfloat = floatToBfloat(x[i]);
+            std::memcpy(code + (i * sizeof(bfloat)), &bfloat, sizeof(bfloat));
+        }
+        break;
+    case PRECISION_INT8: {
+        float largest = 0;
+        for (size_t i = 0; i < d; i++) {
+            largest = std::max(largest, std::fabs(x[i]));
+        }
+        float scale = largest / 127;
+        std::memcpy(code, &scale, sizeof(scale));
+        int8_t *components = reinterpret_cast<int8_t *>(code + sizeof(scale));
+        for (size_t i = 0; i < d; i++) {
+            components[i] = scale > 0 ? (int8_t)std::clamp(std::lrint(x[i] / scale), -127L, 127L) : 0;
+        }
+        break;
+    }
+    default:
+        std::memcpy(code, x, sizeof(float) * d);
+    }
+}
+
+void decodeEmbedding(const char *code, size_t d, EmbeddingPrecision precision, float *x) {
+    switch (precision) {
+    case PRECISION_FP16:
+        kernels().decodeHalf(reinterpret_cast<const uint16_t *>(code), d, x);
+        break;
+    case PRECISION_BF16:
+        kernels().decodeBfloat(reinterpret_cast<const uint16_t *>(code), d, x);
+        break;
+    case PRECISION_INT8: {
+        float scale;
+        std::memcpy(&scale, code, sizeof(scale));
+        kernels().decodeInt8(reinterpret_cast<const int8_t *>(code + sizeof(scale)), scale, d, x);
+        break;
+    }
+    default:
+        std::memcpy(x, code, sizeof(float) * d);
+    }
+}
+
+const char *embeddingCodecKernel() {
+    return kernels().name;
+}
@@ -0,0 +1,35 @@
+/*
+Encodings for the copy of each resident embedding kept in the cell arenas alongside the index codes. Besides full
+precision floats, embeddings can be kept as fp16, as bf16 (the upper half of a float, so the same range with less
+precision), or as int8 with a per-vector scale, which take a half or a quarter of the memory. Codes are decoded back
+to floats when a search returns embeddings or re-ranks by exact distance. As with the distance kernels, decoding on
+x86 uses AVX2 (with F16C for fp16) when the CPU supports it, picked at startup, and scalar code otherwise.
+*/
+
+#ifndef EMBEDDING_CODEC_H
+#define EMBEDDING_CODEC_H
+
+#include <cstddef>
+#include <cstdint>
+
+enum EmbeddingPrecision : uint8_t {
+    PRECISION_FP32,
+    PRECISION_FP16,
+    PRECISION_BF16,
+    // Each component is rounded to a multiple of the vector's largest magnitude / 127. The code is the float scale
+    // followed by the d components.
+    PRECISION_INT8
+};
+
+// Bytes the code of one embedding of d dimensions takes
+size_t embeddingCodeSize(size_t d, EmbeddingPrecision precision);
+
+// fp16 and bf16 codes must be 2 byte aligned, int8 codes can be anywhere
+void encodeEmbedding(const float *x, size_t d, EmbeddingPrecision precision, char *code);
+
+void decodeEmbedding(const char *code, size_t d, EmbeddingPrecision precision, float *x);
+
+// Name of the decoding kernels in use: "avx2" or "scalar"
+const char *embeddingCodecKernel();
+
+#endif
@@ -0,0 +1,50 @@
+#include "eviction_policy.h"
+
+#include <algorithm>
+#include <memory>
+#include <stdexcept>
+
+
+std::unique_ptr<EvictionPolicy> EvictionPolicy::create(EvictionPolicyType type) {
+    switch (type) {
+        case LRU:
+            return std::make_unique<LRUPolicy>();
+        case LFU:
+            return std::make_unique<LFUPolicy>();
+        case TWO_Q:
+            return std::make_unique<TwoQPolicy>();
+        default:
+            throw std::invalid_argument("Unknown eviction policy: " + std::to_string(type));
+    }
+}
+
+void LRUPolicy::rank(std::vector<faiss::idx_t>& cells, const CellStats *stats) const {
+    std::sort(cells.begin(), cells.end(), [stats](faiss::idx_t a, faiss::idx_t b) {
+        return stats[a].last_access.load(std::memory_order_relaxed) < stats[b].last_access.load(std::memory_order_relaxed);
+    });
+}
+
+void LFUPolicy::rank(std::vector<faiss::idx_t>& cells, const CellStats *stats) const {
+    std::sort(cells.begin(), cells.end(), [stats](faiss::idx_t a, faiss::idx_t b) {
+        uint64_t aAccesses = stats[a].accesses.load(std::memory_order_relaxed);
+        uint64_t bAccesses = stats[b].accesses.load(std::memory_order_relaxed);
+        if (aAccesses != bAccesses) {
+            return aAccesses < bAccesses;
+        }
+        return stats[a].last_access.load(std::memory_order_relaxed) < stats[b].last_access.load(std::memory_order_relaxed);
+    });
+}
+
+void TwoQPolicy::rank(std::vector<faiss::idx_t>& cells, const CellStats *stats) const {
+    std::sort(cells.begin(), cells.end(), [stats](faiss::idx_t a, faiss::idx_t b) {
+        bool aProbation = stats[a].accesses.load(std::memory_order_relaxed) == 0;
+        bool bProbation = stats[b].accesses.load(std::memory_order_relaxed) == 0;
+        if (aProbation != bProbation) {
+            return aProbation;
+        }
+        if (aProbation) {
+            return stats[a].loaded_at < stats[b].loaded_at;
+        }
+        return stats[a].last_access.load(std::memory_order_relaxed) < stats[b].last_access.load(std::memory_order_relaxed);
+    });
+}
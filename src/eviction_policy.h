@@ -0,0 +1,61 @@
+/*
+Eviction policies decide which resident cells to give up when loading more cells would take Periplus over its
+memory budget. Core::search records how each cell is used in its CellStats, and a policy ranks the resident
+cells by those stats. The stats are atomics so searches can record them while only holding a shared lock.
+*/
+
+#ifndef EVICTION_POLICY_H
+#define EVICTION_POLICY_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <faiss/Index.h>
+
+enum EvictionPolicyType : uint8_t {
+    LRU,
+    LFU,
+    TWO_Q
+};
+
+struct CellStats {
+    // Ticks of the core's access clock
+    uint64_t loaded_at = 0;
+    std::atomic<uint64_t> last_access{0};
+    // Number of searches which have used the cell since it was loaded
+    std::atomic<uint64_t> accesses{0};
+};
+
+struct EvictionPolicy {
+    // Orders the cells so the ones to evict first come first
+    virtual void rank(std::vector<faiss::idx_t>& cells, const CellStats *stats) const = 0;
+    virtual EvictionPolicyType type() const = 0;
+    virtual ~EvictionPolicy() {}
+
+    static std::unique_ptr<EvictionPolicy> create(EvictionPolicyType type);
+};
+
+// Evicts the cell that was searched least recently
+struct LRUPolicy : EvictionPolicy {
+    void rank(std::vector<faiss::idx_t>& cells, const CellStats *stats) const override;
+    EvictionPolicyType type() const override { return LRU; }
+};
+
+// Evicts the cell that has been searched the fewest times since it was loaded, least recently used first on ties
+struct LFUPolicy : EvictionPolicy {
+    void rank(std::vector<faiss::idx_t>& cells, const CellStats *stats) const override;
+    EvictionPolicyType type() const override { return LFU; }
+};
+
+// Simplified 2Q. Cells that haven't been searched since they were loaded sit in a probationary FIFO queue and are
+// evicted first, oldest load first, so one-off loads can't flush the cells that are actually being searched.
+// The remaining cells are evicted in LRU order.
+struct TwoQPolicy : EvictionPolicy {
+    void rank(std::vector<faiss::idx_t>& cells, const CellStats *stats) const override;
+    EvictionPolicyType type() const override { return TWO_Q; }
+};
+
+#endif
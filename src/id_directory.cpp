@@ -0,0 +1,290 @@
+#include "id_directory.h"
+
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+
+IdDirectory::IdDirectory(size_t nCells) : slots(1024, empty_slot), cells(nCells) {}
+
+// FNV-1a
+uint64_t IdDirectory::hash(std::string_view id) {
+    uint64_t h = 14695981039346656037ULL;
+    for (char c : id) {
+        h ^= static_cast<unsigned char>(c);
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+faiss::idx_t IdDirectory::find(std::string_view id) const {
+    size_t mask = this->slots.size() - 1;
+    for (size_t slot = hash(id) & mask; ; slot = (slot + 1) & mask) {
+        faiss::idx_t internal = this->slots[slot];
+        if (internal == empty_slot) {
+            return -1;
+        }
+        if (this->get(internal) == id) {
+            // Each string is in the table once, so a removed id's entry means the id isn't held
+            return this->cell_of[internal] == free_cell ? -1 : internal;
+        }
+    }
+}
+
+faiss::idx_t IdDirectory::insert(std::string_view id, faiss::idx_t cell) {
+    if (id.size() > UINT32_MAX) {
+        throw std::invalid_argument("Id is too long");
+    }
+    if (this->strings.size() + 1 > this->slots.size() * max_load_factor) {
+        this->grow();
+    }
+
+    size_t mask = this->slots.size() - 1;
+    size_t slot = hash(id) & mask;
+    for (; this->slots[slot] != empty_slot; slot = (slot + 1) & mask) {
+        faiss::idx_t internal = this->slots[slot];
+        if (this->get(internal) != id) {
+            continue;
+        }
+        if (this->cell_of[internal] != free_cell) {
+            return -1;
+        }
+        // The id was removed and is added back, e.g. by UPSERT, so it takes its old internal id and string
+        faiss::idx_t last = this->free_ids.back();
+        this->free_ids[this->positions[internal]] = last;
+        this->positions[last] = this->positions[internal];
+        this->free_ids.pop_back();
+        this->addToCell(internal, cell);
+        return internal;
+    }
+
+    faiss::idx_t internal;
+    if (!this->free_ids.empty()) {
+        internal = this->free_ids.back();
+        this->free_ids.pop_back();
+        // The removed id's entry goes, so its place in the table may be taken by the new one
+        this->eraseSlot(this->slotOf(internal));
+        slot = hash(id) & mask;
+        while (this->slots[slot] != empty_slot) {
+            slot = (slot + 1) & mask;
+        }
+        this->strings[internal] = this->intern(id);
+        this->lengths[internal] = id.size();
+    } else {
+        internal = this->strings.size();
+        this->strings.push_back(this->intern(id));
+        this->lengths.push_back(id.size());
+        this->cell_of.push_back(free_cell);
+        this->positions.push_back(0);
+    }
+    this->slots[slot] = internal;
+    this->addToCell(internal, cell);
+    return internal;
+}
+
+faiss::idx_t IdDirectory::remove(std::string_view id) {
+    faiss::idx_t internal = this->find(id);
+    if (internal < 0) {
+        return -1;
+    }
+
+    // The cell's last member takes the removed one's place
+    std::vector<faiss::idx_t>& members = this->cells[this->cell_of[internal]];
+    faiss::idx_t last = members.back();
+    members[this->positions[internal]] = last;
+    this->positions[last] = this->positions[internal];
+    members.pop_back();
+
+    // The id stays in the table so adding it back finds its string, and a freed internal id's position is where
+    // it is in free_ids
+    this->cell_of[internal] = free_cell;
+    this->positions[internal] = this->free_ids.size();
+    this->free_ids.push_back(internal);
+    return internal;
+}
+
+std::string_view IdDirectory::get(faiss::idx_t internal) const {
+    return std::string_view(this->strings[internal], this->lengths[internal]);
+}
+
+faiss::idx_t IdDirectory::cellOf(faiss::idx_t internal) const {
+    return this->cell_of[internal];
+}
+
+const std::vector<faiss::idx_t>& IdDirectory::cell(faiss::idx_t cell) const {
+    return this->cells[cell];
+}
+
+size_t IdDirectory::cellSize(faiss::idx_t cell) const {
+    return this->cells[cell].size();
+}
+
+void IdDirectory::addToCell(faiss::idx_t internal, faiss::idx_t cell) {
+    this->cell_of[internal] = cell;
+    this->positions[internal] = this->cells[cell].size();
+    this->cells[cell].push_back(internal);
+}
+
+size_t IdDirectory::size() const {
+    return this->strings.size() - this->free_ids.size();
+}
+
+size_t IdDirectory::memoryUsage() const {
+    size_t bytes = this->pool_bytes;
+    bytes += this->strings.capacity() * sizeof(const char*);
+    bytes += this->lengths.capacity() * sizeof(uint32_t);
+    bytes += this->cell_of.capacity() * sizeof(faiss::idx_t);
+    bytes += this->positions.capacity() * sizeof(size_t);
+    bytes += this->free_ids.capacity() * sizeof(faiss::idx_t);
+    bytes += this->slots.capacity() * sizeof(faiss::idx_t);
+    bytes += this->cells.capacity() * sizeof(std::vector<faiss::idx_t>);
+    for (const auto& cell : this->cells) {
+        bytes += cell.capacity() * sizeof(faiss::idx_t);
+    }
+    return bytes;
+}
+
+// Layout: nCells, nIds and the table size, then the id lengths, the hash table, each cell's size followed by every
+// cell's members, and finally the id strings back to back in internal id order. Freed internal ids are the ones
+// which aren't a member of any cell, and keep the string of the id they last held.
+void IdDirectory::write(SnapshotWriter& writer) const {
+    writer.write<uint64_t>(this->cells.size());
+    writer.write<uint64_t>(this->strings.size());
+    writer.write<uint64_t>(this->slots.size());
+    writer.writeBytes(reinterpret_cast<const char *>(this->lengths.data()), sizeof(uint32_t) * this->lengths.size());
+    writer.align(sizeof(faiss::idx_t));
+    writer.writeBytes(reinterpret_cast<const char *>(this->slots.data()), sizeof(faiss::idx_t) * this->slots.size());
+    for (const auto& cell : this->cells) {
+        writer.write<uint64_t>(cell.size());
+    }
+    for (const auto& cell : this->cells) {
+        writer.writeBytes(reinterpret_cast<const char *>(cell.data()), sizeof(faiss::idx_t) * cell.size());
+    }
+    for (size_t internal = 0; internal < this->strings.size(); internal++) {
+        writer.writeBytes(this->strings[internal], this->lengths[internal]);
+    }
+}
+
+void IdDirectory::read(SnapshotReader& reader) {
+    uint64_t nCells = reader.read<uint64_t>();
+    uint64_t nIds = reader.read<uint64_t>();
+    uint64_t nSlots = reader.read<uint64_t>();
+    if (nCells != this->cells.size()) {
+        throw std::runtime_error("Snapshot id directory has " + std::to_string(nCells) + " cells but the index has " + std::to_string(this->cells.size()));
+    }
+    if (nSlots == 0 || (nSlots & (nSlots - 1)) != 0 || nIds > nSlots * max_load_factor) {
+        throw std::runtime_error("Snapshot id directory has an invalid hash table");
+    }
+
+    const char *lengths = reader.take(sizeof(uint32_t) * nIds);
+    this->lengths.resize(nIds);
+    std::memcpy(this->lengths.data(), lengths, sizeof(uint32_t) * nIds);
+    reader.align(sizeof(faiss::idx_t));
+    const char *slots = reader.take(sizeof(faiss::idx_t) * nSlots);
+    this->slots.resize(nSlots);
+    std::memcpy(this->slots.data(), slots, sizeof(faiss::idx_t) * nSlots);
+
+    std::vector<uint64_t> cellSizes(nCells);
+    std::memcpy(cellSizes.data(), reader.take(sizeof(uint64_t) * nCells), sizeof(uint64_t) * nCells);
+    this->cell_of.assign(nIds, free_cell);
+    this->positions.assign(nIds, 0);
+    for (size_t cell = 0; cell < nCells; cell++) {
+        const char *members = reader.take(sizeof(faiss::idx_t) * cellSizes[cell]);
+        this->cells[cell].resize(cellSizes[cell]);
+        std::memcpy(this->cells[cell].data(), members, sizeof(faiss::idx_t) * cellSizes[cell]);
+        for (size_t position = 0; position < cellSizes[cell]; position++) {
+            faiss::idx_t internal = this->cells[cell][position];
+            if (internal < 0 || (uint64_t)internal >= nIds || this->cell_of[internal] != free_cell) {
+                throw std::runtime_error("Snapshot id directory has an invalid member of cell " + std::to_string(cell));
+            }
+            this->cell_of[internal] = cell;
+            this->positions[internal] = position;
+        }
+    }
+    // Internal ids which aren't in any cell were freed, the lowest are reused first
+    this->free_ids.clear();
+    for (faiss::idx_t internal = nIds - 1; internal >= 0; internal--) {
+        if (this->cell_of[internal] == free_cell) {
+            this->positions[internal] = this->free_ids.size();
+            this->free_ids.push_back(internal);
+        }
+    }
+
+    size_t poolBytes = 0;
+    for (uint32_t length : this->lengths) {
+        poolBytes += length;
+    }
+    const char *pool = reader.take(poolBytes);
+    this->strings.resize(nIds);
+    for (size_t internal = 0, offset = 0; internal < nIds; internal++) {
+        this->strings[internal] = pool + offset;
+        offset += this->lengths[internal];
+    }
+
+    // New ids go into fresh chunks
+    this->chunks.clear();
+    this->chunks.push_back(reader.alias(pool));
+    this->chunk_used = chunk_size;
+    this->pool_bytes = poolBytes;
+}
+
+// Copies the id into the pool. Ids never straddle chunks, and an id too long for a chunk gets one of its own.
+const char *IdDirectory::intern(std::string_view id) {
+    if (id.size() > chunk_size) {
+        // Kept in front of the chunk currently being filled
+        this->chunks.insert(this->chunks.begin(), std::shared_ptr<char[]>(new char[id.size()]));
+        this->pool_bytes += id.size();
+        std::memcpy(this->chunks.front().get(), id.data(), id.size());
+        return this->chunks.front().get();
+    }
+    if (this->chunk_used + id.size() > chunk_size) {
+        this->chunks.push_back(std::shared_ptr<char[]>(new char[chunk_size]));
+        this->pool_bytes += chunk_size;
+        this->chunk_used = 0;
+    }
+    char *dest = &this->chunks.back()[this->chunk_used];
+    std::memcpy(dest, id.data(), id.size());
+    this->chunk_used += id.size();
+    return dest;
+}
+
+// Doubles the hash table and reinserts every internal id in it, freed ones included
+void IdDirectory::grow() {
+    std::vector<faiss::idx_t> slots(this->slots.size() * 2, empty_slot);
+    size_t mask = slots.size() - 1;
+    for (faiss::idx_t internal = 0; internal < (faiss::idx_t)this->strings.size(); internal++) {
+        size_t slot = hash(this->get(internal)) & mask;
+        while (slots[slot] != empty_slot) {
+            slot = (slot + 1) & mask;
+        }
+        slots[slot] = internal;
+    }
+    this->slots = std::move(slots);
+}
+
+size_t IdDirectory::slotOf(faiss::idx_t internal) const {
+    size_t mask = this->slots.size() - 1;
+    for (size_t slot = hash(this->get(internal)) & mask; this->slots[slot] != empty_slot; slot = (slot + 1) & mask) {
+        if (this->slots[slot] == internal) {
+            return slot;
+        }
+    }
+    throw std::logic_error("Internal id " + std::to_string(internal) + " is missing from the id table");
+}
+
+void IdDirectory::eraseSlot(size_t slot) {
+    size_t mask = this->slots.size() - 1;
+    size_t hole = slot;
+    for (size_t next = (hole + 1) & mask; this->slots[next] != empty_slot; next = (next + 1) & mask) {
+        size_t home = hash(this->get(this->slots[next])) & mask;
+        // An entry can fill the hole if the hole lies between its home slot and where it is now
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            this->slots[hole] = this->slots[next];
+            hole = next;
+        }
+    }
+    this->slots[hole] = empty_slot;
+}
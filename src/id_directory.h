@@ -0,0 +1,84 @@
+/*
+The id directory maps the external (database) ids Periplus has been told about with ADD to the internal ids used
+in the index, and records which cell each id belongs to. Ids are interned once into a pool of large chunks, which
+never move so the string_views handed out stay valid. Lookups go through an open-addressing hash table of internal
+ids, and each cell's members are kept as an array of internal ids. Internal ids are assigned densely from 0 in the
+order ids are added, and the internal ids of removed ids are recycled through a free list so the arrays indexed by
+them stay as large as the most ids ever held at once. The strings of removed ids stay in the pool, since views of
+them may still be in use, and removed ids stay in the hash table marked as free. Adding a removed id back, as
+UPSERT does, takes its old internal id and string again rather than interning another copy.
+*/
+
+#ifndef ID_DIRECTORY_H
+#define ID_DIRECTORY_H
+
+#include "snapshot.h"
+
+#include <cstdint>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+#include <faiss/Index.h>
+
+class IdDirectory {
+public:
+    explicit IdDirectory(size_t nCells);
+
+    // Returns the internal id of an external id, or -1 if it hasn't been added
+    faiss::idx_t find(std::string_view id) const;
+    // Interns the id and adds it to the cell. Returns its new internal id, or -1 if it has already been added. An id
+    // which was removed gets the internal id it had back.
+    faiss::idx_t insert(std::string_view id, faiss::idx_t cell);
+    // Removes the id from the directory and its cell, freeing its internal id for reuse. Returns the internal id it
+    // had, or -1 if it hasn't been added.
+    faiss::idx_t remove(std::string_view id);
+    std::string_view get(faiss::idx_t internal) const;
+    // Cell of a live internal id
+    faiss::idx_t cellOf(faiss::idx_t internal) const;
+
+    const std::vector<faiss::idx_t>& cell(faiss::idx_t cell) const;
+    size_t cellSize(faiss::idx_t cell) const;
+    // Number of ids currently held
+    size_t size() const;
+    // Bytes allocated by the directory
+    size_t memoryUsage() const;
+
+    void write(SnapshotWriter& writer) const;
+    // Replaces the directory's contents with one written by write. The id strings are used in place in the mapping.
+    void read(SnapshotReader& reader);
+
+private:
+    static constexpr const size_t chunk_size = 1 << 20;
+    static constexpr const faiss::idx_t empty_slot = -1;
+    static constexpr const faiss::idx_t free_cell = -1;
+    static constexpr const double max_load_factor = 0.7;
+
+    // A restored directory's first chunk aliases the snapshot mapping
+    std::vector<std::shared_ptr<char[]>> chunks;
+    size_t chunk_used = chunk_size;
+    size_t pool_bytes = 0;
+    // Indexed by internal id
+    std::vector<const char*> strings;
+    std::vector<uint32_t> lengths;
+    // Cell of each internal id and its position in the cell's members, free_cell and the position in free_ids for
+    // freed internal ids
+    std::vector<faiss::idx_t> cell_of;
+    std::vector<size_t> positions;
+    std::vector<faiss::idx_t> free_ids;
+    // Open-addressing table of every internal id, freed ones included, with linear probing. Its size is always a
+    // power of 2.
+    std::vector<faiss::idx_t> slots;
+    std::vector<std::vector<faiss::idx_t>> cells;
+
+    static uint64_t hash(std::string_view id);
+    const char *intern(std::string_view id);
+    void grow();
+    void addToCell(faiss::idx_t internal, faiss::idx_t cell);
+    // Slot of the table an internal id is in
+    size_t slotOf(faiss::idx_t internal) const;
+    // Empties a slot of the hash table, shifting back the entries after it which probed past it
+    void eraseSlot(size_t slot);
+};
+
+#endif
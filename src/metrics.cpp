@@ -0,0 +1,149 @@
+#include "metrics.h"
+#include "args.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+
+// Values below sub_buckets get a bucket each. Above that, a value's bucket is found from its most significant bit,
+// which picks the group, and the sub_bucket_bits bits below it, which pick the bucket within the group.
+size_t LatencyHistogram::bucketOf(uint64_t nanoseconds) {
+    if (nanoseconds < sub_buckets) {
+        return nanoseconds;
+    }
+#if defined(__GNUC__) || defined(__clang__)
+    size_t magnitude = 63 - __builtin_clzll(nanoseconds);
+#else
+    size_t magnitude = 0;
+    while ((nanoseconds >> (magnitude + 1)) != 0) {
+        magnitude++;
+    }
+#endif
+    if (magnitude >= max_magnitude) {
+        return n_buckets - 1;
+    }
+    size_t group = magnitude - sub_bucket_bits + 1;
+    size_t sub = (nanoseconds >> (magnitude - sub_bucket_bits)) - sub_buckets;
+    return (group * sub_buckets) + sub;
+}
+
+uint64_t LatencyHistogram::bucketUpperBound(size_t bucket) {
+    size_t group = bucket / sub_buckets;
+    if (group == 0) {
+        return bucket;
+    }
+    uint64_t width = 1ULL << (group - 1);
+    uint64_t lower = (sub_buckets + (bucket % sub_buckets)) * width;
+    return lower + width - 1;
+}
+
+void LatencyHistogram::record(uint64_t nanoseconds) {
+    this->buckets[bucketOf(nanoseconds)].fetch_add(1, std::memory_order_relaxed);
+    this->total.fetch_add(1, std::memory_order_relaxed);
+    this->total_nanoseconds.fetch_add(nanoseconds, std::memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::count() const {
+    return this->total.load(std::memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::sum() const {
+    return this->total_nanoseconds.load(std::memory_order_relaxed);
+}
+
+// Buckets can be recorded into while they're read, so the rank is taken from the bucket counts themselves rather
+// than the total, which may be ahead of them
+uint64_t LatencyHistogram::quantile(double q) const {
+    uint64_t counts[n_buckets];
+    uint64_t recorded = 0;
+    for (size_t bucket = 0; bucket < n_buckets; bucket++) {
+        counts[bucket] = this->buckets[bucket].load(std::memory_order_relaxed);
+        recorded += counts[bucket];
+    }
+    if (recorded == 0) {
+        return 0;
+    }
+
+    uint64_t rank = std::max<uint64_t>(1, std::ceil(std::clamp(q, 0.0, 1.0) * recorded));
+    uint64_t seen = 0;
+    for (size_t bucket = 0; bucket < n_buckets; bucket++) {
+        seen += counts[bucket];
+        if (seen >= rank) {
+            return bucketUpperBound(bucket);
+        }
+    }
+    return bucketUpperBound(n_buckets - 1);
+}
+
+void LatencyHistogram::render(std::string& out, const std::string& name, const std::string& labels) const {
+    std::string separator = labels.empty() ? "" : ",";
+    for (double q : {0.5, 0.9, 0.99, 0.999}) {
+        char quantile[16];
+        std::snprintf(quantile, sizeof(quantile), "%g", q);
+        renderSample(out, name, labels + separator + "quantile=\"" + quantile + "\"", this->quantile(q) / 1e9);
+    }
+    renderSample(out, name + "_sum", labels, this->sum() / 1e9);
+    renderSample(out, name + "_count", labels, this->count());
+}
+
+void renderHeader(std::string& out, const std::string& name, const char *type, const char *help) {
+    out += "# HELP " + name + " " + help + "\n";
+    out += "# TYPE " + name + " " + type + "\n";
+}
+
+void renderSample(std::string& out, const std::string& name, const std::string& labels, double value) {
+    char formatted[32];
+    std::snprintf(formatted, sizeof(formatted), "%.17g", value);
+    out += name;
+    if (!labels.empty()) {
+        out += "{" + labels + "}";
+    }
+    out += " ";
+    out += formatted;
+    out += "\n";
+}
+
+void Metrics::render(std::string& out) const {
+    auto counter = [&out](const char *name, const char *help, const std::atomic<uint64_t>& value) {
+        renderHeader(out, name, "counter", help);
+        renderSample(out, name, "", value.load(std::memory_order_relaxed));
+    };
+    counter("periplus_queries_total", "Queries searched.", this->queries);
+    counter("periplus_cache_hits_total", "Queries which were cache hits.", this->cache_hits);
+    counter("periplus_cells_evicted_total", "Cells evicted.", this->cells_evicted);
+    counter("periplus_db_requests_total", "Requests sent to the database.", this->db_requests);
+    counter("periplus_db_records_total", "Records received from the database.", this->db_records);
+    counter("periplus_db_errors_total", "Requests to the database which failed.", this->db_errors);
+    counter("periplus_bytes_written_total", "Bytes of responses written to clients.", this->bytes_written);
+
+    renderHeader(out, "periplus_cells_loaded_total", "counter", "Cells made resident, by where they were loaded from.");
+    renderSample(out, "periplus_cells_loaded_total", "source=\"disk\"", this->cells_loaded_disk.load(std::memory_order_relaxed));
+    renderSample(out, "periplus_cells_loaded_total", "source=\"db\"", this->cells_loaded_db.load(std::memory_order_relaxed));
+
+    auto summary = [&out](const char *name, const char *help, const LatencyHistogram& histogram) {
+        renderHeader(out, name, "summary", help);
+        histogram.render(out, name);
+    };
+    summary("periplus_search_seconds", "Time taken by searches of the index.", this->search);
+    summary("periplus_load_seconds", "Time taken to load a batch of cells.", this->load);
+    summary("periplus_evict_seconds", "Time taken to evict a cell.", this->evict);
+    summary("periplus_db_fetch_seconds", "Time taken by requests to the database.", this->db_fetch);
+    summary("periplus_session_read_seconds", "Time from reading a command line to having parsed its arguments.", this->session_read);
+    summary("periplus_session_write_seconds", "Time taken to write a response to a client.", this->session_write);
+
+    renderHeader(out, "periplus_command_seconds", "summary", "Time from reading a command line to its response being ready.");
+    for (size_t command = 0; command < n_commands; command++) {
+        // Commands which haven't been sent are left out
+        if (this->commands[command].count() > 0) {
+            this->commands[command].render(out, "periplus_command_seconds", std::string("command=\"") + command_names[command] + "\"");
+        }
+    }
+}
+
+Metrics& metrics() {
+    static Metrics metrics;
+    return metrics;
+}
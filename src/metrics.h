@@ -0,0 +1,95 @@
+/*
+Counters and latency histograms of the hot paths, cheap enough to always be on: recording is a couple of relaxed
+atomic increments. Latencies go into HDR style log-linear buckets, where every power of two of nanoseconds is split
+into sub_buckets linear buckets, so a fixed array covers a nanosecond up to minutes and any quantile read from it is
+within 1/sub_buckets of the recorded latency. Metrics are rendered in the Prometheus text exposition format for the
+STATS command and the /metrics listener.
+*/
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "args.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+class LatencyHistogram {
+public:
+    static constexpr const size_t sub_bucket_bits = 3;
+    static constexpr const size_t sub_buckets = 1 << sub_bucket_bits;
+    // Latencies from 2^max_magnitude nanoseconds (about 18 minutes) up all land in the last bucket
+    static constexpr const size_t max_magnitude = 40;
+    static constexpr const size_t n_buckets = (max_magnitude - sub_bucket_bits + 1) * sub_buckets;
+
+    void record(uint64_t nanoseconds);
+    uint64_t count() const;
+    uint64_t sum() const;
+    // Upper bound in nanoseconds of the bucket holding the q quantile, 0 if nothing has been recorded
+    uint64_t quantile(double q) const;
+    // Appends the histogram's samples as a Prometheus summary in seconds, with the median, 90th, 99th and 99.9th
+    // percentiles
+    void render(std::string& out, const std::string& name, const std::string& labels = "") const;
+
+    static size_t bucketOf(uint64_t nanoseconds);
+    static uint64_t bucketUpperBound(size_t bucket);
+
+private:
+    std::atomic<uint64_t> buckets[n_buckets] = {};
+    std::atomic<uint64_t> total{0};
+    std::atomic<uint64_t> total_nanoseconds{0};
+};
+
+// Records the time from its construction to its destruction into a histogram
+class ScopedLatency {
+public:
+    explicit ScopedLatency(LatencyHistogram& histogram) : histogram(histogram), start(std::chrono::steady_clock::now()) {}
+    ~ScopedLatency() {
+        this->histogram.record(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - this->start).count());
+    }
+
+private:
+    LatencyHistogram& histogram;
+    std::chrono::steady_clock::time_point start;
+};
+
+struct Metrics {
+    // Queries searched, and how many of them were cache hits
+    std::atomic<uint64_t> queries{0};
+    std::atomic<uint64_t> cache_hits{0};
+    // Cells made resident, by where they came from, and cells evicted
+    std::atomic<uint64_t> cells_loaded_disk{0};
+    std::atomic<uint64_t> cells_loaded_db{0};
+    std::atomic<uint64_t> cells_evicted{0};
+    // Requests sent to the database, records received and requests which failed
+    std::atomic<uint64_t> db_requests{0};
+    std::atomic<uint64_t> db_records{0};
+    std::atomic<uint64_t> db_errors{0};
+    std::atomic<uint64_t> bytes_written{0};
+
+    LatencyHistogram search;
+    LatencyHistogram load;
+    LatencyHistogram evict;
+    LatencyHistogram db_fetch;
+    // From a command line being read to its arguments being parsed, and the time taken to write each response
+    LatencyHistogram session_read;
+    LatencyHistogram session_write;
+    // From a command line being read to its response being handed to the session, indexed by Command
+    LatencyHistogram commands[n_commands];
+
+    // Appends every counter and histogram
+    void render(std::string& out) const;
+};
+
+// The process wide metrics
+Metrics& metrics();
+
+// Appends the HELP and TYPE lines which come before a metric's samples
+void renderHeader(std::string& out, const std::string& name, const char *type, const char *help);
+// Appends a Prometheus sample line, labels are given without braces e.g. cell="3"
+void renderSample(std::string& out, const std::string& name, const std::string& labels, double value);
+
+#endif
@@ -0,0 +1,63 @@
+#include "metrics_server.h"
+
+#include <iostream>
+#include <istream>
+#include <memory>
+#include <string>
+#include <asio.hpp>
+#include <asio/ts/internet.hpp>
+
+
+MetricsServer::MetricsServer(asio::io_context& io_context, unsigned short port, std::function<std::string()> render)
+    : io_context_(io_context), acceptor_(io_context, asio::ip::tcp::endpoint(asio::ip::tcp::v4(), port)), render(std::move(render)) {
+    do_accept();
+}
+
+void MetricsServer::do_accept() {
+    this->acceptor_.async_accept(asio::make_strand(this->io_context_),
+        [this](std::error_code ec, asio::ip::tcp::socket socket) {
+            if (!ec) {
+                this->serve(std::make_shared<asio::ip::tcp::socket>(std::move(socket)));
+            } else {
+                std::cerr << "Metrics listener failed to accept a connection: " << ec.message() << std::endl;
+            }
+            do_accept();
+        });
+}
+
+void MetricsServer::serve(std::shared_ptr<asio::ip::tcp::socket> socket) {
+    auto request = std::make_shared<asio::streambuf>(8192);
+    asio::async_read_until(*socket, *request, "\r\n\r\n",
+        [this, socket, request](std::error_code ec, std::size_t) {
+            if (ec) {
+                return;
+            }
+
+            // Only the request line matters e.g. GET /metrics HTTP/1.1
+            std::istream is(request.get());
+            std::string method, target;
+            is >> method >> target;
+
+            auto response = std::make_shared<std::string>();
+            if (method == "GET" && (target == "/metrics" || target.rfind("/metrics?", 0) == 0)) {
+                std::string body = this->render();
+                *response = "HTTP/1.0 200 OK\r\n"
+                            "Content-Type: text/plain; version=0.0.4\r\n"
+                            "Content-Length: " + std::to_string(body.size()) + "\r\n"
+                            "Connection: close\r\n\r\n" + body;
+            } else {
+                std::string body = "Not found, metrics are served at /metrics\n";
+                *response = "HTTP/1.0 404 Not Found\r\n"
+                            "Content-Type: text/plain\r\n"
+                            "Content-Length: " + std::to_string(body.size()) + "\r\n"
+                            "Connection: close\r\n\r\n" + body;
+            }
+
+            asio::async_write(*socket, asio::buffer(*response),
+                [socket, response](std::error_code, std::size_t) {
+                    std::error_code ignored;
+                    socket->shutdown(asio::ip::tcp::socket::shutdown_both, ignored);
+                    socket->close(ignored);
+                });
+        });
+}
@@ -0,0 +1,29 @@
+/*
+A minimal HTTP listener which serves the metrics to a Prometheus scraper. Each connection gets one response to a
+GET /metrics request and is then closed, so there's no keep-alive or request body handling to speak of.
+*/
+
+#ifndef METRICS_SERVER_H
+#define METRICS_SERVER_H
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <asio.hpp>
+#include <asio/ts/internet.hpp>
+
+class MetricsServer {
+public:
+    // render is called for every scrape, from whichever thread is running the io_context
+    MetricsServer(asio::io_context& io_context, unsigned short port, std::function<std::string()> render);
+
+private:
+    asio::io_context& io_context_;
+    asio::ip::tcp::acceptor acceptor_;
+    std::function<std::string()> render;
+
+    void do_accept();
+    void serve(std::shared_ptr<asio::ip::tcp::socket> socket);
+};
+
+#endif
@@ -0,0 +1,40 @@
+#include "reservoir_sampler.h"
+
+#include <cstring>
+#include <random>
+#include <vector>
+
+
+ReservoirSampler::ReservoirSampler(size_t d, size_t capacity, uint64_t seed) : d(d), capacity(capacity), rng(seed) {
+    if (capacity > 0) {
+        this->samples.reserve(capacity * d);
+    }
+}
+
+void ReservoirSampler::add(size_t n, const float *x) {
+    for (size_t i = 0; i < n; i++, this->nSeen++) {
+        const float *vector = &x[i * this->d];
+        if (this->capacity == 0 || this->nSeen < this->capacity) {
+            this->samples.insert(this->samples.end(), vector, vector + this->d);
+            continue;
+        }
+        // The vector replaces a random member of the sample with probability capacity / (seen + 1)
+        std::uniform_int_distribution<size_t> slot(0, this->nSeen);
+        size_t j = slot(this->rng);
+        if (j < this->capacity) {
+            std::memcpy(&this->samples[j * this->d], vector, sizeof(float) * this->d);
+        }
+    }
+}
+
+size_t ReservoirSampler::size() const {
+    return this->samples.size() / this->d;
+}
+
+size_t ReservoirSampler::seen() const {
+    return this->nSeen;
+}
+
+const float *ReservoirSampler::data() const {
+    return this->samples.data();
+}
@@ -0,0 +1,35 @@
+/*
+Keeps a uniform random sample of at most capacity vectors out of a stream of vectors of unknown length (Algorithm R).
+TRAIN uses it to sample a training set streamed in chunks, so a training set of any size takes at most capacity
+vectors of memory.
+*/
+
+#ifndef RESERVOIR_SAMPLER_H
+#define RESERVOIR_SAMPLER_H
+
+#include <cstdint>
+#include <random>
+#include <vector>
+
+class ReservoirSampler {
+public:
+    // A capacity of 0 keeps every vector
+    ReservoirSampler(size_t d, size_t capacity, uint64_t seed = 1234);
+
+    void add(size_t n, const float *x);
+
+    // Number of vectors in the sample
+    size_t size() const;
+    // Number of vectors added so far
+    size_t seen() const;
+    const float *data() const;
+
+private:
+    size_t d;
+    size_t capacity;
+    size_t nSeen = 0;
+    std::vector<float> samples;
+    std::mt19937_64 rng;
+};
+
+#endif
@@ -0,0 +1,67 @@
+#include "response.h"
+#include "data.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <asio.hpp>
+
+
+void Response::frame(uint64_t request_id) {
+    this->header[0] = request_id;
+    this->header[1] = asio::buffer_size(this->buffers);
+    this->buffers.insert(this->buffers.begin(), asio::buffer(this->header, sizeof(this->header)));
+}
+
+
+MessageResponse::MessageResponse(std::string message) : message(std::move(message)) {
+    this->buffers.push_back(asio::buffer(this->message));
+}
+
+TextResponse::TextResponse(std::string text) : length(text.size()), text(std::move(text)) {
+    this->buffers.push_back(asio::buffer(&this->length, sizeof(this->length)));
+    this->buffers.push_back(asio::buffer(this->text));
+}
+
+
+SearchResponse::SearchResponse(size_t n, size_t k, uint8_t fields, bool compact) : n(n), k(k), fields(fields), compact(compact), results(n * k), distances(n * k), cacheHits(n), coverage(n) {}
+
+void SearchResponse::serialize() {
+    // For each query: the number of results (-1 on a cache miss) and its coverage, followed by each result's distance
+    // to the query, then its id, embedding, document and metadata, each prefixed with its length. Fields left out of
+    // the mask are skipped entirely, length included. The lengths are sent straight from the Data structs and the payloads
+    // from the resident arrays they share ownership of. A compact response follows each embedding's length with the
+    // EmbeddingPrecision it's sent at and then its code, as stored in the cell arena.
+    this->buffers.clear();
+    for (size_t i = 0; i < this->n; i++) {
+        this->buffers.push_back(asio::buffer(&this->cacheHits[i], sizeof(int)));
+        this->buffers.push_back(asio::buffer(&this->coverage[i], sizeof(float)));
+        for (int j = 0; j < this->cacheHits[i]; j++) {
+            const Data& result = this->results[(i * this->k) + j];
+            if (this->fields & FIELD_DISTANCE) {
+                this->buffers.push_back(asio::buffer(&this->distances[(i * this->k) + j], sizeof(float)));
+            }
+            if (this->fields & FIELD_ID) {
+                this->buffers.push_back(asio::buffer(&result.id_len, sizeof(result.id_len)));
+                this->buffers.push_back(asio::buffer(result.id.get(), result.id_len));
+            }
+            if ((this->fields & FIELD_EMBEDDING) && this->compact) {
+                this->buffers.push_back(asio::buffer(&result.embedding_len, sizeof(result.embedding_len)));
+                this->buffers.push_back(asio::buffer(&result.embedding_precision, sizeof(result.embedding_precision)));
+                const void *code = result.embedding_precision == PRECISION_FP32 ? (const void *)result.embedding.get() : result.embedding_code.get();
+                this->buffers.push_back(asio::buffer(code, embeddingCodeSize(result.embedding_len, result.embedding_precision)));
+            } else if (this->fields & FIELD_EMBEDDING) {
+                this->buffers.push_back(asio::buffer(&result.embedding_len, sizeof(result.embedding_len)));
+                this->buffers.push_back(asio::buffer(result.embedding.get(), sizeof(float) * result.embedding_len));
+            }
+            if (this->fields & FIELD_DOCUMENT) {
+                this->buffers.push_back(asio::buffer(&result.document_len, sizeof(result.document_len)));
+                this->buffers.push_back(asio::buffer(result.document.get(), result.document_len));
+            }
+            if (this->fields & FIELD_METADATA) {
+                this->buffers.push_back(asio::buffer(&result.metadata_len, sizeof(result.metadata_len)));
+                this->buffers.push_back(asio::buffer(result.metadata.get(), result.metadata_len));
+            }
+        }
+    }
+}
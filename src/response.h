@@ -0,0 +1,77 @@
+/*
+Responses are the counterpart to the args structs: they encode the result of a command into the wire format
+without the cache needing to know how it's sent. Each response describes its payload as a list of buffers
+which the session sends to the client with a single gather-write. Those buffers point directly at memory owned
+by the response (or kept alive through the shared pointers it holds), so nothing is copied into an intermediate
+buffer and the response must outlive the write.
+
+Responses to pipelined requests are framed with a header of the request id and the payload length (both u64) since
+they can be sent in a different order than the requests arrived in.
+*/
+
+#ifndef RESPONSE_H
+#define RESPONSE_H
+
+#include "data.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include <asio.hpp>
+
+struct Response {
+    std::vector<asio::const_buffer> buffers;
+    // Request id and payload length sent ahead of the payload for pipelined requests
+    uint64_t header[2];
+
+    // Prefixes the payload with a header so a pipelined client can match the response to its request. Must be
+    // called after the payload's buffers are complete.
+    void frame(uint64_t request_id);
+    virtual ~Response() {}
+};
+
+// Plain text status message e.g. "Loaded cell"
+struct MessageResponse : Response {
+    std::string message;
+
+    explicit MessageResponse(std::string message);
+};
+
+// Text prefixed with its length (u64), for text which can be too long to read without knowing where it ends
+struct TextResponse : Response {
+    uint64_t length;
+    std::string text;
+
+    explicit TextResponse(std::string text);
+};
+
+// Fields of each result a SEARCH response carries, combined into a mask
+enum SearchField : uint8_t {
+    FIELD_ID = 1 << 0,
+    FIELD_EMBEDDING = 1 << 1,
+    FIELD_DOCUMENT = 1 << 2,
+    FIELD_METADATA = 1 << 3,
+    FIELD_DISTANCE = 1 << 4,
+    ALL_FIELDS = FIELD_ID | FIELD_EMBEDDING | FIELD_DOCUMENT | FIELD_METADATA | FIELD_DISTANCE
+};
+
+struct SearchResponse : Response {
+    size_t n;
+    size_t k;
+    // Mask of the SearchFields to send, the others are left out of the payload altogether
+    uint8_t fields;
+    // Embeddings kept at reduced precision are sent as stored, see serialize
+    bool compact;
+    // Laid out the way Core::search expects: k results for each of the n queries
+    std::vector<Data> results;
+    std::vector<float> distances;
+    std::vector<int> cacheHits;
+    // Fraction of the vectors in each query's nprobe nearest cells which were resident
+    std::vector<float> coverage;
+
+    SearchResponse(size_t n, size_t k, uint8_t fields = ALL_FIELDS, bool compact = false);
+    void serialize();
+};
+
+#endif
@@ -5,6 +5,7 @@ The server manages the cache lifecycle, accepts connections, and creates session
 #include "server.h"
 #include "session.h"
 #include "cache.h"
+#include "metrics_server.h"
 
 #include <iostream>
 #include <memory>
@@ -12,17 +13,27 @@ The server manages the cache lifecycle, accepts connections, and creates session
 #include <asio/ts/internet.hpp>
 
 
-TcpServer::TcpServer(asio::io_context& io_context, short port) 
-    : acceptor_(io_context, asio::ip::tcp::endpoint(asio::ip::tcp::v4(), port)) {
-    this->cache = std::make_unique<Cache>();
+TcpServer::TcpServer(asio::io_context& io_context, short port, const CacheConfig& config) 
+    : io_context_(io_context), acceptor_(io_context, asio::ip::tcp::endpoint(asio::ip::tcp::v4(), port)) {
+    this->cache = std::make_unique<Cache>(config);
+    if (config.metrics_port != 0) {
+        // Scrapes leave out the per cell samples, which grow with the number of cells
+        Cache *cache = this->cache.get();
+        this->metrics_server = std::make_unique<MetricsServer>(io_context, config.metrics_port, [cache]() {
+            return cache->renderMetrics(false);
+        });
+        std::cout << "Serving metrics on port: " << config.metrics_port << std::endl;
+    }
     do_accept();
 }
 
 void TcpServer::do_accept() {
-    this->acceptor_.async_accept(
+    // Each session's socket is bound to its own strand so a session's handlers never run concurrently with
+    // each other, while different sessions are free to be served by different threads.
+    this->acceptor_.async_accept(asio::make_strand(this->io_context_),
         [this](std::error_code ec, asio::ip::tcp::socket socket) {
             if (!ec) {
-                auto session = std::make_shared<Session>(std::move(socket), this->cache.get());
+                auto session = std::make_shared<Session>(std::move(socket), this->cache.get(), this->io_context_.get_executor());
                 this->sessions.push_back(session);
                 session->start();
             }
@@ -2,17 +2,21 @@
 #define SERVER_H
 
 #include "cache.h"
+#include "metrics_server.h"
 #include <asio.hpp>
 #include <asio/ts/internet.hpp>
 
 class TcpServer {
 public:
-    TcpServer(asio::io_context& io_context, short port);
+    TcpServer(asio::io_context& io_context, short port, const CacheConfig& config);
 
 private:
     std::vector<std::shared_ptr<Session>> sessions;
+    asio::io_context& io_context_;
     asio::ip::tcp::acceptor acceptor_;
     std::unique_ptr<Cache> cache;
+    // Only created when a metrics port is configured
+    std::unique_ptr<MetricsServer> metrics_server;
 
 
     void do_accept();
@@ -1,5 +1,6 @@
 #include "cache.h"
 #include "session.h"
+#include "metrics.h"
 
 #include <iostream>
 #include <functional>
@@ -7,7 +8,12 @@
 #include <asio/ts/buffer.hpp>
 
 
-Session::Session(asio::ip::tcp::socket socket, Cache *cache) : args(nullptr), socket_(std::move(socket)), cache(cache) {}
+Session::Session(asio::ip::tcp::socket socket, Cache *cache, asio::any_io_executor work_executor)
+    : args(nullptr), socket_(std::move(socket)), cache(cache), work_executor(work_executor) {}
+
+asio::any_io_executor Session::get_executor() {
+    return this->socket_.get_executor();
+}
 
 void Session::start() {
     this->read_command();
@@ -18,6 +24,7 @@ void Session::read_command() {
     asio::async_read_until(this->socket_, this->input_stream, "\r\n",
         [this, self](std::error_code ec, std::size_t length) {
             if (!ec) {
+                this->received_at = std::chrono::steady_clock::now();
                 std::istream is(&this->input_stream);
                 std::string command;
                 std::getline(is, command);
@@ -25,6 +32,20 @@ void Session::read_command() {
                     command.pop_back();
                 }
 
+                // Pipelined commands carry a request id after the command name e.g. "SEARCH 42"
+                this->pipelined = false;
+                this->request_id = 0;
+                size_t separator = command.find(' ');
+                if (separator != std::string::npos) {
+                    try {
+                        this->request_id = std::stoull(command.substr(separator + 1));
+                        this->pipelined = true;
+                    } catch (const std::exception& e) {
+                        std::cerr << "Invalid request id in command: " << command << std::endl;
+                    }
+                    command = command.substr(0, separator);
+                }
+
                 // Inform the cache we received a command, and ask it what to do next. 
                 this->cache->processCommand(self, command);
             }
@@ -35,21 +56,25 @@ void Session::read_command() {
 void Session::read_args(std::shared_ptr<Args> args) {
     auto self(shared_from_this());
     this->args = args;
+    args->pipelined = this->pipelined;
+    args->request_id = this->request_id;
+    args->received_at = this->received_at;
 
     // Check what data has already been read into the buffer
-    if (this->input_stream.size() >= this->args->get_static_size()) {
+    if (this->input_stream.size() >= args->get_static_size()) {
         // Already read in enough data to get the static args
         std::istream is(&this->input_stream);
-        this->args->deserialize_static(is);
+        args->deserialize_static(is);
         this->read_dynamic_args(args);
         // Read dynamic data
     } else {
-        // Need to read more data to deserialize static args, retreive the difference of what's needed and what's already read into the buffer
-        asio::async_read(this->socket_, this->input_stream, asio::transfer_exactly(this->args->get_static_size() - this->input_stream.size()),
-        [this, self, &args](std::error_code ec, std::size_t bytes_transferred) {
+        // Need to read more data to deserialize static args, retreive the difference of what's needed and what's already read into the buffer.
+        // The handler holds its own reference to args since this call has returned by the time it runs.
+        asio::async_read(this->socket_, this->input_stream, asio::transfer_exactly(args->get_static_size() - this->input_stream.size()),
+        [this, self, args](std::error_code ec, std::size_t bytes_transferred) {
             if (!ec) {
                 std::istream is(&this->input_stream);
-                this->args->deserialize_static(is);
+                args->deserialize_static(is);
                 // Now we can go forward with reading dynamic data
                 this->read_dynamic_args(args);
             } else {
@@ -62,18 +87,18 @@ void Session::read_args(std::shared_ptr<Args> args) {
 void Session::read_dynamic_args(std::shared_ptr<Args> args) {
     auto self(shared_from_this());
 
-    if (this->input_stream.size() >= this->args->size + 2) {
+    if (this->input_stream.size() >= args->size + 2) {
         std::istream is(&this->input_stream);
-        this->args->deserialize_dynamic(is);
-        this->cache->process_args(self);
+        args->deserialize_dynamic(is);
+        this->dispatch(args);
     } else {
         // Need to read more data
-        asio::async_read(this->socket_, this->input_stream, asio::transfer_exactly(this->args->size + 2 - this->input_stream.size()),
-        [this, self, &args](std::error_code ec, std::size_t length) {
+        asio::async_read(this->socket_, this->input_stream, asio::transfer_exactly(args->size + 2 - this->input_stream.size()),
+        [this, self, args](std::error_code ec, std::size_t length) {
             if (!ec) {
                 std::istream is(&this->input_stream);
-                this->args->deserialize_dynamic(is);
-                this->cache->process_args(self);
+                args->deserialize_dynamic(is);
+                this->dispatch(args);
             } else {
                 std::cout << "AN ERROR OCCURRED WHILE READYING DYNAMIC DATA" << std::endl;
             }
@@ -86,19 +111,19 @@ void Session::read_static_args(std::shared_ptr<Args> args) {
     this->args = args;
     auto self(shared_from_this());
 
-    asio::async_read(this->socket_, this->input_stream, asio::transfer_exactly(this->args->get_static_size()),
-        [this, self, &args](std::error_code ec, std::size_t bytes_transferred) {
+    asio::async_read(this->socket_, this->input_stream, asio::transfer_exactly(args->get_static_size()),
+        [this, self, args](std::error_code ec, std::size_t bytes_transferred) {
             std::cout << "Updated buffer size: " << this->input_stream.size() << std::endl;
             if (!ec) {
                 std::istream is(&this->input_stream);
-                this->args->deserialize_static(is);
+                args->deserialize_static(is);
                 // Read the dynamic data (size +2 is for the end delimiter (2 chars 1 byte each))
-                asio::async_read(this->socket_, this->input_stream, asio::transfer_exactly(this->args->size + 2 - this->input_stream.size()), 
-                    [this, self, &args](std::error_code ec, std::size_t length) {
+                asio::async_read(this->socket_, this->input_stream, asio::transfer_exactly(args->size + 2 - this->input_stream.size()), 
+                    [this, self, args](std::error_code ec, std::size_t length) {
                         if (!ec) {
                             std::istream dynamic_is(&this->input_stream);
-                            this->args->deserialize_dynamic(dynamic_is);
-                            this->cache->process_args(self);
+                            args->deserialize_dynamic(dynamic_is);
+                            this->dispatch(args);
                         } else {
                             std::cout << "AN ERROR HAS OCCURRED DURING DYNAMIC DESERIALIZATION" << std::endl;
                             std::cerr << ec << std::endl;
@@ -112,26 +137,61 @@ void Session::read_static_args(std::shared_ptr<Args> args) {
     std::cout << "Called asio::async_read" << std::endl;
 }
 
-void Session::async_write(size_t length) {
+// Runs a fully read command and moves on to reading the next one. Concurrent pipelined commands are handed off
+// to the work executor so the commands behind them are read, and can start, while they run.
+void Session::dispatch(std::shared_ptr<Args> args) {
     auto self(shared_from_this());
-    asio::async_write(socket_, asio::buffer(output_buf, length),
-        [this, self](std::error_code ec, std::size_t /*length*/) {
-            if (ec) {
-                std::cout << "An error occurred responding to the client" << std::endl;
-            }
+    metrics().session_read.record(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - args->received_at).count());
+    if (args->pipelined && args->is_concurrent()) {
+        asio::post(this->work_executor, [this, self, args]() {
+            this->cache->process_args(self, args);
         });
-}
+    } else {
+        this->cache->process_args(self, args);
+    }
 
-void Session::sync_write(size_t length) {
-    asio::error_code ec;
-    asio::write(socket_, asio::buffer(this->output_buf, length), ec);
+    // Allow for multiple commands in a single session
+    this->read_command();
+}
 
-    if (!ec) {
-        // std::cout << "Sent data!" << std::endl;
-    } else {
-        std::cout << "An error occurred while sending data to the client" << std::endl;
-        std::cout << ec << std::endl;
+void Session::respond(std::shared_ptr<Args> args, std::shared_ptr<Response> response) {
+    metrics().commands[args->get_command()].record(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - args->received_at).count());
+    if (args->pipelined) {
+        response->frame(args->request_id);
     }
+    this->write(response);
+}
+
+void Session::write(std::shared_ptr<Response> response) {
+    auto self(shared_from_this());
+    // Responses can be produced on any thread, so hop onto the session's strand before touching the queue
+    asio::post(this->socket_.get_executor(), [this, self, response]() {
+        this->write_queue.push_back(response);
+        if (this->write_queue.size() == 1) {
+            this->do_write();
+        }
+    });
+}
+
+void Session::do_write() {
+    auto self(shared_from_this());
+    auto start = std::chrono::steady_clock::now();
+    // Gather-write every buffer of the response in one operation. The queue holds a reference to the
+    // response, keeping the memory its buffers point at alive until the write completes.
+    asio::async_write(this->socket_, this->write_queue.front()->buffers,
+        [this, self, start](std::error_code ec, std::size_t length) {
+            if (ec) {
+                std::cout << "An error occurred responding to the client" << std::endl;
+                std::cout << ec << std::endl;
+            }
+            metrics().session_write.record(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+            metrics().bytes_written.fetch_add(length, std::memory_order_relaxed);
+            this->write_queue.pop_front();
+            if (!this->write_queue.empty()) {
+                this->do_write();
+            }
+        });
 }
 
 Session::~Session() {
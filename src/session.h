@@ -9,7 +9,10 @@ to process incoming data and then figure out what data to send back.
 
 #include "args.h"
 #include "cache.h"
+#include "response.h"
 
+#include <chrono>
+#include <deque>
 #include <vector>
 #include <asio.hpp>
 #include <asio/ts/buffer.hpp>
@@ -21,18 +24,20 @@ public:
 
     // TODO: Add cache weak ptr here (Sessions should not impact the cache lifecycle which is owned by the server)
     // This will alleviate the need to pass callback functions everywhere.
-    explicit Session(asio::ip::tcp::socket socket, Cache *cache);
+    // Pipelined commands run on work_executor so the session can keep reading the commands behind them
+    Session(asio::ip::tcp::socket socket, Cache *cache, asio::any_io_executor work_executor);
 
     void start();
     void read_command();
     void read_static_args(std::shared_ptr<Args> args);
     void read_args(std::shared_ptr<Args> args);
     void read_dynamic_args(std::shared_ptr<Args> args);
-    void async_write(std::size_t length);
-    void sync_write(std::size_t length);
+    void write(std::shared_ptr<Response> response);
+    // Writes the response to the command described by args, framing it if the command was pipelined
+    void respond(std::shared_ptr<Args> args, std::shared_ptr<Response> response);
+    // Executor of the session's strand, for work that has to be scheduled alongside the session's I/O
+    asio::any_io_executor get_executor();
 
-    enum { max_length = 1024 };
-    char output_buf[max_length];
     std::shared_ptr<Args> args;
     Cache *cache;
 
@@ -40,7 +45,18 @@ public:
 
 private:
     asio::ip::tcp::socket socket_;
+    asio::any_io_executor work_executor;
     asio::streambuf input_stream;
+    // Parsed from the command line of the command currently being read
+    bool pipelined = false;
+    uint64_t request_id = 0;
+    std::chrono::steady_clock::time_point received_at;
+    // Responses waiting to be written. Only one write can be outstanding on the socket at a time, so the
+    // response at the front is being written and the rest are sent in order once it completes.
+    std::deque<std::shared_ptr<Response>> write_queue;
+
+    void do_write();
+    void dispatch(std::shared_ptr<Args> args);
     // void do_read();
 };
 
@@ -0,0 +1,149 @@
+#include "snapshot.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+// "PERIPLUS" read as a little-endian u64
+static constexpr const uint64_t snapshot_magic = 0x53554c5049524550ULL;
+static constexpr const uint64_t snapshot_version = 4;
+
+
+void SnapshotMeta::write(const std::string& dir) const {
+    SnapshotWriter writer(dir + "/" + snapshot_meta_file);
+    writer.write<size_t>(this->d);
+    writer.write<size_t>(this->nCells);
+    writer.write<float>(this->nTotal);
+    writer.write<size_t>(this->max_mem);
+    writer.write<uint8_t>(this->eviction_policy);
+    writer.write<bool>(this->include_cells);
+    writer.write<uint8_t>(this->payload_precision);
+    writer.write<size_t>(this->db_url.size());
+    writer.writeBytes(this->db_url.data(), this->db_url.size());
+    writer.close();
+}
+
+SnapshotMeta SnapshotMeta::read(const std::string& dir) {
+    SnapshotReader reader(dir + "/" + snapshot_meta_file);
+    SnapshotMeta meta;
+    meta.d = reader.read<size_t>();
+    meta.nCells = reader.read<size_t>();
+    meta.nTotal = reader.read<float>();
+    meta.max_mem = reader.read<size_t>();
+    meta.eviction_policy = reader.read<uint8_t>();
+    meta.include_cells = reader.read<bool>();
+    meta.payload_precision = reader.read<uint8_t>();
+    size_t urlLength = reader.read<size_t>();
+    meta.db_url = std::string(reader.take(urlLength), urlLength);
+    return meta;
+}
+
+
+std::string locateSnapshot(const std::string& dir) {
+    std::string previous = dir + snapshot_previous_suffix;
+    if (!std::filesystem::exists(dir + "/" + snapshot_meta_file) && std::filesystem::exists(previous + "/" + snapshot_meta_file)) {
+        return previous;
+    }
+    return dir;
+}
+
+
+SnapshotWriter::SnapshotWriter(const std::string& path) : path(path), os(path, std::ios::binary | std::ios::trunc) {
+    if (!this->os) {
+        throw std::runtime_error("Failed to open snapshot file " + path + " for writing");
+    }
+    this->write<uint64_t>(snapshot_magic);
+    this->write<uint64_t>(snapshot_version);
+}
+
+void SnapshotWriter::writeBytes(const char *data, size_t length) {
+    this->os.write(data, length);
+    if (!this->os) {
+        throw std::runtime_error("Failed to write snapshot file " + this->path);
+    }
+    this->written += length;
+}
+
+void SnapshotWriter::align(size_t alignment) {
+    static const char zeros[64] = {};
+    while (this->written % alignment != 0) {
+        this->writeBytes(zeros, std::min(alignment - (this->written % alignment), sizeof(zeros)));
+    }
+}
+
+size_t SnapshotWriter::offset() const {
+    return this->written;
+}
+
+void SnapshotWriter::close() {
+    this->os.close();
+    if (!this->os) {
+        throw std::runtime_error("Failed to write snapshot file " + this->path);
+    }
+}
+
+
+SnapshotReader::SnapshotReader(const std::string& path) : path(path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+        throw std::runtime_error("Failed to open snapshot file " + path);
+    }
+    struct stat st;
+    if (::fstat(fd, &st) == -1 || st.st_size < (off_t)(2 * sizeof(uint64_t))) {
+        ::close(fd);
+        throw std::runtime_error("Snapshot file " + path + " is truncated");
+    }
+    this->size = st.st_size;
+    // Mapped privately so pages are only copied if something ever writes to them, the file itself is never modified
+    void *data = ::mmap(nullptr, this->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED) {
+        throw std::runtime_error("Failed to map snapshot file " + path);
+    }
+    size_t size = this->size;
+    this->mapping = std::shared_ptr<char[]>(static_cast<char *>(data), [size](char *ptr) { ::munmap(ptr, size); });
+
+    if (this->read<uint64_t>() != snapshot_magic) {
+        throw std::runtime_error(path + " is not a Periplus snapshot file");
+    }
+    uint64_t version = this->read<uint64_t>();
+    if (version != snapshot_version) {
+        throw std::runtime_error("Unsupported snapshot version " + std::to_string(version) + " in " + path);
+    }
+}
+
+const char *SnapshotReader::take(size_t length) {
+    if (length > this->size - this->offset) {
+        throw std::runtime_error("Snapshot file " + this->path + " is truncated");
+    }
+    const char *ptr = &this->mapping[this->offset];
+    this->offset += length;
+    return ptr;
+}
+
+void SnapshotReader::align(size_t alignment) {
+    this->seek(((this->offset + alignment - 1) / alignment) * alignment);
+}
+
+void SnapshotReader::seek(size_t offset) {
+    if (offset > this->size) {
+        throw std::runtime_error("Snapshot file " + this->path + " is truncated");
+    }
+    this->offset = offset;
+}
+
+std::shared_ptr<char[]> SnapshotReader::alias(const char *ptr) const {
+    return std::shared_ptr<char[]>(this->mapping, const_cast<char *>(ptr));
+}
@@ -0,0 +1,98 @@
+/*
+Snapshots persist a trained Periplus instance to a directory so it can be restarted without re-running INITIALIZE,
+TRAIN and every ADD, or reloading its hot cells from the database. A snapshot directory holds
+    meta    the settings the instance was initialized with
+    index   the trained quantizer and IVF index, written with FAISS I/O
+    ids     the id directory
+    cells   the arenas of the cells which were resident, only if they were included
+The ids and cells files are memory mapped on restore. Id strings and cell arenas are used in place and the rest is
+restored with a handful of bulk copies, so nothing is hashed or allocated per record.
+*/
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+static constexpr const char *snapshot_meta_file = "meta";
+static constexpr const char *snapshot_index_file = "index";
+static constexpr const char *snapshot_ids_file = "ids";
+static constexpr const char *snapshot_cells_file = "cells";
+// Cell arenas are aligned to a cache line within the cells file
+static constexpr const size_t snapshot_alignment = 64;
+// Number of u64 fields in each cell's entry of the cells file's table
+static constexpr const size_t snapshot_cell_entry = 5;
+// A snapshot being replaced is moved aside to its directory with this suffix until the new one is in place
+static constexpr const char *snapshot_previous_suffix = ".old";
+
+// Returns the directory the snapshot at dir is restored from: dir, or the previous snapshot moved aside if writing a
+// snapshot was interrupted between moving it and moving the new one into place
+std::string locateSnapshot(const std::string& dir);
+
+struct SnapshotMeta {
+    size_t d;
+    size_t nCells;
+    float nTotal;
+    size_t max_mem;
+    uint8_t eviction_policy;
+    bool include_cells;
+    // One of the EmbeddingPrecision values, which the cell arenas were written with
+    uint8_t payload_precision;
+    std::string db_url;
+
+    void write(const std::string& dir) const;
+    static SnapshotMeta read(const std::string& dir);
+};
+
+// Writes a snapshot file. Every file starts with a magic number and the format version.
+class SnapshotWriter {
+public:
+    explicit SnapshotWriter(const std::string& path);
+
+    template<typename T>
+    void write(const T& value) {
+        this->writeBytes(reinterpret_cast<const char *>(&value), sizeof(T));
+    }
+    void writeBytes(const char *data, size_t length);
+    // Pads the file with zeros up to a multiple of alignment
+    void align(size_t alignment);
+    size_t offset() const;
+    void close();
+
+private:
+    std::string path;
+    std::ofstream os;
+    size_t written = 0;
+};
+
+// Reads a memory mapped snapshot file. Reads are bounds checked so a truncated file is reported instead of read past.
+class SnapshotReader {
+public:
+    explicit SnapshotReader(const std::string& path);
+
+    template<typename T>
+    T read() {
+        T value;
+        std::memcpy(&value, this->take(sizeof(T)), sizeof(T));
+        return value;
+    }
+    // Returns a pointer to the next length bytes of the mapping and skips past them
+    const char *take(size_t length);
+    void align(size_t alignment);
+    void seek(size_t offset);
+    // Shares ownership of the mapping, which is unmapped once the reader and every alias are gone
+    std::shared_ptr<char[]> alias(const char *ptr) const;
+
+private:
+    std::string path;
+    std::shared_ptr<char[]> mapping;
+    size_t size = 0;
+    size_t offset = 0;
+};
+
+#endif
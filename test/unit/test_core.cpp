@@ -2,11 +2,30 @@
 #include <catch2/catch_test_macros.hpp>
 #include "../../src/data.h"
 #include "../../src/core.h"
+#include "../../src/reservoir_sampler.h"
+#include "../../src/metrics.h"
+#include "../../src/response.h"
+#include "../../src/cache.h"
+#include "../../src/session.h"
+#include "../../src/snapshot.h"
 #include <iostream>
 #include <cstdlib>
+#include <cmath>
 #include <stdexcept>
+#include <filesystem>
+#include <random>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <string>
+#include <sstream>
+#include <vector>
+#include <unistd.h>
 #include <faiss/IndexIVFFlat.h>
+#include <faiss/IndexIVFPQ.h>
+#include <faiss/IndexHNSW.h>
 #include <faiss/IndexFlat.h>
+#include <asio.hpp>
 
 
 void generate_data(size_t d, const float *centroids, std::vector<Data>& data, std::vector<float>& embeddings) {
@@ -76,17 +95,92 @@ TEST_CASE("Train the cache core", "[Core::train]") {
         x[i] = float(i);
     }
     // Train the cache core
-    core.train(n, x);
+    size_t steps = 0;
+    size_t lastStep = 0;
+    core.train(n, x, [&](size_t step, size_t total) {
+        REQUIRE(step == lastStep + 1);
+        lastStep = step;
+        steps = total;
+    });
 
     // Assert
     // ensure the centroid pointer is written to
     REQUIRE(core.centroids.get() != nullptr);
     // ensure the index pointer is written to
     REQUIRE(core.index.get() != nullptr);
+    REQUIRE(core.index->is_trained);
+    REQUIRE(core.quantizer->ntotal == 4);
+    // Every k-means iteration and the final index training step are reported
+    REQUIRE(steps == Core::kmeans_iterations + 1);
+    REQUIRE(lastStep == steps);
 
     // Figure out what else we can assert here...
 }
 
+TEST_CASE("K-means", "[Core::kmeans]") {
+    size_t d = 2;
+    float nTotal = 800;
+    std::shared_ptr<DBClient> client = std::shared_ptr<DBClient>(new DBClient_Mock(d));
+    size_t nCells = 4;
+    Core core(d, client, nCells, nTotal, false);
+
+    // Four well separated clusters of 100 vectors
+    const float centroids[] = {100, 100, -100, 100, 100, -100, -100, -100};
+    std::vector<Data> data;
+    std::vector<float> embeddings;
+    generate_data(d, centroids, data, embeddings);
+    faiss::idx_t n = embeddings.size() / d;
+
+    std::vector<size_t> steps;
+    std::vector<float> found = core.kmeans(n, embeddings.data(), [&](size_t step, size_t total) {
+        REQUIRE(total == Core::kmeans_iterations + 1);
+        steps.push_back(step);
+    });
+    REQUIRE(found.size() == nCells * d);
+    // One step per iteration, the last step is left for training the rest of the index
+    REQUIRE(steps.size() == Core::kmeans_iterations);
+    for (size_t i = 0; i < steps.size(); i++) {
+        REQUIRE(steps[i] == i + 1);
+    }
+
+    // Every cluster gets its own centroid, close to the cluster's centre
+    std::vector<bool> matched(nCells, false);
+    for (size_t c = 0; c < nCells; c++) {
+        for (size_t t = 0; t < nCells; t++) {
+            float dx = found[c * d] - centroids[t * d];
+            float dy = found[(c * d) + 1] - centroids[(t * d) + 1];
+            if ((dx * dx) + (dy * dy) < 25) {
+                REQUIRE_FALSE(matched[t]);
+                matched[t] = true;
+            }
+        }
+    }
+    for (size_t t = 0; t < nCells; t++) {
+        REQUIRE(matched[t]);
+    }
+
+    // Identical vectors leave clusters empty, which are split off the largest so every centroid is finite
+    std::vector<float> same(50 * d, 7.0f);
+    std::vector<float> degenerate = core.kmeans(50, same.data(), nullptr);
+    for (float value : degenerate) {
+        REQUIRE(std::isfinite(value));
+        REQUIRE(std::abs(value - 7.0f) < 0.1f);
+    }
+
+    // Clusters split off a centroid at the origin are still moved apart from it
+    std::vector<float> zeros(50 * d, 0.0f);
+    std::vector<float> split = core.kmeans(50, zeros.data(), nullptr);
+    bool moved = false;
+    for (float value : split) {
+        REQUIRE(std::abs(value) < 0.1f);
+        moved = moved || value != 0;
+    }
+    REQUIRE(moved);
+
+    // A cell can't be trained without a vector for it
+    REQUIRE_THROWS_AS(core.kmeans(nCells - 1, embeddings.data(), nullptr), std::runtime_error);
+}
+
 TEST_CASE("Load Cell", "[Core::loadCell]") {
     // Create cache core
     size_t d = 2;
@@ -124,18 +218,18 @@ TEST_CASE("Load Cell", "[Core::loadCell]") {
 
     // Load the first cell
     core.loadCell(0);
-    REQUIRE(core.data_map.size() == 100);
+    REQUIRE(core.store.size() == 100);
     // Load the 4th cell
     core.loadCell(3);
     // REQUIRE(core.embeddings.size() == 200);
-    REQUIRE(core.data_map.size() == 200);
+    REQUIRE(core.store.size() == 200);
 
 
     // Test multiple db queries needed to get full cell (Should need to make 3 total)
     core.nTotal = 100;
     core.loadCell(1);
     // REQUIRE(core.embeddings.size() == 300);
-    REQUIRE(core.data_map.size() == 300);
+    REQUIRE(core.store.size() == 300);
     // Is there a way to assert how many times db->search is being called to validate what we're testing?
 }
 
@@ -215,8 +309,8 @@ TEST_CASE("Search", "[Core::search]") {
 }
 
 
-TEST_CASE("Evict cell", "[Core::evictCell]") {
-    // Create Cache Core
+TEST_CASE("Batched search", "[Core::search]") {
+    // Create cache core
     size_t d = 2;
     float nTotal = 800;
     std::shared_ptr<DBClient_Mock> client = std::shared_ptr<DBClient_Mock>(new DBClient_Mock(d));
@@ -250,40 +344,1993 @@ TEST_CASE("Evict cell", "[Core::evictCell]") {
     // Load the external db the cache core pulls from
     client->loadDB(400, data.data());
 
-    // Load the first cell
     core.loadCell(0);
-
-    // Remove the cell
-    core.evictCell(0);
-    REQUIRE(core.data_map.size() == 0);
-    
-    core.loadCell(1);
     core.loadCell(3);
-    REQUIRE(core.data_map.size() == 200);
 
-    size_t xq_n = 1;
+    // Query the centroids of cells 0, 1 and 3. Cell 1 isn't loaded so the middle query is a miss.
+    size_t xq_n = 3;
     size_t k = 5;
-    std::vector<Data> results(k);
-    int cacheHits[n];
-    float xq[xq_n * d];
-    xq[0] = centroids[6];
-    xq[1] = centroids[7];
+    std::vector<Data> results(xq_n * k);
+    int cacheHits[xq_n];
+    float xq[] = {centroids[0], centroids[1], centroids[2], centroids[3], centroids[6], centroids[7]};
 
     size_t nprobe = 1;
     bool require_all = true;
     core.search(xq_n, xq, k, nprobe, require_all, results.data(), cacheHits);
     REQUIRE(cacheHits[0] == k);
-    for (size_t i = 0; i < results.size(); i++) {
-        for (size_t j = 0; j < d; j++) {
-            REQUIRE((results[i].embedding[j] <= -95 && results[i].embedding[j] >= -105));
+    REQUIRE(cacheHits[1] == -1);
+    REQUIRE(cacheHits[2] == k);
+
+    // Each query's results must come from its own cell
+    for (size_t j = 0; j < k; j++) {
+        for (size_t l = 0; l < d; l++) {
+            REQUIRE((results[j].embedding[l] <= 105 && results[j].embedding[l] >= 95));
+            REQUIRE((results[(2 * k) + j].embedding[l] <= -95 && results[(2 * k) + j].embedding[l] >= -105));
         }
     }
 
-    core.evictCell(3);
-    core.search(xq_n, xq, k, nprobe, require_all, results.data(), cacheHits);
+    // The cell behind the miss is reported once even when several queries miss on it
+    float xqMisses[] = {centroids[2], centroids[3], centroids[2], centroids[3], centroids[0], centroids[1]};
+    std::vector<faiss::idx_t> missing;
+    core.search(xq_n, xqMisses, k, nprobe, require_all, results.data(), cacheHits, &missing);
     REQUIRE(cacheHits[0] == -1);
-    REQUIRE(core.data_map.size() == 100);
-    
-    core.evictCell(1);
-    REQUIRE(core.data_map.size() == 0);
+    REQUIRE(cacheHits[1] == -1);
+    REQUIRE(cacheHits[2] == k);
+    REQUIRE(missing.size() == 1);
+    REQUIRE(missing[0] == 1);
+}
+
+
+TEST_CASE("Refine search results with exact distances", "[Core::refine]") {
+    // Large enough to get a product quantized index
+    size_t d = 64;
+    size_t n = 1000;
+    std::shared_ptr<DBClient_Mock> client = std::shared_ptr<DBClient_Mock>(new DBClient_Mock(d));
+    size_t nCells = 1;
+    Core core(d, client, nCells, n, false);
+    REQUIRE(dynamic_cast<faiss::IndexIVFPQ*>(core.index.get()) != nullptr);
+
+    std::mt19937 rng(7);
+    std::uniform_real_distribution<float> uniform(-1, 1);
+    std::vector<float> embeddings(n * d);
+    for (auto& x : embeddings) {
+        x = uniform(rng);
+    }
+
+    std::vector<Data> data;
+    std::vector<std::shared_ptr<char[]>> ids;
+    char document[] = "doc";
+    char metadata[] = "meta";
+    for (size_t i = 0; i < n; i++) {
+        std::string id = std::to_string(i);
+        ids.push_back(std::shared_ptr<char[]>(new char[id.size() + 1]));
+        std::memcpy(ids.back().get(), id.c_str(), id.size() + 1);
+        data.push_back(Data(id.size() + 1, d, 3, 4, ids.back().get(), &embeddings[i * d], document, metadata));
+    }
+
+    core.train(n, embeddings.data());
+    std::shared_ptr<float[]> embeddings_copy(new float[embeddings.size()]);
+    memcpy(embeddings_copy.get(), embeddings.data(), sizeof(float) * embeddings.size());
+    core.add(n, ids, embeddings_copy);
+    client->loadDB(n, data.data());
+    core.loadCell(0);
+
+    size_t xq_n = 4;
+    size_t k = 5;
+    std::vector<float> xq(xq_n * d);
+    for (auto& x : xq) {
+        x = uniform(rng);
+    }
+
+    // Taking every vector in the cell as a candidate makes the refined results the exact nearest neighbors
+    std::vector<Data> results(xq_n * k);
+    int cacheHits[xq_n];
+    SearchOptions options;
+    options.refine_factor = n / k;
+    core.search(xq_n, xq.data(), k, 1, true, results.data(), cacheHits, nullptr, options);
+    for (size_t i = 0; i < xq_n; i++) {
+        REQUIRE(cacheHits[i] == k);
+
+        std::vector<std::pair<float, size_t>> exact;
+        for (size_t j = 0; j < n; j++) {
+            float distance = 0;
+            for (size_t l = 0; l < d; l++) {
+                float diff = xq[(i * d) + l] - embeddings[(j * d) + l];
+                distance += diff * diff;
+            }
+            exact.push_back({distance, j});
+        }
+        std::sort(exact.begin(), exact.end());
+        for (size_t j = 0; j < k; j++) {
+            REQUIRE(std::string(results[(i * k) + j].id.get()) == std::to_string(exact[j].second));
+        }
+    }
+
+    // Without refinement the results come straight from the quantized index
+    core.search(xq_n, xq.data(), k, 1, true, results.data(), cacheHits);
+    for (size_t i = 0; i < xq_n; i++) {
+        REQUIRE(cacheHits[i] == k);
+    }
+}
+
+
+TEST_CASE("Search distances and thresholds", "[Core::search]") {
+    // Create cache core
+    size_t d = 2;
+    float nTotal = 800;
+    std::shared_ptr<DBClient_Mock> client = std::shared_ptr<DBClient_Mock>(new DBClient_Mock(d));
+    size_t nCells = 4;
+    Core core(d, client, nCells, nTotal, false);
+
+    // Manually set the centroids for testing purposes
+    const float centroids[] = {100, 100, -100, 100, 100, -100, -100, -100};
+    core.quantizer->add(nCells, centroids);
+
+    // Generate dataset
+    std::vector<Data> data;
+    std::vector<float> embeddings;
+    faiss::idx_t n = 800;
+    generate_data(d, centroids, data, embeddings);
+
+    std::vector<std::shared_ptr<char[]>> ids;
+    for (auto itr = data.begin(); itr != data.end(); itr++) {
+        ids.push_back(std::shared_ptr<char[]>(new char[itr->id_len]));
+        std::memcpy(ids[ids.size() - 1].get(), itr->id.get(), sizeof(char) * (itr->id_len));
+    }
+
+    std::shared_ptr<float[]> embeddings_copy(new float[embeddings.size()]);
+    memcpy(embeddings_copy.get(), embeddings.data(), sizeof(float) * embeddings.size());
+    core.add(data.size(), ids, embeddings_copy);
+
+    // Train the index
+    core.index->is_trained = true;
+    core.train(n, embeddings.data());
+
+    // Load the external db the cache core pulls from
+    client->loadDB(400, data.data());
+    core.loadCell(0);
+
+    size_t xq_n = 1;
+    size_t k = 5;
+    std::vector<Data> results(k);
+    std::vector<float> distances(k);
+    int cacheHits[xq_n];
+    float xq[] = {centroids[0] + 0.5f, centroids[1] + 0.5f};
+
+    // Each result comes with its squared L2 distance to the query, nearest first
+    core.search(xq_n, xq, k, 1, true, results.data(), cacheHits, nullptr, SearchOptions(), distances.data());
+    REQUIRE(cacheHits[0] == k);
+    for (size_t j = 0; j < k; j++) {
+        float dx = results[j].embedding[0] - xq[0];
+        float dy = results[j].embedding[1] - xq[1];
+        REQUIRE(std::abs(distances[j] - ((dx * dx) + (dy * dy))) < 1e-3);
+        if (j > 0) {
+            REQUIRE(distances[j - 1] <= distances[j]);
+        }
+    }
+
+    // Results past max_distance are dropped, and the query is still a hit when none are left
+    float max_distance = distances[0];
+    SearchOptions options;
+    options.max_distance = max_distance;
+    core.search(xq_n, xq, k, 1, true, results.data(), cacheHits, nullptr, options, distances.data());
+    REQUIRE(cacheHits[0] >= 1);
+    REQUIRE(cacheHits[0] <= k);
+    for (int j = 0; j < cacheHits[0]; j++) {
+        REQUIRE(distances[j] <= max_distance);
+    }
+
+    options.max_distance = 0.1f;
+    core.search(xq_n, xq, k, 1, true, results.data(), cacheHits, nullptr, options, distances.data());
+    REQUIRE(cacheHits[0] == 0);
+}
+
+
+TEST_CASE("Partial coverage search", "[Core::search]") {
+    // Create cache core
+    size_t d = 2;
+    float nTotal = 800;
+    std::shared_ptr<DBClient_Mock> client = std::shared_ptr<DBClient_Mock>(new DBClient_Mock(d));
+    size_t nCells = 4;
+    Core core(d, client, nCells, nTotal, false);
+
+    // Manually set the centroids for testing purposes
+    const float centroids[] = {100, 100, -100, 100, 100, -100, -100, -100};
+    core.quantizer->add(nCells, centroids);
+
+    // Generate dataset
+    std::vector<Data> data;
+    std::vector<float> embeddings;
+    faiss::idx_t n = 800;
+    generate_data(d, centroids, data, embeddings);
+
+    std::vector<std::shared_ptr<char[]>> ids;
+    for (auto itr = data.begin(); itr != data.end(); itr++) {
+        ids.push_back(std::shared_ptr<char[]>(new char[itr->id_len]));
+        std::memcpy(ids[ids.size() - 1].get(), itr->id.get(), sizeof(char) * (itr->id_len));
+    }
+
+    std::shared_ptr<float[]> embeddings_copy(new float[embeddings.size()]);
+    memcpy(embeddings_copy.get(), embeddings.data(), sizeof(float) * embeddings.size());
+    core.add(data.size(), ids, embeddings_copy);
+
+    // Train the index
+    core.index->is_trained = true;
+    core.train(n, embeddings.data());
+
+    // Load the external db the cache core pulls from
+    client->loadDB(400, data.data());
+    core.loadCell(0);
+
+    // Every cell holds the same number of vectors, so with one of the two nearest cells resident the coverage is half
+    size_t xq_n = 1;
+    size_t k = 5;
+    std::vector<Data> results(k);
+    int cacheHits[xq_n];
+    float coverage[xq_n];
+    float xq[] = {centroids[0], centroids[1]};
+    size_t nprobe = 2;
+
+    core.search(xq_n, xq, k, nprobe, true, results.data(), cacheHits, nullptr, SearchOptions(), nullptr, coverage);
+    REQUIRE(cacheHits[0] == -1);
+    REQUIRE(coverage[0] == 0.5f);
+
+    // Enough coverage makes it a hit which searches only the resident cell
+    SearchOptions options;
+    options.min_coverage = 0.5f;
+    std::vector<faiss::idx_t> missing;
+    core.search(xq_n, xq, k, nprobe, true, results.data(), cacheHits, &missing, options, nullptr, coverage);
+    REQUIRE(cacheHits[0] == k);
+    REQUIRE(coverage[0] == 0.5f);
+    REQUIRE(missing.empty());
+    for (size_t j = 0; j < k; j++) {
+        for (size_t l = 0; l < d; l++) {
+            REQUIRE((results[j].embedding[l] <= 105 && results[j].embedding[l] >= 95));
+        }
+    }
+
+    options.min_coverage = 0.75f;
+    core.search(xq_n, xq, k, nprobe, true, results.data(), cacheHits, &missing, options, nullptr, coverage);
+    REQUIRE(cacheHits[0] == -1);
+    REQUIRE(missing.size() == 1);
+
+    // A query whose nearest cell isn't resident can still be a hit
+    float xqNearCell1[] = {centroids[2] + 1, centroids[3] + 1};
+    options.min_coverage = 0.25f;
+    core.search(xq_n, xqNearCell1, k, nCells, true, results.data(), cacheHits, nullptr, options, nullptr, coverage);
+    REQUIRE(cacheHits[0] == k);
+    REQUIRE(coverage[0] == 0.25f);
+}
+
+
+TEST_CASE("Search with an HNSW quantizer", "[Core::search]") {
+    // Create cache core
+    size_t d = 2;
+    float nTotal = 800;
+    std::shared_ptr<DBClient_Mock> client = std::shared_ptr<DBClient_Mock>(new DBClient_Mock(d));
+    size_t nCells = 4;
+    Core core(d, client, nCells, nTotal, false, 0, LRU, HNSW_QUANTIZER);
+    REQUIRE(dynamic_cast<faiss::IndexHNSWFlat*>(core.quantizer.get()) != nullptr);
+
+    // Manually set the centroids for testing purposes
+    const float centroids[] = {100, 100, -100, 100, 100, -100, -100, -100};
+    core.quantizer->add(nCells, centroids);
+
+    // Generate dataset
+    std::vector<Data> data;
+    std::vector<float> embeddings;
+    faiss::idx_t n = 800;
+    generate_data(d, centroids, data, embeddings);
+
+    std::vector<std::shared_ptr<char[]>> ids;
+    for (auto itr = data.begin(); itr != data.end(); itr++) {
+        ids.push_back(std::shared_ptr<char[]>(new char[itr->id_len]));
+        std::memcpy(ids[ids.size() - 1].get(), itr->id.get(), sizeof(char) * (itr->id_len));
+    }
+
+    std::shared_ptr<float[]> embeddings_copy(new float[embeddings.size()]);
+    memcpy(embeddings_copy.get(), embeddings.data(), sizeof(float) * embeddings.size());
+    core.add(data.size(), ids, embeddings_copy);
+    for (size_t cell = 0; cell < nCells; cell++) {
+        REQUIRE(core.directory.cellSize(cell) == 100);
+    }
+
+    // Train the index
+    core.index->is_trained = true;
+    core.train(n, embeddings.data());
+
+    // Load the external db the cache core pulls from
+    client->loadDB(400, data.data());
+    core.loadCell(3);
+
+    size_t xq_n = 2;
+    size_t k = 5;
+    std::vector<Data> results(xq_n * k);
+    int cacheHits[xq_n];
+    float xq[] = {centroids[6], centroids[7], centroids[0], centroids[1]};
+    core.search(xq_n, xq, k, 1, true, results.data(), cacheHits);
+    REQUIRE(cacheHits[0] == k);
+    REQUIRE(cacheHits[1] == -1);
+    for (size_t j = 0; j < k; j++) {
+        for (size_t l = 0; l < d; l++) {
+            REQUIRE((results[j].embedding[l] <= -95 && results[j].embedding[l] >= -105));
+        }
+    }
+}
+
+
+// Returns only the nearest kept cells and pads the rest of the results with -1, as an HNSW quantizer can
+struct TruncatingQuantizer : faiss::Index {
+    std::shared_ptr<faiss::Index> inner;
+    faiss::idx_t kept;
+
+    TruncatingQuantizer(std::shared_ptr<faiss::Index> inner, faiss::idx_t kept) : faiss::Index(inner->d, inner->metric_type), inner(inner), kept(kept) {
+        this->ntotal = inner->ntotal;
+        this->is_trained = true;
+    }
+    void add(faiss::idx_t n, const float *x) override {
+        this->inner->add(n, x);
+        this->ntotal = this->inner->ntotal;
+    }
+    void reset() override {
+        this->inner->reset();
+        this->ntotal = 0;
+    }
+    void search(faiss::idx_t n, const float *x, faiss::idx_t k, float *distances, faiss::idx_t *labels, const faiss::SearchParameters *params = nullptr) const override {
+        this->inner->search(n, x, k, distances, labels, params);
+        for (faiss::idx_t i = 0; i < n; i++) {
+            for (faiss::idx_t j = this->kept; j < k; j++) {
+                labels[(i * k) + j] = -1;
+                distances[(i * k) + j] = std::numeric_limits<float>::infinity();
+            }
+        }
+    }
+};
+
+TEST_CASE("Search with fewer cells than nprobe", "[Core::search]") {
+    size_t d = 2;
+    float nTotal = 800;
+    std::shared_ptr<DBClient_Mock> client = std::shared_ptr<DBClient_Mock>(new DBClient_Mock(d));
+    size_t nCells = 4;
+    Core core(d, client, nCells, nTotal, false);
+
+    const float centroids[] = {100, 100, -100, 100, 100, -100, -100, -100};
+    core.quantizer->add(nCells, centroids);
+
+    std::vector<Data> data;
+    std::vector<float> embeddings;
+    faiss::idx_t n = 400;
+    generate_data(d, centroids, data, embeddings);
+
+    std::vector<std::shared_ptr<char[]>> ids;
+    for (auto itr = data.begin(); itr != data.end(); itr++) {
+        ids.push_back(std::shared_ptr<char[]>(new char[itr->id_len]));
+        std::memcpy(ids[ids.size() - 1].get(), itr->id.get(), sizeof(char) * (itr->id_len));
+    }
+    std::shared_ptr<float[]> embeddings_copy(new float[embeddings.size()]);
+    memcpy(embeddings_copy.get(), embeddings.data(), sizeof(float) * embeddings.size());
+    core.add(data.size(), ids, embeddings_copy);
+
+    core.index->is_trained = true;
+    core.train(n, embeddings.data());
+    client->loadDB(n, data.data());
+    core.loadCell(3);
+
+    // Only the nearest cell comes back from the quantizer
+    core.quantizer = std::make_shared<TruncatingQuantizer>(core.quantizer, 1);
+
+    size_t k = 5;
+    std::vector<Data> results(k);
+    std::vector<float> distances(k);
+    int cacheHits[1];
+    float coverage[1];
+    float xq[] = {centroids[6], centroids[7]};
+    std::vector<faiss::idx_t> missing;
+    core.search(1, xq, k, nCells, true, results.data(), cacheHits, &missing, SearchOptions(), distances.data(), coverage);
+    // The padding isn't counted as cells which aren't resident, nor probed
+    REQUIRE(cacheHits[0] == k);
+    REQUIRE(coverage[0] == 1.0f);
+    REQUIRE(missing.empty());
+    REQUIRE(core.cell_probes[3].load() == 1);
+    for (size_t cell = 0; cell < 3; cell++) {
+        REQUIRE(core.cell_probes[cell].load() == 0);
+    }
+
+    SearchOptions partial;
+    partial.min_coverage = 1;
+    core.search(1, xq, k, nCells, false, results.data(), cacheHits, nullptr, partial, distances.data(), coverage);
+    REQUIRE(cacheHits[0] == k);
+    REQUIRE(coverage[0] == 1.0f);
+
+    // Nor is it counted as resident when loading
+    std::shared_ptr<float[]> loadAt(new float[d]{centroids[6], centroids[7]});
+    LoadSources sources = core.loadCellWithVec(loadAt, nCells);
+    REQUIRE(sources.ram == 1);
+    REQUIRE(sources.db == 0);
+    REQUIRE(sources.disk == 0);
+
+    // A query the quantizer returns no cells for is a miss with nothing to load
+    core.quantizer = std::make_shared<TruncatingQuantizer>(core.quantizer, 0);
+    core.search(1, xq, k, nCells, true, results.data(), cacheHits, &missing, SearchOptions(), distances.data(), coverage);
+    REQUIRE(cacheHits[0] == -1);
+    REQUIRE(coverage[0] == 0);
+    REQUIRE(missing.empty());
+}
+
+
+TEST_CASE("Search with reduced precision payloads", "[CellArena]") {
+    // Create cache core
+    size_t d = 2;
+    float nTotal = 800;
+    std::shared_ptr<DBClient_Mock> client = std::shared_ptr<DBClient_Mock>(new DBClient_Mock(d));
+    size_t nCells = 4;
+    Core core(d, client, nCells, nTotal, false);
+    // Every generated component is an integer of magnitude at most 105, which bf16 holds exactly
+    core.payload_precision = PRECISION_BF16;
+
+    // Manually set the centroids for testing purposes
+    const float centroids[] = {100, 100, -100, 100, 100, -100, -100, -100};
+    core.quantizer->add(nCells, centroids);
+
+    // Generate dataset
+    std::vector<Data> data;
+    std::vector<float> embeddings;
+    faiss::idx_t n = 800;
+    generate_data(d, centroids, data, embeddings);
+
+    std::vector<std::shared_ptr<char[]>> ids;
+    for (auto itr = data.begin(); itr != data.end(); itr++) {
+        ids.push_back(std::shared_ptr<char[]>(new char[itr->id_len]));
+        std::memcpy(ids[ids.size() - 1].get(), itr->id.get(), sizeof(char) * (itr->id_len));
+    }
+
+    std::shared_ptr<float[]> embeddings_copy(new float[embeddings.size()]);
+    memcpy(embeddings_copy.get(), embeddings.data(), sizeof(float) * embeddings.size());
+    core.add(data.size(), ids, embeddings_copy);
+
+    // Train the index
+    core.index->is_trained = true;
+    core.train(n, embeddings.data());
+
+    // Load the external db the cache core pulls from
+    client->loadDB(400, data.data());
+    core.loadCell(3);
+    // The arena keeps each embedding in half the bytes, plus the same offsets and strings
+    std::shared_ptr<const CellArena> arena = core.store.arena(3);
+    REQUIRE(arena->precision == PRECISION_BF16);
+    REQUIRE(std::string(arena->get(0).id.get()) == std::string(data[300].id.get()));
+
+    size_t k = 5;
+    std::vector<Data> results(k);
+    int cacheHits[1];
+    float xq[] = {centroids[6], centroids[7]};
+    core.search(1, xq, k, 1, true, results.data(), cacheHits);
+    REQUIRE(cacheHits[0] == k);
+    for (size_t j = 0; j < k; j++) {
+        REQUIRE(results[j].embedding_precision == PRECISION_BF16);
+        REQUIRE(results[j].embedding_code.get() != nullptr);
+        for (size_t l = 0; l < d; l++) {
+            REQUIRE((results[j].embedding[l] <= -95 && results[j].embedding[l] >= -105));
+        }
+    }
+
+    // Without decoding, results only carry the codes
+    SearchOptions options;
+    options.decode_embeddings = false;
+    core.search(1, xq, k, 1, true, results.data(), cacheHits, nullptr, options);
+    REQUIRE(cacheHits[0] == k);
+    for (size_t j = 0; j < k; j++) {
+        REQUIRE(results[j].embedding.get() == nullptr);
+        float decoded[2];
+        decodeEmbedding(results[j].embedding_code.get(), d, PRECISION_BF16, decoded);
+        REQUIRE((decoded[0] <= -95 && decoded[0] >= -105));
+    }
+
+    // Codes of each precision decode back to within its rounding error, tails past a SIMD register included
+    size_t dims = 21;
+    std::vector<float> x(dims);
+    for (size_t i = 0; i < dims; i++) {
+        x[i] = std::sin(i + 1.0f) * 3;
+    }
+    for (EmbeddingPrecision precision : {PRECISION_FP32, PRECISION_FP16, PRECISION_BF16, PRECISION_INT8}) {
+        std::vector<char> code(embeddingCodeSize(dims, precision));
+        std::vector<float> decoded(dims);
+        encodeEmbedding(x.data(), dims, precision, code.data());
+        decodeEmbedding(code.data(), dims, precision, decoded.data());
+        float tolerance = precision == PRECISION_INT8 ? 3.0f / 254 : precision == PRECISION_BF16 ? 3.0f / 256 : 3.0f / 2048;
+        for (size_t i = 0; i < dims; i++) {
+            REQUIRE(std::fabs(decoded[i] - x[i]) <= tolerance);
+        }
+    }
+    REQUIRE(embeddingCodeSize(dims, PRECISION_FP16) == dims * 2);
+    REQUIRE(embeddingCodeSize(dims, PRECISION_INT8) == dims + sizeof(float));
+}
+
+
+TEST_CASE("Claim cells", "[Core::claimCells]") {
+    // Create cache core
+    size_t d = 2;
+    float nTotal = 800;
+    std::shared_ptr<DBClient_Mock> client = std::shared_ptr<DBClient_Mock>(new DBClient_Mock(d));
+    size_t nCells = 4;
+    Core core(d, client, nCells, nTotal, false);
+
+    // Manually set the centroids for testing purposes
+    const float centroids[] = {100, 100, -100, 100, 100, -100, -100, -100};
+    core.quantizer->add(nCells, centroids);
+
+    // Generate dataset
+    std::vector<Data> data;
+    std::vector<float> embeddings;
+    faiss::idx_t n = 800;
+    generate_data(d, centroids, data, embeddings);
+
+    std::vector<std::shared_ptr<char[]>> ids;
+    for (auto itr = data.begin(); itr != data.end(); itr++) {
+        ids.push_back(std::shared_ptr<char[]>(new char[itr->id_len]));
+        std::memcpy(ids[ids.size() - 1].get(), itr->id.get(), sizeof(char) * (itr->id_len));
+    }
+
+    std::shared_ptr<float[]> embeddings_copy(new float[embeddings.size()]);
+    memcpy(embeddings_copy.get(), embeddings.data(), sizeof(float) * embeddings.size());
+    core.add(data.size(), ids, embeddings_copy);
+
+    // Train the index
+    core.index->is_trained = true;
+    core.train(n, embeddings.data());
+
+    // Load the external db the cache core pulls from
+    client->loadDB(400, data.data());
+
+    // Claiming marks the cell as loading and a second claim of the same cell is deduplicated
+    std::vector<faiss::idx_t> claimed = core.claimCells({0, 0});
+    REQUIRE(claimed.size() == 1);
+    REQUIRE(core.residence_statuses[0] == Core::LOADING);
+    REQUIRE(core.claimCells({0}).empty());
+
+    // A cell that is still loading is a cache miss
+    size_t xq_n = 1;
+    size_t k = 5;
+    std::vector<Data> results(k);
+    int cacheHits[xq_n];
+    float xq[] = {centroids[0], centroids[1]};
+    core.search(xq_n, xq, k, 1, true, results.data(), cacheHits);
+    REQUIRE(cacheHits[0] == -1);
+
+    core.loadCells(claimed);
+    REQUIRE(core.residence_statuses[0] == 100);
+    core.search(xq_n, xq, k, 1, true, results.data(), cacheHits);
+    REQUIRE(cacheHits[0] == k);
+}
+
+
+TEST_CASE("Load multiple cells", "[Core::loadCellWithVec]") {
+    // Create cache core
+    size_t d = 2;
+    float nTotal = 800;
+    std::shared_ptr<DBClient_Mock> client = std::shared_ptr<DBClient_Mock>(new DBClient_Mock(d));
+    size_t nCells = 4;
+    Core core(d, client, nCells, nTotal, false);
+
+    // Manually set the centroids for testing purposes
+    const float centroids[] = {100, 100, -100, 100, 100, -100, -100, -100};
+    core.quantizer->add(nCells, centroids);
+
+    // Generate dataset
+    std::vector<Data> data;
+    std::vector<float> embeddings;
+    faiss::idx_t n = 800;
+    generate_data(d, centroids, data, embeddings);
+
+    std::vector<std::shared_ptr<char[]>> ids;
+    for (auto itr = data.begin(); itr != data.end(); itr++) {
+        ids.push_back(std::shared_ptr<char[]>(new char[itr->id_len]));
+        std::memcpy(ids[ids.size() - 1].get(), itr->id.get(), sizeof(char) * (itr->id_len));
+    }
+
+    std::shared_ptr<float[]> embeddings_copy(new float[embeddings.size()]);
+    memcpy(embeddings_copy.get(), embeddings.data(), sizeof(float) * embeddings.size());
+    core.add(data.size(), ids, embeddings_copy);
+
+    // Train the index
+    core.index->is_trained = true;
+    core.train(n, embeddings.data());
+
+    // Load the external db the cache core pulls from
+    client->loadDB(400, data.data());
+
+    // The two nearest cells to a point between cells 0 and 1 are loaded with a single database request
+    std::shared_ptr<float[]> xq(new float[d]);
+    xq[0] = 0;
+    xq[1] = 100;
+    core.loadCellWithVec(xq, 2);
+    REQUIRE(client->n_searches == 1);
+    REQUIRE(core.residence_statuses[0] == 100);
+    REQUIRE(core.residence_statuses[1] == 100);
+    REQUIRE(core.store.size() == 200);
+    REQUIRE(core.index->ntotal == 200);
+    REQUIRE(core.index->get_list_size(0) == 100);
+    REQUIRE(core.index->get_list_size(1) == 100);
+}
+
+
+// Runs on_search after each database search, while the core isn't locked
+struct DBClient_HookMock : DBClient_Mock {
+    std::function<void()> on_search;
+
+    DBClient_HookMock(size_t d) : DBClient_Mock(d) {}
+    void search(const std::vector<std::string_view>& ids, Data *x) override {
+        DBClient_Mock::search(ids, x);
+        if (this->on_search) {
+            this->on_search();
+        }
+    }
+};
+
+TEST_CASE("Refetch cells added to while loading", "[Core::loadCells]") {
+    size_t d = 2;
+    float nTotal = 800;
+    std::shared_ptr<DBClient_HookMock> client = std::shared_ptr<DBClient_HookMock>(new DBClient_HookMock(d));
+    size_t nCells = 4;
+    Core core(d, client, nCells, nTotal, false);
+
+    const float centroids[] = {100, 100, -100, 100, 100, -100, -100, -100};
+    core.quantizer->add(nCells, centroids);
+
+    std::vector<Data> data;
+    std::vector<float> embeddings;
+    faiss::idx_t n = 400;
+    generate_data(d, centroids, data, embeddings);
+
+    std::vector<std::shared_ptr<char[]>> ids;
+    for (auto itr = data.begin(); itr != data.end(); itr++) {
+        ids.push_back(std::shared_ptr<char[]>(new char[itr->id_len]));
+        std::memcpy(ids[ids.size() - 1].get(), itr->id.get(), sizeof(char) * (itr->id_len));
+    }
+    std::shared_ptr<float[]> embeddings_copy(new float[embeddings.size()]);
+    memcpy(embeddings_copy.get(), embeddings.data(), sizeof(float) * embeddings.size());
+    core.add(data.size(), ids, embeddings_copy);
+
+    core.index->is_trained = true;
+    core.train(n, embeddings.data());
+    client->loadDB(n, data.data());
+
+    // Each search adds another vector to cell 3 and the database, which the search itself missed
+    std::vector<Data> added;
+    auto addToCell = [&]() {
+        std::string id = "added" + std::to_string(added.size());
+        std::vector<char> idChars(id.begin(), id.end());
+        idChars.push_back('\0');
+        float embedding[] = {-110, -110};
+        char document[] = "doc";
+        char metadata[] = "meta";
+        added.push_back(Data(idChars.size(), d, 3, 4, idChars.data(), embedding, document, metadata));
+        client->loadDB(1, &added.back());
+
+        std::vector<std::shared_ptr<char[]>> addedIds = {std::shared_ptr<char[]>(new char[idChars.size()])};
+        std::memcpy(addedIds[0].get(), idChars.data(), idChars.size());
+        std::shared_ptr<float[]> addedEmbedding(new float[d]{-110, -110});
+        core.add(1, addedIds, addedEmbedding);
+    };
+    added.reserve(Core::max_load_attempts + 1);
+
+    // The cell is fetched again with the added id
+    client->on_search = [&]() {
+        client->on_search = nullptr;
+        addToCell();
+    };
+    core.loadCell(3);
+    REQUIRE(client->n_searches == 2);
+    REQUIRE(core.directory.cellSize(3) == 101);
+    REQUIRE(core.residence_statuses[3] == 101);
+    REQUIRE(core.store.arena(3)->n == 101);
+    REQUIRE(core.index->get_list_size(3) == 101);
+
+    // Ids keep being added, so once out of attempts the cell is installed with what was fetched and left stale
+    core.evictCell(3);
+    client->n_searches = 0;
+    client->on_search = addToCell;
+    core.loadCell(3);
+    client->on_search = nullptr;
+    REQUIRE(client->n_searches == Core::max_load_attempts);
+    REQUIRE(core.directory.cellSize(3) == 101 + Core::max_load_attempts);
+    REQUIRE(core.residence_statuses[3] == 101 + Core::max_load_attempts - 1);
+    REQUIRE(core.store.arena(3)->n == 101 + Core::max_load_attempts - 1);
+
+    // Only the records the database returned count towards the status, so the cell is stale without one of them
+    client->data_map.erase("5");
+    core.loadCell(0);
+    REQUIRE(core.directory.cellSize(0) == 100);
+    REQUIRE(core.residence_statuses[0] == 99);
+    REQUIRE(core.store.arena(0)->n == 99);
+}
+
+
+TEST_CASE("Evict to stay within the memory budget", "[Core::makeRoom]") {
+    // Create cache core
+    size_t d = 2;
+    float nTotal = 800;
+    std::shared_ptr<DBClient_Mock> client = std::shared_ptr<DBClient_Mock>(new DBClient_Mock(d));
+    size_t nCells = 4;
+    Core core(d, client, nCells, nTotal, false);
+
+    // Manually set the centroids for testing purposes
+    const float centroids[] = {100, 100, -100, 100, 100, -100, -100, -100};
+    core.quantizer->add(nCells, centroids);
+
+    // Generate dataset
+    std::vector<Data> data;
+    std::vector<float> embeddings;
+    faiss::idx_t n = 800;
+    generate_data(d, centroids, data, embeddings);
+
+    std::vector<std::shared_ptr<char[]>> ids;
+    for (auto itr = data.begin(); itr != data.end(); itr++) {
+        ids.push_back(std::shared_ptr<char[]>(new char[itr->id_len]));
+        std::memcpy(ids[ids.size() - 1].get(), itr->id.get(), sizeof(char) * (itr->id_len));
+    }
+
+    std::shared_ptr<float[]> embeddings_copy(new float[embeddings.size()]);
+    memcpy(embeddings_copy.get(), embeddings.data(), sizeof(float) * embeddings.size());
+    core.add(data.size(), ids, embeddings_copy);
+
+    // Train the index
+    core.index->is_trained = true;
+    core.train(n, embeddings.data());
+
+    // Load the external db the cache core pulls from
+    client->loadDB(400, data.data());
+
+    // Cells 1, 2 and 3 hold the same number of bytes, so the budget only fits two of them
+    core.loadCell(1);
+    core.loadCell(2);
+    REQUIRE(core.resident_bytes > 0);
+    REQUIRE(core.resident_bytes == core.cell_bytes[1] + core.cell_bytes[2]);
+    core.max_mem = core.resident_bytes;
+
+    // Search cell 1 so cell 2 becomes the least recently used
+    float xq[] = {-100, 100};
+    Data results[1];
+    int cacheHits[1];
+    core.search(1, xq, 1, 1, true, results, cacheHits);
+    REQUIRE(cacheHits[0] == 1);
+    REQUIRE(core.cell_stats[1].accesses == 1);
+
+    core.loadCell(3);
+    REQUIRE(core.residence_statuses[1] == 100);
+    REQUIRE(core.residence_statuses[2] == Core::NOT_RESIDENT);
+    REQUIRE(core.residence_statuses[3] == 100);
+    REQUIRE(core.resident_bytes <= core.max_mem);
+    REQUIRE(core.store.size() == 200);
+    REQUIRE(core.index->get_list_size(2) == 0);
+
+    // A load that can never fit is rejected and leaves the resident cells alone
+    core.max_mem = 1;
+    REQUIRE_THROWS(core.loadCell(0));
+    REQUIRE(core.residence_statuses[0] == Core::NOT_RESIDENT);
+    REQUIRE(core.residence_statuses[1] == 100);
+}
+
+
+TEST_CASE("Evict cell", "[Core::evictCell]") {
+    // Create Cache Core
+    size_t d = 2;
+    float nTotal = 800;
+    std::shared_ptr<DBClient_Mock> client = std::shared_ptr<DBClient_Mock>(new DBClient_Mock(d));
+    size_t nCells = 4;
+    Core core(d, client, nCells, nTotal, false);
+
+    // Manually set the centroids for testing purposes
+    const float centroids[] = {100, 100, -100, 100, 100, -100, -100, -100};
+    core.quantizer->add(nCells, centroids);
+
+    // Generate dataset
+    std::vector<Data> data;
+    std::vector<float> embeddings;
+    faiss::idx_t n = 800;
+    generate_data(d, centroids, data, embeddings);
+
+    std::vector<std::shared_ptr<char[]>> ids;
+    for (auto itr = data.begin(); itr != data.end(); itr++) {
+        ids.push_back(std::shared_ptr<char[]>(new char[itr->id_len]));
+        std::memcpy(ids[ids.size() - 1].get(), itr->id.get(), sizeof(char) * (itr->id_len));
+    }
+
+    std::shared_ptr<float[]> embeddings_copy(new float[embeddings.size()]);
+    memcpy(embeddings_copy.get(), embeddings.data(), sizeof(float) * embeddings.size());
+    core.add(data.size(), ids, embeddings_copy);
+
+    // Train the index
+    core.index->is_trained = true;
+    core.train(n, embeddings.data());
+
+    // Load the external db the cache core pulls from
+    client->loadDB(400, data.data());
+
+    // Load the first cell
+    core.loadCell(0);
+
+    // Remove the cell
+    core.evictCell(0);
+    REQUIRE(core.store.size() == 0);
+    
+    core.loadCell(1);
+    core.loadCell(3);
+    REQUIRE(core.store.size() == 200);
+
+    size_t xq_n = 1;
+    size_t k = 5;
+    std::vector<Data> results(k);
+    int cacheHits[n];
+    float xq[xq_n * d];
+    xq[0] = centroids[6];
+    xq[1] = centroids[7];
+
+    size_t nprobe = 1;
+    bool require_all = true;
+    core.search(xq_n, xq, k, nprobe, require_all, results.data(), cacheHits);
+    REQUIRE(cacheHits[0] == k);
+    for (size_t i = 0; i < results.size(); i++) {
+        for (size_t j = 0; j < d; j++) {
+            REQUIRE((results[i].embedding[j] <= -95 && results[i].embedding[j] >= -105));
+        }
+    }
+
+    core.evictCell(3);
+    core.search(xq_n, xq, k, nprobe, require_all, results.data(), cacheHits);
+    REQUIRE(cacheHits[0] == -1);
+    REQUIRE(core.store.size() == 100);
+    REQUIRE(core.store.cellSize(3) == 0);
+
+    // Results handed out before the eviction keep the evicted cell's arena alive
+    for (size_t i = 0; i < results.size(); i++) {
+        REQUIRE(results[i].embedding_len == d);
+        REQUIRE((results[i].embedding[0] <= -95 && results[i].embedding[0] >= -105));
+        REQUIRE(std::strlen(results[i].id.get()) == results[i].id_len - 1);
+    }
+    
+    core.evictCell(1);
+    REQUIRE(core.store.size() == 0);
+}
+
+
+TEST_CASE("Id directory", "[IdDirectory]") {
+    size_t nCells = 4;
+    IdDirectory directory(nCells);
+
+    // Enough ids to grow the hash table a few times
+    size_t n = 5000;
+    for (size_t i = 0; i < n; i++) {
+        std::string id = "id-" + std::to_string(i);
+        REQUIRE(directory.insert(id, i % nCells) == (faiss::idx_t)i);
+    }
+    REQUIRE(directory.size() == n);
+    REQUIRE(directory.insert("id-42", 0) == -1);
+    REQUIRE(directory.size() == n);
+
+    for (size_t i = 0; i < n; i++) {
+        std::string id = "id-" + std::to_string(i);
+        REQUIRE(directory.find(id) == (faiss::idx_t)i);
+        REQUIRE(directory.get(i) == id);
+    }
+    REQUIRE(directory.find("id-5000") == -1);
+
+    for (size_t c = 0; c < nCells; c++) {
+        REQUIRE(directory.cellSize(c) == n / nCells);
+        for (faiss::idx_t internal : directory.cell(c)) {
+            REQUIRE((size_t)internal % nCells == c);
+        }
+    }
+
+    // Ids longer than a pool chunk get a chunk of their own
+    std::string long_id(2 << 20, 'x');
+    faiss::idx_t internal = directory.insert(long_id, 1);
+    REQUIRE(directory.get(internal) == long_id);
+    REQUIRE(directory.get(0) == "id-0");
+    REQUIRE(directory.memoryUsage() > long_id.size());
+
+    // Removing ids takes them out of the table and their cells, and frees their internal ids for reuse
+    for (size_t i = 0; i < n; i += 2) {
+        REQUIRE(directory.remove("id-" + std::to_string(i)) == (faiss::idx_t)i);
+    }
+    REQUIRE(directory.remove("id-0") == -1);
+    REQUIRE(directory.size() == (n / 2) + 1);
+    for (size_t i = 0; i < n; i++) {
+        std::string id = "id-" + std::to_string(i);
+        if (i % 2 == 0) {
+            REQUIRE(directory.find(id) == -1);
+        } else {
+            REQUIRE(directory.find(id) == (faiss::idx_t)i);
+            REQUIRE(directory.cellOf(i) == (faiss::idx_t)(i % nCells));
+        }
+    }
+    REQUIRE(directory.cellSize(0) == 0);
+    REQUIRE(directory.cellSize(1) == (n / nCells) + 1);
+    REQUIRE(directory.cellSize(2) == 0);
+    for (faiss::idx_t internal : directory.cell(3)) {
+        REQUIRE(directory.cellOf(internal) == 3);
+    }
+
+    faiss::idx_t reused = directory.insert("id-new", 2);
+    REQUIRE(reused % 2 == 0);
+    REQUIRE(reused < (faiss::idx_t)n);
+    REQUIRE(directory.find("id-new") == reused);
+    REQUIRE(directory.cell(2) == std::vector<faiss::idx_t>{reused});
+    REQUIRE(directory.size() == (n / 2) + 2);
+
+    // Ids which are removed and added back, as UPSERT does, get their old internal id and string again, so the
+    // pool doesn't grow
+    std::string_view view = directory.get(1);
+    size_t memory = directory.memoryUsage();
+    for (size_t i = 0; i < 1000; i++) {
+        REQUIRE(directory.remove("id-1") == 1);
+        REQUIRE(directory.find("id-1") == -1);
+        REQUIRE(directory.insert("id-1", 0) == 1);
+    }
+    REQUIRE(directory.get(1).data() == view.data());
+    REQUIRE(directory.find("id-1") == 1);
+    REQUIRE(directory.cellOf(1) == 0);
+    REQUIRE(directory.insert("id-2", 0) == 2);
+    REQUIRE(directory.find("id-2") == 2);
+    REQUIRE(directory.memoryUsage() == memory);
+    REQUIRE(directory.size() == (n / 2) + 3);
+}
+
+
+TEST_CASE("Delete and upsert vectors", "[Core::remove]") {
+    size_t d = 2;
+    float nTotal = 800;
+    std::shared_ptr<DBClient_Mock> client = std::shared_ptr<DBClient_Mock>(new DBClient_Mock(d));
+    size_t nCells = 4;
+    Core core(d, client, nCells, nTotal, true);
+
+    const float centroids[] = {100, 100, -100, 100, 100, -100, -100, -100};
+    core.quantizer->add(nCells, centroids);
+
+    std::vector<Data> data;
+    std::vector<float> embeddings;
+    faiss::idx_t n = 400;
+    generate_data(d, centroids, data, embeddings);
+
+    std::vector<std::shared_ptr<char[]>> ids;
+    for (auto itr = data.begin(); itr != data.end(); itr++) {
+        ids.push_back(std::shared_ptr<char[]>(new char[itr->id_len]));
+        std::memcpy(ids[ids.size() - 1].get(), itr->id.get(), sizeof(char) * (itr->id_len));
+    }
+    std::shared_ptr<float[]> embeddings_copy(new float[embeddings.size()]);
+    memcpy(embeddings_copy.get(), embeddings.data(), sizeof(float) * embeddings.size());
+    core.add(data.size(), ids, embeddings_copy);
+
+    core.index->is_trained = true;
+    core.train(n, embeddings.data());
+    client->loadDB(n, data.data());
+    core.loadCell(3);
+    REQUIRE(core.index->ntotal == 100);
+
+    size_t k = 5;
+    float xq[] = {centroids[6], centroids[7]};
+    std::vector<Data> results(k);
+    int cacheHits[1];
+    core.search(1, xq, k, 1, true, results.data(), cacheHits);
+    REQUIRE(cacheHits[0] == 1);
+    std::string nearest(results[0].id.get());
+
+    // The nearest vector is dropped from the resident cell, an id of a cell which isn't resident is only dropped
+    // from the directory, and unknown ids are skipped
+    auto makeId = [](const std::string& id) {
+        std::shared_ptr<char[]> copy(new char[id.size() + 1]);
+        std::memcpy(copy.get(), id.c_str(), id.size() + 1);
+        return copy;
+    };
+    std::vector<std::shared_ptr<char[]>> deleted = {makeId(nearest), makeId("0"), makeId("unknown")};
+    REQUIRE(core.remove(deleted.size(), deleted) == 2);
+    REQUIRE(core.directory.find(nearest) == -1);
+    REQUIRE(core.directory.find("0") == -1);
+    REQUIRE(core.directory.cellSize(0) == 99);
+    REQUIRE(core.directory.cellSize(3) == 99);
+    REQUIRE(core.index->ntotal == 99);
+    REQUIRE(core.index->get_list_size(3) == 99);
+    REQUIRE(core.store.arena(3)->n == 99);
+    REQUIRE(core.residence_statuses[3] == 99);
+
+    std::vector<Data> afterDelete(k);
+    core.search(1, xq, k, 1, true, afterDelete.data(), cacheHits);
+    REQUIRE(cacheHits[0] == 1);
+    for (size_t i = 0; i < k; i++) {
+        REQUIRE(std::string(afterDelete[i].id.get()) != nearest);
+        // The remaining records still line up with their slots in the arena
+        faiss::idx_t internal = core.directory.find(afterDelete[i].id.get());
+        REQUIRE(internal != -1);
+        REQUIRE(core.directory.cellOf(internal) == 3);
+    }
+
+    // Upserting the next nearest vector next to the first centroid moves it to the first cell, and the resident cell
+    // stops returning it straight away
+    std::string moved(afterDelete[0].id.get());
+    std::vector<std::shared_ptr<char[]>> upserted = {makeId(moved)};
+    std::shared_ptr<float[]> movedEmbedding(new float[d]{centroids[0], centroids[1]});
+    core.upsert(upserted.size(), upserted, movedEmbedding);
+    faiss::idx_t internal = core.directory.find(moved);
+    REQUIRE(internal != -1);
+    REQUIRE(core.directory.cellOf(internal) == 0);
+    REQUIRE(core.directory.cellSize(0) == 100);
+    REQUIRE(core.directory.cellSize(3) == 98);
+    REQUIRE(core.index->ntotal == 98);
+    REQUIRE(core.store.arena(3)->n == 98);
+    REQUIRE(core.residence_statuses[3] == 98);
+
+    std::vector<Data> afterUpsert(k);
+    core.search(1, xq, k, 1, true, afterUpsert.data(), cacheHits);
+    for (size_t i = 0; i < k; i++) {
+        REQUIRE(std::string(afterUpsert[i].id.get()) != moved);
+    }
+    REQUIRE(core.directory.size() == 399);
+}
+
+
+TEST_CASE("Write added vectors through to resident cells", "[Core::appendToCell]") {
+    size_t d = 2;
+    float nTotal = 800;
+    std::shared_ptr<DBClient_Mock> client = std::shared_ptr<DBClient_Mock>(new DBClient_Mock(d));
+    size_t nCells = 4;
+    Core core(d, client, nCells, nTotal, true);
+
+    const float centroids[] = {100, 100, -100, 100, 100, -100, -100, -100};
+    core.quantizer->add(nCells, centroids);
+
+    std::vector<Data> data;
+    std::vector<float> embeddings;
+    faiss::idx_t n = 400;
+    generate_data(d, centroids, data, embeddings);
+
+    std::vector<std::shared_ptr<char[]>> ids;
+    for (auto itr = data.begin(); itr != data.end(); itr++) {
+        ids.push_back(std::shared_ptr<char[]>(new char[itr->id_len]));
+        std::memcpy(ids[ids.size() - 1].get(), itr->id.get(), sizeof(char) * (itr->id_len));
+    }
+    std::shared_ptr<float[]> embeddings_copy(new float[embeddings.size()]);
+    memcpy(embeddings_copy.get(), embeddings.data(), sizeof(float) * embeddings.size());
+    core.add(data.size(), ids, embeddings_copy);
+
+    core.index->is_trained = true;
+    core.train(n, embeddings.data());
+    client->loadDB(n, data.data());
+    core.loadCell(3);
+    size_t bytes = core.resident_bytes;
+
+    auto makeString = [](const std::string& str) {
+        std::shared_ptr<char[]> copy(new char[str.size() + 1]);
+        std::memcpy(copy.get(), str.c_str(), str.size() + 1);
+        return copy;
+    };
+
+    // Away from the generated vectors, so it's the only result at distance 0
+    float xq[] = {-120, -120};
+    std::vector<std::shared_ptr<char[]>> freshIds = {makeString("fresh"), makeString("elsewhere")};
+    std::shared_ptr<float[]> freshEmbeddings(new float[4]{-120, -120, 120, 120});
+    std::vector<Payload> payloads(2);
+    payloads[0].document_len = 5;
+    payloads[0].document = makeString("hello");
+    payloads[0].metadata = makeString("");
+    payloads[1].metadata_len = 2;
+    payloads[1].document = makeString("");
+    payloads[1].metadata = makeString("{}");
+    core.add(2, freshIds, freshEmbeddings, &payloads);
+
+    // Only the vector landing in the resident cell is written through, and the cell stays current
+    REQUIRE(core.index->ntotal == 101);
+    REQUIRE(core.store.arena(3)->n == 101);
+    REQUIRE(core.residence_statuses[3] == 101);
+    REQUIRE(core.directory.cellSize(3) == 101);
+    REQUIRE(core.directory.cellSize(0) == 101);
+    REQUIRE(core.resident_bytes > bytes);
+    REQUIRE(core.resident_bytes == core.cell_bytes[3]);
+
+    size_t k = 3;
+    std::vector<Data> results(k);
+    std::vector<float> distances(k);
+    int cacheHits[1];
+    core.search(1, xq, k, 1, true, results.data(), cacheHits, nullptr, SearchOptions(), distances.data());
+    REQUIRE(std::string(results[0].id.get()) == "fresh");
+    REQUIRE(std::string(results[0].document.get(), results[0].document_len) == "hello");
+    REQUIRE(results[0].embedding[0] == -120);
+    REQUIRE(distances[0] == 0);
+    // The records which were already resident still line up with their slots
+    for (size_t i = 1; i < k; i++) {
+        faiss::idx_t internal = core.directory.find(results[i].id.get());
+        REQUIRE(internal != -1);
+        REQUIRE(core.directory.cellOf(internal) == 3);
+    }
+
+    // Without payloads the vector is only recorded, and searched once the cell is reloaded
+    std::vector<std::shared_ptr<char[]>> laterIds = {makeString("later")};
+    std::shared_ptr<float[]> laterEmbedding(new float[2]{-121, -121});
+    core.add(1, laterIds, laterEmbedding);
+    REQUIRE(core.index->ntotal == 101);
+    REQUIRE(core.residence_statuses[3] == 101);
+    REQUIRE(core.directory.cellSize(3) == 102);
+}
+
+
+TEST_CASE("Snapshot and restore", "[Core::writeSnapshot]") {
+    size_t d = 2;
+    float nTotal = 800;
+    std::shared_ptr<DBClient_Mock> client = std::shared_ptr<DBClient_Mock>(new DBClient_Mock(d));
+    size_t nCells = 4;
+    Core core(d, client, nCells, nTotal, true);
+
+    const float centroids[] = {100, 100, -100, 100, 100, -100, -100, -100};
+    core.quantizer->add(nCells, centroids);
+
+    std::vector<Data> data;
+    std::vector<float> embeddings;
+    faiss::idx_t n = 400;
+    generate_data(d, centroids, data, embeddings);
+
+    std::vector<std::shared_ptr<char[]>> ids;
+    for (auto itr = data.begin(); itr != data.end(); itr++) {
+        ids.push_back(std::shared_ptr<char[]>(new char[itr->id_len]));
+        std::memcpy(ids[ids.size() - 1].get(), itr->id.get(), sizeof(char) * (itr->id_len));
+    }
+    std::shared_ptr<float[]> embeddings_copy(new float[embeddings.size()]);
+    memcpy(embeddings_copy.get(), embeddings.data(), sizeof(float) * embeddings.size());
+    core.add(data.size(), ids, embeddings_copy);
+
+    core.index->is_trained = true;
+    core.train(n, embeddings.data());
+    client->loadDB(n, data.data());
+    core.loadCell(1);
+    core.loadCell(3);
+
+    size_t k = 5;
+    float xq[] = {centroids[6], centroids[7]};
+    std::vector<Data> expected(k);
+    int expectedHits[1];
+    core.search(1, xq, k, 1, true, expected.data(), expectedHits);
+    REQUIRE(expectedHits[0] == k);
+
+    std::string dir = (std::filesystem::temp_directory_path() / "periplus_test_snapshot").string();
+    for (bool include_cells : {false, true}) {
+        core.writeSnapshot(dir, include_cells);
+
+        // The restored core doesn't need the database to answer
+        std::shared_ptr<DBClient_Mock> restoredClient = std::shared_ptr<DBClient_Mock>(new DBClient_Mock(d));
+        Core restored(d, restoredClient, nCells, nTotal, false);
+        restored.readSnapshot(dir);
+        REQUIRE(restored.index->is_trained);
+        REQUIRE(restored.directory.size() == core.directory.size());
+        for (size_t cell = 0; cell < nCells; cell++) {
+            REQUIRE(restored.directory.cell(cell) == core.directory.cell(cell));
+        }
+
+        std::vector<Data> results(k);
+        int cacheHits[1];
+        restored.search(1, xq, k, 1, true, results.data(), cacheHits);
+        if (!include_cells) {
+            REQUIRE(restored.store.size() == 0);
+            REQUIRE(cacheHits[0] == -1);
+            continue;
+        }
+        REQUIRE(restored.store.size() == 200);
+        REQUIRE(restored.resident_bytes == core.resident_bytes);
+        REQUIRE(cacheHits[0] == k);
+        for (size_t i = 0; i < k; i++) {
+            REQUIRE(std::string(results[i].id.get()) == std::string(expected[i].id.get()));
+            REQUIRE(results[i].embedding[0] == expected[i].embedding[0]);
+            REQUIRE(std::string(results[i].document.get()) == std::string(expected[i].document.get()));
+        }
+
+        // Restored cells can be evicted and loaded again like any other
+        restoredClient->loadDB(n, data.data());
+        restored.evictCell(3);
+        restored.loadCell(3);
+        restored.search(1, xq, k, 1, true, results.data(), cacheHits);
+        REQUIRE(cacheHits[0] == k);
+    }
+
+    // Replacing a snapshot leaves nothing beside it
+    REQUIRE(std::filesystem::exists(dir));
+    REQUIRE_FALSE(std::filesystem::exists(dir + ".tmp"));
+    REQUIRE_FALSE(std::filesystem::exists(dir + snapshot_previous_suffix));
+    REQUIRE(locateSnapshot(dir) == dir);
+
+    // A snapshot interrupted after moving the previous one aside is restored from there, and the next one clears it
+    std::filesystem::rename(dir, dir + snapshot_previous_suffix);
+    REQUIRE(locateSnapshot(dir) == dir + snapshot_previous_suffix);
+    Core interrupted(d, std::shared_ptr<DBClient_Mock>(new DBClient_Mock(d)), nCells, nTotal, false);
+    interrupted.readSnapshot(locateSnapshot(dir));
+    REQUIRE(interrupted.store.size() == 200);
+    core.writeSnapshot(dir, false);
+    REQUIRE(locateSnapshot(dir) == dir);
+    REQUIRE_FALSE(std::filesystem::exists(dir + snapshot_previous_suffix));
+    std::filesystem::remove_all(dir);
+}
+
+
+TEST_CASE("Reload evicted cells from the disk tier", "[Core::loadCells]") {
+    size_t d = 2;
+    float nTotal = 800;
+    std::shared_ptr<DBClient_Mock> client = std::shared_ptr<DBClient_Mock>(new DBClient_Mock(d));
+    size_t nCells = 4;
+    Core core(d, client, nCells, nTotal, true);
+    std::string dir = (std::filesystem::temp_directory_path() / "periplus_test_disk_tier").string();
+    core.disk_tier = std::make_shared<DiskTier>(dir, 1024 * 1024);
+
+    const float centroids[] = {100, 100, -100, 100, 100, -100, -100, -100};
+    core.quantizer->add(nCells, centroids);
+
+    std::vector<Data> data;
+    std::vector<float> embeddings;
+    faiss::idx_t n = 400;
+    generate_data(d, centroids, data, embeddings);
+
+    std::vector<std::shared_ptr<char[]>> ids;
+    for (auto itr = data.begin(); itr != data.end(); itr++) {
+        ids.push_back(std::shared_ptr<char[]>(new char[itr->id_len]));
+        std::memcpy(ids[ids.size() - 1].get(), itr->id.get(), sizeof(char) * (itr->id_len));
+    }
+    std::shared_ptr<float[]> embeddings_copy(new float[embeddings.size()]);
+    memcpy(embeddings_copy.get(), embeddings.data(), sizeof(float) * embeddings.size());
+    core.add(data.size(), ids, embeddings_copy);
+
+    core.index->is_trained = true;
+    core.train(n, embeddings.data());
+    client->loadDB(n, data.data());
+
+    LoadSources sources = core.loadCells(core.claimCells({1, 3}));
+    REQUIRE(sources.db == 2);
+    REQUIRE(sources.disk == 0);
+
+    size_t k = 5;
+    float xq[] = {centroids[6], centroids[7]};
+    std::vector<Data> expected(k);
+    int cacheHits[1];
+    core.search(1, xq, k, 1, true, expected.data(), cacheHits);
+    REQUIRE(cacheHits[0] == k);
+
+    core.evictCell(3);
+    REQUIRE(core.disk_tier->contains(3));
+    REQUIRE(core.store.size() == 100);
+
+    // Served from the disk tier without asking the database
+    size_t searches = client->n_searches;
+    sources = core.loadCells(core.claimCells({3}));
+    REQUIRE(sources.disk == 1);
+    REQUIRE(sources.db == 0);
+    REQUIRE(client->n_searches == searches);
+    REQUIRE(core.store.size() == 200);
+
+    std::vector<Data> results(k);
+    core.search(1, xq, k, 1, true, results.data(), cacheHits);
+    REQUIRE(cacheHits[0] == k);
+    for (size_t i = 0; i < k; i++) {
+        REQUIRE(std::string(results[i].id.get()) == std::string(expected[i].id.get()));
+        REQUIRE(results[i].embedding[1] == expected[i].embedding[1]);
+    }
+
+    // Once ADD gives the cell another id, the copy on disk is stale and the database is used again
+    core.evictCell(3);
+    std::vector<std::shared_ptr<char[]>> newIds = {std::shared_ptr<char[]>(new char[4])};
+    std::memcpy(newIds[0].get(), "new", 4);
+    std::shared_ptr<float[]> newEmbedding(new float[2]{-100, -100});
+    core.add(1, newIds, newEmbedding);
+    sources = core.loadCells(core.claimCells({3}));
+    REQUIRE(sources.db == 1);
+    REQUIRE(sources.disk == 0);
+
+    core.disk_tier.reset();
+    std::filesystem::remove_all(dir);
+}
+
+
+TEST_CASE("Disk tier capacity", "[DiskTier]") {
+    size_t d = 2;
+    size_t page = sysconf(_SC_PAGESIZE);
+    std::string dir = (std::filesystem::temp_directory_path() / "periplus_test_disk_tier_capacity").string();
+    // Three cells fit in a segment, and the tier holds a little over one segment
+    std::shared_ptr<DiskTier> tier = std::make_shared<DiskTier>(dir, 4 * page, 3 * page);
+
+    std::vector<Data> data;
+    std::vector<float> embeddings;
+    const float centroids[] = {100, 100, -100, 100, 100, -100, -100, -100};
+    generate_data(d, centroids, data, embeddings);
+    std::vector<const Data*> records = {&data[0], &data[1]};
+    CellArena arena(d, records);
+    std::vector<faiss::idx_t> ids = {0, 1};
+    std::vector<uint8_t> codes(2 * sizeof(float) * d);
+
+    for (faiss::idx_t cell = 0; cell < 5; cell++) {
+        REQUIRE(tier->put(cell, 2, 2, ids.data(), codes.data(), sizeof(float) * d, arena, tier->ticket()));
+    }
+    REQUIRE(tier->cells() == 5);
+    REQUIRE(tier->bytes() <= 4 * page);
+
+    // Cells 0 and 1 are used again, so cell 2 is the least recently used. Its segment is dropped whole to make room,
+    // cells 0 and 1 with it, rather than dropping live cells one by one which frees nothing until the segment is dead.
+    REQUIRE(tier->get(0) != nullptr);
+    REQUIRE(tier->get(1) != nullptr);
+    REQUIRE(tier->put(5, 2, 2, ids.data(), codes.data(), sizeof(float) * d, arena, tier->ticket()));
+    REQUIRE(tier->bytes() <= 4 * page);
+    REQUIRE(tier->cells() == 3);
+    for (faiss::idx_t cell : {3, 4, 5}) {
+        REQUIRE(tier->contains(cell));
+    }
+
+    // A copy taken before the cell was dropped isn't put, it may hold removed records
+    uint64_t ticket = tier->ticket();
+    tier->drop(4);
+    REQUIRE_FALSE(tier->put(4, 2, 2, ids.data(), codes.data(), sizeof(float) * d, arena, ticket));
+    REQUIRE_FALSE(tier->contains(4));
+    REQUIRE(tier->put(4, 2, 2, ids.data(), codes.data(), sizeof(float) * d, arena, tier->ticket()));
+
+    tier.reset();
+    std::filesystem::remove_all(dir);
+}
+
+
+TEST_CASE("Reservoir sampling", "[ReservoirSampler]") {
+    size_t d = 2;
+    ReservoirSampler sampler(d, 1000);
+
+    // Stream the vectors in as chunks
+    std::vector<float> chunk(5000 * d);
+    for (size_t c = 0; c < 20; c++) {
+        for (size_t i = 0; i < 5000; i++) {
+            chunk[i * d] = c * 5000 + i;
+            chunk[i * d + 1] = -(float)(c * 5000 + i);
+        }
+        sampler.add(5000, chunk.data());
+    }
+    REQUIRE(sampler.size() == 1000);
+    REQUIRE(sampler.seen() == 100000);
+
+    // Vectors are kept whole, and the sample is drawn from the whole stream rather than its start
+    double mean = 0;
+    for (size_t i = 0; i < sampler.size(); i++) {
+        REQUIRE(sampler.data()[i * d] == -sampler.data()[i * d + 1]);
+        mean += sampler.data()[i * d] / sampler.size();
+    }
+    REQUIRE((mean > 40000 && mean < 60000));
+
+    ReservoirSampler unlimited(d, 0);
+    unlimited.add(5000, chunk.data());
+    REQUIRE(unlimited.size() == 5000);
+}
+
+
+TEST_CASE("Auto-tune the index at training", "[AutoTuner]") {
+    REQUIRE(IndexConfig::defaults(128, 10, false).family == IVF_PQ);
+    REQUIRE(IndexConfig::defaults(128, 10, false).m == 16);
+    REQUIRE(IndexConfig::defaults(72, 10, false).m == 8);
+    REQUIRE(IndexConfig::defaults(36, 10, false).family == IVF_FLAT);
+    REQUIRE(IndexConfig::defaults(128, 10, true).family == IVF_FLAT);
+
+    size_t d = 32;
+    size_t n = 4000;
+    std::mt19937 rng(11);
+    std::uniform_real_distribution<float> uniform(-1, 1);
+    std::vector<float> embeddings(n * d);
+    for (auto& x : embeddings) {
+        x = uniform(rng);
+    }
+
+    // Every candidate has codes no larger than the next, and PQ subquantizers divide d
+    AutoTuner unlimited(d, 0.9, 0);
+    std::vector<IndexConfig> candidates = unlimited.candidates(10);
+    REQUIRE(candidates.front().family == IVF_PQ);
+    REQUIRE(candidates.back().family == IVF_FLAT);
+    for (size_t i = 0; i < candidates.size(); i++) {
+        if (i > 0) {
+            REQUIRE(candidates[i - 1].codeSize(d) <= candidates[i].codeSize(d));
+        }
+        if (candidates[i].family == IVF_PQ) {
+            REQUIRE(d % candidates[i].m == 0);
+        }
+    }
+
+    // A tight budget rules out the larger codes even though they would reach the target
+    AutoTuner budgeted(d, 1, (4 + sizeof(faiss::idx_t)) * n);
+    TuningResult result = budgeted.tune(n, embeddings.data(), n, 10, 1);
+    REQUIRE(result.config.codeSize(d) <= 4);
+
+    // Probing a single cell of uniformly spread vectors only reaches the target with far fewer cells, while with
+    // every cell probed the most cells the sample allows are kept
+    size_t maxCells = n / AutoTuner::min_points_per_cell;
+    TuningResult oneProbe = unlimited.tune(n, embeddings.data(), n, 200, 1);
+    REQUIRE(oneProbe.recall >= 0.9);
+    REQUIRE(oneProbe.config.nCells < maxCells);
+    TuningResult allProbed = unlimited.tune(n, embeddings.data(), n, 200, maxCells);
+    REQUIRE(allProbed.recall >= 0.9);
+    REQUIRE(allProbed.config.nCells == maxCells);
+
+    // nCells is lowered so every centroid has enough training vectors
+    std::shared_ptr<DBClient_Mock> client = std::shared_ptr<DBClient_Mock>(new DBClient_Mock(d));
+    Core core(d, client, 200, n, false);
+    core.target_recall = 0.9;
+    core.tuning_nprobe = maxCells;
+    core.train(n, embeddings.data());
+    REQUIRE(core.index->is_trained);
+    REQUIRE(core.tuning.recall >= 0.9);
+    REQUIRE(core.tuning.qps > 0);
+    REQUIRE(core.nCells == maxCells);
+    REQUIRE(core.index->nlist == core.nCells);
+    REQUIRE(core.index->code_size == core.tuning.config.codeSize(d));
+
+    // Once ids have been added the index can't be swapped for a tuned one
+    Core added(d, client, 10, n, true);
+    added.target_recall = 0.9;
+    added.quantizer->add(1, embeddings.data());
+    std::vector<std::shared_ptr<char[]>> ids = {std::shared_ptr<char[]>(new char[2]{'0', '\0'})};
+    std::shared_ptr<float[]> embedding(new float[d]);
+    std::memcpy(embedding.get(), embeddings.data(), sizeof(float) * d);
+    added.add(1, ids, embedding);
+    REQUIRE_THROWS_AS(added.train(n, embeddings.data()), std::runtime_error);
+}
+
+
+TEST_CASE("Latency histograms", "[LatencyHistogram]") {
+    // Small latencies get a bucket each, after which every power of two is split into sub_buckets buckets
+    for (uint64_t ns = 0; ns < LatencyHistogram::sub_buckets; ns++) {
+        REQUIRE(LatencyHistogram::bucketOf(ns) == ns);
+        REQUIRE(LatencyHistogram::bucketUpperBound(ns) == ns);
+    }
+    std::mt19937_64 rng(42);
+    for (int i = 0; i < 10000; i++) {
+        uint64_t ns = rng() >> (rng() % 40 + 24);
+        size_t bucket = LatencyHistogram::bucketOf(ns);
+        REQUIRE(bucket < LatencyHistogram::n_buckets);
+        REQUIRE(ns <= LatencyHistogram::bucketUpperBound(bucket));
+        if (bucket > 0) {
+            REQUIRE(ns > LatencyHistogram::bucketUpperBound(bucket - 1));
+        }
+        // A bucket's bound is within 1/sub_buckets of every latency in it
+        REQUIRE(LatencyHistogram::bucketUpperBound(bucket) - ns <= ns / LatencyHistogram::sub_buckets);
+    }
+    // Latencies too long for the buckets all land in the last one
+    REQUIRE(LatencyHistogram::bucketOf(UINT64_MAX) == LatencyHistogram::n_buckets - 1);
+
+    LatencyHistogram histogram;
+    REQUIRE(histogram.count() == 0);
+    REQUIRE(histogram.quantile(0.5) == 0);
+
+    // 1us to 1ms
+    uint64_t sum = 0;
+    for (uint64_t us = 1; us <= 1000; us++) {
+        histogram.record(us * 1000);
+        sum += us * 1000;
+    }
+    REQUIRE(histogram.count() == 1000);
+    REQUIRE(histogram.sum() == sum);
+    for (double q : {0.5, 0.9, 0.99, 0.999}) {
+        double expected = q * 1000 * 1000;
+        double quantile = histogram.quantile(q);
+        REQUIRE(quantile >= expected);
+        REQUIRE(quantile <= expected * (1.0 + (1.0 / LatencyHistogram::sub_buckets)));
+    }
+    REQUIRE(histogram.quantile(1.0) >= 1000 * 1000);
+
+    std::string out;
+    histogram.render(out, "periplus_test_seconds", "command=\"SEARCH\"");
+    REQUIRE(out.find("periplus_test_seconds{command=\"SEARCH\",quantile=\"0.99\"} ") != std::string::npos);
+    REQUIRE(out.find("periplus_test_seconds_count{command=\"SEARCH\"} 1000\n") != std::string::npos);
+}
+
+
+TEST_CASE("Record search and cell metrics", "[Metrics]") {
+    // Create cache core
+    size_t d = 2;
+    float nTotal = 800;
+    std::shared_ptr<DBClient_Mock> client = std::shared_ptr<DBClient_Mock>(new DBClient_Mock(d));
+    size_t nCells = 4;
+    Core core(d, client, nCells, nTotal, false);
+
+    // Manually set the centroids for testing purposes
+    const float centroids[] = {100, 100, -100, 100, 100, -100, -100, -100};
+    core.quantizer->add(nCells, centroids);
+
+    // Generate dataset
+    std::vector<Data> data;
+    std::vector<float> embeddings;
+    faiss::idx_t n = 800;
+    generate_data(d, centroids, data, embeddings);
+
+    std::vector<std::shared_ptr<char[]>> ids;
+    for (auto itr = data.begin(); itr != data.end(); itr++) {
+        ids.push_back(std::shared_ptr<char[]>(new char[itr->id_len]));
+        std::memcpy(ids[ids.size() - 1].get(), itr->id.get(), sizeof(char) * (itr->id_len));
+    }
+
+    std::shared_ptr<float[]> embeddings_copy(new float[embeddings.size()]);
+    memcpy(embeddings_copy.get(), embeddings.data(), sizeof(float) * embeddings.size());
+    core.add(data.size(), ids, embeddings_copy);
+
+    // Train the index
+    core.index->is_trained = true;
+    core.train(n, embeddings.data());
+
+    // Load the external db the cache core pulls from
+    client->loadDB(400, data.data());
+
+    // The metrics are process wide, so only their changes are checked
+    Metrics& m = metrics();
+    uint64_t queries = m.queries.load();
+    uint64_t hits = m.cache_hits.load();
+    uint64_t loadedDb = m.cells_loaded_db.load();
+    uint64_t evicted = m.cells_evicted.load();
+    uint64_t searches = m.search.count();
+    uint64_t loads = m.load.count();
+
+    core.loadCell(0);
+    REQUIRE(m.cells_loaded_db.load() == loadedDb + 1);
+    REQUIRE(m.load.count() == loads + 1);
+
+    size_t xq_n = 1;
+    size_t k = 5;
+    std::vector<Data> results(k);
+    int cacheHits[n];
+    float xq[xq_n * d];
+    xq[0] = centroids[0];
+    xq[1] = centroids[1];
+
+    size_t nprobe = 1;
+    bool require_all = true;
+    core.search(xq_n, xq, k, nprobe, require_all, results.data(), cacheHits);
+    REQUIRE(cacheHits[0] == k);
+
+    xq[0] = centroids[6];
+    xq[1] = centroids[7];
+    core.search(xq_n, xq, k, nprobe, require_all, results.data(), cacheHits);
+    REQUIRE(cacheHits[0] == -1);
+
+    REQUIRE(m.queries.load() == queries + 2);
+    REQUIRE(m.cache_hits.load() == hits + 1);
+    REQUIRE(m.search.count() == searches + 2);
+    // Probes are counted whether or not the cell was resident
+    REQUIRE(core.cell_probes[0].load() == 1);
+    REQUIRE(core.cell_probes[3].load() == 1);
+    REQUIRE(core.cell_probes[1].load() == 0);
+
+    core.evictCell(0);
+    REQUIRE(m.cells_evicted.load() == evicted + 1);
+
+    std::string out;
+    m.render(out);
+    REQUIRE(out.find("# TYPE periplus_queries_total counter\n") != std::string::npos);
+    REQUIRE(out.find("periplus_cells_loaded_total{source=\"db\"} ") != std::string::npos);
+    REQUIRE(out.find("periplus_search_seconds{quantile=\"0.5\"} ") != std::string::npos);
+}
+
+
+// Concatenates a response's buffers into the bytes a gather-write of them sends
+std::vector<char> flatten_buffers(const std::vector<asio::const_buffer>& buffers) {
+    std::vector<char> bytes;
+    for (const asio::const_buffer& buffer : buffers) {
+        const char *data = static_cast<const char*>(buffer.data());
+        bytes.insert(bytes.end(), data, data + buffer.size());
+    }
+    return bytes;
+}
+
+Data make_result(const std::string& id, size_t d, float value, const std::string& document, const std::string& metadata) {
+    std::vector<char> id_bytes(id.begin(), id.end());
+    id_bytes.push_back('\0');
+    std::vector<float> embedding(d);
+    for (size_t i = 0; i < d; i++) {
+        embedding[i] = value + i;
+    }
+    std::vector<char> document_bytes(document.begin(), document.end());
+    std::vector<char> metadata_bytes(metadata.begin(), metadata.end());
+    return Data(id_bytes.size(), d, document_bytes.size(), metadata_bytes.size(),
+        id_bytes.data(), embedding.data(), document_bytes.data(), metadata_bytes.data());
+}
+
+template<typename T>
+void append_bytes(std::vector<char>& bytes, const T& value) {
+    const char *p = reinterpret_cast<const char*>(&value);
+    bytes.insert(bytes.end(), p, p + sizeof(T));
+}
+
+
+TEST_CASE("Serialize search responses", "[SearchResponse]") {
+    size_t d = 3;
+    size_t n = 3;
+    size_t k = 2;
+    SearchResponse response(n, k);
+
+    // A full query, a cache miss and a query with fewer results than k
+    response.cacheHits = {2, -1, 1};
+    response.coverage = {1.0f, 0.25f, 0.5f};
+    response.results[0] = make_result("a", d, 1.0f, "first", "{\"m\": 1}");
+    response.results[1] = make_result("bb", d, 2.0f, "second", "{}");
+    response.results[4] = make_result("ccc", d, 3.0f, "third document", "-");
+    response.distances = {0.5f, 1.5f, 0.0f, 0.0f, 2.5f, 0.0f};
+    response.serialize();
+
+    // What was sent before the response was gather-written: each query's hit count and coverage, then each result's
+    // distance followed by the result as Data::serialize lays it out
+    std::vector<char> expected;
+    for (size_t i = 0; i < n; i++) {
+        append_bytes(expected, response.cacheHits[i]);
+        append_bytes(expected, response.coverage[i]);
+        for (int j = 0; j < response.cacheHits[i]; j++) {
+            append_bytes(expected, response.distances[(i * k) + j]);
+            std::vector<char> record;
+            response.results[(i * k) + j].serialize(record);
+            expected.insert(expected.end(), record.begin(), record.end());
+        }
+    }
+
+    std::vector<char> sent = flatten_buffers(response.buffers);
+    REQUIRE(sent.size() == expected.size());
+    REQUIRE(sent == expected);
+
+    // Serializing again rebuilds the buffers rather than appending to them
+    response.serialize();
+    REQUIRE(flatten_buffers(response.buffers) == expected);
+
+    // Framing only adds the header in front of the same payload
+    response.frame(42);
+    std::vector<char> framed = flatten_buffers(response.buffers);
+    REQUIRE(framed.size() == expected.size() + (2 * sizeof(uint64_t)));
+    uint64_t header[2];
+    std::memcpy(header, framed.data(), sizeof(header));
+    REQUIRE(header[0] == 42);
+    REQUIRE(header[1] == expected.size());
+    REQUIRE(std::vector<char>(framed.begin() + sizeof(header), framed.end()) == expected);
+}
+
+
+// encode_query_result from the Python proxy applied to two records, see proxies/python/tests/test_encoding.py
+const char *encoded_query_result_hex =
+    "0200000000000000" "0300000000000000"
+    "0400000000000000" "69642d30" "0400000000000000" "69642d31"
+    "0000803f000020c00000003e" "0000404000008040000000bf"
+    "0500000000000000" "6669727374" "0500000000000000" "636166c3a9"
+    "0800000000000000" "7b2269223a20307d" "0000000000000000";
+
+std::string from_hex(const std::string& hex) {
+    std::string bytes;
+    for (size_t i = 0; i < hex.size(); i += 2) {
+        bytes.push_back(static_cast<char>(std::stoi(hex.substr(i, 2), nullptr, 16)));
+    }
+    return bytes;
+}
+
+std::string encode_u64(uint64_t value) {
+    return std::string(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+
+TEST_CASE("Decode binary proxy responses", "[DBClient::decodeBinaryResponse]") {
+    std::string body = from_hex(encoded_query_result_hex);
+    REQUIRE(body.size() == 114);
+
+    std::vector<Data> x(2);
+    REQUIRE(DBClient::decodeBinaryResponse(body, x.size(), x.data()) == 2);
+
+    REQUIRE(x[0].id_len == 4);
+    REQUIRE(std::string(x[0].id.get()) == "id-0");
+    REQUIRE(x[0].embedding_len == 3);
+    REQUIRE(x[0].embedding[0] == 1.0f);
+    REQUIRE(x[0].embedding[1] == -2.5f);
+    REQUIRE(x[0].embedding[2] == 0.125f);
+    REQUIRE(x[0].document_len == 5);
+    REQUIRE(std::string(x[0].document.get()) == "first");
+    REQUIRE(x[0].metadata_len == 8);
+    REQUIRE(std::string(x[0].metadata.get()) == "{\"i\": 0}");
+
+    REQUIRE(std::string(x[1].id.get()) == "id-1");
+    REQUIRE(x[1].embedding[0] == 3.0f);
+    REQUIRE(x[1].embedding[1] == 4.0f);
+    REQUIRE(x[1].embedding[2] == -0.5f);
+    // Lengths are in bytes of the UTF-8 encoding
+    REQUIRE(x[1].document_len == 5);
+    REQUIRE(std::string(x[1].document.get()) == "caf\xc3\xa9");
+    REQUIRE(x[1].metadata_len == 0);
+    REQUIRE(std::string(x[1].metadata.get()) == "");
+
+    // The records alias one block, which stays alive as long as any of them does
+    Data kept = x[1];
+    x.clear();
+    REQUIRE(std::string(kept.id.get()) == "id-1");
+    REQUIRE(kept.embedding[2] == -0.5f);
+
+    // A proxy may answer with fewer records than were requested
+    std::vector<Data> spare(5);
+    REQUIRE(DBClient::decodeBinaryResponse(body, spare.size(), spare.data()) == 2);
+    REQUIRE(spare[2].id_len == 0);
+
+    std::string empty = encode_u64(0) + encode_u64(0);
+    REQUIRE(DBClient::decodeBinaryResponse(empty, spare.size(), spare.data()) == 0);
+}
+
+
+TEST_CASE("Reject malformed binary proxy responses", "[DBClient::decodeBinaryResponse]") {
+    std::string body = from_hex(encoded_query_result_hex);
+    std::vector<Data> x(2);
+
+    // Cut short anywhere, in the header or the body
+    for (size_t size = 0; size < body.size(); size++) {
+        REQUIRE_THROWS_AS(DBClient::decodeBinaryResponse(body.substr(0, size), x.size(), x.data()), std::runtime_error);
+    }
+
+    // More records than the ids which were asked for
+    REQUIRE_THROWS_AS(DBClient::decodeBinaryResponse(body, 1, x.data()), std::runtime_error);
+    std::string huge = encode_u64(UINT64_MAX) + encode_u64(3);
+    REQUIRE_THROWS_AS(DBClient::decodeBinaryResponse(huge, x.size(), x.data()), std::runtime_error);
+
+    // Lengths which run past the end of the body
+    std::string longId = encode_u64(1) + encode_u64(3) + encode_u64(UINT64_MAX) + "id-0";
+    REQUIRE_THROWS_AS(DBClient::decodeBinaryResponse(longId, x.size(), x.data()), std::runtime_error);
+    std::string longEmbeddings = encode_u64(1) + encode_u64(UINT64_MAX / 2) + encode_u64(4) + "id-0";
+    REQUIRE_THROWS_AS(DBClient::decodeBinaryResponse(longEmbeddings, x.size(), x.data()), std::runtime_error);
+}
+
+
+// Answers each command with its name and request id. STATUS, which pipelined clients may run concurrently, holds
+// its response until release is set so the commands behind it can overtake it. DELETE runs inline.
+struct PipelineCache_Mock : Cache {
+    std::shared_future<void> release;
+    std::mutex calls_mutex;
+    // The commands process_args was called with, in order, and the thread each was called on
+    std::vector<std::string> calls;
+    std::vector<std::thread::id> threads;
+
+    explicit PipelineCache_Mock(std::shared_future<void> release) : Cache(CacheConfig{1}), release(release) {}
+
+    void processCommand(std::shared_ptr<Session> session, std::string command) override {
+        if (command == "STATUS") {
+            session->read_args(std::make_shared<StatusArgs>());
+        } else if (command == "STATS") {
+            session->read_args(std::make_shared<StatsArgs>());
+        } else if (command == "DELETE") {
+            session->read_args(std::make_shared<DeleteArgs>());
+        }
+    }
+
+    void process_args(std::shared_ptr<Session> session, std::shared_ptr<Args> args) override {
+        std::string name = command_names[args->get_command()];
+        {
+            std::lock_guard<std::mutex> lock(this->calls_mutex);
+            this->calls.push_back(name + " " + std::to_string(args->request_id));
+            this->threads.push_back(std::this_thread::get_id());
+        }
+        if (args->get_command() == STATUS) {
+            this->release.wait();
+        }
+        session->respond(args, std::make_shared<MessageResponse>(name + " " + std::to_string(args->request_id)));
+    }
+};
+
+// Sends a command in three writes so the session has to wait for its static and then its dynamic args
+void send_command(asio::ip::tcp::socket& socket, const std::string& line, const std::string& static_args, const std::string& dynamic_args) {
+    asio::write(socket, asio::buffer(line + "\r\n"));
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    asio::write(socket, asio::buffer(static_args + "\n"));
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    asio::write(socket, asio::buffer(dynamic_args + "\r\n"));
+}
+
+// Reads a pipelined response: the request id and payload length (both u64), then the payload
+std::pair<uint64_t, std::string> read_frame(asio::ip::tcp::socket& socket) {
+    uint64_t header[2];
+    asio::read(socket, asio::buffer(header, sizeof(header)));
+    std::string payload(header[1], '\0');
+    asio::read(socket, asio::buffer(&payload[0], payload.size()));
+    return {header[0], payload};
+}
+
+
+TEST_CASE("Pipelined commands", "[Session::dispatch]") {
+    asio::io_context io_context;
+    asio::thread_pool work_pool(2);
+    std::promise<void> release;
+    PipelineCache_Mock cache(release.get_future().share());
+
+    asio::ip::tcp::acceptor acceptor(io_context, asio::ip::tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+    asio::ip::tcp::socket client(io_context);
+    client.connect(acceptor.local_endpoint());
+    auto session = std::make_shared<Session>(acceptor.accept(), &cache, work_pool.get_executor());
+    session->start();
+    session.reset();
+    std::thread io_thread([&io_context]() { io_context.run(); });
+    std::thread::id io_thread_id = io_thread.get_id();
+
+    std::string statusArgs = encode_u64(0);
+    std::string statsArgs = std::string(1, '\0') + encode_u64(0);
+    std::string deleteArgs = encode_u64(0) + encode_u64(0);
+
+    // STATUS 1 is held, the commands behind it are still read and answered
+    send_command(client, "STATUS 1", statusArgs, "");
+    send_command(client, "DELETE 2", deleteArgs, "");
+    send_command(client, "STATS 3", statsArgs, "");
+    send_command(client, "DELETE 4", deleteArgs, "");
+
+    std::vector<uint64_t> order;
+    for (int i = 0; i < 3; i++) {
+        auto frame = read_frame(client);
+        // Every payload is framed with the id of the request it answers and its exact length
+        REQUIRE(frame.second.size() == std::string("DELETE 2").size() - (frame.first == 3 ? 1 : 0));
+        REQUIRE(frame.second.substr(frame.second.find(' ') + 1) == std::to_string(frame.first));
+        order.push_back(frame.first);
+    }
+    REQUIRE(std::find(order.begin(), order.end(), 1) == order.end());
+    REQUIRE(std::find(order.begin(), order.end(), 3) != order.end());
+    // Inline commands are answered in the order they were sent
+    REQUIRE(std::find(order.begin(), order.end(), 2) < std::find(order.begin(), order.end(), 4));
+
+    release.set_value();
+    auto last = read_frame(client);
+    REQUIRE(last.first == 1);
+    REQUIRE(last.second == "STATUS 1");
+
+    // Without a request id the response isn't framed
+    send_command(client, "STATS", statsArgs, "");
+    std::string unframed(std::string("STATS 0").size(), '\0');
+    asio::read(client, asio::buffer(&unframed[0], unframed.size()));
+    REQUIRE(unframed == "STATS 0");
+
+    client.close();
+    io_thread.join();
+    work_pool.join();
+
+    // DELETE runs inline on the session's thread, the concurrent commands are posted to the work pool
+    REQUIRE(cache.calls.size() == 5);
+    for (size_t i = 0; i < cache.calls.size(); i++) {
+        bool inline_command = cache.calls[i].rfind("DELETE", 0) == 0 || cache.calls[i] == "STATS 0";
+        REQUIRE((cache.threads[i] == io_thread_id) == inline_command);
+    }
+    REQUIRE(std::find(cache.calls.begin(), cache.calls.end(), "DELETE 2") < std::find(cache.calls.begin(), cache.calls.end(), "DELETE 4"));
+}
+
+
+// Fills a response with k results for each of its n queries, each with an embedding of d dimensions
+void fill_search_response(SearchResponse& response, size_t d) {
+    for (size_t i = 0; i < response.n; i++) {
+        response.cacheHits[i] = response.k;
+        response.coverage[i] = 1.0f;
+        for (size_t j = 0; j < response.k; j++) {
+            size_t r = (i * response.k) + j;
+            response.results[r] = make_result("id-" + std::to_string(r), d, float(r), "document " + std::to_string(r), "{\"r\": " + std::to_string(r) + "}");
+            response.distances[r] = float(r) / 2;
+        }
+    }
+}
+
+
+TEST_CASE("Serialize search responses with a field mask", "[SearchResponse]") {
+    size_t d = 64;
+    size_t n = 2;
+    size_t k = 3;
+    SearchResponse full(n, k);
+    fill_search_response(full, d);
+    full.serialize();
+    size_t fullBytes = asio::buffer_size(full.buffers);
+
+    // The fields are left out along with their lengths, everything else is laid out as before
+    for (uint8_t omitted : std::vector<uint8_t>{FIELD_EMBEDDING, FIELD_DOCUMENT, FIELD_METADATA, FIELD_EMBEDDING | FIELD_DOCUMENT | FIELD_METADATA}) {
+        SearchResponse masked(n, k, ALL_FIELDS & ~omitted);
+        fill_search_response(masked, d);
+        masked.serialize();
+
+        std::vector<char> expected;
+        size_t omittedBytes = 0;
+        for (size_t i = 0; i < n; i++) {
+            append_bytes(expected, masked.cacheHits[i]);
+            append_bytes(expected, masked.coverage[i]);
+            for (size_t j = 0; j < k; j++) {
+                const Data& result = masked.results[(i * k) + j];
+                append_bytes(expected, masked.distances[(i * k) + j]);
+                append_bytes(expected, result.id_len);
+                expected.insert(expected.end(), result.id.get(), result.id.get() + result.id_len);
+                if (omitted & FIELD_EMBEDDING) {
+                    omittedBytes += sizeof(size_t) + (sizeof(float) * d);
+                } else {
+                    append_bytes(expected, result.embedding_len);
+                    const char *embedding = reinterpret_cast<const char*>(result.embedding.get());
+                    expected.insert(expected.end(), embedding, embedding + (sizeof(float) * d));
+                }
+                if (omitted & FIELD_DOCUMENT) {
+                    omittedBytes += sizeof(size_t) + result.document_len;
+                } else {
+                    append_bytes(expected, result.document_len);
+                    expected.insert(expected.end(), result.document.get(), result.document.get() + result.document_len);
+                }
+                if (omitted & FIELD_METADATA) {
+                    omittedBytes += sizeof(size_t) + result.metadata_len;
+                } else {
+                    append_bytes(expected, result.metadata_len);
+                    expected.insert(expected.end(), result.metadata.get(), result.metadata.get() + result.metadata_len);
+                }
+            }
+        }
+
+        REQUIRE(flatten_buffers(masked.buffers) == expected);
+        REQUIRE(asio::buffer_size(masked.buffers) == fullBytes - omittedBytes);
+        REQUIRE(asio::buffer_size(masked.buffers) < fullBytes);
+    }
+
+    // Only the ids: a result is its id and nothing more
+    SearchResponse idsOnly(n, k, FIELD_ID);
+    fill_search_response(idsOnly, d);
+    idsOnly.serialize();
+    size_t idBytes = 0;
+    for (const Data& result : idsOnly.results) {
+        idBytes += sizeof(size_t) + result.id_len;
+    }
+    REQUIRE(asio::buffer_size(idsOnly.buffers) == (n * (sizeof(int) + sizeof(float))) + idBytes);
+}
+
+
+TEST_CASE("Serialize compact search responses", "[SearchResponse]") {
+    size_t d = 64;
+    size_t n = 1;
+    size_t k = 3;
+
+    SearchResponse full(n, k);
+    fill_search_response(full, d);
+    full.serialize();
+    size_t fullBytes = asio::buffer_size(full.buffers);
+
+    // Results kept at fp16 and int8 carry the code as stored and no floats, the last was kept at full precision
+    SearchResponse compact(n, k, ALL_FIELDS, true);
+    fill_search_response(compact, d);
+    EmbeddingPrecision precisions[] = {PRECISION_FP16, PRECISION_INT8, PRECISION_FP32};
+    for (size_t r = 0; r < k; r++) {
+        Data& result = compact.results[r];
+        result.embedding_precision = precisions[r];
+        if (precisions[r] != PRECISION_FP32) {
+            result.embedding_code = std::shared_ptr<char[]>(new char[embeddingCodeSize(d, precisions[r])]);
+            encodeEmbedding(result.embedding.get(), d, precisions[r], result.embedding_code.get());
+            result.embedding = nullptr;
+        }
+    }
+    compact.serialize();
+
+    // Each embedding is its length, the precision it's sent at and then its code
+    std::vector<char> expected;
+    append_bytes(expected, compact.cacheHits[0]);
+    append_bytes(expected, compact.coverage[0]);
+    for (size_t r = 0; r < k; r++) {
+        const Data& result = compact.results[r];
+        append_bytes(expected, compact.distances[r]);
+        append_bytes(expected, result.id_len);
+        expected.insert(expected.end(), result.id.get(), result.id.get() + result.id_len);
+        append_bytes(expected, result.embedding_len);
+        append_bytes(expected, result.embedding_precision);
+        const char *code = result.embedding_precision == PRECISION_FP32 ? reinterpret_cast<const char*>(result.embedding.get()) : result.embedding_code.get();
+        expected.insert(expected.end(), code, code + embeddingCodeSize(d, result.embedding_precision));
+        append_bytes(expected, result.document_len);
+        expected.insert(expected.end(), result.document.get(), result.document.get() + result.document_len);
+        append_bytes(expected, result.metadata_len);
+        expected.insert(expected.end(), result.metadata.get(), result.metadata.get() + result.metadata_len);
+    }
+    REQUIRE(flatten_buffers(compact.buffers) == expected);
+
+    // fp16 halves the embedding and int8 quarters it, each code costing a byte for its precision
+    size_t saved = ((sizeof(float) * d) - embeddingCodeSize(d, PRECISION_FP16)) + ((sizeof(float) * d) - embeddingCodeSize(d, PRECISION_INT8));
+    REQUIRE(asio::buffer_size(compact.buffers) == fullBytes - saved + (k * sizeof(EmbeddingPrecision)));
+    REQUIRE(asio::buffer_size(compact.buffers) < fullBytes);
+
+    // The codes decode back to close to the original embeddings
+    std::vector<float> decoded(d);
+    decodeEmbedding(compact.results[0].embedding_code.get(), d, PRECISION_FP16, decoded.data());
+    for (size_t j = 0; j < d; j++) {
+        REQUIRE(std::abs(decoded[j] - full.results[0].embedding[j]) <= 0.01f * std::abs(full.results[0].embedding[j]) + 0.01f);
+    }
+}
+
+TEST_CASE("Reject truncated static args", "[Args::deserialize_static]") {
+    // n and k are sent, but nprobe is cut short
+    std::istringstream is(encode_u64(1) + encode_u64(10) + std::string(3, '\0'));
+    SearchArgs args;
+    std::string message;
+    try {
+        args.deserialize_static(is);
+    } catch (const std::runtime_error& e) {
+        message = e.what();
+    }
+    REQUIRE(message == "Failed to read the 8 bytes of argument nprobe");
+    REQUIRE(args.n == 1);
+    REQUIRE(args.k == 10);
 }